@@ -28,6 +28,8 @@
 #include "migration/vmstate.h"
 #include "monitor/monitor.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
+#include "qapi/qapi-commands-char.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qapi/qapi-events-run-state.h"
 #include "qapi/qmp/qerror.h"
@@ -480,6 +482,107 @@ static void icount_timer_cb(void *opaque)
     icount_warp_rt();
 }
 
+/* Fast-forward QEMU_CLOCK_VIRTUAL over idle periods, see qemu_set_idle_warp */
+static bool idle_warp;
+
+/* Poll period while all vCPUs stay idle after a warp */
+#define IDLE_WARP_POLL_MS 1
+
+void qemu_set_idle_warp(bool enable)
+{
+    idle_warp = enable;
+}
+
+/*
+ * When all vCPUs are idle, move QEMU_CLOCK_VIRTUAL forward to the earliest
+ * pending deadline so that the timer fires immediately instead of after
+ * the same amount of real time. Returns true if the clock was advanced or
+ * a timer is already due, in which case the caller should check again
+ * after the main loop had a chance to run the timers.
+ *
+ * Caller must hold BQL which serves as mutex for vm_clock_seqlock.
+ */
+static bool qemu_idle_warp(void)
+{
+    int64_t deadline;
+
+    if (!idle_warp || use_icount || qtest_enabled() ||
+        !runstate_is_running() || !all_cpu_threads_idle()) {
+        return false;
+    }
+
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL,
+                                          ~QEMU_TIMER_ATTR_EXTERNAL);
+    if (deadline < 0) {
+        return false;
+    }
+    if (deadline > 0) {
+        seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                           &timers_state.vm_clock_lock);
+        timers_state.cpu_clock_offset += deadline;
+        seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                             &timers_state.vm_clock_lock);
+    }
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    return true;
+}
+
+/* Caller must hold BQL which serves as mutex for vm_clock_seqlock. */
+static int64_t qemu_busy_wait_warp_locked(int64_t delta)
+{
+    int64_t deadline;
+
+    if (!runstate_is_running()) {
+        return 0;
+    }
+
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL,
+                                          ~QEMU_TIMER_ATTR_EXTERNAL);
+    if (deadline >= 0 && deadline < delta) {
+        delta = deadline;
+    }
+    if (delta <= 0) {
+        return 0;
+    }
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    timers_state.cpu_clock_offset += delta;
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+    if (delta == deadline) {
+        qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    }
+    return delta;
+}
+
+/*
+ * Move QEMU_CLOCK_VIRTUAL forward by up to @delta ns on behalf of a vCPU
+ * that is spinning on a cycle counter, stopping at the earliest pending
+ * timer deadline so that no timer fires late relative to the guest.
+ * Returns the amount the clock was advanced by.
+ *
+ * Called from vCPU threads without the BQL. It is taken here around the
+ * deadline read and the offset update, so that vCPUs warping at the same
+ * time cannot each add up to the same deadline and overshoot it.
+ */
+int64_t qemu_busy_wait_warp(int64_t delta)
+{
+    bool locked = qemu_mutex_iothread_locked();
+
+    if (use_icount || qtest_enabled()) {
+        return 0;
+    }
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    delta = qemu_busy_wait_warp_locked(delta);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return delta;
+}
+
 void qtest_clock_warp(int64_t dest)
 {
     int64_t clock = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
@@ -1181,7 +1284,12 @@ static void qemu_tcg_rr_wait_io_event(void)
 
     while (all_cpu_threads_idle()) {
         stop_tcg_kick_timer();
-        qemu_cond_wait(first_cpu->halt_cond, &qemu_global_mutex);
+        if (qemu_idle_warp()) {
+            qemu_cond_timedwait(first_cpu->halt_cond, &qemu_global_mutex,
+                                IDLE_WARP_POLL_MS);
+        } else {
+            qemu_cond_wait(first_cpu->halt_cond, &qemu_global_mutex);
+        }
     }
 
     start_tcg_kick_timer();
@@ -1200,7 +1308,12 @@ static void qemu_wait_io_event(CPUState *cpu)
             slept = true;
             qemu_plugin_vcpu_idle_cb(cpu);
         }
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        if (qemu_idle_warp()) {
+            qemu_cond_timedwait(cpu->halt_cond, &qemu_global_mutex,
+                                IDLE_WARP_POLL_MS);
+        } else {
+            qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        }
     }
     if (slept) {
         qemu_plugin_vcpu_resume_cb(cpu);
@@ -1922,11 +2035,12 @@ void cpu_remove_sync(CPUState *cpu)
 /* For temporary buffers for forming a name */
 #define VCPU_THREAD_NAME_SIZE 16
 
+static QemuCond *single_tcg_halt_cond;
+static QemuThread *single_tcg_cpu_thread;
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
-    static QemuCond *single_tcg_halt_cond;
-    static QemuThread *single_tcg_cpu_thread;
     static int tcg_region_inited;
 
     assert(tcg_enabled());
@@ -2262,6 +2376,152 @@ void qmp_inject_nmi(Error **errp)
     nmi_monitor_handle(monitor_get_cpu_index(), errp);
 }
 
+#ifdef CONFIG_POSIX
+/* Children created by x-fork that have not been reaped yet */
+static GSList *fork_children;
+
+static void qemu_fork_reap_children(void)
+{
+    GSList *l = fork_children;
+
+    while (l) {
+        GSList *next = l->next;
+
+        if (waitpid(GPOINTER_TO_INT(l->data), NULL, WNOHANG) != 0) {
+            fork_children = g_slist_delete_link(fork_children, l);
+        }
+        l = next;
+    }
+}
+
+/*
+ * Only the calling thread survives fork(). Re-create the threads of the
+ * stopped vCPUs in the child, they start running with the next vm_start().
+ */
+static void qemu_fork_child_vcpus(void)
+{
+    CPUState *cpu;
+
+    single_tcg_halt_cond = NULL;
+    single_tcg_cpu_thread = NULL;
+    tcg_fork_child();
+
+    CPU_FOREACH(cpu) {
+        cpu->created = false;
+        qemu_tcg_init_vcpu(cpu);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    }
+}
+
+static void qemu_fork_child_setup(ForkChardevList *chardevs,
+                                  BlockdevSnapshotSyncList *snapshots,
+                                  Error **errp)
+{
+    Error *local_err = NULL;
+
+    for (; chardevs; chardevs = chardevs->next) {
+        ForkChardev *c = chardevs->value;
+
+        qapi_free_ChardevReturn(qmp_chardev_change(c->id, c->backend,
+                                                   &local_err));
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    for (; snapshots; snapshots = snapshots->next) {
+        BlockdevSnapshotSync *sn = snapshots->value;
+
+        qmp_blockdev_snapshot_sync(sn->has_device, sn->device,
+                                   sn->has_node_name, sn->node_name,
+                                   sn->snapshot_file,
+                                   sn->has_snapshot_node_name,
+                                   sn->snapshot_node_name,
+                                   sn->has_format, sn->format,
+                                   sn->has_mode, sn->mode, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+}
+
+ForkInfo *qmp_x_fork(bool has_chardevs, ForkChardevList *chardevs,
+                     bool has_snapshots, BlockdevSnapshotSyncList *snapshots,
+                     Error **errp)
+{
+    Error *local_err = NULL;
+    ForkInfo *info;
+    pid_t pid;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "x-fork is only supported with TCG");
+        return NULL;
+    }
+    if (runstate_is_running()) {
+        error_setg(errp, "The VM must be stopped");
+        return NULL;
+    }
+
+    qemu_fork_reap_children();
+
+    /* Thread pool workers do not survive fork(), nothing may be in flight */
+    bdrv_drain_all();
+
+    monitor_fork_prepare();
+    rcu_enable_atfork();
+    pid = fork();
+    rcu_disable_atfork();
+    if (pid != 0) {
+        monitor_fork_parent();
+    }
+
+    if (pid < 0) {
+        error_setg_errno(errp, errno, "fork failed");
+        return NULL;
+    }
+
+    info = g_new0(ForkInfo, 1);
+    info->pid = pid;
+    if (pid > 0) {
+        fork_children = g_slist_prepend(fork_children, GINT_TO_POINTER(pid));
+        return info;
+    }
+
+    /*
+     * The child: nobody listens to our reply, so failures to set up the
+     * child's own endpoints and overlays are fatal.
+     */
+    monitor_fork_child();
+    g_slist_free(fork_children);
+    fork_children = NULL;
+    qemu_get_aio_context()->thread_pool = NULL;
+    qemu_fork_child_vcpus();
+
+    qemu_fork_child_setup(has_chardevs ? chardevs : NULL,
+                          has_snapshots ? snapshots : NULL, &local_err);
+    if (local_err) {
+        error_prepend(&local_err, "x-fork child %d: ", getpid());
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+
+    vm_start();
+    return info;
+}
+#else
+ForkInfo *qmp_x_fork(bool has_chardevs, ForkChardevList *chardevs,
+                     bool has_snapshots, BlockdevSnapshotSyncList *snapshots,
+                     Error **errp)
+{
+    error_setg(errp, "x-fork is not supported on this host");
+    return NULL;
+}
+#endif
+
 void dump_drift_info(void)
 {
     if (!use_icount) {
@@ -237,6 +237,38 @@ SRST
     Show virtual to physical memory mappings.
 ERST
 
+#if defined(TARGET_XTENSA)
+    {
+        .name       = "hle",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show natively emulated guest routines and their hit counts",
+        .cmd        = hmp_info_hle,
+    },
+#endif
+
+SRST
+  ``info hle``
+    Show guest routines that are run natively on the host and how many
+    times each of them was called (Xtensa only).
+ERST
+
+#if defined(TARGET_XTENSA)
+    {
+        .name       = "decode-cache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show decoded instruction cache statistics",
+        .cmd        = hmp_info_decode_cache,
+    },
+#endif
+
+SRST
+  ``info decode-cache``
+    Show how often the translator found instructions in the decoded
+    instruction cache of the current CPU's core configuration (Xtensa only).
+ERST
+
 #if defined(TARGET_I386) || defined(TARGET_RISCV)
     {
         .name       = "mem",
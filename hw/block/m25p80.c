@@ -23,12 +23,18 @@
 
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "exec/memory.h"
 #include "sysemu/block-backend.h"
 #include "hw/qdev-properties.h"
+#include "hw/block/flash.h"
 #include "hw/ssi/ssi.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
+#include "sysemu/runstate.h"
+#include "qapi/qapi-commands-block.h"
 #include "qemu/module.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
@@ -415,6 +421,8 @@ typedef struct Flash {
     SSISlave parent_obj;
 
     BlockBackend *blk;
+    /* Optional RAM region (e.g. a mapped image file) used as the storage */
+    MemoryRegion *storage_mem;
 
     uint8_t *storage;
     uint32_t size;
@@ -449,6 +457,21 @@ typedef struct Flash {
 
     int64_t dirty_page;
 
+    /* Write-back mode: programmed pages are only marked in dirty_bitmap and
+     * written to the drive in batches, see flash_writeback_flush().
+     */
+    bool write_back;
+    uint32_t write_back_interval;
+    unsigned long *dirty_bitmap;
+    QEMUTimer *write_back_timer;
+    VMChangeStateEntry *vm_change_state;
+
+    /* I/O statistics, for query-flash-writeback */
+    uint64_t program_ops;
+    uint64_t write_requests;
+    uint64_t bytes_written;
+    uint64_t flushes;
+
     const FlashPartInfo *pi;
 
 } Flash;
@@ -496,35 +519,80 @@ static void blk_sync_complete(void *opaque, int ret)
      */
 }
 
-static void flash_sync_page(Flash *s, int page)
+static void flash_write_storage(Flash *s, int64_t off, int64_t len)
 {
     QEMUIOVector *iov;
 
-    if (!s->blk || blk_is_read_only(s->blk)) {
+    iov = g_new(QEMUIOVector, 1);
+    qemu_iovec_init(iov, 1);
+    qemu_iovec_add(iov, s->storage + off, len);
+    blk_aio_pwritev(s->blk, off, iov, 0, blk_sync_complete, iov);
+    s->write_requests++;
+    s->bytes_written += len;
+}
+
+/* Write all dirty pages to the drive, one request per run of adjacent
+ * dirty pages. Completion is not waited for; the requests are drained
+ * by whoever needs the data on the drive (VM stop, QMP flush).
+ */
+static void flash_writeback_flush(Flash *s)
+{
+    unsigned long nr_pages = s->size / s->pi->page_size;
+    unsigned long start, end;
+
+    if (!s->dirty_bitmap) {
         return;
     }
+    timer_del(s->write_back_timer);
 
-    iov = g_new(QEMUIOVector, 1);
-    qemu_iovec_init(iov, 1);
-    qemu_iovec_add(iov, s->storage + page * s->pi->page_size,
-                   s->pi->page_size);
-    blk_aio_pwritev(s->blk, page * s->pi->page_size, iov, 0,
-                    blk_sync_complete, iov);
+    start = find_first_bit(s->dirty_bitmap, nr_pages);
+    if (start >= nr_pages) {
+        return;
+    }
+    while (start < nr_pages) {
+        end = find_next_zero_bit(s->dirty_bitmap, nr_pages, start);
+        bitmap_clear(s->dirty_bitmap, start, end - start);
+        trace_m25p80_writeback(s, start * s->pi->page_size,
+                               (end - start) * s->pi->page_size);
+        flash_write_storage(s, start * s->pi->page_size,
+                            (end - start) * s->pi->page_size);
+        start = find_next_bit(s->dirty_bitmap, nr_pages, end);
+    }
+    s->flushes++;
 }
 
-static inline void flash_sync_area(Flash *s, int64_t off, int64_t len)
+static void flash_writeback_timer_cb(void *opaque)
 {
-    QEMUIOVector *iov;
+    flash_writeback_flush(opaque);
+}
 
+static void flash_mark_dirty(Flash *s, int64_t off, int64_t len)
+{
+    bitmap_set(s->dirty_bitmap, off / s->pi->page_size,
+               DIV_ROUND_UP(off + len, s->pi->page_size) - off / s->pi->page_size);
+    if (s->write_back_interval && !timer_pending(s->write_back_timer)) {
+        timer_mod(s->write_back_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->write_back_interval);
+    }
+}
+
+static void flash_sync_area(Flash *s, int64_t off, int64_t len)
+{
     if (!s->blk || blk_is_read_only(s->blk)) {
         return;
     }
 
-    assert(!(len % BDRV_SECTOR_SIZE));
-    iov = g_new(QEMUIOVector, 1);
-    qemu_iovec_init(iov, 1);
-    qemu_iovec_add(iov, s->storage + off, len);
-    blk_aio_pwritev(s->blk, off, iov, 0, blk_sync_complete, iov);
+    s->program_ops++;
+    if (s->dirty_bitmap) {
+        flash_mark_dirty(s, off, len);
+    } else {
+        flash_write_storage(s, off, len);
+    }
+}
+
+static void flash_sync_page(Flash *s, int page)
+{
+    flash_sync_area(s, (int64_t) page * s->pi->page_size, s->pi->page_size);
 }
 
 static void flash_erase(Flash *s, int offset, FlashCMD cmd)
@@ -1266,6 +1334,55 @@ static uint32_t m25p80_transfer8(SSISlave *ss, uint32_t tx)
     return r;
 }
 
+static uint32_t m25p80_transfer_bulk(SSISlave *ss, const uint8_t *tx,
+                                     uint8_t *rx, uint32_t len)
+{
+    Flash *s = M25P80(ss);
+    uint32_t i, n;
+
+    switch (s->state) {
+
+    case STATE_PAGE_PROGRAM:
+        trace_m25p80_page_program_bulk(s, s->cur_addr, len);
+        for (i = 0; i < len; ++i) {
+            flash_write8(s, s->cur_addr, tx ? tx[i] : 0);
+            if (rx) {
+                rx[i] = 0;
+            }
+            s->cur_addr = (s->cur_addr + 1) & (s->size - 1);
+        }
+        return len;
+
+    case STATE_READ:
+        trace_m25p80_read_bulk(s, s->cur_addr, len);
+        for (i = 0; i < len; i += n) {
+            n = MIN(len - i, s->size - s->cur_addr);
+            if (rx) {
+                memcpy(rx + i, s->storage + s->cur_addr, n);
+            }
+            s->cur_addr = (s->cur_addr + n) & (s->size - 1);
+        }
+        return len;
+
+    default:
+        /* Command, address and register phases go byte by byte */
+        return 0;
+    }
+}
+
+/* Stopping the VM is followed by draining all drives, so this also takes
+ * care of shutdown, migration and snapshots.
+ */
+static void m25p80_vm_state_change(void *opaque, int running, RunState state)
+{
+    Flash *s = opaque;
+
+    if (!running) {
+        flash_sync_dirty(s, -1);
+        flash_writeback_flush(s);
+    }
+}
+
 static void m25p80_realize(SSISlave *ss, Error **errp)
 {
     Flash *s = M25P80(ss);
@@ -1284,7 +1401,19 @@ static void m25p80_realize(SSISlave *ss, Error **errp)
         if (ret < 0) {
             return;
         }
+    }
 
+    if (s->storage_mem) {
+        if (!memory_region_is_ram(s->storage_mem) ||
+            memory_region_size(s->storage_mem) < s->size) {
+            error_setg(errp, "storage region must be RAM of at least %u bytes",
+                       s->size);
+            return;
+        }
+        /* Contents are already there; writes still go to the drive, if any */
+        trace_m25p80_binding_storage_mem(s);
+        s->storage = memory_region_get_ram_ptr(s->storage_mem);
+    } else if (s->blk) {
         trace_m25p80_binding(s);
         s->storage = blk_blockalign(s->blk, s->size);
 
@@ -1297,6 +1426,14 @@ static void m25p80_realize(SSISlave *ss, Error **errp)
         s->storage = blk_blockalign(NULL, s->size);
         memset(s->storage, 0xFF, s->size);
     }
+
+    if (s->write_back && s->blk && !blk_is_read_only(s->blk)) {
+        s->dirty_bitmap = bitmap_new(s->size / s->pi->page_size);
+        s->write_back_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                           flash_writeback_timer_cb, s);
+        s->vm_change_state = qemu_add_vm_change_state_handler(
+                                 m25p80_vm_state_change, s);
+    }
 }
 
 static void m25p80_reset(DeviceState *d)
@@ -1309,6 +1446,7 @@ static void m25p80_reset(DeviceState *d)
 static int m25p80_pre_save(void *opaque)
 {
     flash_sync_dirty((Flash *)opaque, -1);
+    flash_writeback_flush((Flash *)opaque);
 
     return 0;
 }
@@ -1321,6 +1459,12 @@ static Property m25p80_properties[] = {
     DEFINE_PROP_UINT8("spansion-cr3nv", Flash, spansion_cr3nv, 0x2),
     DEFINE_PROP_UINT8("spansion-cr4nv", Flash, spansion_cr4nv, 0x10),
     DEFINE_PROP_DRIVE("drive", Flash, blk),
+    DEFINE_PROP_LINK("storage", Flash, storage_mem, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_BOOL("write-back", Flash, write_back, false),
+    /* ms between the first write to a clean flash and the write-back,
+     * 0 to only write back when the VM stops or on flash-writeback-flush */
+    DEFINE_PROP_UINT32("write-back-interval", Flash, write_back_interval, 1000),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1392,6 +1536,7 @@ static void m25p80_class_init(ObjectClass *klass, void *data)
 
     k->realize = m25p80_realize;
     k->transfer = m25p80_transfer8;
+    k->transfer_bulk = m25p80_transfer_bulk;
     k->set_cs = m25p80_cs;
     k->cs_polarity = SSI_CS_LOW;
     dc->vmsd = &vmstate_m25p80;
@@ -1408,6 +1553,102 @@ static const TypeInfo m25p80_info = {
     .abstract       = true,
 };
 
+/* Read the current flash contents, including programmed data which has
+ * not been written to the drive yet. Returns -EINVAL if the range does
+ * not fit in the flash.
+ */
+int m25p80_read(DeviceState *dev, uint32_t addr, void *buf, uint32_t len)
+{
+    Flash *s = M25P80(dev);
+
+    if ((uint64_t) addr + len > s->size) {
+        return -EINVAL;
+    }
+    memcpy(buf, s->storage + addr, len);
+    return 0;
+}
+
+static int m25p80_query_writeback_one(Object *obj, void *opaque)
+{
+    FlashWritebackInfoList ***tail = opaque;
+    FlashWritebackInfoList *entry;
+    FlashWritebackInfo *info;
+    Flash *s = (Flash *)object_dynamic_cast(obj, TYPE_M25P80);
+
+    if (!s || !s->blk) {
+        return 0;
+    }
+
+    info = g_new0(FlashWritebackInfo, 1);
+    info->path = object_get_canonical_path(obj);
+    info->write_back = s->dirty_bitmap != NULL;
+    if (s->dirty_bitmap) {
+        info->dirty_bytes = (uint64_t) s->pi->page_size *
+            bitmap_count_one(s->dirty_bitmap, s->size / s->pi->page_size);
+    }
+    info->program_ops = s->program_ops;
+    info->write_requests = s->write_requests;
+    info->bytes_written = s->bytes_written;
+    info->flushes = s->flushes;
+
+    entry = g_new0(FlashWritebackInfoList, 1);
+    entry->value = info;
+    **tail = entry;
+    *tail = &entry->next;
+    return 0;
+}
+
+FlashWritebackInfoList *qmp_query_flash_writeback(Error **errp)
+{
+    FlashWritebackInfoList *head = NULL, **tail = &head;
+
+    object_child_foreach_recursive(object_get_root(),
+                                   m25p80_query_writeback_one, &tail);
+    return head;
+}
+
+static int m25p80_writeback_flush_one(Object *obj, void *opaque)
+{
+    Error **errp = opaque;
+    Flash *s = (Flash *)object_dynamic_cast(obj, TYPE_M25P80);
+    int ret;
+
+    if (!s || !s->blk || blk_is_read_only(s->blk)) {
+        return 0;
+    }
+
+    flash_sync_dirty(s, -1);
+    flash_writeback_flush(s);
+    blk_drain(s->blk);
+    ret = blk_flush(s->blk);
+    if (ret < 0) {
+        char *path = object_get_canonical_path(obj);
+
+        error_setg_errno(errp, -ret, "Failed to flush '%s'", path);
+        g_free(path);
+        return ret;
+    }
+    return 0;
+}
+
+void qmp_flash_writeback_flush(bool has_path, const char *path, Error **errp)
+{
+    Object *obj;
+
+    if (!has_path) {
+        object_child_foreach_recursive(object_get_root(),
+                                       m25p80_writeback_flush_one, errp);
+        return;
+    }
+
+    obj = object_resolve_path_type(path, TYPE_M25P80, NULL);
+    if (!obj) {
+        error_setg(errp, "Path '%s' does not refer to a SPI flash device", path);
+        return;
+    }
+    m25p80_writeback_flush_one(obj, errp);
+}
+
 static void m25p80_register_types(void)
 {
     int i;
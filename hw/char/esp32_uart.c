@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
+#include "qemu/main-loop.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/error-report.h"
 #include "sysemu/sysemu.h"
 #include "chardev/char-fe.h"
@@ -22,18 +24,65 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/char/esp32_uart.h"
+#include "migration/vmstate.h"
 #include "trace.h"
 
 
 static gboolean uart_transmit(GIOChannel *chan, GIOCondition cond, void *opaque);
 static void uart_receive(void *opaque, const uint8_t *buf, int size);
 
-static uint8_t fifo8_peek(Fifo8 *fifo)
+/* Copy the contents of the FIFO to buf without consuming them */
+static uint32_t fifo8_peek_all(Fifo8 *fifo, uint8_t *buf)
 {
-    if (fifo->num == 0) {
-        abort();
+    for (uint32_t i = 0; i < fifo->num; ++i) {
+        buf[i] = fifo->data[(fifo->head + i) % fifo->capacity];
     }
-    return fifo->data[fifo->head];
+    return fifo->num;
+}
+
+static uint32_t esp32_uart_baud_rate(ESP32UARTState *s)
+{
+    /* The divider is a fixed point value with a 4-bit fractional part */
+    uint32_t div_x16 = FIELD_EX32(s->reg[R_UART_CLKDIV], UART_CLKDIV, CLKDIV) * 16 +
+                       FIELD_EX32(s->reg[R_UART_CLKDIV], UART_CLKDIV, CLKDIV_FRAG);
+    uint32_t clk_freq = s->apb_freq;
+
+    if (div_x16 < 16) {
+        return UART_DEFAULT_BAUD_RATE;
+    }
+    if (!FIELD_EX32(s->reg[R_UART_CONF0], UART_CONF0, TICK_REF_ALWAYS_ON)) {
+        clk_freq = UART_REF_TICK_FREQ;
+    }
+    return (uint64_t) clk_freq * 16 / div_x16;
+}
+
+/* Time it takes to send one character with the current line settings */
+static int64_t esp32_uart_frame_ns(ESP32UARTState *s)
+{
+    uint32_t conf0 = s->reg[R_UART_CONF0];
+    /* Count in half bits, there can be 1.5 stop bits */
+    uint32_t half_bits = 2 * (1 + 5 + FIELD_EX32(conf0, UART_CONF0, BIT_NUM) +
+                              FIELD_EX32(conf0, UART_CONF0, PARITY_EN));
+    const uint32_t stop_half_bits[] = {2, 2, 3, 4};
+    half_bits += stop_half_bits[FIELD_EX32(conf0, UART_CONF0, STOP_BIT_NUM)];
+
+    return muldiv64(half_bits, NANOSECONDS_PER_SECOND, 2 * esp32_uart_baud_rate(s));
+}
+
+/* Number of characters at the head of the TX FIFO which may be sent now */
+static uint32_t esp32_uart_tx_due(ESP32UARTState *s)
+{
+    uint32_t used = fifo8_num_used(&s->tx_fifo);
+    int64_t now;
+
+    if (!s->accurate_baud || used == 0) {
+        return used;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (now < s->tx_next_ns) {
+        return 0;
+    }
+    return MIN(used, (now - s->tx_next_ns) / esp32_uart_frame_ns(s) + 1);
 }
 
 static void esp_uart_update_irq(ESP32UARTState *s)
@@ -111,7 +160,23 @@ static void uart_write(void *opaque, hwaddr addr,
             error_report("esp_uart: write to UART FIFO while it is full");
         } else {
             fifo8_push(&s->tx_fifo, (uint8_t) (value & 0xff));
-            uart_transmit(NULL, G_IO_OUT, s);
+            if (s->accurate_baud) {
+                /* Characters leave the FIFO one frame time apart */
+                if (fifo8_num_used(&s->tx_fifo) == 1) {
+                    s->tx_next_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                    esp32_uart_frame_ns(s);
+                    timer_mod_ns(&s->tx_timer, s->tx_next_ns);
+                }
+                break;
+            }
+            /* Send the data in bulk once the guest is done filling the FIFO,
+             * unless it is full and the guest would have to wait for it.
+             */
+            if (s->tx_coalesce && !fifo8_is_full(&s->tx_fifo)) {
+                qemu_bh_schedule(s->tx_bh);
+            } else {
+                uart_transmit(NULL, G_IO_OUT, s);
+            }
         }
         break;
 
@@ -154,18 +219,31 @@ static void uart_write(void *opaque, hwaddr addr,
 static gboolean uart_transmit(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     ESP32UARTState *s = ESP32_UART(opaque);
+    uint8_t buf[UART_FIFO_LENGTH];
+    uint32_t len;
+    int r;
 
     s->tx_watch_handle = 0;
+    qemu_bh_cancel(s->tx_bh);
 
-    while (fifo8_num_used(&s->tx_fifo) > 0) {
-        uint8_t b = fifo8_peek(&s->tx_fifo);
-        int r = qemu_chr_fe_write(&s->chr, &b, 1);
-        if (r == 1) {
-            fifo8_pop(&s->tx_fifo);
-        } else {
-            s->tx_watch_handle = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
-                                                       uart_transmit, s);
-            break;
+    fifo8_peek_all(&s->tx_fifo, buf);
+    len = esp32_uart_tx_due(s);
+    if (len == 0) {
+        return FALSE;
+    }
+
+    r = qemu_chr_fe_write(&s->chr, buf, len);
+    for (int i = 0; i < r; ++i) {
+        fifo8_pop(&s->tx_fifo);
+    }
+    if (r < (int) len) {
+        s->tx_watch_handle = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                   uart_transmit, s);
+    }
+    if (s->accurate_baud && r > 0) {
+        s->tx_next_ns += r * esp32_uart_frame_ns(s);
+        if (!fifo8_is_empty(&s->tx_fifo) && !s->tx_watch_handle) {
+            timer_mod_ns(&s->tx_timer, s->tx_next_ns);
         }
     }
 
@@ -174,6 +252,15 @@ static gboolean uart_transmit(GIOChannel *chan, GIOCondition cond, void *opaque)
     return FALSE;
 }
 
+static void uart_tx_bh(void *opaque)
+{
+    ESP32UARTState *s = ESP32_UART(opaque);
+
+    if (!s->tx_watch_handle) {
+        uart_transmit(NULL, G_IO_OUT, s);
+    }
+}
+
 static void uart_receive(void *opaque, const uint8_t *buf, int size)
 {
     ESP32UARTState *s = ESP32_UART(opaque);
@@ -182,6 +269,13 @@ static void uart_receive(void *opaque, const uint8_t *buf, int size)
         return;
     }
 
+    if (s->accurate_baud) {
+        /* Accept the next character once this one has been received */
+        s->throttle_rx = true;
+        timer_mod_ns(&s->throttle_timer,
+                     qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + esp32_uart_frame_ns(s));
+    }
+
     for (int i = 0; i < size && fifo8_num_free(&s->rx_fifo) > 0; i++) {
         fifo8_push(&s->rx_fifo, buf[i]);
 
@@ -190,10 +284,10 @@ static void uart_receive(void *opaque, const uint8_t *buf, int size)
         }
     }
 
-    if (fifo8_is_full(&s->rx_fifo)) {
+    if (fifo8_is_full(&s->rx_fifo) && !s->accurate_baud) {
         s->throttle_rx = true;
         const int bits_per_symbol = 10;
-        const int baud_rate = 115200; /* FIXME: get from the divider register */
+        const int baud_rate = esp32_uart_baud_rate(s);
         uint64_t throttle_time_ns = (uint64_t) UART_FIFO_LENGTH * bits_per_symbol * NANOSECONDS_PER_SECOND / baud_rate;
         timer_mod_ns(&s->throttle_timer,
                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
@@ -209,6 +303,9 @@ static int uart_can_receive(void *opaque)
     if (s->throttle_rx) {
         return 0;
     }
+    if (s->accurate_baud) {
+        return MIN(fifo8_num_free(&s->rx_fifo), 1);
+    }
     return fifo8_num_free(&s->rx_fifo);
 }
 
@@ -225,11 +322,21 @@ static void uart_throttle_timer_cb(void* opaque)
     qemu_chr_fe_accept_input(&s->chr);
 }
 
+static void uart_tx_timer_cb(void *opaque)
+{
+    ESP32UARTState *s = ESP32_UART(opaque);
+
+    if (!s->tx_watch_handle) {
+        uart_transmit(NULL, G_IO_OUT, s);
+    }
+}
+
 static void esp32_uart_reset(DeviceState *dev)
 {
     ESP32UARTState *s = ESP32_UART(dev);
 
     memset(s->reg, 0, sizeof(s->reg));
+    s->reg[R_UART_CONF0] = 0x0800001c;
     s->autobaud_en = false;
     s->reg[R_UART_RXD_CNT] = 0;
     s->reg[R_UART_INT_ST] = 0;
@@ -242,21 +349,47 @@ static void esp32_uart_reset(DeviceState *dev)
         g_source_remove(s->tx_watch_handle);
         s->tx_watch_handle = 0;
     }
+    qemu_bh_cancel(s->tx_bh);
+    timer_del(&s->tx_timer);
     timer_del(&s->throttle_timer);
     s->throttle_rx = false;
     qemu_irq_lower(s->irq);
 }
 
+static int uart_be_change(void *opaque)
+{
+    ESP32UARTState *s = ESP32_UART(opaque);
+
+    qemu_chr_fe_set_handlers(&s->chr, uart_can_receive, uart_receive,
+                             uart_event, uart_be_change, s, NULL, true);
+
+    /* The watch belonged to the old backend */
+    if (s->tx_watch_handle) {
+        g_source_remove(s->tx_watch_handle);
+        s->tx_watch_handle = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                   uart_transmit, s);
+    }
+    return 0;
+}
 
 static void esp32_uart_realize(DeviceState *dev, Error **errp)
 {
     ESP32UARTState *s = ESP32_UART(dev);
 
+    s->tx_bh = qemu_bh_new(uart_tx_bh, s);
     qemu_chr_fe_set_handlers(&s->chr, uart_can_receive, uart_receive,
-                             uart_event, NULL, s, NULL, true);
+                             uart_event, uart_be_change, s, NULL, true);
 }
 
 
+static void esp32_uart_set_apb_freq(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    ESP32UARTState *s = ESP32_UART(opaque);
+    visit_type_uint32(v, name, &s->apb_freq, errp);
+}
+
 static const MemoryRegionOps uart_ops = {
     .read =  uart_read,
     .write = uart_write,
@@ -275,11 +408,53 @@ static void esp32_uart_init(Object *obj)
     fifo8_create(&s->tx_fifo, UART_FIFO_LENGTH);
     fifo8_create(&s->rx_fifo, UART_FIFO_LENGTH);
     timer_init_ns(&s->throttle_timer, QEMU_CLOCK_VIRTUAL, uart_throttle_timer_cb, s);
+    timer_init_ns(&s->tx_timer, QEMU_CLOCK_VIRTUAL, uart_tx_timer_cb, s);
+
+    object_property_add(obj, "apb_freq", "uint32",
+                        NULL,
+                        esp32_uart_set_apb_freq,
+                        NULL,
+                        obj, &error_abort);
+    s->apb_freq = 40000000;
 }
 
 
+static int esp32_uart_post_load(void *opaque, int version_id)
+{
+    ESP32UARTState *s = ESP32_UART(opaque);
+
+    /* Characters left in the TX FIFO were waiting for the chardev,
+     * watch for it to become writable again.
+     */
+    if (fifo8_num_used(&s->tx_fifo) > 0 && !s->tx_watch_handle) {
+        s->tx_watch_handle = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                   uart_transmit, s);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_uart = {
+    .name = TYPE_ESP32_UART,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = esp32_uart_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(reg, ESP32UARTState, UART_REG_CNT),
+        VMSTATE_FIFO8(rx_fifo, ESP32UARTState),
+        VMSTATE_FIFO8(tx_fifo, ESP32UARTState),
+        VMSTATE_TIMER(throttle_timer, ESP32UARTState),
+        VMSTATE_BOOL(throttle_rx, ESP32UARTState),
+        VMSTATE_BOOL(autobaud_en, ESP32UARTState),
+        VMSTATE_TIMER(tx_timer, ESP32UARTState),
+        VMSTATE_INT64(tx_next_ns, ESP32UARTState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_uart_properties[] = {
     DEFINE_PROP_CHR("chardev", ESP32UARTState, chr),
+    DEFINE_PROP_BOOL("tx-coalesce", ESP32UARTState, tx_coalesce, true),
+    DEFINE_PROP_BOOL("accurate-baud", ESP32UARTState, accurate_baud, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -289,6 +464,7 @@ static void esp32_uart_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_uart_reset;
     dc->realize = esp32_uart_realize;
+    dc->vmsd = &vmstate_esp32_uart;
     device_class_set_props(dc, esp32_uart_properties);
 }
 
@@ -13,6 +13,7 @@
    setup are ignored. */
 #include "qemu/osdep.h"
 #include "hw/i2c/i2c.h"
+#include "hw/qdev-properties.h"
 #include "ui/console.h"
 #include "migration/vmstate.h"
 
@@ -63,6 +64,11 @@ enum ssd1306_cmd {
 
 #define MAX_FRAMEBUFF (132*64)
 
+/* Visible area: 8 pages of 128 columns, each byte covering 8 lines */
+#define SSD1306_WIDTH   128
+#define SSD1306_HEIGHT  64
+#define SSD1306_PAGES   (SSD1306_HEIGHT / 8)
+
 typedef struct {
     I2CSlave parent_obj;
 
@@ -80,7 +86,11 @@ typedef struct {
     int flash;
     int enabled;
     int inverse;
-    int redraw;
+    int redraw;     /* whole display needs to be redrawn */
+    /* Columns written since the last update, per page. Empty when min > max. */
+    uint8_t dirty_col_min[SSD1306_PAGES];
+    uint8_t dirty_col_max[SSD1306_PAGES];
+    bool render;
     enum ssd1306_mode mode;
     enum ssd1306_adressing_mode  adressing_mode;
     enum ssd1306_cmd cmd_state;
@@ -88,8 +98,20 @@ typedef struct {
 } ssd1306_state;
 
 
-ssd1306_state *the_ssd1306 = NULL;
+static void ssd1306_clear_dirty(ssd1306_state *s)
+{
+    memset(s->dirty_col_min, SSD1306_WIDTH - 1, sizeof(s->dirty_col_min));
+    memset(s->dirty_col_max, 0, sizeof(s->dirty_col_max));
+    s->redraw = 0;
+}
 
+static void ssd1306_mark_dirty(ssd1306_state *s, int page, int col)
+{
+    if (page < SSD1306_PAGES && col < SSD1306_WIDTH) {
+        s->dirty_col_min[page] = MIN(s->dirty_col_min[page], col);
+        s->dirty_col_max[page] = MAX(s->dirty_col_max[page], col);
+    }
+}
 
 static uint8_t ssd1306_recv(I2CSlave *i2c)
 {
@@ -99,7 +121,7 @@ static uint8_t ssd1306_recv(I2CSlave *i2c)
 
 static int ssd1306_send(I2CSlave *i2c, uint8_t data)
 {
-    ssd1306_state *s = the_ssd1306; //SSD1306(i2c);
+    ssd1306_state *s = SSD1306(i2c);
     enum ssd1306_cmd old_cmd_state;
 
     switch (s->mode) {
@@ -139,8 +161,10 @@ static int ssd1306_send(I2CSlave *i2c, uint8_t data)
                //}
                 offset=s->col + s->row * 128;
                 //DPRINTF("%d,%d offset 0x%02x\n", s->col , s->row,offset);
-                if (offset < MAX_FRAMEBUFF) {
+                /* Firmware tends to resend the whole screen; only count what changed */
+                if (offset < MAX_FRAMEBUFF && s->framebuffer[offset] != data) {
                     s->framebuffer[offset] = data;
+                    ssd1306_mark_dirty(s, s->row, s->col);
                 }
                 s->col++;
 
@@ -159,7 +183,6 @@ static int ssd1306_send(I2CSlave *i2c, uint8_t data)
                 //    s->col=0;
                 //}
             //}
-            s->redraw = 1;
         }
         break;
     case SSD1306_CMD:
@@ -229,6 +252,7 @@ static int ssd1306_send(I2CSlave *i2c, uint8_t data)
             case 0x40 ... 0x7f: /* Set start line.  */
                  DPRINTF("1306 segment map 0x%02x\n", data );
                 s->start_line = 0;
+                s->redraw = 1;
                 break;
             case 0x81: /* Set contrast (Ignored).  */
                 s->cmd_state = SSD1306_CMD_SKIP1;
@@ -243,15 +267,19 @@ static int ssd1306_send(I2CSlave *i2c, uint8_t data)
                 break;
             case 0xa4: /* Entire display off.  */
                 s->flash = 0;
+                s->redraw = 1;
                 break;
             case 0xa5: /* Entire display on.  */
                 s->flash = 1;
+                s->redraw = 1;
                 break;
             case 0xa6: /* Inverse off.  */
                 s->inverse = 0;
+                s->redraw = 1;
                 break;
             case 0xa7: /* Inverse on.  */
                 s->inverse = 1;
+                s->redraw = 1;
                 break;
             case 0xa8: /* Set multiplied ratio (Ignored).  */
                 s->cmd_state = SSD1306_CMD_SKIP1;
@@ -339,8 +367,7 @@ static int ssd1306_send(I2CSlave *i2c, uint8_t data)
 
 static int ssd1306_event(I2CSlave *i2c, enum i2c_event event)
 {
-    //ssd1306_state *s = SSD1306(i2c);
-    ssd1306_state *s = the_ssd1306;
+    ssd1306_state *s = SSD1306(i2c);
 
     DPRINTF("ssd1306_event 0x%02x\n", (int)event);
 
@@ -358,10 +385,16 @@ static int ssd1306_event(I2CSlave *i2c, enum i2c_event event)
     return 0;
 }
 
+/* Only the pages written since the last update are converted, and only
+ * the bounding box of what was converted is pushed to the console.
+ *
+ * This runs only when a display refreshes the console, or for a
+ * screendump. Displays without a viewer do not refresh it, e.g. VNC with
+ * no client connected, so the dirty state simply accumulates until then.
+ */
 static void ssd1306_update_display(void *opaque)
 {
-    //ssd1306_state *s = (ssd1306_state *)opaque;
-    ssd1306_state *s = the_ssd1306;
+    ssd1306_state *s = (ssd1306_state *)opaque;
 
     DisplaySurface *surface = qemu_console_surface(s->con);
     uint8_t *dest;
@@ -369,15 +402,31 @@ static void ssd1306_update_display(void *opaque)
     int x;
     int y;
     int line;
+    int page;
     char *colors[2];
     char colortab[MAGNIFY * 8];
     int dest_width;
+    int stride;
     uint8_t mask;
+    int x_min = SSD1306_WIDTH, x_max = -1;
+    int y_min = SSD1306_HEIGHT, y_max = -1;
 
-    //DPRINTF("ssd1306_update_display  0x%02x\n", 0x47);
+    if (!s->render) {
+        return;
+    }
 
-    if (!s->redraw)
+    if (s->redraw) {
+        memset(s->dirty_col_min, 0, sizeof(s->dirty_col_min));
+        memset(s->dirty_col_max, SSD1306_WIDTH - 1, sizeof(s->dirty_col_max));
+    }
+    for (page = 0; page < SSD1306_PAGES; page++) {
+        if (s->dirty_col_min[page] <= s->dirty_col_max[page]) {
+            break;
+        }
+    }
+    if (page == SSD1306_PAGES) {
         return;
+    }
 
     switch (surface_bits_per_pixel(surface)) {
     case 0:
@@ -411,23 +460,36 @@ static void ssd1306_update_display(void *opaque)
         colors[0] = colortab + dest_width;
         colors[1] = colortab;
     }
-    dest = surface_data(surface);
-    for (y = 0; y < 64; y++) {
-        line = (y + s->start_line) & 63;
-        src = s->framebuffer + 128 * (line >> 3) ;
+    stride = surface_stride(surface);
+    for (y = 0; y < SSD1306_HEIGHT; y++) {
+        line = (y + s->start_line) & (SSD1306_HEIGHT - 1);
+        page = line >> 3;
+        int col_min = s->dirty_col_min[page];
+        int col_max = s->dirty_col_max[page];
+        if (col_min > col_max) {
+            continue;
+        }
+        uint8_t *row_start = surface_data(surface) + y * MAGNIFY * stride + col_min * dest_width;
+        int row_bytes = (col_max - col_min + 1) * dest_width;
+        src = s->framebuffer + SSD1306_WIDTH * page + col_min;
         mask = 1 << (line & 7);
-        for (x = 0; x < 128; x++) {
+        dest = row_start;
+        for (x = col_min; x <= col_max; x++) {
             memcpy(dest, colors[(*src & mask) != 0], dest_width);
             dest += dest_width;
             src++;
         }
         for (x = 1; x < MAGNIFY; x++) {
-            memcpy(dest, dest - dest_width * 128, dest_width * 128);
-            dest += dest_width * 128;
+            memcpy(row_start + x * stride, row_start, row_bytes);
         }
+        x_min = MIN(x_min, col_min);
+        x_max = MAX(x_max, col_max);
+        y_min = MIN(y_min, y);
+        y_max = y;
     }
-    s->redraw = 0;
-    dpy_gfx_update(s->con, 0, 0, 128 * MAGNIFY, 64 * MAGNIFY);
+    ssd1306_clear_dirty(s);
+    dpy_gfx_update(s->con, x_min * MAGNIFY, y_min * MAGNIFY,
+                   (x_max - x_min + 1) * MAGNIFY, (y_max - y_min + 1) * MAGNIFY);
 }
 
 static void ssd1306_invalidate_display(void * opaque)
@@ -436,10 +498,18 @@ static void ssd1306_invalidate_display(void * opaque)
     s->redraw = 1;
 }
 
+static int ssd1306_post_load(void *opaque, int version_id)
+{
+    ssd1306_state *s = (ssd1306_state *)opaque;
+    s->redraw = 1;
+    return 0;
+}
+
 static const VMStateDescription vmstate_ssd1306 = {
     .name = "ssd1306_oled",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = ssd1306_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_INT32(row, ssd1306_state),
         VMSTATE_INT32(col, ssd1306_state),
@@ -501,9 +571,6 @@ static void ssd1306_init(Object *obj)
 static void ssd1306_realize(DeviceState *dev, Error **errp)
 {
     ssd1306_state *s = SSD1306(dev);
-    if (the_ssd1306 == NULL) {
-        the_ssd1306 = s;
-    }
 
     s->col = 0;
     s->row = 0;
@@ -517,9 +584,19 @@ static void ssd1306_realize(DeviceState *dev, Error **errp)
     s->adressing_mode = SSD1306_PAGE;
 
     s->con = graphic_console_init(dev, 0, &ssd1306_ops, s);
-    qemu_console_resize(s->con, 128 * MAGNIFY, 64 * MAGNIFY);
+    qemu_console_resize(s->con, SSD1306_WIDTH * MAGNIFY, SSD1306_HEIGHT * MAGNIFY);
+    ssd1306_clear_dirty(s);
+    s->redraw = 1;
 }
 
+/* render=off keeps the framebuffer up to date but never converts it,
+ * for headless instances where nothing looks at the display.
+ */
+static Property ssd1306_properties[] = {
+    DEFINE_PROP_BOOL("render", ssd1306_state, render, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void ssd1306_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -531,6 +608,7 @@ static void ssd1306_class_init(ObjectClass *klass, void *data)
     k->recv = ssd1306_recv;
     k->send = ssd1306_send;
     dc->vmsd = &vmstate_ssd1306;
+    device_class_set_props(dc, ssd1306_properties);
 }
 
 static const TypeInfo ssd1306_info = {
@@ -3,6 +3,14 @@
  *
  * Copyright (c) 2019 Espressif Systems (Shanghai) Co. Ltd.
  *
+ * Pads driven by the GPIO_OUT registers are exported as qdev GPIO outputs,
+ * and external pad levels can be driven through the qdev GPIO inputs.
+ * Optionally, a chardev can be attached to exchange pin events with
+ * the host. Each event is a line of text, "<pin> <level>\n":
+ * - the device sends one whenever the level of a pad it drives changes,
+ *   and the levels of all driven pads when the chardev is opened;
+ * - the host sends one to set the external level of a pad.
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 2 or
  * (at your option) any later version.
@@ -11,6 +19,7 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/error-report.h"
+#include "qemu/cutils.h"
 #include "qapi/error.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
@@ -18,17 +27,177 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/gpio/esp32_gpio.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
+#define ESP32_GPIO_PIN_REG(n)           (A_GPIO_PIN0 + (n) * 4)
+#define ESP32_GPIO_FUNC_IN_SEL_REG(n)   (A_GPIO_FUNC0_IN_SEL_CFG + (n) * 4)
+#define ESP32_GPIO_FUNC_OUT_SEL_REG(n)  (A_GPIO_FUNC0_OUT_SEL_CFG + (n) * 4)
+
+/* Pins 32-39 live in the upper halves of the 64-bit pin masks */
+static void set_low_word(uint64_t *mask, uint32_t value)
+{
+    *mask = deposit64(*mask, 0, 32, value);
+}
+
+static void set_high_word(uint64_t *mask, uint32_t value)
+{
+    *mask = deposit64(*mask, 32, ESP32_GPIO_COUNT - 32, value);
+}
+
+/* Pads whose level is set by the GPIO_OUT registers */
+static uint64_t esp32_gpio_driven_pads(Esp32GpioState *s)
+{
+    uint64_t driven = 0;
+    for (int n = 0; n < ESP32_GPIO_COUNT; ++n) {
+        uint32_t out_sel = FIELD_EX32(s->func_out_sel[n], GPIO_FUNC0_OUT_SEL_CFG, OUT_SEL);
+        if (out_sel == ESP32_GPIO_OUT_SEL_GPIO) {
+            driven |= BIT_ULL(n);
+        }
+    }
+    return driven & s->enable;
+}
+
+/* Pads with a pending interrupt enabled for any of the given INT_ENA bits */
+static uint64_t esp32_gpio_int_status(Esp32GpioState *s, uint32_t int_ena_mask)
+{
+    uint64_t result = 0;
+    for (int n = 0; n < ESP32_GPIO_COUNT; ++n) {
+        if (FIELD_EX32(s->pin[n], GPIO_PIN0, INT_ENA) & int_ena_mask) {
+            result |= BIT_ULL(n);
+        }
+    }
+    return result & s->status;
+}
+
+static void esp32_gpio_send_event(Esp32GpioState *s, int pin, int level)
+{
+    char event[16];
+    int len = snprintf(event, sizeof(event), "%d %d\n", pin, level);
+    qemu_chr_fe_write_all(&s->chr, (const uint8_t *) event, len);
+}
+
+static void esp32_gpio_update(Esp32GpioState *s)
+{
+    uint64_t driven = esp32_gpio_driven_pads(s);
+    uint64_t level = ((s->out & driven) | (s->in_ext & ~driven)) & ESP32_GPIO_MASK;
+    uint64_t changed = level ^ s->level;
 
+    for (int n = 0; n < ESP32_GPIO_COUNT; ++n) {
+        bool pin_level = extract64(level, n, 1);
+        bool pin_changed = extract64(changed, n, 1);
+        bool int_raw = false;
 
+        switch (FIELD_EX32(s->pin[n], GPIO_PIN0, INT_TYPE)) {
+        case ESP32_GPIO_INT_POSEDGE:
+            int_raw = pin_changed && pin_level;
+            break;
+        case ESP32_GPIO_INT_NEGEDGE:
+            int_raw = pin_changed && !pin_level;
+            break;
+        case ESP32_GPIO_INT_ANYEDGE:
+            int_raw = pin_changed;
+            break;
+        case ESP32_GPIO_INT_LOW_LEVEL:
+            int_raw = !pin_level;
+            break;
+        case ESP32_GPIO_INT_HIGH_LEVEL:
+            int_raw = pin_level;
+            break;
+        default:
+            break;
+        }
+        if (int_raw) {
+            s->status |= BIT_ULL(n);
+        }
+
+        if (pin_changed && extract64(driven, n, 1)) {
+            trace_esp32_gpio_pin_out(n, pin_level);
+            qemu_set_irq(s->pin_out[n], pin_level);
+            esp32_gpio_send_event(s, n, pin_level);
+        }
+    }
+    s->level = level;
+
+    qemu_set_irq(s->irq, esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_APP |
+                                                  ESP32_GPIO_INT_ENA_PRO) != 0);
+    qemu_set_irq(s->nmi_irq, esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_APP_NMI |
+                                                      ESP32_GPIO_INT_ENA_PRO_NMI) != 0);
+}
+
+static void esp32_gpio_set_input(Esp32GpioState *s, int pin, int level)
+{
+    trace_esp32_gpio_pin_in(pin, level);
+    s->in_ext = deposit64(s->in_ext, pin, 1, level != 0);
+    esp32_gpio_update(s);
+}
 
 static uint64_t esp32_gpio_read(void *opaque, hwaddr addr, unsigned int size)
 {
     Esp32GpioState *s = ESP32_GPIO(opaque);
     uint64_t r = 0;
     switch (addr) {
+    case A_GPIO_OUT:
+        r = (uint32_t) s->out;
+        break;
+    case A_GPIO_OUT1:
+        r = s->out >> 32;
+        break;
+    case A_GPIO_ENABLE:
+        r = (uint32_t) s->enable;
+        break;
+    case A_GPIO_ENABLE1:
+        r = s->enable >> 32;
+        break;
     case A_GPIO_STRAP:
         r = s->strap_mode;
         break;
+    case A_GPIO_IN:
+        r = (uint32_t) s->level;
+        break;
+    case A_GPIO_IN1:
+        r = s->level >> 32;
+        break;
+    case A_GPIO_STATUS:
+        r = (uint32_t) s->status;
+        break;
+    case A_GPIO_STATUS1:
+        r = s->status >> 32;
+        break;
+    case A_GPIO_ACPU_INT:
+        r = (uint32_t) esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_APP);
+        break;
+    case A_GPIO_ACPU_NMI_INT:
+        r = (uint32_t) esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_APP_NMI);
+        break;
+    case A_GPIO_PCPU_INT:
+        r = (uint32_t) esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_PRO);
+        break;
+    case A_GPIO_PCPU_NMI_INT:
+        r = (uint32_t) esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_PRO_NMI);
+        break;
+    case A_GPIO_ACPU_INT1:
+        r = esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_APP) >> 32;
+        break;
+    case A_GPIO_ACPU_NMI_INT1:
+        r = esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_APP_NMI) >> 32;
+        break;
+    case A_GPIO_PCPU_INT1:
+        r = esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_PRO) >> 32;
+        break;
+    case A_GPIO_PCPU_NMI_INT1:
+        r = esp32_gpio_int_status(s, ESP32_GPIO_INT_ENA_PRO_NMI) >> 32;
+        break;
+
+    case ESP32_GPIO_PIN_REG(0) ... ESP32_GPIO_PIN_REG(ESP32_GPIO_COUNT - 1):
+        r = s->pin[(addr - A_GPIO_PIN0) / 4];
+        break;
+    case ESP32_GPIO_FUNC_IN_SEL_REG(0) ... ESP32_GPIO_FUNC_IN_SEL_REG(ESP32_GPIO_IN_SIGNALS - 1):
+        r = s->func_in_sel[(addr - A_GPIO_FUNC0_IN_SEL_CFG) / 4];
+        break;
+    case ESP32_GPIO_FUNC_OUT_SEL_REG(0) ... ESP32_GPIO_FUNC_OUT_SEL_REG(ESP32_GPIO_COUNT - 1):
+        r = s->func_out_sel[(addr - A_GPIO_FUNC0_OUT_SEL_CFG) / 4];
+        break;
 
     default:
         break;
@@ -39,6 +208,134 @@ static uint64_t esp32_gpio_read(void *opaque, hwaddr addr, unsigned int size)
 static void esp32_gpio_write(void *opaque, hwaddr addr,
                        uint64_t value, unsigned int size)
 {
+    Esp32GpioState *s = ESP32_GPIO(opaque);
+    switch (addr) {
+    case A_GPIO_OUT:
+        set_low_word(&s->out, value);
+        break;
+    case A_GPIO_OUT_W1TS:
+        s->out |= (uint32_t) value;
+        break;
+    case A_GPIO_OUT_W1TC:
+        s->out &= ~(uint64_t) (uint32_t) value;
+        break;
+    case A_GPIO_OUT1:
+        set_high_word(&s->out, value);
+        break;
+    case A_GPIO_OUT1_W1TS:
+        s->out |= (value << 32) & ESP32_GPIO_MASK;
+        break;
+    case A_GPIO_OUT1_W1TC:
+        s->out &= ~(value << 32);
+        break;
+    case A_GPIO_ENABLE:
+        set_low_word(&s->enable, value);
+        break;
+    case A_GPIO_ENABLE_W1TS:
+        s->enable |= (uint32_t) value;
+        break;
+    case A_GPIO_ENABLE_W1TC:
+        s->enable &= ~(uint64_t) (uint32_t) value;
+        break;
+    case A_GPIO_ENABLE1:
+        set_high_word(&s->enable, value);
+        break;
+    case A_GPIO_ENABLE1_W1TS:
+        s->enable |= (value << 32) & ESP32_GPIO_MASK;
+        break;
+    case A_GPIO_ENABLE1_W1TC:
+        s->enable &= ~(value << 32);
+        break;
+    case A_GPIO_STATUS:
+        set_low_word(&s->status, value);
+        break;
+    case A_GPIO_STATUS_W1TS:
+        s->status |= (uint32_t) value;
+        break;
+    case A_GPIO_STATUS_W1TC:
+        s->status &= ~(uint64_t) (uint32_t) value;
+        break;
+    case A_GPIO_STATUS1:
+        set_high_word(&s->status, value);
+        break;
+    case A_GPIO_STATUS1_W1TS:
+        s->status |= (value << 32) & ESP32_GPIO_MASK;
+        break;
+    case A_GPIO_STATUS1_W1TC:
+        s->status &= ~(value << 32);
+        break;
+
+    case ESP32_GPIO_PIN_REG(0) ... ESP32_GPIO_PIN_REG(ESP32_GPIO_COUNT - 1):
+        s->pin[(addr - A_GPIO_PIN0) / 4] = value;
+        break;
+    case ESP32_GPIO_FUNC_IN_SEL_REG(0) ... ESP32_GPIO_FUNC_IN_SEL_REG(ESP32_GPIO_IN_SIGNALS - 1):
+        s->func_in_sel[(addr - A_GPIO_FUNC0_IN_SEL_CFG) / 4] = value;
+        break;
+    case ESP32_GPIO_FUNC_OUT_SEL_REG(0) ... ESP32_GPIO_FUNC_OUT_SEL_REG(ESP32_GPIO_COUNT - 1):
+        s->func_out_sel[(addr - A_GPIO_FUNC0_OUT_SEL_CFG) / 4] = value;
+        break;
+
+    default:
+        return;
+    }
+    esp32_gpio_update(s);
+}
+
+static void esp32_gpio_in_handler(void *opaque, int n, int level)
+{
+    esp32_gpio_set_input(ESP32_GPIO(opaque), n, level);
+}
+
+static void esp32_gpio_handle_event(Esp32GpioState *s, const char *line)
+{
+    const char *end;
+    unsigned int pin, level;
+
+    if (qemu_strtoui(line, &end, 10, &pin) < 0 ||
+        qemu_strtoui(end, NULL, 10, &level) < 0 ||
+        pin >= ESP32_GPIO_COUNT || level > 1) {
+        error_report("esp32_gpio: invalid pin event '%s'", line);
+        return;
+    }
+    esp32_gpio_set_input(s, pin, level);
+}
+
+static int esp32_gpio_can_receive(void *opaque)
+{
+    return 1;
+}
+
+static void esp32_gpio_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Esp32GpioState *s = ESP32_GPIO(opaque);
+
+    for (int i = 0; i < size; ++i) {
+        if (buf[i] == '\n') {
+            s->rx_line[s->rx_line_len] = 0;
+            if (s->rx_line_len > 0) {
+                esp32_gpio_handle_event(s, s->rx_line);
+            }
+            s->rx_line_len = 0;
+        } else if (buf[i] != '\r' && s->rx_line_len < sizeof(s->rx_line) - 1) {
+            s->rx_line[s->rx_line_len++] = buf[i];
+        }
+    }
+}
+
+static void esp32_gpio_event(void *opaque, QEMUChrEvent event)
+{
+    Esp32GpioState *s = ESP32_GPIO(opaque);
+
+    if (event == CHR_EVENT_OPENED) {
+        /* Let the other side know the current state of the outputs */
+        uint64_t driven = esp32_gpio_driven_pads(s);
+        for (int n = 0; n < ESP32_GPIO_COUNT; ++n) {
+            if (extract64(driven, n, 1)) {
+                esp32_gpio_send_event(s, n, extract64(s->level, n, 1));
+            }
+        }
+        s->rx_line_len = 0;
+    }
 }
 
 static const MemoryRegionOps uart_ops = {
@@ -49,10 +346,44 @@ static const MemoryRegionOps uart_ops = {
 
 static void esp32_gpio_reset(DeviceState *dev)
 {
+    Esp32GpioState *s = ESP32_GPIO(dev);
+
+    s->out = 0;
+    s->enable = 0;
+    s->status = 0;
+    memset(s->pin, 0, sizeof(s->pin));
+    memset(s->func_in_sel, 0, sizeof(s->func_in_sel));
+    for (int n = 0; n < ESP32_GPIO_COUNT; ++n) {
+        s->func_out_sel[n] = ESP32_GPIO_OUT_SEL_GPIO;
+    }
+    /*
+     * Nothing is driven, the pads follow the external levels. Outputs which
+     * were driven before the reset are released.
+     */
+    s->level = s->in_ext;
+    for (int n = 0; n < ESP32_GPIO_COUNT; ++n) {
+        qemu_set_irq(s->pin_out[n], extract64(s->level, n, 1));
+    }
+    qemu_irq_lower(s->irq);
+    qemu_irq_lower(s->nmi_irq);
+}
+
+static int esp32_gpio_be_change(void *opaque)
+{
+    Esp32GpioState *s = ESP32_GPIO(opaque);
+
+    s->rx_line_len = 0;
+    qemu_chr_fe_set_handlers(&s->chr, esp32_gpio_can_receive, esp32_gpio_receive,
+                             esp32_gpio_event, esp32_gpio_be_change, s, NULL, true);
+    return 0;
 }
 
 static void esp32_gpio_realize(DeviceState *dev, Error **errp)
 {
+    Esp32GpioState *s = ESP32_GPIO(dev);
+
+    qemu_chr_fe_set_handlers(&s->chr, esp32_gpio_can_receive, esp32_gpio_receive,
+                             esp32_gpio_event, esp32_gpio_be_change, s, NULL, true);
 }
 
 static void esp32_gpio_init(Object *obj)
@@ -64,10 +395,31 @@ static void esp32_gpio_init(Object *obj)
                           TYPE_ESP32_GPIO, 0x1000);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
+    sysbus_init_irq(sbd, &s->nmi_irq);
+    qdev_init_gpio_in(DEVICE(s), esp32_gpio_in_handler, ESP32_GPIO_COUNT);
+    qdev_init_gpio_out(DEVICE(s), s->pin_out, ESP32_GPIO_COUNT);
 }
 
+static const VMStateDescription vmstate_esp32_gpio = {
+    .name = TYPE_ESP32_GPIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(out, Esp32GpioState),
+        VMSTATE_UINT64(enable, Esp32GpioState),
+        VMSTATE_UINT64(status, Esp32GpioState),
+        VMSTATE_UINT64(in_ext, Esp32GpioState),
+        VMSTATE_UINT64(level, Esp32GpioState),
+        VMSTATE_UINT32_ARRAY(pin, Esp32GpioState, ESP32_GPIO_COUNT),
+        VMSTATE_UINT32_ARRAY(func_in_sel, Esp32GpioState, ESP32_GPIO_IN_SIGNALS),
+        VMSTATE_UINT32_ARRAY(func_out_sel, Esp32GpioState, ESP32_GPIO_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_gpio_properties[] = {
     DEFINE_PROP_UINT32("strap_mode", Esp32GpioState, strap_mode, ESP32_STRAP_MODE_FLASH_BOOT),
+    DEFINE_PROP_CHR("chardev", Esp32GpioState, chr),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -77,6 +429,7 @@ static void esp32_gpio_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_gpio_reset;
     dc->realize = esp32_gpio_realize;
+    dc->vmsd = &vmstate_esp32_gpio;
     device_class_set_props(dc, esp32_gpio_properties);
 }
 
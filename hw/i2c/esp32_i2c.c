@@ -1,8 +1,11 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/i2c/esp32_i2c.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 
 enum {
     I2C_SCL_LOW_PERIOD_REG   = 0x0000,
@@ -107,6 +110,34 @@ const char * I2C_REG_NAME[] =
 #define ESP32_I2C_MEM_SIZE 0x1000
 #define I2C_FIFO_LENGTH 32
 
+static void esp32_i2c_update_irq(Esp32I2CState * s)
+{
+    qemu_set_irq(s->irq, s->i2c_int_status_reg.val != 0);
+}
+
+/* Completion of the command list started by TRANS_START */
+static void esp32_i2c_trans_done(Esp32I2CState * s)
+{
+    s->trans_busy = false;
+    for(int i = 0; i < I2C_COMD_REG_COUNT; i++)
+    {
+        if(s->pending_done & BIT(i))
+        {
+            s->i2c_comd_reg[i].I2C_COMMAND_DONE = 1;
+        }
+    }
+    s->pending_done = 0;
+    s->i2c_int_raw_reg.val |= s->pending_int.val;
+    s->i2c_int_status_reg.val |= s->pending_int.val & s->i2c_int_ena_reg.val;
+    s->pending_int.val = 0;
+    esp32_i2c_update_irq(s);
+}
+
+static void esp32_i2c_trans_timer_cb(void * opaque)
+{
+    esp32_i2c_trans_done(Esp32_I2C(opaque));
+}
+
 static void esp32_i2c_reset(DeviceState * dev)
 {
     Esp32I2CState * s = Esp32_I2C(dev);
@@ -129,6 +160,14 @@ static void esp32_i2c_reset(DeviceState * dev)
 
     fifo8_reset(&s->tx_fifo);
     fifo8_reset(&s->rx_fifo);
+
+    timer_del(&s->trans_timer);
+    s->trans_busy = false;
+    s->pending_done = 0;
+    s->pending_int.val = 0;
+    s->scl_low_period = 0;
+    s->scl_high_period = 0;
+    qemu_irq_lower(s->irq);
 }
 
 static uint64_t esp32_i2c_read(void * opaque, hwaddr addr, unsigned int size)
@@ -142,9 +181,19 @@ static uint64_t esp32_i2c_read(void * opaque, hwaddr addr, unsigned int size)
         DPRINTF("read: 0x%x\n", s->i2c_ctr_reg.val);
         return s->i2c_ctr_reg.val;
     case I2C_SR_REG:
+        s->i2c_sr_reg.I2C_RXFIFO_CNT = fifo8_num_used(&s->rx_fifo);
+        s->i2c_sr_reg.I2C_TXFIFO_CNT = fifo8_num_used(&s->tx_fifo);
         DPRINTF("read: 0x%x\n", s->i2c_sr_reg.val);
         return s->i2c_sr_reg.val;
+    case I2C_SCL_LOW_PERIOD_REG:
+        return s->scl_low_period;
+    case I2C_SCL_HIGH_PERIOD_REG:
+        return s->scl_high_period;
     case I2C_FIFO_DATA_REG:
+        if(fifo8_is_empty(&s->rx_fifo))
+        {
+            return 0;
+        }
         return fifo8_pop(&s->rx_fifo);
     case I2C_FIFO_CONF_REG:
         DPRINTF("read: 0x%x\n", s->i2c_fifo_conf_reg.val);
@@ -190,161 +239,133 @@ static uint64_t esp32_i2c_read(void * opaque, hwaddr addr, unsigned int size)
     return 0;
 }
 
-static void esp32_i2c_perform_write(Esp32I2CState * s)
+/* The command list is executed against the I2C core in one go when
+ * TRANS_START is written. What the guest can observe (COMMAND_DONE bits,
+ * interrupts) is held back until the bus would have been done with it,
+ * see esp32_i2c_trans_done.
+ */
+static void esp32_i2c_perform_write(Esp32I2CState *s)
 {
-    for(int i = 0; i < I2C_COMD_REG_COUNT; i++)
-    {
-        if(s->i2c_comd_reg[i].I2C_COMMAND_DONE)
-        {
+    uint64_t scl_cycles = 0;
+
+    for (int i = 0; i < I2C_COMD_REG_COUNT; i++) {
+        if (s->i2c_comd_reg[i].I2C_COMMAND_DONE) {
             continue;
         }
         char op_code = s->i2c_comd_reg[i].I2C_COMMAND_OP_CODE;
         DPRINTF("cmd i: %d, op: %d\n", i, op_code);
+        bool stop = false;
 
-        switch (op_code)
-        {
+        switch (op_code) {
         case I2C_COMMAND_OP_CODE_RSTART:
-            DPRINTF("I2C_COMMAND_OP_CODE_RSTART\n"); // just reset the bus
+            DPRINTF("I2C_COMMAND_OP_CODE_RSTART\n"); /* just reset the bus */
             s->i2c_sr_reg.I2C_BUS_BUSY = I2C_BUS_IDLE;
             i2c_end_transfer(s->bus);
+            scl_cycles += 1;
             break;
-        case I2C_COMMAND_OP_CODE_WRITE:
-            {
-                DPRINTF("I2C_COMMAND_OP_CODE_WRITE, leng: %d\n", s->i2c_comd_reg[i].I2C_COMMAND_BYTE_NUM);
-
-                char leng = s->i2c_comd_reg[i].I2C_COMMAND_BYTE_NUM;
-
-                if(s->i2c_sr_reg.I2C_BUS_BUSY == I2C_BUS_IDLE)
-                {
-                    if(fifo8_is_empty(&s->tx_fifo))
-                    {
-                        s->i2c_int_raw_reg.I2C_TX_FIFO_EMPTY = 1;
-                        if(s->i2c_int_ena_reg.I2C_TX_FIFO_EMPTY)
-                        {
-                            s->i2c_int_status_reg.I2C_TX_FIFO_EMPTY = 1;
-                            qemu_irq_raise(s->irq);
-                        }
-                        break;
-                    }
-                    uint8_t data = fifo8_pop(&s->tx_fifo);
-                    uint8_t addr = data >> 1;
-                    uint8_t read_write = data & 0x1;
-
-                    DPRINTF("start_transfer: 0x%x, 0x%x\n", addr, read_write);
-                    if(i2c_start_transfer(s->bus, addr, read_write) != 0)
-                    {
-                        DPRINTF("not found!\n");
-                        s->i2c_sr_reg.I2C_ACK_REC = 0;
-                        s->i2c_int_raw_reg.I2C_ACK_ERR = 1;
-                        if(s->i2c_int_ena_reg.I2C_ACK_ERR)
-                        {
-                            s->i2c_int_status_reg.I2C_ACK_ERR = 1;
-                            qemu_irq_raise(s->irq);
-                        }
-                        break;
-                    }
-                    DPRINTF("found\n");
-                    s->i2c_sr_reg.I2C_BUS_BUSY = I2C_BUS_BUSY;
-                    s->i2c_sr_reg.I2C_ACK_REC = 1;
-                    s->i2c_sr_reg.I2C_BYTE_TRANS = 1;
-
-                    if(s->i2c_comd_reg[i].I2C_COMMAND_ACK_CHECK_EN && s->i2c_comd_reg[i].I2C_COMMAND_ACK_EXP)
-                    {
-                        s->i2c_comd_reg[i].I2C_COMMAND_ACK_VALUE = 1;
-                    }
-                    else
-                    {
-                        s->i2c_comd_reg[i].I2C_COMMAND_ACK_VALUE = 0;
-                    }
-
-                    s->i2c_int_raw_reg.I2C_TRANS_START = 1;
-                    if(s->i2c_int_ena_reg.I2C_TRANS_START)
-                    {
-                        s->i2c_int_status_reg.I2C_TRANS_START = 1;
-                        qemu_irq_raise(s->irq);
-                    }
-                    leng--;
-                }
+        case I2C_COMMAND_OP_CODE_WRITE: {
+            DPRINTF("I2C_COMMAND_OP_CODE_WRITE, leng: %d\n", s->i2c_comd_reg[i].I2C_COMMAND_BYTE_NUM);
 
-                for(uint num_byte = 0; num_byte < leng; num_byte++)
-                {
-                    if(fifo8_is_empty(&s->tx_fifo))
-                    {
-                        s->i2c_int_raw_reg.I2C_TX_FIFO_EMPTY = 1;
-                        if(s->i2c_int_ena_reg.I2C_TX_FIFO_EMPTY)
-                        {
-                            s->i2c_int_status_reg.I2C_TX_FIFO_EMPTY = 1;
-                            qemu_irq_raise(s->irq);
-                        }
-                        break;
-                    }
-                    uint8_t data = fifo8_pop(&s->tx_fifo);
-                    DPRINTF("i2c_send: 0x%x\n", data);
-                    i2c_send(s->bus, data);
-                    s->i2c_sr_reg.I2C_BYTE_TRANS = 1;
+            int leng = s->i2c_comd_reg[i].I2C_COMMAND_BYTE_NUM;
+
+            if (s->i2c_sr_reg.I2C_BUS_BUSY == I2C_BUS_IDLE) {
+                if (fifo8_is_empty(&s->tx_fifo)) {
+                    s->pending_int.I2C_TX_FIFO_EMPTY = 1;
+                    break;
+                }
+                uint8_t data = fifo8_pop(&s->tx_fifo);
+                uint8_t addr = data >> 1;
+                uint8_t read_write = data & 0x1;
+
+                scl_cycles += 9;
+                DPRINTF("start_transfer: 0x%x, 0x%x\n", addr, read_write);
+                if (i2c_start_transfer(s->bus, addr, read_write) != 0) {
+                    /* The controller stops executing commands on a NACK */
+                    DPRINTF("not found!\n");
+                    s->i2c_sr_reg.I2C_ACK_REC = 0;
+                    s->pending_int.I2C_ACK_ERR = 1;
+                    stop = true;
+                    break;
                 }
-                s->i2c_int_raw_reg.I2C_TX_SEND_EMPTY = 1;
-                if(s->i2c_int_ena_reg.I2C_TX_SEND_EMPTY)
-                {
-                    s->i2c_int_status_reg.I2C_TX_SEND_EMPTY = 1;
-                    qemu_irq_raise(s->irq);
+                DPRINTF("found\n");
+                s->i2c_sr_reg.I2C_BUS_BUSY = I2C_BUS_BUSY;
+                s->i2c_sr_reg.I2C_ACK_REC = 1;
+                s->i2c_sr_reg.I2C_BYTE_TRANS = 1;
+
+                if (s->i2c_comd_reg[i].I2C_COMMAND_ACK_CHECK_EN &&
+                    s->i2c_comd_reg[i].I2C_COMMAND_ACK_EXP) {
+                    s->i2c_comd_reg[i].I2C_COMMAND_ACK_VALUE = 1;
+                } else {
+                    s->i2c_comd_reg[i].I2C_COMMAND_ACK_VALUE = 0;
+                }
+
+                s->pending_int.I2C_TRANS_START = 1;
+                leng--;
+            }
+
+            for (int num_byte = 0; num_byte < leng; num_byte++) {
+                if (fifo8_is_empty(&s->tx_fifo)) {
+                    s->pending_int.I2C_TX_FIFO_EMPTY = 1;
+                    break;
                 }
+                uint8_t data = fifo8_pop(&s->tx_fifo);
+                DPRINTF("i2c_send: 0x%x\n", data);
+                i2c_send(s->bus, data);
+                s->i2c_sr_reg.I2C_BYTE_TRANS = 1;
+                scl_cycles += 9;
             }
+            s->pending_int.I2C_TX_SEND_EMPTY = 1;
             break;
-        case I2C_COMMAND_OP_CODE_READ:
-            {
-                DPRINTF("I2C_COMMAND_OP_CODE_READ\n");
-                if(fifo8_is_full(&s->rx_fifo))
-                {
-                    s->i2c_int_raw_reg.I2C_RX_FIFO_OVF = 1;
-                    if(s->i2c_int_ena_reg.I2C_RX_FIFO_OVF)
-                    {
-                        s->i2c_int_status_reg.I2C_RX_FIFO_OVF = 1;
-                        qemu_irq_raise(s->irq);
-                    }
+        }
+        case I2C_COMMAND_OP_CODE_READ: {
+            int leng = s->i2c_comd_reg[i].I2C_COMMAND_BYTE_NUM;
+            DPRINTF("I2C_COMMAND_OP_CODE_READ, leng: %d\n", leng);
+            for (int num_byte = 0; num_byte < leng; num_byte++) {
+                if (fifo8_is_full(&s->rx_fifo)) {
+                    s->pending_int.I2C_RX_FIFO_OVF = 1;
                     break;
                 }
                 uint8_t data = i2c_recv(s->bus);
                 DPRINTF("i2c_recv: 0x%x\n", data);
                 fifo8_push(&s->rx_fifo, data);
-                s->i2c_sr_reg.I2C_RXFIFO_CNT++;
-                if(fifo8_is_full(&s->rx_fifo))
-                {
-                    s->i2c_int_raw_reg.I2C_RX_FIFO_FULL = 1;
-                    if(s->i2c_int_ena_reg.I2C_RX_FIFO_FULL)
-                    {
-                        s->i2c_int_status_reg.I2C_RX_FIFO_FULL = 1;
-                        qemu_irq_raise(s->irq);
-                    }
+                scl_cycles += 9;
+                if (fifo8_is_full(&s->rx_fifo)) {
+                    s->pending_int.I2C_RX_FIFO_FULL = 1;
                 }
             }
             break;
+        }
         case I2C_COMMAND_OP_CODE_STOP:
             DPRINTF("I2C_COMMAND_OP_CODE_STOP\n");
             s->i2c_sr_reg.I2C_BUS_BUSY = I2C_BUS_IDLE;
             i2c_end_transfer(s->bus);
-            s->i2c_int_raw_reg.I2C_TRANS_COMPLETE = 1;
-            if(s->i2c_int_ena_reg.I2C_TRANS_COMPLETE)
-            {
-                s->i2c_int_status_reg.I2C_TRANS_COMPLETE = 1;
-                qemu_irq_raise(s->irq);
-            }
+            s->pending_int.I2C_TRANS_COMPLETE = 1;
+            scl_cycles += 1;
+            stop = true;
             break;
         case I2C_COMMAND_OP_CODE_END:
             DPRINTF("I2C_COMMAND_OP_CODE_END\n");
-            s->i2c_int_raw_reg.I2C_END_DETECT = 1;
-            if(s->i2c_int_ena_reg.I2C_END_DETECT)
-            {
-                s->i2c_int_status_reg.I2C_END_DETECT = 1;
-                qemu_irq_raise(s->irq);
-            }
+            s->pending_int.I2C_END_DETECT = 1;
+            stop = true;
             break;
         default:
             break;
         }
 
-        s->i2c_comd_reg[i].I2C_COMMAND_DONE = 1;
+        s->pending_done |= BIT(i);
+        if (stop) {
+            break;
+        }
+    }
+
+    uint64_t scl_period = s->scl_low_period + s->scl_high_period;
+    if (scl_period == 0 || s->apb_freq == 0) {
+        esp32_i2c_trans_done(s);
+        return;
     }
+    s->trans_busy = true;
+    timer_mod(&s->trans_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              muldiv64(scl_cycles * scl_period, NANOSECONDS_PER_SECOND, s->apb_freq));
 }
 
 static void esp32_i2c_write(void * opaque, hwaddr addr, uint64_t value, unsigned int size)
@@ -362,17 +383,32 @@ static void esp32_i2c_write(void * opaque, hwaddr addr, uint64_t value, unsigned
         }
         if(s->i2c_ctr_reg.I2C_TRANS_START)
         {
-            esp32_i2c_perform_write(s);
+            if(s->trans_busy)
+            {
+                qemu_log_mask(LOG_GUEST_ERROR, "%s: TRANS_START while a transaction is in progress\n", __func__);
+            }
+            else
+            {
+                esp32_i2c_perform_write(s);
+            }
         }
         s->i2c_ctr_reg.I2C_TRANS_START = 0;
         break;
     case I2C_SR_REG:
         s->i2c_sr_reg.val = value;
         break;
+    case I2C_SCL_LOW_PERIOD_REG:
+        s->scl_low_period = value & 0x3fff;
+        break;
+    case I2C_SCL_HIGH_PERIOD_REG:
+        s->scl_high_period = value & 0x3fff;
+        break;
     case I2C_FIFO_DATA_REG:
         DPRINTF("---- FIFO DATA write: 0x%x ----\n", (int)value);
-        fifo8_push(&s->tx_fifo, value);
-        s->i2c_sr_reg.I2C_TXFIFO_CNT++;
+        if(!fifo8_is_full(&s->tx_fifo))
+        {
+            fifo8_push(&s->tx_fifo, value);
+        }
         break;
     case I2C_FIFO_CONF_REG:
         s->i2c_fifo_conf_reg.val = value;
@@ -387,7 +423,7 @@ static void esp32_i2c_write(void * opaque, hwaddr addr, uint64_t value, unsigned
         break;
     case I2C_INT_CLR_REG:
         s->i2c_int_status_reg.val = 0;
-        qemu_irq_lower(s->irq);
+        esp32_i2c_update_irq(s);
         break;
     case I2C_INT_ENA_REG:
         s->i2c_int_ena_reg.val = value;
@@ -424,6 +460,14 @@ static const MemoryRegionOps esp32_i2c_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+static void esp32_i2c_set_apb_freq(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    Esp32I2CState *s = Esp32_I2C(opaque);
+    visit_type_uint32(v, name, &s->apb_freq, errp);
+}
+
 static void esp32_i2c_init(Object * obj)
 {
     Esp32I2CState *s = Esp32_I2C(obj);
@@ -438,13 +482,57 @@ static void esp32_i2c_init(Object * obj)
 
     fifo8_create(&s->tx_fifo, I2C_FIFO_LENGTH);
     fifo8_create(&s->rx_fifo, I2C_FIFO_LENGTH);
+
+    object_property_add(obj, "apb_freq", "uint32",
+                        NULL,
+                        esp32_i2c_set_apb_freq,
+                        NULL,
+                        obj, &error_abort);
+    s->apb_freq = 80000000;
+    timer_init_ns(&s->trans_timer, QEMU_CLOCK_VIRTUAL, esp32_i2c_trans_timer_cb, s);
 }
 
+static const VMStateDescription vmstate_esp32_i2c_comd = {
+    .name = "esp32_i2c_comd",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(val, i2c_comd_reg_t),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_i2c = {
+    .name = TYPE_ESP32_I2C,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(i2c_ctr_reg.val, Esp32I2CState),
+        VMSTATE_UINT32(i2c_sr_reg.val, Esp32I2CState),
+        VMSTATE_UINT32(i2c_fifo_conf_reg.val, Esp32I2CState),
+        VMSTATE_UINT32(i2c_int_raw_reg.val, Esp32I2CState),
+        VMSTATE_UINT32(i2c_int_ena_reg.val, Esp32I2CState),
+        VMSTATE_UINT32(i2c_int_status_reg.val, Esp32I2CState),
+        VMSTATE_STRUCT_ARRAY(i2c_comd_reg, Esp32I2CState, I2C_COMD_REG_COUNT, 1,
+                             vmstate_esp32_i2c_comd, i2c_comd_reg_t),
+        VMSTATE_FIFO8(rx_fifo, Esp32I2CState),
+        VMSTATE_FIFO8(tx_fifo, Esp32I2CState),
+        VMSTATE_UINT32(scl_low_period, Esp32I2CState),
+        VMSTATE_UINT32(scl_high_period, Esp32I2CState),
+        VMSTATE_BOOL(trans_busy, Esp32I2CState),
+        VMSTATE_UINT16(pending_done, Esp32I2CState),
+        VMSTATE_UINT32(pending_int.val, Esp32I2CState),
+        VMSTATE_TIMER(trans_timer, Esp32I2CState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void esp32_i2c_class_init(ObjectClass * klass, void * data)
 {
     DeviceClass * dc = DEVICE_CLASS(klass);
 
     dc->reset = esp32_i2c_reset;
+    dc->vmsd = &vmstate_esp32_i2c;
 }
 
 static const TypeInfo esp32_i2c_type_info = {
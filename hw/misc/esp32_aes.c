@@ -0,0 +1,227 @@
+/*
+ * ESP32 AES accelerator
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "hw/hw.h"
+#include "hw/sysbus.h"
+#include "hw/registerfields.h"
+#include "hw/misc/esp32_aes.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
+#define ESP32_AES_REGS_SIZE (A_AES_ENDIAN + 4)
+
+/* The accelerator processes one 16-byte block per START, in place: the
+ * guest writes the input into the text registers and reads the result back
+ * from the same registers. There is no chaining, so the block operation is
+ * plain ECB and the guest implements the block cipher modes on top of it.
+ *
+ * Key and text words are stored in little-endian byte order, which is the
+ * reset value of the AES_ENDIAN register and the only setting ESP-IDF uses.
+ * Other byte orders are not modeled.
+ *
+ * Expanding the key dominates the cost of a single block, so the cipher
+ * object is kept until the guest changes the key or the mode.
+ */
+
+static const QCryptoCipherAlgorithm esp32_aes_alg[] = {
+    QCRYPTO_CIPHER_ALG_AES_128,
+    QCRYPTO_CIPHER_ALG_AES_192,
+    QCRYPTO_CIPHER_ALG_AES_256,
+};
+
+static void esp32_aes_invalidate_key(Esp32AesState *s)
+{
+    qcrypto_cipher_free(s->cipher);
+    s->cipher = NULL;
+}
+
+static void esp32_aes_start(Esp32AesState *s)
+{
+    unsigned keylen = FIELD_EX32(s->mode, AES_MODE, KEYLEN);
+    bool decrypt = FIELD_EX32(s->mode, AES_MODE, DECRYPT);
+    uint8_t block[ESP32_AES_TEXT_REG_CNT * 4];
+    Error *err = NULL;
+    int rc;
+
+    if (keylen >= ARRAY_SIZE(esp32_aes_alg)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: invalid mode 0x%x\n", __func__, s->mode);
+        return;
+    }
+    if (s->endian != 0) {
+        qemu_log_mask(LOG_UNIMP, "%s: AES_ENDIAN=0x%x is not supported\n", __func__, s->endian);
+    }
+
+    if (!s->cipher) {
+        uint8_t key[ESP32_AES_KEY_REG_CNT * 4];
+        size_t nkey = 16 + 8 * keylen;
+
+        for (int i = 0; i < ESP32_AES_KEY_REG_CNT; ++i) {
+            stl_le_p(key + i * 4, s->key[i]);
+        }
+        s->cipher = qcrypto_cipher_new(esp32_aes_alg[keylen], QCRYPTO_CIPHER_MODE_ECB,
+                                       key, nkey, &err);
+        if (!s->cipher) {
+            error_report_err(err);
+            return;
+        }
+    }
+
+    for (int i = 0; i < ESP32_AES_TEXT_REG_CNT; ++i) {
+        stl_le_p(block + i * 4, s->text[i]);
+    }
+    if (decrypt) {
+        rc = qcrypto_cipher_decrypt(s->cipher, block, block, sizeof(block), &err);
+    } else {
+        rc = qcrypto_cipher_encrypt(s->cipher, block, block, sizeof(block), &err);
+    }
+    if (rc < 0) {
+        error_report_err(err);
+        return;
+    }
+    for (int i = 0; i < ESP32_AES_TEXT_REG_CNT; ++i) {
+        s->text[i] = ldl_le_p(block + i * 4);
+    }
+    trace_esp32_aes_block(s->mode);
+}
+
+static uint64_t esp32_aes_read(void *opaque, hwaddr addr, unsigned int size)
+{
+    Esp32AesState *s = ESP32_AES(opaque);
+    uint64_t r = 0;
+    switch (addr) {
+    case A_AES_IDLE:
+        /* blocks are processed synchronously on START */
+        r = 1;
+        break;
+    case A_AES_MODE:
+        r = s->mode;
+        break;
+    case A_AES_ENDIAN:
+        r = s->endian;
+        break;
+    case A_AES_KEY_0 ... A_AES_KEY_0 + (ESP32_AES_KEY_REG_CNT - 1) * sizeof(uint32_t):
+        r = s->key[(addr - A_AES_KEY_0) / sizeof(uint32_t)];
+        break;
+    case A_AES_TEXT_0 ... A_AES_TEXT_0 + (ESP32_AES_TEXT_REG_CNT - 1) * sizeof(uint32_t):
+        r = s->text[(addr - A_AES_TEXT_0) / sizeof(uint32_t)];
+        break;
+    }
+    return r;
+}
+
+static void esp32_aes_write(void *opaque, hwaddr addr,
+                       uint64_t value, unsigned int size)
+{
+    Esp32AesState *s = ESP32_AES(opaque);
+    switch (addr) {
+    case A_AES_START:
+        if (value & 1) {
+            esp32_aes_start(s);
+        }
+        break;
+    case A_AES_MODE:
+        if (s->mode != value) {
+            s->mode = value;
+            esp32_aes_invalidate_key(s);
+        }
+        break;
+    case A_AES_ENDIAN:
+        s->endian = value;
+        break;
+    case A_AES_KEY_0 ... A_AES_KEY_0 + (ESP32_AES_KEY_REG_CNT - 1) * sizeof(uint32_t):
+        if (s->key[(addr - A_AES_KEY_0) / sizeof(uint32_t)] != value) {
+            s->key[(addr - A_AES_KEY_0) / sizeof(uint32_t)] = value;
+            esp32_aes_invalidate_key(s);
+        }
+        break;
+    case A_AES_TEXT_0 ... A_AES_TEXT_0 + (ESP32_AES_TEXT_REG_CNT - 1) * sizeof(uint32_t):
+        s->text[(addr - A_AES_TEXT_0) / sizeof(uint32_t)] = value;
+        break;
+    }
+}
+
+static const MemoryRegionOps esp32_aes_ops = {
+    .read =  esp32_aes_read,
+    .write = esp32_aes_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+static void esp32_aes_reset(DeviceState *dev)
+{
+    Esp32AesState *s = ESP32_AES(dev);
+    s->mode = 0;
+    s->endian = 0;
+    memset(s->key, 0, sizeof(s->key));
+    memset(s->text, 0, sizeof(s->text));
+    esp32_aes_invalidate_key(s);
+}
+
+static void esp32_aes_init(Object *obj)
+{
+    Esp32AesState *s = ESP32_AES(obj);
+    SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
+
+    memory_region_init_io(&s->iomem, obj, &esp32_aes_ops, s,
+                          TYPE_ESP32_AES, ESP32_AES_REGS_SIZE);
+    sysbus_init_mmio(sbd, &s->iomem);
+}
+
+static void esp32_aes_finalize(Object *obj)
+{
+    esp32_aes_invalidate_key(ESP32_AES(obj));
+}
+
+static int esp32_aes_post_load(void *opaque, int version_id)
+{
+    esp32_aes_invalidate_key(ESP32_AES(opaque));
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_aes = {
+    .name = TYPE_ESP32_AES,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = esp32_aes_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mode, Esp32AesState),
+        VMSTATE_UINT32(endian, Esp32AesState),
+        VMSTATE_UINT32_ARRAY(key, Esp32AesState, ESP32_AES_KEY_REG_CNT),
+        VMSTATE_UINT32_ARRAY(text, Esp32AesState, ESP32_AES_TEXT_REG_CNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void esp32_aes_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = esp32_aes_reset;
+    dc->vmsd = &vmstate_esp32_aes;
+}
+
+static const TypeInfo esp32_aes_info = {
+    .name = TYPE_ESP32_AES,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(Esp32AesState),
+    .instance_init = esp32_aes_init,
+    .instance_finalize = esp32_aes_finalize,
+    .class_init = esp32_aes_class_init
+};
+
+static void esp32_aes_register_types(void)
+{
+    type_register_static(&esp32_aes_info);
+}
+
+type_init(esp32_aes_register_types)
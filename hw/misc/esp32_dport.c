@@ -16,10 +16,14 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/registerfields.h"
+#include "hw/block/flash.h"
 #include "hw/boards.h"
 #include "hw/misc/esp32_reg.h"
 #include "hw/misc/esp32_dport.h"
 #include "target/xtensa/cpu.h"
+#include "exec/exec-all.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 
 #define ESP32_DPORT_SIZE        (DR_REG_DPORT_APB_BASE - DR_REG_DPORT_BASE)
@@ -39,6 +43,7 @@
 
 static void esp32_cache_state_update(Esp32CacheState* cs);
 static void esp32_cache_data_sync(Esp32CacheRegionState* crs);
+static void esp32_cache_init_flash_alias(Esp32CacheRegionState *crs, const char* name);
 
 static inline uint32_t get_mmu_entry(Esp32CacheRegionState* crs, hwaddr base, hwaddr addr)
 {
@@ -217,49 +222,110 @@ static const MemoryRegionOps esp32_dport_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+static void esp32_cache_page_fill(Esp32CacheRegionState* crs, int index)
+{
+    Esp32DportState *dport = crs->cache->dport;
+    uint8_t* cache_data = (uint8_t*) memory_region_get_ram_ptr(&crs->mem);
+    uint32_t phys_addr = (crs->mmu_table[index] & MMU_ENTRY_MASK) * ESP32_CACHE_PAGE_SIZE;
+
+    /* The flash device may hold programmed data not written to the drive yet */
+    if (dport->flash_dev) {
+        m25p80_read(dport->flash_dev, phys_addr,
+                    cache_data + index * ESP32_CACHE_PAGE_SIZE, ESP32_CACHE_PAGE_SIZE);
+    } else {
+        blk_pread(dport->flash_blk, phys_addr,
+                  cache_data + index * ESP32_CACHE_PAGE_SIZE, ESP32_CACHE_PAGE_SIZE);
+    }
+    crs->pages[index].filled = true;
+    crs->pages[index].filled_addr = phys_addr;
+    dport->cache_pages_filled++;
+    trace_esp32_cache_page_fill(crs->cache->core_id, crs->base, index, phys_addr);
+}
+
 static void esp32_cache_data_sync(Esp32CacheRegionState* crs)
 {
-    if (crs->cache->dport->flash_blk == NULL) {
+    Esp32DportState *dport = crs->cache->dport;
+
+    if (dport->flash_blk == NULL) {
         return;
     }
 
-    uint8_t* cache_data = (uint8_t*) memory_region_get_ram_ptr(&crs->mem);
-    int n = 0;
+    bool page_changed[ESP32_CACHE_PAGES_PER_REGION] = { false };
+    memory_region_transaction_begin();
     for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
-        uint32_t* cache_page = (uint32_t*) (cache_data + i * ESP32_CACHE_PAGE_SIZE);
+        Esp32CachePageState *ps = &crs->pages[i];
         uint32_t mmu_entry = crs->mmu_table[i];
         if (!(mmu_entry & ESP32_CACHE_MMU_ENTRY_CHANGED)) {
             continue;
         }
         mmu_entry &= MMU_ENTRY_MASK;
+        bool fill_on_access = false;
+        bool alias_flash = false;
+        bool invalid = false;
+        page_changed[i] = true;
         if (mmu_entry & ESP32_CACHE_MMU_INVALID_VAL) {
-            uint32_t fill_val = crs->type == ESP32_DCACHE ? 0xbaadbaad : 0x00000000;
-            for (int word = 0; word < ESP32_CACHE_PAGE_SIZE / sizeof(uint32_t); ++word) {
-                cache_page[word] = fill_val;
-            }
+            /* The ROM invalidates all entries before mapping the pages it
+             * needs again. Keep the page data, so that a remap reuses it.
+             */
+            invalid = true;
+            page_changed[i] = false;
         } else {
             uint32_t phys_addr = mmu_entry * ESP32_CACHE_PAGE_SIZE;
-            blk_pread(crs->cache->dport->flash_blk, phys_addr, cache_page, ESP32_CACHE_PAGE_SIZE);
+            dport->cache_pages_mapped++;
+            trace_esp32_cache_page_map(crs->cache->core_id, crs->base, i, phys_addr);
+            if (dport->flash_mem &&
+                phys_addr + ESP32_CACHE_PAGE_SIZE <= memory_region_size(dport->flash_mem)) {
+                memory_region_set_alias_offset(&ps->flash_alias_mem, phys_addr);
+                alias_flash = true;
+            } else if (ps->filled && ps->filled_addr == phys_addr) {
+                /* Same flash page as before, e.g. the bootloader mapping
+                 * the application again after a reset. The data is still
+                 * there, and so is the code translated from it.
+                 */
+                dport->cache_pages_reused++;
+                page_changed[i] = false;
+            } else if (dport->lazy_cache_fill) {
+                fill_on_access = true;
+            } else {
+                esp32_cache_page_fill(crs, i);
+            }
+        }
+        memory_region_set_enabled(&ps->fill_trap_mem, fill_on_access);
+        memory_region_set_enabled(&ps->invalid_alias_mem, invalid);
+        if (dport->flash_mem) {
+            memory_region_set_enabled(&ps->flash_alias_mem, alias_flash);
         }
         crs->mmu_table[i] &= ~ESP32_CACHE_MMU_ENTRY_CHANGED;
-        n++;
     }
-    memory_region_flush_rom_device(&crs->mem, 0, ESP32_CACHE_REGION_SIZE);
+    for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
+        if (page_changed[i]) {
+            memory_region_flush_rom_device(&crs->mem, i * ESP32_CACHE_PAGE_SIZE, ESP32_CACHE_PAGE_SIZE);
+        }
+    }
+    memory_region_transaction_commit();
 }
 
-static void esp32_cache_state_update(Esp32CacheState* cs)
+static bool esp32_cache_drom0_enabled(Esp32CacheState* cs)
 {
-    bool cache_enabled = FIELD_EX32(cs->cache_ctrl_reg, DPORT_PRO_CACHE_CTRL, CACHE_ENA) != 0;
-
-    bool drom0_enabled = cache_enabled &&
+    return FIELD_EX32(cs->cache_ctrl_reg, DPORT_PRO_CACHE_CTRL, CACHE_ENA) != 0 &&
         FIELD_EX32(cs->cache_ctrl1_reg, DPORT_PRO_CACHE_CTRL1, MASK_DROM0) == 0;
+}
+
+static bool esp32_cache_iram0_enabled(Esp32CacheState* cs)
+{
+    return FIELD_EX32(cs->cache_ctrl_reg, DPORT_PRO_CACHE_CTRL, CACHE_ENA) != 0 &&
+        FIELD_EX32(cs->cache_ctrl1_reg, DPORT_PRO_CACHE_CTRL1, MASK_IRAM0) == 0;
+}
+
+static void esp32_cache_state_update(Esp32CacheState* cs)
+{
+    bool drom0_enabled = esp32_cache_drom0_enabled(cs);
     if (!cs->drom0.mem.enabled && drom0_enabled) {
         esp32_cache_data_sync(&cs->drom0);
     }
     memory_region_set_enabled(&cs->drom0.mem, drom0_enabled);
 
-    bool iram0_enabled = cache_enabled &&
-        FIELD_EX32(cs->cache_ctrl1_reg, DPORT_PRO_CACHE_CTRL1, MASK_IRAM0) == 0;
+    bool iram0_enabled = esp32_cache_iram0_enabled(cs);
     if (!cs->iram0.mem.enabled && iram0_enabled) {
         esp32_cache_data_sync(&cs->iram0);
     }
@@ -294,6 +360,34 @@ static uint64_t esp32_cache_ill_read(void *opaque, hwaddr addr, unsigned int siz
     return result;
 }
 
+/* Called when the flash contents are modified through the SPI controller.
+ * Cache pages holding a copy of the modified range have to be read again
+ * the next time they are mapped. Pages aliasing the flash image see the
+ * new data right away, only the code translated from them is dropped.
+ */
+void esp32_dport_flash_written(Esp32DportState* s, uint32_t addr, uint32_t len)
+{
+    uint64_t end = (uint64_t) addr + len;
+
+    for (int core = 0; core < ESP32_CPU_COUNT; ++core) {
+        Esp32CacheRegionState *regions[] = { &s->cache_state[core].drom0, &s->cache_state[core].iram0 };
+        for (int r = 0; r < ARRAY_SIZE(regions); ++r) {
+            for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
+                Esp32CachePageState *ps = &regions[r]->pages[i];
+                if (ps->filled && ps->filled_addr < end &&
+                    addr < ps->filled_addr + ESP32_CACHE_PAGE_SIZE) {
+                    ps->filled = false;
+                }
+            }
+        }
+    }
+    if (s->flash_mem && addr < memory_region_size(s->flash_mem)) {
+        ram_addr_t start = memory_region_get_ram_addr(s->flash_mem) + addr;
+        end = MIN(end, memory_region_size(s->flash_mem));
+        tb_invalidate_phys_range(start, start + (end - addr));
+    }
+}
+
 void esp32_dport_clear_ill_trap_state(Esp32DportState* s)
 {
     s->cache_state[0].drom0.illegal_access_status = false;
@@ -304,14 +398,59 @@ void esp32_dport_clear_ill_trap_state(Esp32DportState* s)
     qemu_irq_lower(cache_ill_irq);
 }
 
+static void esp32_cache_page_fill_trap(Esp32CachePageState *ps)
+{
+    Esp32CacheRegionState *crs = ps->crs;
+
+    /* With MTTCG both CPUs may hit the trap for the same page before it is
+     * removed from their flat views. MMIO dispatch runs under the BQL, so
+     * the second one only has to notice that the page is already filled.
+     */
+    if (!ps->fill_trap_mem.enabled) {
+        return;
+    }
+    esp32_cache_page_fill(crs, ps->index);
+    memory_region_flush_rom_device(&crs->mem, ps->index * ESP32_CACHE_PAGE_SIZE, ESP32_CACHE_PAGE_SIZE);
+    memory_region_set_enabled(&ps->fill_trap_mem, false);
+}
+
+static uint64_t esp32_cache_page_fill_read(void *opaque, hwaddr addr, unsigned int size)
+{
+    Esp32CachePageState *ps = (Esp32CachePageState*) opaque;
+    uint8_t* cache_data = (uint8_t*) memory_region_get_ram_ptr(&ps->crs->mem);
+
+    esp32_cache_page_fill_trap(ps);
+    return ldn_le_p(cache_data + ps->index * ESP32_CACHE_PAGE_SIZE + addr, size);
+}
+
+static void esp32_cache_page_fill_write(void *opaque, hwaddr addr,
+                                        uint64_t value, unsigned int size)
+{
+    /* Cache is read-only, but fill the page anyway so that the trap goes away */
+    esp32_cache_page_fill_trap((Esp32CachePageState*) opaque);
+}
+
+static const MemoryRegionOps esp32_cache_page_fill_ops = {
+    .read = esp32_cache_page_fill_read,
+    .write = esp32_cache_page_fill_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
 static const MemoryRegionOps esp32_cache_ops = {
     .write = NULL,
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
 
+static void esp32_cache_ill_write(void *opaque, hwaddr addr,
+                                  uint64_t value, unsigned int size)
+{
+    /* Cache is read-only; invalid pages are covered by this region too */
+}
+
 static const MemoryRegionOps esp32_cache_ill_trap_ops = {
     .read = esp32_cache_ill_read,
+    .write = esp32_cache_ill_write,
 };
 
 static void esp32_dport_reset(DeviceState *dev)
@@ -353,6 +492,13 @@ static void esp32_dport_realize(DeviceState *dev, Error **errp)
         assert(target);
         sysbus_connect_irq(SYS_BUS_DEVICE(&s->crosscore_int), index, target);
     }
+
+    if (s->flash_mem) {
+        for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+            esp32_cache_init_flash_alias(&s->cache_state[i].drom0, "drom0");
+            esp32_cache_init_flash_alias(&s->cache_state[i].iram0, "iram0");
+        }
+    }
 }
 
 static void esp32_cache_init_region(Esp32CacheState *cs,
@@ -375,6 +521,40 @@ static void esp32_cache_init_region(Esp32CacheState *cs,
     memory_region_init_io(&crs->illegal_access_trap_mem, OBJECT(cs->dport),
                           &esp32_cache_ill_trap_ops, crs,
                           desc, ESP32_CACHE_REGION_SIZE);
+
+    for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
+        Esp32CachePageState *ps = &crs->pages[i];
+        char fill_desc[32];
+        ps->crs = crs;
+        ps->index = i;
+        snprintf(fill_desc, sizeof(fill_desc), "cpu%d-%s-fill%d", cs->core_id, name, i);
+        memory_region_init_io(&ps->fill_trap_mem, OBJECT(cs->dport),
+                              &esp32_cache_page_fill_ops, ps,
+                              fill_desc, ESP32_CACHE_PAGE_SIZE);
+        memory_region_set_enabled(&ps->fill_trap_mem, false);
+        memory_region_add_subregion_overlap(&crs->mem, i * ESP32_CACHE_PAGE_SIZE, &ps->fill_trap_mem, 1);
+
+        snprintf(fill_desc, sizeof(fill_desc), "cpu%d-%s-inv%d", cs->core_id, name, i);
+        memory_region_init_alias(&ps->invalid_alias_mem, OBJECT(cs->dport), fill_desc,
+                                 &crs->illegal_access_trap_mem, i * ESP32_CACHE_PAGE_SIZE,
+                                 ESP32_CACHE_PAGE_SIZE);
+        memory_region_set_enabled(&ps->invalid_alias_mem, false);
+        memory_region_add_subregion_overlap(&crs->mem, i * ESP32_CACHE_PAGE_SIZE, &ps->invalid_alias_mem, 3);
+    }
+}
+
+static void esp32_cache_init_flash_alias(Esp32CacheRegionState *crs, const char* name)
+{
+    for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
+        Esp32CachePageState *ps = &crs->pages[i];
+        char alias_desc[32];
+        snprintf(alias_desc, sizeof(alias_desc), "cpu%d-%s-flash%d", crs->cache->core_id, name, i);
+        memory_region_init_alias(&ps->flash_alias_mem, OBJECT(crs->cache->dport), alias_desc,
+                                 crs->cache->dport->flash_mem, 0, ESP32_CACHE_PAGE_SIZE);
+        memory_region_set_readonly(&ps->flash_alias_mem, true);
+        memory_region_set_enabled(&ps->flash_alias_mem, false);
+        memory_region_add_subregion_overlap(&crs->mem, i * ESP32_CACHE_PAGE_SIZE, &ps->flash_alias_mem, 2);
+    }
 }
 
 static void esp32_dport_init(Object *obj)
@@ -403,13 +583,143 @@ static void esp32_dport_init(Object *obj)
                                 0x40000000, 0x00000000);
     }
 
+    object_property_add_uint64_ptr(obj, "cache-pages-mapped", &s->cache_pages_mapped,
+                                   OBJ_PROP_FLAG_READ, &error_abort);
+    object_property_add_uint64_ptr(obj, "cache-pages-filled", &s->cache_pages_filled,
+                                   OBJ_PROP_FLAG_READ, &error_abort);
+    object_property_add_uint64_ptr(obj, "cache-pages-reused", &s->cache_pages_reused,
+                                   OBJ_PROP_FLAG_READ, &error_abort);
+
     qdev_init_gpio_out_named(DEVICE(sbd), &s->appcpu_stall_req, ESP32_DPORT_APPCPU_STALL_GPIO, 1);
     qdev_init_gpio_out_named(DEVICE(sbd), &s->appcpu_reset_req, ESP32_DPORT_APPCPU_RESET_GPIO, 1);
     qdev_init_gpio_out_named(DEVICE(sbd), &s->clk_update_req, ESP32_DPORT_CLK_UPDATE_GPIO, 1);
 }
 
+static void esp32_cache_region_pre_save(Esp32CacheRegionState *crs)
+{
+    for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
+        Esp32CachePageState *ps = &crs->pages[i];
+        ps->fill_pending = ps->fill_trap_mem.enabled;
+        ps->flash_mapped = crs->cache->dport->flash_mem && ps->flash_alias_mem.enabled;
+        ps->flash_offset = ps->flash_alias_mem.alias_offset;
+        ps->invalid = ps->invalid_alias_mem.enabled;
+    }
+}
+
+static void esp32_cache_region_post_load(Esp32CacheRegionState *crs)
+{
+    Esp32DportState *dport = crs->cache->dport;
+
+    for (int i = 0; i < ESP32_CACHE_PAGES_PER_REGION; ++i) {
+        Esp32CachePageState *ps = &crs->pages[i];
+        /* Cache RAM contents came from the source, whatever they are */
+        ps->filled = false;
+        memory_region_set_enabled(&ps->fill_trap_mem, ps->fill_pending);
+        memory_region_set_enabled(&ps->invalid_alias_mem, ps->invalid);
+        if (dport->flash_mem) {
+            memory_region_set_alias_offset(&ps->flash_alias_mem, ps->flash_offset);
+            memory_region_set_enabled(&ps->flash_alias_mem, ps->flash_mapped);
+        } else if (ps->flash_mapped) {
+            /* The source had the flash image mapped, and this instance doesn't.
+             * Copy the page on the first access instead.
+             */
+            memory_region_set_enabled(&ps->fill_trap_mem, true);
+        }
+    }
+}
+
+static int esp32_dport_pre_save(void *opaque)
+{
+    Esp32DportState *s = ESP32_DPORT(opaque);
+
+    for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+        esp32_cache_region_pre_save(&s->cache_state[i].drom0);
+        esp32_cache_region_pre_save(&s->cache_state[i].iram0);
+    }
+    return 0;
+}
+
+/* Cache contents are migrated as RAM, only the mapping state of the cache
+ * regions needs to be restored here. No data is read from flash.
+ */
+static int esp32_dport_post_load(void *opaque, int version_id)
+{
+    Esp32DportState *s = ESP32_DPORT(opaque);
+
+    memory_region_transaction_begin();
+    for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+        Esp32CacheState *cs = &s->cache_state[i];
+        esp32_cache_region_post_load(&cs->drom0);
+        esp32_cache_region_post_load(&cs->iram0);
+        memory_region_set_enabled(&cs->drom0.mem, esp32_cache_drom0_enabled(cs));
+        memory_region_set_enabled(&cs->iram0.mem, esp32_cache_iram0_enabled(cs));
+    }
+    memory_region_transaction_commit();
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_cache_page = {
+    .name = "esp32_cache_page",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(fill_pending, Esp32CachePageState),
+        VMSTATE_BOOL(flash_mapped, Esp32CachePageState),
+        VMSTATE_UINT32(flash_offset, Esp32CachePageState),
+        VMSTATE_BOOL(invalid, Esp32CachePageState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_cache_region = {
+    .name = "esp32_cache_region",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(illegal_access_trap_en, Esp32CacheRegionState),
+        VMSTATE_BOOL(illegal_access_status, Esp32CacheRegionState),
+        VMSTATE_UINT16_ARRAY(mmu_table, Esp32CacheRegionState, ESP32_CACHE_PAGES_PER_REGION),
+        VMSTATE_STRUCT_ARRAY(pages, Esp32CacheRegionState, ESP32_CACHE_PAGES_PER_REGION, 1,
+                             vmstate_esp32_cache_page, Esp32CachePageState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_cache = {
+    .name = "esp32_cache",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(cache_ctrl_reg, Esp32CacheState),
+        VMSTATE_UINT32(cache_ctrl1_reg, Esp32CacheState),
+        VMSTATE_STRUCT(iram0, Esp32CacheState, 1, vmstate_esp32_cache_region, Esp32CacheRegionState),
+        VMSTATE_STRUCT(drom0, Esp32CacheState, 1, vmstate_esp32_cache_region, Esp32CacheRegionState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_dport = {
+    .name = TYPE_ESP32_DPORT,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = esp32_dport_pre_save,
+    .post_load = esp32_dport_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(cache_state, Esp32DportState, ESP32_CPU_COUNT, 1,
+                             vmstate_esp32_cache, Esp32CacheState),
+        VMSTATE_BOOL(appcpu_reset_state, Esp32DportState),
+        VMSTATE_BOOL(appcpu_stall_state, Esp32DportState),
+        VMSTATE_BOOL(appcpu_clkgate_state, Esp32DportState),
+        VMSTATE_UINT32(appcpu_boot_addr, Esp32DportState),
+        VMSTATE_UINT32(cpuperiod_sel, Esp32DportState),
+        VMSTATE_UINT32(cache_ill_trap_en_reg, Esp32DportState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_dport_properties[] = {
     DEFINE_PROP_DRIVE("flash", Esp32DportState, flash_blk),
+    DEFINE_PROP_BOOL("lazy-cache-fill", Esp32DportState, lazy_cache_fill, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -419,6 +729,7 @@ static void esp32_dport_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_dport_reset;
     dc->realize = esp32_dport_realize;
+    dc->vmsd = &vmstate_esp32_dport;
     device_class_set_props(dc, esp32_dport_properties);
 }
 
@@ -16,8 +16,12 @@
 #include "hw/sysbus.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "hw/intc/intc.h"
+#include "monitor/monitor.h"
 #include "hw/misc/esp32_reg.h"
 #include "hw/misc/esp32_dport.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 #define INTMATRIX_UNINT_VALUE   6
 
@@ -26,16 +30,44 @@
 static void esp32_intmatrix_irq_handler(void *opaque, int n, int level)
 {
     Esp32IntMatrixState *s = ESP32_INTMATRIX(opaque);
+
+    if (level && !s->irq_level[n]) {
+        s->irq_count[n]++;
+    }
+    s->irq_level[n] = level;
+    trace_esp32_intmatrix_irq(n, level, s->irq_count[n]);
+
     for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
-        if (s->outputs[i] == NULL) {
-            continue;
+        int extint = s->irq_route[i][n];
+        if (extint >= 0) {
+            qemu_set_irq(s->outputs[i][extint], level);
         }
-        int out_index = IRQ_MAP(i, n);
-        for (int int_index = 0; int_index < s->cpu[i]->env.config->nextint; ++int_index) {
-            if (s->cpu[i]->env.config->extint[int_index] == out_index) {
-                qemu_set_irq(s->outputs[i][int_index], level);
-                break;
-            }
+    }
+}
+
+/* Find the CPU external interrupt line the source is mapped to */
+static void esp32_intmatrix_update_route(Esp32IntMatrixState *s, int cpu, int source)
+{
+    int out_index = IRQ_MAP(cpu, source);
+
+    s->irq_route[cpu][source] = -1;
+    if (s->outputs[cpu] == NULL) {
+        return;
+    }
+    for (int int_index = 0; int_index < s->cpu[cpu]->env.config->nextint; ++int_index) {
+        if (s->cpu[cpu]->env.config->extint[int_index] == out_index) {
+            s->irq_route[cpu][source] = int_index;
+            break;
+        }
+    }
+    trace_esp32_intmatrix_map(cpu, source, out_index, s->irq_route[cpu][source]);
+}
+
+static void esp32_intmatrix_update_all_routes(Esp32IntMatrixState *s)
+{
+    for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+        for (int n = 0; n < ESP32_INT_MATRIX_INPUTS; ++n) {
+            esp32_intmatrix_update_route(s, i, n);
         }
     }
 }
@@ -64,7 +96,10 @@ static void esp32_intmatrix_write(void* opaque, hwaddr addr, uint64_t value, uns
     Esp32IntMatrixState *s = ESP32_INTMATRIX(opaque);
     uint8_t* map_entry = get_map_entry(s, addr);
     if (map_entry != NULL) {
+        int source_index = (addr / sizeof(uint32_t)) % ESP32_INT_MATRIX_INPUTS;
+        int cpu_index = (addr / sizeof(uint32_t)) / ESP32_INT_MATRIX_INPUTS;
         *map_entry = value & 0x1f;
+        esp32_intmatrix_update_route(s, cpu_index, source_index);
     }
 }
 
@@ -78,6 +113,9 @@ static void esp32_intmatrix_reset(DeviceState *dev)
 {
     Esp32IntMatrixState *s = ESP32_INTMATRIX(dev);
     memset(s->irq_map, INTMATRIX_UNINT_VALUE, sizeof(s->irq_map));
+    memset(s->irq_level, 0, sizeof(s->irq_level));
+    memset(s->irq_count, 0, sizeof(s->irq_count));
+    esp32_intmatrix_update_all_routes(s);
     for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
         if (s->outputs[i] == NULL) {
             continue;
@@ -113,6 +151,53 @@ static void esp32_intmatrix_init(Object *obj)
     qdev_init_gpio_in(DEVICE(s), esp32_intmatrix_irq_handler, ESP32_INT_MATRIX_INPUTS);
 }
 
+static bool esp32_intmatrix_get_statistics(InterruptStatsProvider *obj,
+                                           uint64_t **irq_counts,
+                                           unsigned int *nb_irqs)
+{
+    Esp32IntMatrixState *s = ESP32_INTMATRIX(obj);
+
+    *irq_counts = s->irq_count;
+    *nb_irqs = ESP32_INT_MATRIX_INPUTS;
+    return true;
+}
+
+static void esp32_intmatrix_print_info(InterruptStatsProvider *obj, Monitor *mon)
+{
+    Esp32IntMatrixState *s = ESP32_INTMATRIX(obj);
+
+    for (int n = 0; n < ESP32_INT_MATRIX_INPUTS; ++n) {
+        if (s->irq_route[0][n] < 0 && s->irq_route[1][n] < 0) {
+            continue;
+        }
+        monitor_printf(mon, "source %d:", n);
+        for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+            if (s->irq_route[i][n] >= 0) {
+                monitor_printf(mon, " cpu%d int %d", i, IRQ_MAP(i, n));
+            }
+        }
+        monitor_printf(mon, ", %" PRIu64 " interrupts\n", s->irq_count[n]);
+    }
+}
+
+static int esp32_intmatrix_post_load(void *opaque, int version_id)
+{
+    esp32_intmatrix_update_all_routes(ESP32_INTMATRIX(opaque));
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_intmatrix = {
+    .name = TYPE_ESP32_INTMATRIX,
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .post_load = esp32_intmatrix_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_2DARRAY(irq_map, Esp32IntMatrixState, ESP32_CPU_COUNT, ESP32_INT_MATRIX_INPUTS),
+        VMSTATE_BOOL_ARRAY_V(irq_level, Esp32IntMatrixState, ESP32_INT_MATRIX_INPUTS, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_intmatrix_properties[] = {
     DEFINE_PROP_LINK("cpu0", Esp32IntMatrixState, cpu[0], TYPE_XTENSA_CPU, XtensaCPU *),
     DEFINE_PROP_LINK("cpu1", Esp32IntMatrixState, cpu[1], TYPE_XTENSA_CPU, XtensaCPU *),
@@ -122,10 +207,14 @@ static Property esp32_intmatrix_properties[] = {
 static void esp32_intmatrix_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    InterruptStatsProviderClass *ic = INTERRUPT_STATS_PROVIDER_CLASS(klass);
 
     dc->reset = esp32_intmatrix_reset;
     dc->realize = esp32_intmatrix_realize;
+    dc->vmsd = &vmstate_esp32_intmatrix;
     device_class_set_props(dc, esp32_intmatrix_properties);
+    ic->get_statistics = esp32_intmatrix_get_statistics;
+    ic->print_info = esp32_intmatrix_print_info;
 }
 
 static const TypeInfo esp32_intmatrix_info = {
@@ -133,7 +222,11 @@ static const TypeInfo esp32_intmatrix_info = {
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_size = sizeof(Esp32IntMatrixState),
     .instance_init = esp32_intmatrix_init,
-    .class_init = esp32_intmatrix_class_init
+    .class_init = esp32_intmatrix_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_INTERRUPT_STATS_PROVIDER },
+        { }
+    },
 };
 
 static void esp32_intmatrix_register_types(void)
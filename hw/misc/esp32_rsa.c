@@ -0,0 +1,307 @@
+/*
+ * ESP32 RSA (big integer) accelerator
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log.h"
+#include "qemu/bitops.h"
+#include "qapi/error.h"
+#include "hw/hw.h"
+#include "hw/irq.h"
+#include "hw/sysbus.h"
+#include "hw/registerfields.h"
+#include "hw/misc/esp32_rsa.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
+#define ESP32_RSA_REGS_SIZE (A_RSA_CLEAN + 4)
+
+/* The accelerator works on operands of 512 to 4096 bits, in 512-bit steps,
+ * stored in the M, Z, Y and X memory blocks. It supports three operations:
+ *
+ * - modular exponentiation, Z = X ^ Y mod M. The guest also provides
+ *   r = R^2 mod M in Z and M' = -M^-1 mod 2^32 in M_DASH, where R = 2^N;
+ * - Montgomery multiplication, Z = X * Z * R^-1 mod M. The guest runs it
+ *   twice: first with r in Z, to bring X into the Montgomery domain, then
+ *   with the second operand in X, which yields the plain modular product;
+ * - plain multiplication, Z = X * Y, where Y is stored in the upper half
+ *   of the Z block and the product fills the whole block.
+ *
+ * Modular operations are done with word-by-word Montgomery reduction using
+ * the guest-provided r and M', like the hardware does, so that results for
+ * inconsistent inputs match as well. Operations complete synchronously
+ * and raise the interrupt.
+ */
+
+#define ESP32_RSA_MODEXP_MODE_MAX   7
+#define ESP32_RSA_MULT_MODE_MAX     11
+/* MULT_MODE values above this select plain multiplication */
+#define ESP32_RSA_MULT_MODE_PLAIN   7
+
+static int esp32_rsa_cmp(const uint32_t *a, const uint32_t *b, int n)
+{
+    for (int i = n - 1; i >= 0; --i) {
+        if (a[i] != b[i]) {
+            return a[i] > b[i] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+static void esp32_rsa_sub(uint32_t *a, const uint32_t *b, int n)
+{
+    uint64_t borrow = 0;
+
+    for (int i = 0; i < n; ++i) {
+        uint64_t d = (uint64_t) a[i] - b[i] - borrow;
+        a[i] = d;
+        borrow = (d >> 32) & 1;
+    }
+}
+
+/* z = x * y * 2^(-32 * n) mod m, coarsely integrated operand scanning */
+static void esp32_rsa_montmul(uint32_t *z, const uint32_t *x, const uint32_t *y,
+                              const uint32_t *m, uint32_t m_dash, int n)
+{
+    uint32_t t[ESP32_RSA_MEM_WORDS + 2] = { 0 };
+
+    for (int i = 0; i < n; ++i) {
+        uint64_t c = 0;
+        uint32_t u;
+
+        for (int j = 0; j < n; ++j) {
+            c += (uint64_t) x[j] * y[i] + t[j];
+            t[j] = c;
+            c >>= 32;
+        }
+        c += t[n];
+        t[n] = c;
+        t[n + 1] = c >> 32;
+
+        u = t[0] * m_dash;
+        c = ((uint64_t) u * m[0] + t[0]) >> 32;
+        for (int j = 1; j < n; ++j) {
+            c += (uint64_t) u * m[j] + t[j];
+            t[j - 1] = c;
+            c >>= 32;
+        }
+        c += t[n];
+        t[n - 1] = c;
+        t[n] = t[n + 1] + (c >> 32);
+    }
+    if (t[n] || esp32_rsa_cmp(t, m, n) >= 0) {
+        esp32_rsa_sub(t, m, n);
+    }
+    memcpy(z, t, n * sizeof(uint32_t));
+}
+
+static void esp32_rsa_raise_irq(Esp32RsaState *s)
+{
+    s->int_raw = 1;
+    qemu_irq_raise(s->irq);
+}
+
+static void esp32_rsa_modexp(Esp32RsaState *s)
+{
+    uint32_t *m = s->mem[ESP32_RSA_MEM_M];
+    uint32_t *z = s->mem[ESP32_RSA_MEM_Z];
+    const uint32_t *x = s->mem[ESP32_RSA_MEM_X];
+    const uint32_t *y = s->mem[ESP32_RSA_MEM_Y];
+    uint32_t one[ESP32_RSA_MEM_WORDS] = { 1 };
+    uint32_t xr[ESP32_RSA_MEM_WORDS];
+    uint32_t acc[ESP32_RSA_MEM_WORDS];
+    int n, bit;
+
+    if (s->modexp_mode > ESP32_RSA_MODEXP_MODE_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: invalid mode %d\n", __func__, s->modexp_mode);
+        return;
+    }
+    n = (s->modexp_mode + 1) * 16;
+    trace_esp32_rsa_modexp(n * 32);
+
+    /* Leading zero bits of the exponent only square R mod M, skip them */
+    for (bit = n * 32 - 1; bit >= 0 && !extract32(y[bit / 32], bit % 32, 1); --bit) {
+    }
+
+    esp32_rsa_montmul(xr, x, z, m, s->m_dash, n);
+    esp32_rsa_montmul(acc, z, one, m, s->m_dash, n);
+    for (; bit >= 0; --bit) {
+        esp32_rsa_montmul(acc, acc, acc, m, s->m_dash, n);
+        if (extract32(y[bit / 32], bit % 32, 1)) {
+            esp32_rsa_montmul(acc, acc, xr, m, s->m_dash, n);
+        }
+    }
+    esp32_rsa_montmul(z, acc, one, m, s->m_dash, n);
+    esp32_rsa_raise_irq(s);
+}
+
+static void esp32_rsa_mult(Esp32RsaState *s)
+{
+    uint32_t *z = s->mem[ESP32_RSA_MEM_Z];
+    const uint32_t *x = s->mem[ESP32_RSA_MEM_X];
+    int n;
+
+    if (s->mult_mode > ESP32_RSA_MULT_MODE_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: invalid mode %d\n", __func__, s->mult_mode);
+        return;
+    }
+
+    if (s->mult_mode <= ESP32_RSA_MULT_MODE_PLAIN) {
+        n = (s->mult_mode + 1) * 16;
+        trace_esp32_rsa_mult(n * 32, true);
+        esp32_rsa_montmul(z, x, z, s->mem[ESP32_RSA_MEM_M], s->m_dash, n);
+    } else {
+        uint32_t y[ESP32_RSA_MEM_WORDS / 2];
+
+        n = (s->mult_mode - ESP32_RSA_MULT_MODE_PLAIN) * 16;
+        trace_esp32_rsa_mult(n * 32, false);
+        memcpy(y, z + n, n * sizeof(uint32_t));
+        memset(z, 0, 2 * n * sizeof(uint32_t));
+        for (int i = 0; i < n; ++i) {
+            uint64_t c = 0;
+
+            for (int j = 0; j < n; ++j) {
+                c += (uint64_t) x[j] * y[i] + z[i + j];
+                z[i + j] = c;
+                c >>= 32;
+            }
+            z[i + n] = c;
+        }
+    }
+    esp32_rsa_raise_irq(s);
+}
+
+static uint64_t esp32_rsa_read(void *opaque, hwaddr addr, unsigned int size)
+{
+    Esp32RsaState *s = ESP32_RSA(opaque);
+    uint64_t r = 0;
+    switch (addr) {
+    case 0 ... ESP32_RSA_MEM_COUNT * ESP32_RSA_MEM_SIZE - 1:
+        r = s->mem[addr / ESP32_RSA_MEM_SIZE][(addr % ESP32_RSA_MEM_SIZE) / sizeof(uint32_t)];
+        break;
+    case A_RSA_M_DASH:
+        r = s->m_dash;
+        break;
+    case A_RSA_MODEXP_MODE:
+        r = s->modexp_mode;
+        break;
+    case A_RSA_MULT_MODE:
+        r = s->mult_mode;
+        break;
+    case A_RSA_INTERRUPT:
+        r = s->int_raw;
+        break;
+    case A_RSA_CLEAN:
+        /* memory blocks are cleared instantly on reset */
+        r = 1;
+        break;
+    }
+    return r;
+}
+
+static void esp32_rsa_write(void *opaque, hwaddr addr,
+                       uint64_t value, unsigned int size)
+{
+    Esp32RsaState *s = ESP32_RSA(opaque);
+    switch (addr) {
+    case 0 ... ESP32_RSA_MEM_COUNT * ESP32_RSA_MEM_SIZE - 1:
+        s->mem[addr / ESP32_RSA_MEM_SIZE][(addr % ESP32_RSA_MEM_SIZE) / sizeof(uint32_t)] = value;
+        break;
+    case A_RSA_M_DASH:
+        s->m_dash = value;
+        break;
+    case A_RSA_MODEXP_MODE:
+        s->modexp_mode = value;
+        break;
+    case A_RSA_MODEXP_START:
+        if (value & 1) {
+            esp32_rsa_modexp(s);
+        }
+        break;
+    case A_RSA_MULT_MODE:
+        s->mult_mode = value;
+        break;
+    case A_RSA_MULT_START:
+        if (value & 1) {
+            esp32_rsa_mult(s);
+        }
+        break;
+    case A_RSA_INTERRUPT:
+        s->int_raw = 0;
+        qemu_irq_lower(s->irq);
+        break;
+    }
+}
+
+static const MemoryRegionOps esp32_rsa_ops = {
+    .read =  esp32_rsa_read,
+    .write = esp32_rsa_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+};
+
+static void esp32_rsa_reset(DeviceState *dev)
+{
+    Esp32RsaState *s = ESP32_RSA(dev);
+    memset(s->mem, 0, sizeof(s->mem));
+    s->m_dash = 0;
+    s->modexp_mode = 0;
+    s->mult_mode = 0;
+    s->int_raw = 0;
+    qemu_irq_lower(s->irq);
+}
+
+static void esp32_rsa_init(Object *obj)
+{
+    Esp32RsaState *s = ESP32_RSA(obj);
+    SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
+
+    memory_region_init_io(&s->iomem, obj, &esp32_rsa_ops, s,
+                          TYPE_ESP32_RSA, ESP32_RSA_REGS_SIZE);
+    sysbus_init_mmio(sbd, &s->iomem);
+    sysbus_init_irq(sbd, &s->irq);
+}
+
+static const VMStateDescription vmstate_esp32_rsa = {
+    .name = TYPE_ESP32_RSA,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_2DARRAY(mem, Esp32RsaState, ESP32_RSA_MEM_COUNT, ESP32_RSA_MEM_WORDS),
+        VMSTATE_UINT32(m_dash, Esp32RsaState),
+        VMSTATE_UINT32(modexp_mode, Esp32RsaState),
+        VMSTATE_UINT32(mult_mode, Esp32RsaState),
+        VMSTATE_UINT32(int_raw, Esp32RsaState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void esp32_rsa_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = esp32_rsa_reset;
+    dc->vmsd = &vmstate_esp32_rsa;
+}
+
+static const TypeInfo esp32_rsa_info = {
+    .name = TYPE_ESP32_RSA,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(Esp32RsaState),
+    .instance_init = esp32_rsa_init,
+    .class_init = esp32_rsa_class_init
+};
+
+static void esp32_rsa_register_types(void)
+{
+    type_register_static(&esp32_rsa_info);
+}
+
+type_init(esp32_rsa_register_types)
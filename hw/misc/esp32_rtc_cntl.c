@@ -20,9 +20,17 @@
 #include "hw/qdev-properties.h"
 #include "hw/misc/esp32_reg.h"
 #include "hw/misc/esp32_rtc_cntl.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 static void esp32_rtc_update_cpu_stall(Esp32RtcCntlState* s);
 static void esp32_rtc_update_clk(Esp32RtcCntlState* s);
+static void esp32_rtc_sleep_start(Esp32RtcCntlState* s);
+
+static void esp32_rtc_update_irq(Esp32RtcCntlState *s)
+{
+    qemu_set_irq(s->irq, (s->int_raw & s->int_ena) != 0);
+}
 
 static uint64_t esp32_rtc_cntl_read(void *opaque, hwaddr addr, unsigned int size)
 {
@@ -32,6 +40,13 @@ static uint64_t esp32_rtc_cntl_read(void *opaque, hwaddr addr, unsigned int size
     case A_RTC_CNTL_OPTIONS0:
         r = s->options0_reg;
         break;
+    case A_RTC_CNTL_SLP_TIMER0:
+        r = s->slp_timer & UINT32_MAX;
+        break;
+    case A_RTC_CNTL_SLP_TIMER1:
+        r = FIELD_DP32(r, RTC_CNTL_SLP_TIMER1, SLP_VAL_HI, s->slp_timer >> 32);
+        r = FIELD_DP32(r, RTC_CNTL_SLP_TIMER1, MAIN_TIMER_ALARM_EN, s->slp_timer_alarm_en);
+        break;
     case A_RTC_CNTL_TIME_UPDATE:
         r = R_RTC_CNTL_TIME_UPDATE_VALID_MASK;
         break;
@@ -42,6 +57,29 @@ static uint64_t esp32_rtc_cntl_read(void *opaque, hwaddr addr, unsigned int size
         r = s->time_reg >> 32;
         break;
 
+    case A_RTC_CNTL_STATE0:
+        r = FIELD_DP32(r, RTC_CNTL_STATE0, SLEEP_EN, s->sleeping);
+        break;
+
+    case A_RTC_CNTL_WAKEUP_STATE:
+        r = FIELD_DP32(r, RTC_CNTL_WAKEUP_STATE, WAKEUP_ENA, s->wakeup_ena);
+        r = FIELD_DP32(r, RTC_CNTL_WAKEUP_STATE, WAKEUP_CAUSE, s->wakeup_cause);
+        break;
+
+    case A_RTC_CNTL_INT_ENA:
+        r = s->int_ena;
+        break;
+    case A_RTC_CNTL_INT_RAW:
+        r = s->int_raw;
+        break;
+    case A_RTC_CNTL_INT_ST:
+        r = s->int_raw & s->int_ena;
+        break;
+
+    case A_RTC_CNTL_DIG_PWC:
+        r = s->dig_pwc_reg;
+        break;
+
     case A_RTC_CNTL_RESET_STATE:
         r = FIELD_DP32(r, RTC_CNTL_RESET_STATE, RESET_CAUSE_PROCPU, s->reset_cause[0]);
         r = FIELD_DP32(r, RTC_CNTL_RESET_STATE, RESET_CAUSE_APPCPU, s->reset_cause[1]);
@@ -102,6 +140,38 @@ static void esp32_rtc_cntl_write(void *opaque, hwaddr addr, uint64_t value,
         esp32_rtc_update_cpu_stall(s);
         break;
 
+    case A_RTC_CNTL_SLP_TIMER0:
+        s->slp_timer = deposit64(s->slp_timer, 0, 32, value);
+        break;
+    case A_RTC_CNTL_SLP_TIMER1:
+        s->slp_timer = deposit64(s->slp_timer, 32, 16,
+                                 FIELD_EX32(value, RTC_CNTL_SLP_TIMER1, SLP_VAL_HI));
+        s->slp_timer_alarm_en = FIELD_EX32(value, RTC_CNTL_SLP_TIMER1, MAIN_TIMER_ALARM_EN);
+        break;
+
+    case A_RTC_CNTL_STATE0:
+        if (FIELD_EX32(value, RTC_CNTL_STATE0, SLEEP_EN) && !s->sleeping) {
+            esp32_rtc_sleep_start(s);
+        }
+        break;
+
+    case A_RTC_CNTL_WAKEUP_STATE:
+        s->wakeup_ena = FIELD_EX32(value, RTC_CNTL_WAKEUP_STATE, WAKEUP_ENA);
+        break;
+
+    case A_RTC_CNTL_INT_ENA:
+        s->int_ena = value;
+        esp32_rtc_update_irq(s);
+        break;
+    case A_RTC_CNTL_INT_CLR:
+        s->int_raw &= ~value;
+        esp32_rtc_update_irq(s);
+        break;
+
+    case A_RTC_CNTL_DIG_PWC:
+        s->dig_pwc_reg = value;
+        break;
+
     case A_RTC_CNTL_TIME_UPDATE:
         if (value & R_RTC_CNTL_TIME_UPDATE_UPDATE_MASK) {
             s->time_reg = muldiv64(
@@ -155,19 +225,74 @@ static void esp32_rtc_update_cpu_stall(Esp32RtcCntlState* s)
 
     const uint32_t stall_magic_val = 0x86;
 
-    s->cpu_stall_state[0] = procpu_stall == stall_magic_val;
-    s->cpu_stall_state[1] = appcpu_stall == stall_magic_val;
+    s->cpu_stall_state[0] = procpu_stall == stall_magic_val || s->sleeping;
+    s->cpu_stall_state[1] = appcpu_stall == stall_magic_val || s->sleeping;
 
     qemu_set_irq(s->cpu_stall_req[0], s->cpu_stall_state[0]);
     qemu_set_irq(s->cpu_stall_req[1], s->cpu_stall_state[1]);
 }
 
-static void esp32_rtc_update_clk(Esp32RtcCntlState* s)
+/* The sleep timer is compared against the RTC time counter, which counts
+ * RTC slow clock cycles since the RTC reset.
+ */
+static int64_t esp32_rtc_ticks_to_ns(Esp32RtcCntlState* s, uint64_t ticks)
+{
+    return s->time_base_ns + muldiv64(ticks, NANOSECONDS_PER_SECOND, s->rtc_slowclk_freq);
+}
+
+/* With the CPUs stalled, nothing happens until the wakeup timer fires.
+ * The idle-warp machine option skips over the sleep period entirely.
+ */
+static void esp32_rtc_sleep_start(Esp32RtcCntlState* s)
+{
+    s->sleeping = true;
+    s->deep_sleep = FIELD_EX32(s->dig_pwc_reg, RTC_CNTL_DIG_PWC, DG_WRAP_PD_EN);
+    s->wakeup_cause = 0;
+    trace_esp32_rtc_sleep_start(s->deep_sleep, s->wakeup_ena, s->slp_timer);
+
+    if (s->wakeup_ena & ESP32_RTC_TIMER_TRIG_EN) {
+        timer_mod(s->wakeup_timer, esp32_rtc_ticks_to_ns(s, s->slp_timer));
+    } else if (!(s->wakeup_ena & ~ESP32_RTC_TIMER_TRIG_EN)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: no wakeup source enabled, sleeping forever\n", __func__);
+    } else {
+        qemu_log_mask(LOG_UNIMP, "%s: only timer wakeup is supported, wakeup_ena=0x%x\n",
+                      __func__, s->wakeup_ena);
+    }
+    esp32_rtc_update_cpu_stall(s);
+}
+
+static void esp32_rtc_wakeup(void *opaque)
+{
+    Esp32RtcCntlState *s = ESP32_RTC_CNTL(opaque);
+
+    trace_esp32_rtc_wakeup(s->deep_sleep);
+    s->sleeping = false;
+    s->wakeup_cause = ESP32_RTC_TIMER_TRIG_EN;
+    esp32_rtc_update_cpu_stall(s);
+
+    if (s->deep_sleep) {
+        /* The digital part was powered down, it starts from the reset vector */
+        for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+            s->reset_cause[i] = ESP32_DEEPSLEEP_RESET;
+        }
+        qemu_irq_pulse(s->dig_reset_req);
+    } else {
+        s->int_raw |= R_RTC_CNTL_INT_SLP_WAKEUP_MASK;
+        esp32_rtc_update_irq(s);
+    }
+}
+
+static void esp32_rtc_update_clk_freq(Esp32RtcCntlState* s)
 {
     const uint32_t slowclk_freq[] = {150000, 32768, 8000000/256};
     const uint32_t fastclk_freq[] = {s->xtal_apb_freq / 4, 8000000};
     s->rtc_slowclk_freq = slowclk_freq[s->rtc_slowclk];
     s->rtc_fastclk_freq = fastclk_freq[s->rtc_fastclk];
+}
+
+static void esp32_rtc_update_clk(Esp32RtcCntlState* s)
+{
+    esp32_rtc_update_clk_freq(s);
     qemu_irq_pulse(s->clk_update);
 }
 
@@ -182,6 +307,18 @@ static void esp32_rtc_cntl_reset(DeviceState *dev)
     Esp32RtcCntlState *s = ESP32_RTC_CNTL(dev);
 
     s->time_base_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    timer_del(s->wakeup_timer);
+    s->slp_timer = 0;
+    s->slp_timer_alarm_en = false;
+    s->wakeup_ena = ESP32_RTC_TIMER_TRIG_EN | ESP32_RTC_GPIO_TRIG_EN;
+    s->wakeup_cause = 0;
+    s->dig_pwc_reg = 0;
+    s->int_ena = 0;
+    s->int_raw = 0;
+    s->sleeping = false;
+    s->deep_sleep = false;
+    esp32_rtc_update_cpu_stall(s);
+    esp32_rtc_update_irq(s);
 }
 
 static void esp32_rtc_cntl_realize(DeviceState *dev, Error **errp)
@@ -201,6 +338,7 @@ static void esp32_rtc_cntl_init(Object *obj)
     qdev_init_gpio_out_named(DEVICE(sbd), &s->cpu_reset_req[0], ESP32_RTC_CPU_RESET_GPIO, ESP32_CPU_COUNT);
     qdev_init_gpio_out_named(DEVICE(sbd), &s->cpu_stall_req[0], ESP32_RTC_CPU_STALL_GPIO, ESP32_CPU_COUNT);
     qdev_init_gpio_out_named(DEVICE(sbd), &s->clk_update, ESP32_RTC_CLK_UPDATE_GPIO, 1);
+    s->wakeup_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, esp32_rtc_wakeup, s);
 
     for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
         s->reset_cause[i] = ESP32_POWERON_RESET;
@@ -215,6 +353,60 @@ static void esp32_rtc_cntl_init(Object *obj)
     esp32_rtc_update_clk(s);
 }
 
+static int esp32_rtc_cntl_pre_save(void *opaque)
+{
+    Esp32RtcCntlState *s = ESP32_RTC_CNTL(opaque);
+
+    s->clk_conf_reg = esp32_rtc_cntl_read(s, A_RTC_CNTL_CLK_CONF, 4);
+    s->reset_state_reg = esp32_rtc_cntl_read(s, A_RTC_CNTL_RESET_STATE, 4);
+    return 0;
+}
+
+static int esp32_rtc_cntl_post_load(void *opaque, int version_id)
+{
+    Esp32RtcCntlState *s = ESP32_RTC_CNTL(opaque);
+
+    s->soc_clk = FIELD_EX32(s->clk_conf_reg, RTC_CNTL_CLK_CONF, SOC_CLK_SEL);
+    s->rtc_fastclk = FIELD_EX32(s->clk_conf_reg, RTC_CNTL_CLK_CONF, FAST_CLK_RTC_SEL);
+    s->rtc_slowclk = FIELD_EX32(s->clk_conf_reg, RTC_CNTL_CLK_CONF, ANA_CLK_RTC_SEL);
+    esp32_rtc_update_clk_freq(s);
+
+    s->reset_cause[0] = FIELD_EX32(s->reset_state_reg, RTC_CNTL_RESET_STATE, RESET_CAUSE_PROCPU);
+    s->reset_cause[1] = FIELD_EX32(s->reset_state_reg, RTC_CNTL_RESET_STATE, RESET_CAUSE_APPCPU);
+    s->stat_vector_sel[0] = FIELD_EX32(s->reset_state_reg, RTC_CNTL_RESET_STATE, PROCPU_STAT_VECTOR_SEL);
+    s->stat_vector_sel[1] = FIELD_EX32(s->reset_state_reg, RTC_CNTL_RESET_STATE, APPCPU_STAT_VECTOR_SEL);
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_rtc_cntl = {
+    .name = TYPE_ESP32_RTC_CNTL,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = esp32_rtc_cntl_pre_save,
+    .post_load = esp32_rtc_cntl_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL_ARRAY(cpu_stall_state, Esp32RtcCntlState, ESP32_CPU_COUNT),
+        VMSTATE_INT64(time_base_ns, Esp32RtcCntlState),
+        VMSTATE_UINT32(options0_reg, Esp32RtcCntlState),
+        VMSTATE_UINT64(time_reg, Esp32RtcCntlState),
+        VMSTATE_UINT32(sw_cpu_stall_reg, Esp32RtcCntlState),
+        VMSTATE_UINT32_ARRAY(scratch_reg, Esp32RtcCntlState, ESP32_RTC_CNTL_SCRATCH_REG_COUNT),
+        VMSTATE_UINT32(clk_conf_reg, Esp32RtcCntlState),
+        VMSTATE_UINT32(reset_state_reg, Esp32RtcCntlState),
+        VMSTATE_UINT64(slp_timer, Esp32RtcCntlState),
+        VMSTATE_BOOL(slp_timer_alarm_en, Esp32RtcCntlState),
+        VMSTATE_UINT32(wakeup_ena, Esp32RtcCntlState),
+        VMSTATE_UINT32(wakeup_cause, Esp32RtcCntlState),
+        VMSTATE_UINT32(dig_pwc_reg, Esp32RtcCntlState),
+        VMSTATE_UINT32(int_ena, Esp32RtcCntlState),
+        VMSTATE_UINT32(int_raw, Esp32RtcCntlState),
+        VMSTATE_BOOL(sleeping, Esp32RtcCntlState),
+        VMSTATE_BOOL(deep_sleep, Esp32RtcCntlState),
+        VMSTATE_TIMER_PTR(wakeup_timer, Esp32RtcCntlState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_rtc_cntl_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -225,6 +417,7 @@ static void esp32_rtc_cntl_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_rtc_cntl_reset;
     dc->realize = esp32_rtc_cntl_realize;
+    dc->vmsd = &vmstate_esp32_rtc_cntl;
     device_class_set_props(dc, esp32_rtc_cntl_properties);
 }
 
@@ -11,90 +11,243 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/error-report.h"
-#include "crypto/hash.h"
+#include "qemu/bitops.h"
 #include "qapi/error.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
 #include "hw/registerfields.h"
 #include "hw/boards.h"
 #include "hw/misc/esp32_sha.h"
+#include "migration/vmstate.h"
 
 #define ESP32_SHA_REGS_SIZE (A_SHA512_BUSY + 4)
 
-/* QEMU hash API includes only the "qcrypto_hash_bytes" function which takes
- * bytes as input, and calculates the digest. It doesn't allow "updating"
- * the state multiple times with blocks of input. Therefore we collect all
- * the input in an array (s->full_text) and when SHA_X_LOAD_REG is set,
- * we call "qcrypto_hash_bytes" to get the digest.
+/* The accelerator doesn't pad the message, the guest writes padded blocks
+ * into the text registers. START initializes the hash state and processes
+ * the first block, CONTINUE processes one more block, and LOAD copies the
+ * hash state into the text registers. Each block is consumed when it is
+ * written, so only the hash state is kept between operations.
+ *
+ * Message words are big-endian, so the text registers map directly to the
+ * message schedule words, without byte swapping.
  */
 
-static void esp32_sha_text_reg_byteswap_to(Esp32ShaState* s, uint32_t* dst, size_t len_words)
+typedef enum Esp32ShaAlg {
+    ESP32_SHA_1,
+    ESP32_SHA_256,
+    ESP32_SHA_384,
+    ESP32_SHA_512,
+} Esp32ShaAlg;
+
+static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint64_t sha384_iv[8] = {
+    0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+    0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const uint64_t sha512_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint64_t sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static void esp32_sha1_block(uint32_t *h, const uint32_t *text)
 {
-    for (int i = 0; i < len_words; ++i) {
-        dst[i] = __builtin_bswap32(s->text[i]);
+    uint32_t w[80];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int i = 0; i < 16; ++i) {
+        w[i] = text[i];
+    }
+    for (int i = 16; i < 80; ++i) {
+        w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
     }
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rol32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol32(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
 }
 
+static void esp32_sha256_block(uint32_t *h, const uint32_t *text)
+{
+    uint32_t w[64];
+    uint32_t v[8];
 
-static inline QCryptoHashAlgorithm algorithm_for_addr(hwaddr reg_addr)
+    for (int i = 0; i < 16; ++i) {
+        w[i] = text[i];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, h, sizeof(v));
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = ror32(v[4], 6) ^ ror32(v[4], 11) ^ ror32(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = ror32(v[0], 2) ^ ror32(v[0], 13) ^ ror32(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        uint32_t t2 = s0 + maj;
+        memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i) {
+        h[i] += v[i];
+    }
+}
+
+static void esp32_sha512_block(uint64_t *h, const uint32_t *text)
 {
-    const QCryptoHashAlgorithm hash_alg_for_reg[] = {
-        QCRYPTO_HASH_ALG_SHA1,
-        QCRYPTO_HASH_ALG_SHA256,
-        QCRYPTO_HASH_ALG_SHA384,
-        QCRYPTO_HASH_ALG_SHA512
-    };
-    size_t index = (reg_addr - A_SHA1_START) / 0x10;
-    return hash_alg_for_reg[index];
+    uint64_t w[80];
+    uint64_t v[8];
+
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint64_t) text[2 * i] << 32) | text[2 * i + 1];
+    }
+    for (int i = 16; i < 80; ++i) {
+        uint64_t s0 = ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        uint64_t s1 = ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, h, sizeof(v));
+    for (int i = 0; i < 80; ++i) {
+        uint64_t s1 = ror64(v[4], 14) ^ ror64(v[4], 18) ^ ror64(v[4], 41);
+        uint64_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint64_t t1 = v[7] + s1 + ch + sha512_k[i] + w[i];
+        uint64_t s0 = ror64(v[0], 28) ^ ror64(v[0], 34) ^ ror64(v[0], 39);
+        uint64_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        uint64_t t2 = s0 + maj;
+        memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i) {
+        h[i] += v[i];
+    }
 }
 
-static uint32_t hash_block_bytes[] = {
-    [QCRYPTO_HASH_ALG_SHA1] = 64,
-    [QCRYPTO_HASH_ALG_SHA256] = 64,
-    [QCRYPTO_HASH_ALG_SHA384] = 128,
-    [QCRYPTO_HASH_ALG_SHA512] = 128,
-};
+static inline Esp32ShaAlg algorithm_for_addr(hwaddr reg_addr)
+{
+    return (reg_addr - A_SHA1_START) / 0x10;
+}
 
-static void esp32_sha_update_text(Esp32ShaState* s, QCryptoHashAlgorithm hash_alg)
+static void esp32_sha_start(Esp32ShaState *s, Esp32ShaAlg alg)
 {
-    uint32_t block_len_bytes = hash_block_bytes[hash_alg];
-    if (s->full_text_len + block_len_bytes > s->full_text_reserved) {
-        uint32_t full_text_reserved = MAX(s->full_text_reserved * 2, s->full_text_reserved + block_len_bytes);
-        uint8_t *new_full_text = g_realloc(s->full_text, full_text_reserved);
-        s->full_text_reserved = full_text_reserved;
-        s->full_text = new_full_text;
-    }
-    esp32_sha_text_reg_byteswap_to(s, (uint32_t*) (s->full_text + s->full_text_len), block_len_bytes/4);
-    s->full_text_len += block_len_bytes;
+    switch (alg) {
+    case ESP32_SHA_1:
+        memcpy(s->hash32, sha1_iv, sizeof(sha1_iv));
+        break;
+    case ESP32_SHA_256:
+        memcpy(s->hash32, sha256_iv, sizeof(sha256_iv));
+        break;
+    case ESP32_SHA_384:
+        memcpy(s->hash64, sha384_iv, sizeof(sha384_iv));
+        break;
+    case ESP32_SHA_512:
+        memcpy(s->hash64, sha512_iv, sizeof(sha512_iv));
+        break;
+    }
 }
 
-static void esp32_sha_finish(Esp32ShaState *s, QCryptoHashAlgorithm hash_alg)
+static void esp32_sha_update(Esp32ShaState *s, Esp32ShaAlg alg)
 {
-    /* ESP32 SHA accelerator accepts padded blocks (doesn't do any extra padding), but
-     * qcrypto_hash_bytes adds padding after the last block. Remove the padding by checking
-     * the bit count in the last block. This may give results different from what the hardware
-     * would give if the guest application pads the block incorrectly.
-     */
-    uint8_t *result = (uint8_t*) s->text;
-    size_t result_len = qcrypto_hash_digest_len(hash_alg);
-    assert(result_len <= sizeof(s->text));
-    if (s->full_text_len % hash_block_bytes[hash_alg] != 0) {
-        error_report("esp32_sha_finish: invalid text length %" PRIx32 "\n", s->full_text_len);
-    } else {
-        uint32_t byte_count;
-        memcpy(&byte_count, s->full_text + s->full_text_len - sizeof(byte_count), sizeof(byte_count));
-        byte_count = __builtin_bswap32(byte_count) / 8;
-        if (byte_count > s->full_text_len) {
-            error_report("esp32_sha_finish: invalid byte count %" PRIx32 "\n", byte_count);
-        } else {
-            qcrypto_hash_bytes(hash_alg, (const char*) s->full_text, byte_count, &result, &result_len, &error_abort);
-            esp32_sha_text_reg_byteswap_to(s, (uint32_t*) s->text, result_len/4);
+    switch (alg) {
+    case ESP32_SHA_1:
+        esp32_sha1_block(s->hash32, s->text);
+        break;
+    case ESP32_SHA_256:
+        esp32_sha256_block(s->hash32, s->text);
+        break;
+    case ESP32_SHA_384:
+    case ESP32_SHA_512:
+        esp32_sha512_block(s->hash64, s->text);
+        break;
+    }
+}
+
+static void esp32_sha_load(Esp32ShaState *s, Esp32ShaAlg alg)
+{
+    switch (alg) {
+    case ESP32_SHA_1:
+        memcpy(s->text, s->hash32, 5 * sizeof(uint32_t));
+        break;
+    case ESP32_SHA_256:
+        memcpy(s->text, s->hash32, 8 * sizeof(uint32_t));
+        break;
+    case ESP32_SHA_384:
+    case ESP32_SHA_512:
+        for (int i = 0; i < (alg == ESP32_SHA_384 ? 6 : 8); ++i) {
+            s->text[2 * i] = s->hash64[i] >> 32;
+            s->text[2 * i + 1] = s->hash64[i] & UINT32_MAX;
         }
+        break;
     }
-    g_free(s->full_text);
-    s->full_text = NULL;
-    s->full_text_len = 0;
-    s->full_text_reserved = 0;
 }
 
 static uint64_t esp32_sha_read(void *opaque, hwaddr addr, unsigned int size)
@@ -118,20 +271,23 @@ static void esp32_sha_write(void *opaque, hwaddr addr,
         s->text[addr / sizeof(uint32_t)] = value;
         break;
     case A_SHA1_START:
-    case A_SHA1_CONTINUE:
     case A_SHA256_START:
-    case A_SHA256_CONTINUE:
     case A_SHA384_START:
-    case A_SHA384_CONTINUE:
     case A_SHA512_START:
+        esp32_sha_start(s, algorithm_for_addr(addr));
+        esp32_sha_update(s, algorithm_for_addr(addr));
+        break;
+    case A_SHA1_CONTINUE:
+    case A_SHA256_CONTINUE:
+    case A_SHA384_CONTINUE:
     case A_SHA512_CONTINUE:
-        esp32_sha_update_text(s, algorithm_for_addr(addr));
+        esp32_sha_update(s, algorithm_for_addr(addr));
         break;
     case A_SHA1_LOAD:
     case A_SHA256_LOAD:
     case A_SHA384_LOAD:
     case A_SHA512_LOAD:
-        esp32_sha_finish(s, algorithm_for_addr(addr));
+        esp32_sha_load(s, algorithm_for_addr(addr));
         break;
     }
 }
@@ -145,10 +301,9 @@ static const MemoryRegionOps esp32_sha_ops = {
 static void esp32_sha_reset(DeviceState *dev)
 {
     Esp32ShaState *s = ESP32_SHA(dev);
-    g_free(s->full_text);
-    s->full_text = NULL;
-    s->full_text_len = 0;
-    s->full_text_reserved = 0;
+    memset(s->text, 0, sizeof(s->text));
+    memset(s->hash32, 0, sizeof(s->hash32));
+    memset(s->hash64, 0, sizeof(s->hash64));
 }
 
 static void esp32_sha_init(Object *obj)
@@ -161,11 +316,24 @@ static void esp32_sha_init(Object *obj)
     sysbus_init_mmio(sbd, &s->iomem);
 }
 
+static const VMStateDescription vmstate_esp32_sha = {
+    .name = TYPE_ESP32_SHA,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(text, Esp32ShaState, ESP32_SHA_TEXT_REG_CNT),
+        VMSTATE_UINT32_ARRAY(hash32, Esp32ShaState, ESP32_SHA256_HASH_WORDS),
+        VMSTATE_UINT64_ARRAY(hash64, Esp32ShaState, ESP32_SHA512_HASH_WORDS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void esp32_sha_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->reset = esp32_sha_reset;
+    dc->vmsd = &vmstate_esp32_sha;
 }
 
 static const TypeInfo esp32_sha_info = {
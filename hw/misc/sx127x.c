@@ -0,0 +1,560 @@
+/*
+ * Semtech SX1276/SX1277/SX1278/SX1279 LoRa transceiver
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * Only the LoRa modem is modelled. Registers of the FSK/OOK modem can be
+ * accessed, but have no effect.
+ *
+ * The radio channel is a chardev. Each frame is a length byte followed
+ * by the payload, in both directions:
+ * - frames transmitted by the guest are written out when TX completes;
+ * - frames read from the chardev are received when the radio is in one of
+ *   the RX modes. The chardev is not read while the radio isn't listening,
+ *   so no frames are lost.
+ * Unless model-airtime is turned off, TX and RX take as long as sending the
+ * frame over the air with the current modem settings.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qemu/guest-random.h"
+#include "qapi/error.h"
+#include "chardev/char-fe.h"
+#include "hw/irq.h"
+#include "hw/qdev-properties.h"
+#include "hw/ssi/ssi.h"
+#include "hw/misc/sx127x.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
+#define SX127X(obj) OBJECT_CHECK(Sx127xState, (obj), TYPE_SX127X)
+
+#define SX127X_REG_COUNT        0x80
+#define SX127X_FIFO_SIZE        256
+#define SX127X_VERSION          0x12
+
+enum {
+    REG_FIFO                    = 0x00,
+    REG_OP_MODE                 = 0x01,
+    REG_FIFO_ADDR_PTR           = 0x0d,
+    REG_FIFO_TX_BASE_ADDR       = 0x0e,
+    REG_FIFO_RX_BASE_ADDR       = 0x0f,
+    REG_FIFO_RX_CURRENT_ADDR    = 0x10,
+    REG_IRQ_FLAGS_MASK          = 0x11,
+    REG_IRQ_FLAGS               = 0x12,
+    REG_RX_NB_BYTES             = 0x13,
+    REG_RX_HEADER_CNT_MSB       = 0x14,
+    REG_RX_HEADER_CNT_LSB       = 0x15,
+    REG_RX_PACKET_CNT_MSB       = 0x16,
+    REG_RX_PACKET_CNT_LSB       = 0x17,
+    REG_MODEM_STAT              = 0x18,
+    REG_PKT_SNR_VALUE           = 0x19,
+    REG_PKT_RSSI_VALUE          = 0x1a,
+    REG_RSSI_VALUE              = 0x1b,
+    REG_MODEM_CONFIG_1          = 0x1d,
+    REG_MODEM_CONFIG_2          = 0x1e,
+    REG_SYMB_TIMEOUT_LSB        = 0x1f,
+    REG_PREAMBLE_MSB            = 0x20,
+    REG_PREAMBLE_LSB            = 0x21,
+    REG_PAYLOAD_LENGTH          = 0x22,
+    REG_FIFO_RX_BYTE_ADDR       = 0x25,
+    REG_MODEM_CONFIG_3          = 0x26,
+    REG_RSSI_WIDEBAND           = 0x2c,
+    REG_DIO_MAPPING_1           = 0x40,
+    REG_VERSION                 = 0x42,
+};
+
+#define OP_MODE_LONG_RANGE      0x80
+#define OP_MODE_MODE_MASK       0x07
+
+enum {
+    MODE_SLEEP,
+    MODE_STDBY,
+    MODE_FSTX,
+    MODE_TX,
+    MODE_FSRX,
+    MODE_RX_CONTINUOUS,
+    MODE_RX_SINGLE,
+    MODE_CAD,
+};
+
+#define IRQ_CAD_DETECTED        0x01
+#define IRQ_CAD_DONE            0x04
+#define IRQ_TX_DONE             0x08
+#define IRQ_VALID_HEADER        0x10
+#define IRQ_PAYLOAD_CRC_ERROR   0x20
+#define IRQ_RX_DONE             0x40
+#define IRQ_RX_TIMEOUT          0x80
+
+/* Reported link quality of received frames */
+#define SX127X_PKT_RSSI_DBM     (-60)
+#define SX127X_PKT_SNR_QDB      (4 * 9)
+#define SX127X_NOISE_RSSI_DBM   (-120)
+#define SX127X_RSSI_OFFSET      157
+
+typedef struct Sx127xState {
+    SSISlave parent_obj;
+
+    qemu_irq dio[SX127X_DIO_COUNT];
+    CharBackend chr;
+    /* TX, RX timeout and CAD completion, depending on the mode */
+    QEMUTimer op_timer;
+    /* end of the frame being received */
+    QEMUTimer rx_timer;
+
+    uint8_t regs[SX127X_REG_COUNT];
+    uint8_t fifo[SX127X_FIFO_SIZE];
+
+    /* SPI transaction state */
+    bool addr_phase;
+    bool spi_write;
+    uint8_t spi_addr;
+
+    uint8_t tx_buf[SX127X_FIFO_SIZE];
+    uint32_t tx_len;
+
+    /* frame being read from the chardev, or received over the air */
+    uint8_t rx_buf[SX127X_FIFO_SIZE];
+    uint32_t rx_len;
+    uint32_t rx_got;
+    bool rx_have_len;
+    bool rx_in_flight;
+
+    bool model_airtime;
+} Sx127xState;
+
+static const uint8_t sx127x_reset_values[][2] = {
+    { REG_OP_MODE, 0x09 },
+    { 0x06, 0x6c }, { 0x07, 0x80 }, { 0x08, 0x00 },
+    { 0x09, 0x4f }, { 0x0a, 0x09 }, { 0x0b, 0x2b }, { 0x0c, 0x20 },
+    { REG_FIFO_TX_BASE_ADDR, 0x80 },
+    { REG_MODEM_CONFIG_1, 0x72 }, { REG_MODEM_CONFIG_2, 0x70 },
+    { REG_SYMB_TIMEOUT_LSB, 0x64 },
+    { REG_PREAMBLE_LSB, 0x08 },
+    { REG_PAYLOAD_LENGTH, 0x01 }, { 0x23, 0xff },
+    { 0x31, 0xc3 }, { 0x33, 0x27 }, { 0x37, 0x0a }, { 0x39, 0x12 },
+    { REG_VERSION, SX127X_VERSION },
+    { 0x4b, 0x09 }, { 0x4d, 0x84 },
+};
+
+static int sx127x_mode(Sx127xState *s)
+{
+    return s->regs[REG_OP_MODE] & OP_MODE_MODE_MASK;
+}
+
+static bool sx127x_is_lora(Sx127xState *s)
+{
+    return s->regs[REG_OP_MODE] & OP_MODE_LONG_RANGE;
+}
+
+static bool sx127x_is_listening(Sx127xState *s)
+{
+    int mode = sx127x_mode(s);
+    return sx127x_is_lora(s) && (mode == MODE_RX_CONTINUOUS || mode == MODE_RX_SINGLE);
+}
+
+static int64_t sx127x_symbol_ns(Sx127xState *s)
+{
+    static const uint32_t bandwidth_hz[] = {
+        7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000
+    };
+    uint32_t bw = MIN(s->regs[REG_MODEM_CONFIG_1] >> 4, ARRAY_SIZE(bandwidth_hz) - 1);
+    uint32_t sf = MAX(s->regs[REG_MODEM_CONFIG_2] >> 4, 6);
+
+    return muldiv64(1ULL << sf, NANOSECONDS_PER_SECOND, bandwidth_hz[bw]);
+}
+
+/* Time on air of a frame, see "Time on air" in the SX1276 datasheet */
+static int64_t sx127x_airtime_ns(Sx127xState *s, uint32_t len)
+{
+    int sf = MAX(s->regs[REG_MODEM_CONFIG_2] >> 4, 6);
+    int cr = (s->regs[REG_MODEM_CONFIG_1] >> 1) & 0x7;
+    bool implicit_header = s->regs[REG_MODEM_CONFIG_1] & 0x1;
+    bool crc = s->regs[REG_MODEM_CONFIG_2] & 0x4;
+    bool low_dr_opt = s->regs[REG_MODEM_CONFIG_3] & 0x8;
+    uint32_t preamble = (s->regs[REG_PREAMBLE_MSB] << 8) | s->regs[REG_PREAMBLE_LSB];
+
+    int num = 8 * (int) len - 4 * sf + 28 + 16 * crc - 20 * implicit_header;
+    int den = 4 * (sf - 2 * low_dr_opt);
+    int payload_symbols = 8 + MAX(DIV_ROUND_UP(num, den), 0) * (cr + 4);
+
+    /* preamble + 4.25 symbols, counted in quarter symbols */
+    uint64_t quarter_symbols = 4 * preamble + 17 + 4 * payload_symbols;
+    return quarter_symbols * sx127x_symbol_ns(s) / 4;
+}
+
+static void sx127x_update_dio(Sx127xState *s)
+{
+    /* DIO0 mapping in LoRa mode: RxDone, TxDone, CadDone */
+    static const uint8_t dio0_irq[] = { IRQ_RX_DONE, IRQ_TX_DONE, IRQ_CAD_DONE, 0 };
+    uint8_t flags = s->regs[REG_IRQ_FLAGS] & ~s->regs[REG_IRQ_FLAGS_MASK];
+    uint8_t dio0_mask = dio0_irq[s->regs[REG_DIO_MAPPING_1] >> 6];
+
+    qemu_set_irq(s->dio[0], (flags & dio0_mask) != 0);
+}
+
+static void sx127x_set_irq_flags(Sx127xState *s, uint8_t flags)
+{
+    s->regs[REG_IRQ_FLAGS] |= flags;
+    sx127x_update_dio(s);
+}
+
+static void sx127x_set_mode(Sx127xState *s, uint8_t op_mode)
+{
+    int old_mode = sx127x_mode(s);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->regs[REG_OP_MODE] = op_mode;
+    if (!sx127x_is_lora(s)) {
+        timer_del(&s->op_timer);
+        return;
+    }
+
+    int mode = sx127x_mode(s);
+    if (mode == old_mode) {
+        return;
+    }
+    trace_sx127x_set_mode(old_mode, mode);
+    timer_del(&s->op_timer);
+
+    switch (mode) {
+    case MODE_TX:
+        s->tx_len = s->regs[REG_PAYLOAD_LENGTH];
+        for (uint32_t i = 0; i < s->tx_len; ++i) {
+            s->tx_buf[i] = s->fifo[(uint8_t) (s->regs[REG_FIFO_TX_BASE_ADDR] + i)];
+        }
+        timer_mod_ns(&s->op_timer,
+                     now + (s->model_airtime ? sx127x_airtime_ns(s, s->tx_len) : 0));
+        break;
+
+    case MODE_RX_SINGLE: {
+        uint32_t symb_timeout = ((s->regs[REG_MODEM_CONFIG_2] & 0x3) << 8) |
+                                s->regs[REG_SYMB_TIMEOUT_LSB];
+        timer_mod_ns(&s->op_timer, now + symb_timeout * sx127x_symbol_ns(s));
+        qemu_chr_fe_accept_input(&s->chr);
+        break;
+    }
+
+    case MODE_RX_CONTINUOUS:
+        qemu_chr_fe_accept_input(&s->chr);
+        break;
+
+    case MODE_CAD:
+        /* Channel activity detection takes about two symbols */
+        timer_mod_ns(&s->op_timer, now + 2 * sx127x_symbol_ns(s));
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void sx127x_op_timer_cb(void *opaque)
+{
+    Sx127xState *s = SX127X(opaque);
+    uint8_t op_mode_stdby = (s->regs[REG_OP_MODE] & ~OP_MODE_MODE_MASK) | MODE_STDBY;
+
+    switch (sx127x_mode(s)) {
+    case MODE_TX: {
+        uint8_t len = s->tx_len;
+        trace_sx127x_tx(s->tx_len);
+        qemu_chr_fe_write_all(&s->chr, &len, 1);
+        qemu_chr_fe_write_all(&s->chr, s->tx_buf, s->tx_len);
+        sx127x_set_mode(s, op_mode_stdby);
+        sx127x_set_irq_flags(s, IRQ_TX_DONE);
+        break;
+    }
+
+    case MODE_RX_SINGLE:
+        /* Keep listening if a frame is already on its way */
+        if (!s->rx_in_flight) {
+            sx127x_set_mode(s, op_mode_stdby);
+            sx127x_set_irq_flags(s, IRQ_RX_TIMEOUT);
+        }
+        break;
+
+    case MODE_CAD:
+        sx127x_set_mode(s, op_mode_stdby);
+        sx127x_set_irq_flags(s, IRQ_CAD_DONE | (s->rx_in_flight ? IRQ_CAD_DETECTED : 0));
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void sx127x_inc_counter(Sx127xState *s, int msb_reg)
+{
+    uint16_t count = (s->regs[msb_reg] << 8) | s->regs[msb_reg + 1];
+    count++;
+    s->regs[msb_reg] = count >> 8;
+    s->regs[msb_reg + 1] = count & 0xff;
+}
+
+static void sx127x_rx_timer_cb(void *opaque)
+{
+    Sx127xState *s = SX127X(opaque);
+    uint8_t base = s->regs[REG_FIFO_RX_BASE_ADDR];
+
+    s->rx_in_flight = false;
+    s->rx_have_len = false;
+
+    if (!sx127x_is_listening(s)) {
+        /* The guest stopped listening while the frame was on air */
+        trace_sx127x_rx_drop(s->rx_len);
+        qemu_chr_fe_accept_input(&s->chr);
+        return;
+    }
+
+    trace_sx127x_rx(s->rx_len);
+    for (uint32_t i = 0; i < s->rx_len; ++i) {
+        s->fifo[(uint8_t) (base + i)] = s->rx_buf[i];
+    }
+    s->regs[REG_FIFO_RX_CURRENT_ADDR] = base;
+    s->regs[REG_FIFO_RX_BYTE_ADDR] = base + s->rx_len;
+    s->regs[REG_RX_NB_BYTES] = s->rx_len;
+    s->regs[REG_PKT_SNR_VALUE] = SX127X_PKT_SNR_QDB;
+    s->regs[REG_PKT_RSSI_VALUE] = SX127X_PKT_RSSI_DBM + SX127X_RSSI_OFFSET;
+    sx127x_inc_counter(s, REG_RX_HEADER_CNT_MSB);
+    sx127x_inc_counter(s, REG_RX_PACKET_CNT_MSB);
+
+    if (sx127x_mode(s) == MODE_RX_SINGLE) {
+        sx127x_set_mode(s, (s->regs[REG_OP_MODE] & ~OP_MODE_MODE_MASK) | MODE_STDBY);
+    }
+    sx127x_set_irq_flags(s, IRQ_VALID_HEADER | IRQ_RX_DONE);
+    qemu_chr_fe_accept_input(&s->chr);
+}
+
+static int sx127x_can_receive(void *opaque)
+{
+    Sx127xState *s = SX127X(opaque);
+
+    if (s->rx_in_flight || !sx127x_is_listening(s)) {
+        return 0;
+    }
+    /* Never read past the end of the current frame */
+    return s->rx_have_len ? s->rx_len - s->rx_got : 1;
+}
+
+static void sx127x_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Sx127xState *s = SX127X(opaque);
+
+    for (int i = 0; i < size; ++i) {
+        if (!s->rx_have_len) {
+            s->rx_len = buf[i];
+            s->rx_got = 0;
+            s->rx_have_len = true;
+        } else {
+            s->rx_buf[s->rx_got++] = buf[i];
+        }
+    }
+
+    if (s->rx_have_len && s->rx_got == s->rx_len) {
+        int64_t airtime = s->model_airtime ? sx127x_airtime_ns(s, s->rx_len) : 0;
+        s->rx_in_flight = true;
+        timer_mod_ns(&s->rx_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + airtime);
+    }
+}
+
+static uint8_t sx127x_reg_read(Sx127xState *s, uint8_t addr)
+{
+    uint8_t r;
+
+    switch (addr) {
+    case REG_FIFO:
+        r = s->fifo[s->regs[REG_FIFO_ADDR_PTR]++];
+        break;
+    case REG_RSSI_VALUE:
+        r = (s->rx_in_flight ? SX127X_PKT_RSSI_DBM : SX127X_NOISE_RSSI_DBM) + SX127X_RSSI_OFFSET;
+        break;
+    case REG_RSSI_WIDEBAND:
+        /* Used by drivers as a source of random numbers */
+        qemu_guest_getrandom_nofail(&r, sizeof(r));
+        break;
+    default:
+        r = s->regs[addr];
+        break;
+    }
+    return r;
+}
+
+static void sx127x_reg_write(Sx127xState *s, uint8_t addr, uint8_t value)
+{
+    switch (addr) {
+    case REG_FIFO:
+        s->fifo[s->regs[REG_FIFO_ADDR_PTR]++] = value;
+        break;
+    case REG_OP_MODE:
+        sx127x_set_mode(s, value);
+        break;
+    case REG_IRQ_FLAGS:
+        s->regs[REG_IRQ_FLAGS] &= ~value;
+        sx127x_update_dio(s);
+        break;
+    case REG_IRQ_FLAGS_MASK:
+    case REG_DIO_MAPPING_1:
+        s->regs[addr] = value;
+        sx127x_update_dio(s);
+        break;
+    case REG_FIFO_RX_CURRENT_ADDR ... REG_RSSI_VALUE:
+    case REG_FIFO_RX_BYTE_ADDR:
+    case REG_VERSION:
+        /* read-only */
+        break;
+    default:
+        s->regs[addr] = value;
+        break;
+    }
+}
+
+static uint32_t sx127x_transfer(SSISlave *ss, uint32_t val)
+{
+    Sx127xState *s = SX127X(ss);
+    uint32_t r = 0;
+
+    /* The first byte is the address and direction, the following ones are
+     * data. Burst accesses auto-increment the address, except for the FIFO.
+     */
+    if (s->addr_phase) {
+        s->spi_write = val & 0x80;
+        s->spi_addr = val & 0x7f;
+        s->addr_phase = false;
+        return 0;
+    }
+
+    if (s->spi_write) {
+        sx127x_reg_write(s, s->spi_addr, val);
+    } else {
+        r = sx127x_reg_read(s, s->spi_addr);
+    }
+    if (s->spi_addr != REG_FIFO) {
+        s->spi_addr = (s->spi_addr + 1) & 0x7f;
+    }
+    return r;
+}
+
+static int sx127x_set_cs(SSISlave *ss, bool select)
+{
+    Sx127xState *s = SX127X(ss);
+
+    s->addr_phase = true;
+    return 0;
+}
+
+static void sx127x_reset(DeviceState *dev)
+{
+    Sx127xState *s = SX127X(dev);
+
+    timer_del(&s->op_timer);
+    timer_del(&s->rx_timer);
+    memset(s->regs, 0, sizeof(s->regs));
+    for (int i = 0; i < ARRAY_SIZE(sx127x_reset_values); ++i) {
+        s->regs[sx127x_reset_values[i][0]] = sx127x_reset_values[i][1];
+    }
+    memset(s->fifo, 0, sizeof(s->fifo));
+    s->addr_phase = true;
+    s->rx_in_flight = false;
+    s->rx_have_len = false;
+    /* NSS has a pull-up */
+    SSI_SLAVE(dev)->cs = true;
+    sx127x_update_dio(s);
+}
+
+static void sx127x_reset_in(void *opaque, int n, int level)
+{
+    if (!level) {
+        sx127x_reset(DEVICE(opaque));
+    }
+}
+
+static int sx127x_be_change(void *opaque)
+{
+    Sx127xState *s = SX127X(opaque);
+
+    /* Drop a partially received frame, it belonged to the old backend */
+    if (!s->rx_in_flight) {
+        s->rx_have_len = false;
+    }
+    qemu_chr_fe_set_handlers(&s->chr, sx127x_can_receive, sx127x_receive,
+                             NULL, sx127x_be_change, s, NULL, true);
+    return 0;
+}
+
+static void sx127x_realize(SSISlave *ss, Error **errp)
+{
+    Sx127xState *s = SX127X(ss);
+    DeviceState *dev = DEVICE(ss);
+
+    qdev_init_gpio_out_named(dev, s->dio, SX127X_GPIO_DIO, SX127X_DIO_COUNT);
+    qdev_init_gpio_in_named(dev, sx127x_reset_in, SX127X_GPIO_RESET, 1);
+    timer_init_ns(&s->op_timer, QEMU_CLOCK_VIRTUAL, sx127x_op_timer_cb, s);
+    timer_init_ns(&s->rx_timer, QEMU_CLOCK_VIRTUAL, sx127x_rx_timer_cb, s);
+    qemu_chr_fe_set_handlers(&s->chr, sx127x_can_receive, sx127x_receive,
+                             NULL, sx127x_be_change, s, NULL, true);
+}
+
+static const VMStateDescription vmstate_sx127x = {
+    .name = TYPE_SX127X,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_SSI_SLAVE(parent_obj, Sx127xState),
+        VMSTATE_TIMER(op_timer, Sx127xState),
+        VMSTATE_TIMER(rx_timer, Sx127xState),
+        VMSTATE_UINT8_ARRAY(regs, Sx127xState, SX127X_REG_COUNT),
+        VMSTATE_UINT8_ARRAY(fifo, Sx127xState, SX127X_FIFO_SIZE),
+        VMSTATE_BOOL(addr_phase, Sx127xState),
+        VMSTATE_BOOL(spi_write, Sx127xState),
+        VMSTATE_UINT8(spi_addr, Sx127xState),
+        VMSTATE_UINT8_ARRAY(tx_buf, Sx127xState, SX127X_FIFO_SIZE),
+        VMSTATE_UINT32(tx_len, Sx127xState),
+        VMSTATE_UINT8_ARRAY(rx_buf, Sx127xState, SX127X_FIFO_SIZE),
+        VMSTATE_UINT32(rx_len, Sx127xState),
+        VMSTATE_UINT32(rx_got, Sx127xState),
+        VMSTATE_BOOL(rx_have_len, Sx127xState),
+        VMSTATE_BOOL(rx_in_flight, Sx127xState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property sx127x_properties[] = {
+    DEFINE_PROP_CHR("chardev", Sx127xState, chr),
+    DEFINE_PROP_BOOL("model-airtime", Sx127xState, model_airtime, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void sx127x_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SSISlaveClass *k = SSI_SLAVE_CLASS(klass);
+
+    k->realize = sx127x_realize;
+    k->transfer = sx127x_transfer;
+    k->set_cs = sx127x_set_cs;
+    k->cs_polarity = SSI_CS_LOW;
+    dc->reset = sx127x_reset;
+    dc->vmsd = &vmstate_sx127x;
+    device_class_set_props(dc, sx127x_properties);
+}
+
+static const TypeInfo sx127x_info = {
+    .name          = TYPE_SX127X,
+    .parent        = TYPE_SSI_SLAVE,
+    .instance_size = sizeof(Sx127xState),
+    .class_init    = sx127x_class_init,
+};
+
+static void sx127x_register_types(void)
+{
+    type_register_static(&sx127x_info);
+}
+
+type_init(sx127x_register_types)
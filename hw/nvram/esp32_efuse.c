@@ -20,6 +20,7 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/nvram/esp32_efuse.h"
+#include "migration/vmstate.h"
 
 static void esp32_efuse_read_op(Esp32EfuseState *s);
 static void esp32_efuse_program_op(Esp32EfuseState *s);
@@ -266,6 +267,41 @@ static void esp32_efuse_init(Object *obj)
     memset(&s->efuse_wr, 0, sizeof(s->efuse_wr));
 }
 
+static const VMStateDescription vmstate_esp32_efuse_regs = {
+    .name = "esp32_efuse_regs",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(blk0, Esp32EfuseRegs, 7),
+        VMSTATE_UINT32_ARRAY(blk1, Esp32EfuseRegs, 8),
+        VMSTATE_UINT32_ARRAY(blk2, Esp32EfuseRegs, 8),
+        VMSTATE_UINT32_ARRAY(blk3, Esp32EfuseRegs, 8),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_efuse = {
+    .name = TYPE_ESP32_EFUSE,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(efuse_wr, Esp32EfuseState, 1, vmstate_esp32_efuse_regs, Esp32EfuseRegs),
+        VMSTATE_STRUCT(efuse_wr_dis, Esp32EfuseState, 1, vmstate_esp32_efuse_regs, Esp32EfuseRegs),
+        VMSTATE_STRUCT(efuse_rd, Esp32EfuseState, 1, vmstate_esp32_efuse_regs, Esp32EfuseRegs),
+        VMSTATE_STRUCT(efuse_rd_dis, Esp32EfuseState, 1, vmstate_esp32_efuse_regs, Esp32EfuseRegs),
+        VMSTATE_UINT32(clk_reg, Esp32EfuseState),
+        VMSTATE_UINT32(conf_reg, Esp32EfuseState),
+        VMSTATE_UINT32(status_reg, Esp32EfuseState),
+        VMSTATE_UINT32(cmd_reg, Esp32EfuseState),
+        VMSTATE_UINT32(int_raw_reg, Esp32EfuseState),
+        VMSTATE_UINT32(int_st_reg, Esp32EfuseState),
+        VMSTATE_UINT32(int_ena_reg, Esp32EfuseState),
+        VMSTATE_UINT32(dac_conf_reg, Esp32EfuseState),
+        VMSTATE_TIMER(op_timer, Esp32EfuseState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_efuse_properties[] = {
     DEFINE_PROP_DRIVE("drive", Esp32EfuseState, blk),
     DEFINE_PROP_END_OF_LIST(),
@@ -277,6 +313,7 @@ static void esp32_efuse_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_efuse_reset;
     dc->realize = esp32_efuse_realize;
+    dc->vmsd = &vmstate_esp32_efuse;
     device_class_set_props(dc, esp32_efuse_properties);
 }
 
@@ -11,7 +11,11 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/dma.h"
+#include "exec/address-spaces.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
 #include "hw/registerfields.h"
@@ -19,6 +23,8 @@
 #include "hw/qdev-properties.h"
 #include "hw/ssi/ssi.h"
 #include "hw/ssi/esp32_spi.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
 
 
@@ -27,8 +33,11 @@ enum {
     CMD_DP = 0xb9,
     CMD_CE = 0x60,
     CMD_BE = 0xD8,
+    CMD_BE32K = 0x52,
     CMD_SE = 0x20,
     CMD_PP = 0x02,
+    CMD_QPP = 0x32,
+    CMD_CE_ALT = 0xc7,
     CMD_WRSR = 0x1,
     CMD_RDSR = 0x5,
     CMD_RDID = 0x9f,
@@ -42,11 +51,21 @@ enum {
 
 static void esp32_spi_do_command(Esp32SpiState* state, uint32_t cmd_reg);
 
+static void esp32_spi_update_irq(Esp32SpiState *s)
+{
+    qemu_set_irq(s->irq, FIELD_EX32(s->slave_reg, SPI_SLAVE, TRANS_DONE) &&
+                         FIELD_EX32(s->slave_reg, SPI_SLAVE, TRANS_INTEN));
+    qemu_set_irq(s->dma_irq, (s->dma_int_raw & s->dma_int_ena) != 0);
+}
+
 static uint64_t esp32_spi_read(void *opaque, hwaddr addr, unsigned int size)
 {
     Esp32SpiState *s = ESP32_SPI(opaque);
     uint64_t r = 0;
     switch (addr) {
+    case A_SPI_CMD:
+        r = s->usr_busy ? R_SPI_CMD_USR_MASK : 0;
+        break;
     case A_SPI_ADDR:
         r = s->addr_reg;
         break;
@@ -77,15 +96,45 @@ static uint64_t esp32_spi_read(void *opaque, hwaddr addr, unsigned int size)
     case A_SPI_MISO_DLEN:
         r = s->miso_dlen_reg;
         break;
+    case A_SPI_CLOCK:
+        r = s->clock_reg;
+        break;
     case A_SPI_PIN:
         r = s->pin_reg;
         break;
+    case A_SPI_SLAVE:
+        r = s->slave_reg;
+        break;
     case A_SPI_W0 ... A_SPI_W0 + (ESP32_SPI_BUF_WORDS - 1) * sizeof(uint32_t):
         r = s->data_reg[(addr - A_SPI_W0) / sizeof(uint32_t)];
         break;
     case A_SPI_EXT2:
         r = 0;
         break;
+    case A_SPI_DMA_CONF:
+        r = s->dma_conf_reg;
+        break;
+    case A_SPI_DMA_OUT_LINK:
+        r = s->dma_out_link_reg;
+        break;
+    case A_SPI_DMA_IN_LINK:
+        r = s->dma_in_link_reg;
+        break;
+    case A_SPI_DMA_INT_ENA:
+        r = s->dma_int_ena;
+        break;
+    case A_SPI_DMA_INT_RAW:
+        r = s->dma_int_raw;
+        break;
+    case A_SPI_DMA_INT_ST:
+        r = s->dma_int_raw & s->dma_int_ena;
+        break;
+    case A_SPI_IN_SUC_EOF_DES_ADDR:
+        r = s->dma_in_suc_eof_des_addr;
+        break;
+    case A_SPI_OUT_EOF_DES_ADDR:
+        r = s->dma_out_eof_des_addr;
+        break;
     }
     return r;
 }
@@ -128,12 +177,59 @@ static void esp32_spi_write(void *opaque, hwaddr addr,
     case A_SPI_MISO_DLEN:
         s->miso_dlen_reg = value;
         break;
+    case A_SPI_CLOCK:
+        s->clock_reg = value;
+        break;
     case A_SPI_PIN:
         s->pin_reg = value;
         break;
+    case A_SPI_SLAVE:
+        s->slave_reg = value;
+        esp32_spi_update_irq(s);
+        break;
     case A_SPI_CMD:
+        if (s->usr_busy) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: command 0x%08x while a transaction is in progress\n",
+                          __func__, (uint32_t) value);
+            break;
+        }
         esp32_spi_do_command(s, value);
         break;
+    case A_SPI_DMA_CONF:
+        if (value & R_SPI_DMA_CONF_OUT_RST_MASK) {
+            s->dma_out_active = false;
+        }
+        if (value & R_SPI_DMA_CONF_IN_RST_MASK) {
+            s->dma_in_active = false;
+        }
+        s->dma_conf_reg = value;
+        break;
+    case A_SPI_DMA_OUT_LINK:
+        s->dma_out_link_reg = value & R_SPI_DMA_OUT_LINK_ADDR_MASK;
+        if (value & (R_SPI_DMA_OUT_LINK_START_MASK | R_SPI_DMA_OUT_LINK_RESTART_MASK)) {
+            s->dma_out_active = true;
+        }
+        if (value & R_SPI_DMA_OUT_LINK_STOP_MASK) {
+            s->dma_out_active = false;
+        }
+        break;
+    case A_SPI_DMA_IN_LINK:
+        s->dma_in_link_reg = value & R_SPI_DMA_IN_LINK_ADDR_MASK;
+        if (value & (R_SPI_DMA_IN_LINK_START_MASK | R_SPI_DMA_IN_LINK_RESTART_MASK)) {
+            s->dma_in_active = true;
+        }
+        if (value & R_SPI_DMA_IN_LINK_STOP_MASK) {
+            s->dma_in_active = false;
+        }
+        break;
+    case A_SPI_DMA_INT_ENA:
+        s->dma_int_ena = value;
+        esp32_spi_update_irq(s);
+        break;
+    case A_SPI_DMA_INT_CLR:
+        s->dma_int_raw &= ~value;
+        esp32_spi_update_irq(s);
+        break;
     }
 }
 
@@ -149,17 +245,19 @@ typedef struct Esp32SpiTransaction {
 
 static void esp32_spi_txrx_buffer(Esp32SpiState *s, void *buf, int tx_bytes, int rx_bytes)
 {
-    int bytes = MAX(tx_bytes, rx_bytes);
     uint8_t *c_buf = (uint8_t*) buf;
-    for (int i = 0; i < bytes; ++i) {
-        uint8_t byte = 0;
-        if (byte < tx_bytes) {
-            memcpy(&byte, c_buf + i, 1);
-        }
-        uint32_t res = ssi_transfer(s->spi, byte);
-        if (byte < rx_bytes) {
-            memcpy(c_buf + i, &res, 1);
-        }
+    int both = MIN(tx_bytes, rx_bytes);
+
+    /* Full duplex part first, then whichever direction is longer.
+     * Bytes past tx_bytes are sent as zeroes, bytes past rx_bytes are discarded.
+     */
+    if (both > 0) {
+        ssi_transfer_bulk(s->spi, c_buf, c_buf, both);
+    }
+    if (tx_bytes > both) {
+        ssi_transfer_bulk(s->spi, c_buf + both, NULL, tx_bytes - both);
+    } else if (rx_bytes > both) {
+        ssi_transfer_bulk(s->spi, NULL, c_buf + both, rx_bytes - both);
     }
 }
 
@@ -179,6 +277,146 @@ static void esp32_spi_transaction(Esp32SpiState *s, Esp32SpiTransaction *t)
     esp32_spi_cs_set(s, 1);
 }
 
+static void esp32_spi_flash_written(Esp32SpiState *s, uint32_t addr, uint32_t len)
+{
+    s->flash_write_addr = addr;
+    s->flash_write_len = len;
+    qemu_irq_pulse(s->flash_write_req);
+}
+
+/* Let the cache know which part of the flash may have changed,
+ * for the commands software uses to program and erase it.
+ */
+static void esp32_spi_flash_write_check(Esp32SpiState *s, Esp32SpiTransaction *t, uint32_t addr)
+{
+    if (t->cmd_bytes != 1) {
+        return;
+    }
+    switch (t->cmd) {
+    case CMD_PP:
+    case CMD_QPP:
+        esp32_spi_flash_written(s, addr, t->data_tx_bytes);
+        break;
+    case CMD_SE:
+        esp32_spi_flash_written(s, addr & ~0xfff, 0x1000);
+        break;
+    case CMD_BE32K:
+        esp32_spi_flash_written(s, addr & ~0x7fff, 0x8000);
+        break;
+    case CMD_BE:
+        esp32_spi_flash_written(s, addr & ~0xffff, 0x10000);
+        break;
+    case CMD_CE:
+    case CMD_CE_ALT:
+        esp32_spi_flash_written(s, 0, UINT32_MAX);
+        break;
+    }
+}
+
+/* Gather outgoing data from the DMA out link, starting at SPI_DMA_OUT_LINK */
+static void esp32_spi_dma_out(Esp32SpiState *s, uint8_t *buf, uint32_t len)
+{
+    dma_addr_t desc_addr = ESP32_SPI_DMA_ADDR_BASE + FIELD_EX32(s->dma_out_link_reg, SPI_DMA_OUT_LINK, ADDR);
+    uint32_t done = 0;
+
+    for (int n = 0; n < ESP32_SPI_DMA_MAX_DESC; ++n) {
+        uint32_t desc[3];
+        if (dma_memory_read(&address_space_memory, desc_addr, desc, sizeof(desc)) != MEMTX_OK ||
+            !FIELD_EX32(le32_to_cpu(desc[0]), SPI_DMA_DESC, OWNER)) {
+            s->dma_int_pending |= R_SPI_DMA_INT_OUTLINK_DSCR_ERROR_MASK;
+            break;
+        }
+        uint32_t word0 = le32_to_cpu(desc[0]);
+        uint32_t chunk = MIN(FIELD_EX32(word0, SPI_DMA_DESC, LENGTH), len - done);
+        dma_memory_read(&address_space_memory, le32_to_cpu(desc[1]), buf + done, chunk);
+        trace_esp32_spi_dma("out", desc_addr, chunk);
+        done += chunk;
+        s->dma_int_pending |= R_SPI_DMA_INT_OUT_DONE_MASK;
+
+        if (FIELD_EX32(s->dma_conf_reg, SPI_DMA_CONF, OUT_AUTO_WRBACK)) {
+            desc[0] = cpu_to_le32(FIELD_DP32(word0, SPI_DMA_DESC, OWNER, 0));
+            dma_memory_write(&address_space_memory, desc_addr, desc, sizeof(uint32_t));
+        }
+        if (FIELD_EX32(word0, SPI_DMA_DESC, EOF)) {
+            s->dma_out_eof_des_addr = desc_addr;
+            s->dma_int_pending |= R_SPI_DMA_INT_OUT_EOF_MASK | R_SPI_DMA_INT_OUT_TOTAL_EOF_MASK;
+            break;
+        }
+        desc_addr = le32_to_cpu(desc[2]);
+        if (done == len || desc_addr == 0) {
+            break;
+        }
+    }
+    s->dma_out_active = false;
+}
+
+/* Scatter received data into the DMA in link, starting at SPI_DMA_IN_LINK.
+ * The length and EOF fields of the used descriptors are updated, and their
+ * ownership is returned to the CPU.
+ */
+static void esp32_spi_dma_in(Esp32SpiState *s, const uint8_t *buf, uint32_t len)
+{
+    dma_addr_t desc_addr = ESP32_SPI_DMA_ADDR_BASE + FIELD_EX32(s->dma_in_link_reg, SPI_DMA_IN_LINK, ADDR);
+    uint32_t done = 0;
+
+    for (int n = 0; n < ESP32_SPI_DMA_MAX_DESC; ++n) {
+        uint32_t desc[3];
+        if (dma_memory_read(&address_space_memory, desc_addr, desc, sizeof(desc)) != MEMTX_OK ||
+            !FIELD_EX32(le32_to_cpu(desc[0]), SPI_DMA_DESC, OWNER)) {
+            s->dma_int_pending |= R_SPI_DMA_INT_INLINK_DSCR_ERROR_MASK;
+            break;
+        }
+        uint32_t word0 = le32_to_cpu(desc[0]);
+        uint32_t size = FIELD_EX32(word0, SPI_DMA_DESC, SIZE) ?: 4096;
+        uint32_t chunk = MIN(size, len - done);
+        dma_memory_write(&address_space_memory, le32_to_cpu(desc[1]), buf + done, chunk);
+        trace_esp32_spi_dma("in", desc_addr, chunk);
+        done += chunk;
+        s->dma_int_pending |= R_SPI_DMA_INT_IN_DONE_MASK;
+
+        word0 = FIELD_DP32(word0, SPI_DMA_DESC, LENGTH, chunk);
+        word0 = FIELD_DP32(word0, SPI_DMA_DESC, EOF, done == len);
+        word0 = FIELD_DP32(word0, SPI_DMA_DESC, OWNER, 0);
+        desc[0] = cpu_to_le32(word0);
+        dma_memory_write(&address_space_memory, desc_addr, desc, sizeof(uint32_t));
+
+        if (done == len) {
+            s->dma_in_suc_eof_des_addr = desc_addr;
+            s->dma_int_pending |= R_SPI_DMA_INT_IN_SUC_EOF_MASK;
+            break;
+        }
+        desc_addr = le32_to_cpu(desc[2]);
+        if (desc_addr == 0) {
+            s->dma_int_pending |= R_SPI_DMA_INT_INLINK_DSCR_EMPTY_MASK;
+            break;
+        }
+    }
+    s->dma_in_active = false;
+}
+
+static uint32_t esp32_spi_clk_freq(Esp32SpiState *s)
+{
+    if (FIELD_EX32(s->clock_reg, SPI_CLOCK, CLK_EQU_SYSCLK)) {
+        return s->apb_freq;
+    }
+    return s->apb_freq / ((FIELD_EX32(s->clock_reg, SPI_CLOCK, CLKDIV_PRE) + 1) *
+                          (FIELD_EX32(s->clock_reg, SPI_CLOCK, CLKCNT_N) + 1));
+}
+
+static void esp32_spi_trans_done(Esp32SpiState *s)
+{
+    s->usr_busy = false;
+    s->slave_reg = FIELD_DP32(s->slave_reg, SPI_SLAVE, TRANS_DONE, 1);
+    s->dma_int_raw |= s->dma_int_pending;
+    s->dma_int_pending = 0;
+    esp32_spi_update_irq(s);
+}
+
+static void esp32_spi_trans_done_cb(void *opaque)
+{
+    esp32_spi_trans_done(ESP32_SPI(opaque));
+}
+
 /* Convert one of the hardware "bitlen" registers to a byte count */
 static inline int bitlen_to_bytes(uint32_t val)
 {
@@ -190,6 +428,7 @@ static void esp32_spi_do_command(Esp32SpiState* s, uint32_t cmd_reg)
     Esp32SpiTransaction t = {
         .cmd_bytes = 1
     };
+    uint32_t flash_addr = s->addr_reg & 0xffffff;
     switch (cmd_reg) {
     case R_SPI_CMD_READ_MASK:
         t.cmd = CMD_READ;
@@ -270,6 +509,7 @@ static void esp32_spi_do_command(Esp32SpiState* s, uint32_t cmd_reg)
         if (FIELD_EX32(s->user_reg, SPI_USER, ADDR)) {
             t.addr_bytes = bitlen_to_bytes(FIELD_EX32(s->user1_reg, SPI_USER1, ADDR_BITLEN));
             t.addr = bswap32(s->addr_reg);
+            flash_addr = s->addr_reg >> (32 - MIN(t.addr_bytes, 4) * 8);
         }
         if (FIELD_EX32(s->user_reg, SPI_USER, MOSI)) {
             t.data = &s->data_reg[0];
@@ -283,7 +523,58 @@ static void esp32_spi_do_command(Esp32SpiState* s, uint32_t cmd_reg)
     default:
         return;
     }
+
+    if (cmd_reg != R_SPI_CMD_USR_MASK) {
+        esp32_spi_transaction(s, &t);
+        esp32_spi_flash_write_check(s, &t, flash_addr);
+        esp32_spi_trans_done(s);
+        return;
+    }
+
+    /* USR commands may move data through DMA, in which case the lengths are
+     * only limited by the DLEN registers. Otherwise the W0-W15 buffer is used.
+     */
+    g_autofree uint8_t *dma_buf = NULL;
+    if (s->dma_out_active || s->dma_in_active) {
+        uint32_t len = MAX(t.data_tx_bytes, t.data_rx_bytes);
+        dma_buf = g_malloc0(len);
+        if (s->dma_out_active && t.data_tx_bytes) {
+            esp32_spi_dma_out(s, dma_buf, t.data_tx_bytes);
+        } else {
+            memcpy(dma_buf, s->data_reg, MIN(t.data_tx_bytes, sizeof(s->data_reg)));
+        }
+        t.data = (uint32_t *) dma_buf;
+    } else {
+        t.data_tx_bytes = MIN(t.data_tx_bytes, sizeof(s->data_reg));
+        t.data_rx_bytes = MIN(t.data_rx_bytes, sizeof(s->data_reg));
+    }
+
     esp32_spi_transaction(s, &t);
+    esp32_spi_flash_write_check(s, &t, flash_addr);
+
+    if (dma_buf) {
+        if (s->dma_in_active && t.data_rx_bytes) {
+            esp32_spi_dma_in(s, dma_buf, t.data_rx_bytes);
+        } else {
+            memcpy(s->data_reg, dma_buf, MIN(t.data_rx_bytes, sizeof(s->data_reg)));
+        }
+    }
+
+    /* The data has been exchanged with the slave already; the transaction
+     * is reported complete after the time it takes on the bus.
+     */
+    uint64_t bits = 8 * (t.cmd_bytes + t.addr_bytes + MAX(t.data_tx_bytes, t.data_rx_bytes));
+    if (FIELD_EX32(s->user_reg, SPI_USER, DUMMY)) {
+        bits += FIELD_EX32(s->user1_reg, SPI_USER1, DUMMY_CYCLELEN) + 1;
+    }
+    uint32_t clk_freq = esp32_spi_clk_freq(s);
+    if (clk_freq == 0) {
+        esp32_spi_trans_done(s);
+        return;
+    }
+    s->usr_busy = true;
+    timer_mod(&s->trans_done_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              muldiv64(bits, NANOSECONDS_PER_SECOND, clk_freq));
 }
 
 
@@ -300,6 +591,29 @@ static void esp32_spi_reset(DeviceState *dev)
     s->user1_reg = FIELD_DP32(0, SPI_USER1, ADDR_BITLEN, 23);
     s->user1_reg = FIELD_DP32(s->user1_reg, SPI_USER1, DUMMY_CYCLELEN, 7);
     s->status_reg = 0;
+    s->clock_reg = 0;
+    s->slave_reg = 0;
+    s->usr_busy = false;
+    timer_del(&s->trans_done_timer);
+    s->dma_conf_reg = 0;
+    s->dma_out_link_reg = 0;
+    s->dma_in_link_reg = 0;
+    s->dma_int_ena = 0;
+    s->dma_int_raw = 0;
+    s->dma_int_pending = 0;
+    s->dma_in_suc_eof_des_addr = 0;
+    s->dma_out_eof_des_addr = 0;
+    s->dma_out_active = false;
+    s->dma_in_active = false;
+    esp32_spi_update_irq(s);
+}
+
+static void esp32_spi_set_apb_freq(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    Esp32SpiState *s = ESP32_SPI(opaque);
+    visit_type_uint32(v, name, &s->apb_freq, errp);
 }
 
 static void esp32_spi_realize(DeviceState *dev, Error **errp)
@@ -315,11 +629,56 @@ static void esp32_spi_init(Object *obj)
                           TYPE_ESP32_SPI, ESP32_SPI_REG_SIZE);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
+    sysbus_init_irq(sbd, &s->dma_irq);
+
+    object_property_add(obj, "apb_freq", "uint32",
+                        NULL,
+                        esp32_spi_set_apb_freq,
+                        NULL,
+                        obj, &error_abort);
+    s->apb_freq = 80000000;
+    timer_init_ns(&s->trans_done_timer, QEMU_CLOCK_VIRTUAL, esp32_spi_trans_done_cb, s);
 
     s->spi = ssi_create_bus(DEVICE(s), "spi");
     qdev_init_gpio_out_named(DEVICE(s), &s->cs_gpio[0], SSI_GPIO_CS, ESP32_SPI_CS_COUNT);
+    qdev_init_gpio_out_named(DEVICE(s), &s->flash_write_req, ESP32_SPI_FLASH_WRITE_GPIO, 1);
 }
 
+static const VMStateDescription vmstate_esp32_spi = {
+    .name = TYPE_ESP32_SPI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(addr_reg, Esp32SpiState),
+        VMSTATE_UINT32(ctrl_reg, Esp32SpiState),
+        VMSTATE_UINT32(status_reg, Esp32SpiState),
+        VMSTATE_UINT32(ctrl1_reg, Esp32SpiState),
+        VMSTATE_UINT32(ctrl2_reg, Esp32SpiState),
+        VMSTATE_UINT32(user_reg, Esp32SpiState),
+        VMSTATE_UINT32(user1_reg, Esp32SpiState),
+        VMSTATE_UINT32(user2_reg, Esp32SpiState),
+        VMSTATE_UINT32(mosi_dlen_reg, Esp32SpiState),
+        VMSTATE_UINT32(miso_dlen_reg, Esp32SpiState),
+        VMSTATE_UINT32(pin_reg, Esp32SpiState),
+        VMSTATE_UINT32_ARRAY(data_reg, Esp32SpiState, ESP32_SPI_BUF_WORDS),
+        VMSTATE_UINT32(clock_reg, Esp32SpiState),
+        VMSTATE_UINT32(slave_reg, Esp32SpiState),
+        VMSTATE_BOOL(usr_busy, Esp32SpiState),
+        VMSTATE_TIMER(trans_done_timer, Esp32SpiState),
+        VMSTATE_UINT32(dma_conf_reg, Esp32SpiState),
+        VMSTATE_UINT32(dma_out_link_reg, Esp32SpiState),
+        VMSTATE_UINT32(dma_in_link_reg, Esp32SpiState),
+        VMSTATE_UINT32(dma_int_ena, Esp32SpiState),
+        VMSTATE_UINT32(dma_int_raw, Esp32SpiState),
+        VMSTATE_UINT32(dma_int_pending, Esp32SpiState),
+        VMSTATE_UINT32(dma_in_suc_eof_des_addr, Esp32SpiState),
+        VMSTATE_UINT32(dma_out_eof_des_addr, Esp32SpiState),
+        VMSTATE_BOOL(dma_out_active, Esp32SpiState),
+        VMSTATE_BOOL(dma_in_active, Esp32SpiState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_spi_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -330,6 +689,7 @@ static void esp32_spi_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_spi_reset;
     dc->realize = esp32_spi_realize;
+    dc->vmsd = &vmstate_esp32_spi;
     device_class_set_props(dc, esp32_spi_properties);
 }
 
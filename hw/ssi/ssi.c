@@ -44,13 +44,18 @@ static void ssi_cs_default(void *opaque, int n, int level)
     s->cs = cs;
 }
 
+static bool ssi_slave_selected(SSISlave *dev, SSISlaveClass *ssc)
+{
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSISlave *dev, uint32_t val)
 {
     SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-            (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-            ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_slave_selected(dev, ssc)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -125,6 +130,59 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+/* Bulk transfers can only bypass ssi_transfer when a single slave is
+ * listening and it relies on the default chip select handling. Otherwise
+ * every slave has to see every byte.
+ */
+static SSISlave *ssi_bulk_target(SSIBus *bus)
+{
+    BusState *b = BUS(bus);
+    BusChild *kid;
+    SSISlave *target = NULL;
+
+    QTAILQ_FOREACH(kid, &b->children, sibling) {
+        SSISlave *slave = SSI_SLAVE(kid->child);
+        SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(slave);
+
+        if (ssc->transfer_raw != ssi_transfer_raw_default) {
+            return NULL;
+        }
+        if (!ssi_slave_selected(slave, ssc)) {
+            continue;
+        }
+        if (target) {
+            return NULL;
+        }
+        target = slave;
+    }
+
+    if (target && !SSI_SLAVE_GET_CLASS(target)->transfer_bulk) {
+        return NULL;
+    }
+    return target;
+}
+
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       uint32_t len)
+{
+    SSISlave *target = ssi_bulk_target(bus);
+    uint32_t i = 0;
+
+    if (target) {
+        SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(target);
+
+        i = ssc->transfer_bulk(target, tx, rx, len);
+        assert(i <= len);
+    }
+
+    for (; i < len; ++i) {
+        uint32_t r = ssi_transfer(bus, tx ? tx[i] : 0);
+        if (rx) {
+            rx[i] = r;
+        }
+    }
+}
+
 const VMStateDescription vmstate_ssi_slave = {
     .name = "SSISlave",
     .version_id = 1,
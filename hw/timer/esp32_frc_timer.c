@@ -20,6 +20,7 @@
 #include "hw/qdev-properties.h"
 #include "hw/boards.h"
 #include "hw/timer/esp32_frc_timer.h"
+#include "migration/vmstate.h"
 #include "trace.h"
 
 static uint64_t esp32_frc_timer_get_count(Esp32FrcTimerState *s, uint64_t ns_now)
@@ -216,6 +217,26 @@ static void esp32_frc_timer_init(Object *obj)
     s->has_alarm = true;
 }
 
+static const VMStateDescription vmstate_esp32_frc_timer = {
+    .name = TYPE_ESP32_FRC_TIMER,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(apb_freq, Esp32FrcTimerState),
+        VMSTATE_UINT32(count_base, Esp32FrcTimerState),
+        VMSTATE_UINT64(ns_base, Esp32FrcTimerState),
+        VMSTATE_BOOL(level_int_status, Esp32FrcTimerState),
+        VMSTATE_UINT32(load_reg, Esp32FrcTimerState),
+        VMSTATE_BOOL(enable, Esp32FrcTimerState),
+        VMSTATE_BOOL(autoload, Esp32FrcTimerState),
+        VMSTATE_UINT32(prescaler, Esp32FrcTimerState),
+        VMSTATE_BOOL(level_int, Esp32FrcTimerState),
+        VMSTATE_UINT32(alarm_reg, Esp32FrcTimerState),
+        VMSTATE_TIMER(alarm_timer, Esp32FrcTimerState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_frc_timer_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -226,6 +247,7 @@ static void esp32_frc_timer_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_frc_timer_reset;
     dc->realize = esp32_frc_timer_realize;
+    dc->vmsd = &vmstate_esp32_frc_timer;
     device_class_set_props(dc, esp32_frc_timer_properties);
 }
 
@@ -20,6 +20,7 @@
 #include "hw/registerfields.h"
 #include "hw/boards.h"
 #include "hw/timer/esp32_timg.h"
+#include "migration/vmstate.h"
 
 
 #define TIMG_REGFILE_SIZE 0x100
@@ -429,12 +430,8 @@ static uint32_t esp32_timg_timer_div_from_reg(uint32_t reg_val)
     return reg_val;
 }
 
-static void esp32_timg_timer_update_config(Esp32TimgTimerState *ts)
+static void esp32_timg_timer_decode_config(Esp32TimgTimerState *ts)
 {
-    uint64_t ns_now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    ts->count_base = esp32_timg_timer_get_count(ts, ns_now);
-    ts->ns_base = ns_now;
-
     ts->en = FIELD_EX32(ts->config_reg, TIMG_T0CONFIG, EN);
     ts->inc = FIELD_EX32(ts->config_reg, TIMG_T0CONFIG, INCREASE);
     ts->autoreload = FIELD_EX32(ts->config_reg, TIMG_T0CONFIG, AUTORELOAD);
@@ -442,6 +439,15 @@ static void esp32_timg_timer_update_config(Esp32TimgTimerState *ts)
     ts->edge_int_en = FIELD_EX32(ts->config_reg, TIMG_T0CONFIG, EDGE_INT);
     ts->level_int_en = FIELD_EX32(ts->config_reg, TIMG_T0CONFIG, LEVEL_INT);
     ts->alarm = FIELD_EX32(ts->config_reg, TIMG_T0CONFIG, ALARM);
+}
+
+static void esp32_timg_timer_update_config(Esp32TimgTimerState *ts)
+{
+    uint64_t ns_now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    ts->count_base = esp32_timg_timer_get_count(ts, ns_now);
+    ts->ns_base = ns_now;
+
+    esp32_timg_timer_decode_config(ts);
 
     TIMG_DEBUG_LOG("%s: TG%d base=0x%llx ns=0x%llx en=%d inc=%d autoreload=%d div=%d li=%d ei=%d alarm=%d\n", __func__, ts->parent->id,
              ts->count_base, ts->ns_base, ts->en, ts->inc, ts->autoreload, ts->divider,
@@ -502,15 +508,8 @@ static uint64_t esp32_timg_wdt_get_count(Esp32TimgWdtState *ws, uint64_t ns_now)
     return count;
 }
 
-static void esp32_timg_wdt_update_config(Esp32TimgWdtState *ws)
+static void esp32_timg_wdt_decode_config(Esp32TimgWdtState *ws)
 {
-    Esp32TimgState *s = ws->parent;
-
-    uint64_t ns_now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    ws->count_base = esp32_timg_wdt_get_count(ws, ns_now);
-    ws->ns_base = ns_now;
-
-    bool old_en = ws->en;
     ws->en = FIELD_EX32(ws->config0_reg, TIMG_WDTCONFIG0, EN);
     ws->mode[0] = FIELD_EX32(ws->config0_reg, TIMG_WDTCONFIG0, STG0);
     ws->mode[1] = FIELD_EX32(ws->config0_reg, TIMG_WDTCONFIG0, STG1);
@@ -521,6 +520,18 @@ static void esp32_timg_wdt_update_config(Esp32TimgWdtState *ws)
     ws->flashboot_en = FIELD_EX32(ws->config0_reg, TIMG_WDTCONFIG0, FLASHBOOT_MODE_EN);
 
     ws->prescale = FIELD_EX32(ws->config1_reg, TIMG_WDTCONFIG1, PRESCALE);
+}
+
+static void esp32_timg_wdt_update_config(Esp32TimgWdtState *ws)
+{
+    Esp32TimgState *s = ws->parent;
+
+    uint64_t ns_now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    ws->count_base = esp32_timg_wdt_get_count(ws, ns_now);
+    ws->ns_base = ns_now;
+
+    bool old_en = ws->en;
+    esp32_timg_wdt_decode_config(ws);
 
     if (ws->en && !old_en) {
         ws->cur_stage = 0;
@@ -634,6 +645,75 @@ static void esp32_timg_init(Object *obj)
     qdev_init_gpio_out_named(DEVICE(sbd), &s->wdt_sys_reset_req, ESP32_TIMG_WDT_SYS_RESET_GPIO, 1);
 }
 
+/* Timer and WDT fields derived from the config registers are not migrated,
+ * they are decoded again after loading. Running QEMUTimers keep their
+ * deadlines, so alarms and WDT stages continue where they were saved.
+ */
+static int esp32_timg_post_load(void *opaque, int version_id)
+{
+    Esp32TimgState *s = ESP32_TIMG(opaque);
+
+    esp32_timg_timer_decode_config(&s->t0);
+    esp32_timg_timer_decode_config(&s->t1);
+    esp32_timg_timer_decode_config(&s->lact);
+    esp32_timg_wdt_decode_config(&s->wdt);
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_timg_timer = {
+    .name = "esp32_timg_timer",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config_reg, Esp32TimgTimerState),
+        VMSTATE_UINT64(alarm_val, Esp32TimgTimerState),
+        VMSTATE_UINT64(load_val, Esp32TimgTimerState),
+        VMSTATE_UINT64(count_base, Esp32TimgTimerState),
+        VMSTATE_UINT64(last_val, Esp32TimgTimerState),
+        VMSTATE_UINT64(ns_base, Esp32TimgTimerState),
+        VMSTATE_TIMER(alarm_timer, Esp32TimgTimerState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_timg_wdt = {
+    .name = "esp32_timg_wdt",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config0_reg, Esp32TimgWdtState),
+        VMSTATE_UINT32(config1_reg, Esp32TimgWdtState),
+        VMSTATE_INT32_ARRAY(timeout, Esp32TimgWdtState, ESP32_TIMG_WDT_STAGE_COUNT),
+        VMSTATE_UINT32(count_base, Esp32TimgWdtState),
+        VMSTATE_UINT64(ns_base, Esp32TimgWdtState),
+        VMSTATE_INT32(cur_stage, Esp32TimgWdtState),
+        VMSTATE_UINT32(protect_reg, Esp32TimgWdtState),
+        VMSTATE_TIMER(stage_timer, Esp32TimgWdtState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_esp32_timg = {
+    .name = TYPE_ESP32_TIMG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = esp32_timg_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(t0, Esp32TimgState, 1, vmstate_esp32_timg_timer, Esp32TimgTimerState),
+        VMSTATE_STRUCT(t1, Esp32TimgState, 1, vmstate_esp32_timg_timer, Esp32TimgTimerState),
+        VMSTATE_STRUCT(lact, Esp32TimgState, 1, vmstate_esp32_timg_timer, Esp32TimgTimerState),
+        VMSTATE_STRUCT(wdt, Esp32TimgState, 1, vmstate_esp32_timg_wdt, Esp32TimgWdtState),
+        VMSTATE_UINT32(int_ena, Esp32TimgState),
+        VMSTATE_UINT32(int_raw, Esp32TimgState),
+        VMSTATE_UINT32(apb_freq_hz, Esp32TimgState),
+        VMSTATE_BOOL(rtc_cal_start, Esp32TimgState),
+        VMSTATE_BOOL(rtc_cal_ready, Esp32TimgState),
+        VMSTATE_UINT32(rtc_cal_max, Esp32TimgState),
+        VMSTATE_UINT32(rtc_cal_value, Esp32TimgState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_timg_properties[] = {
     DEFINE_PROP_BOOL("wdt_disable", Esp32TimgState, wdt_disable, false),
     DEFINE_PROP_END_OF_LIST(),
@@ -645,6 +725,7 @@ static void esp32_timg_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_timg_reset;
     dc->realize = esp32_timg_realize;
+    dc->vmsd = &vmstate_esp32_timg;
     device_class_set_props(dc, esp32_timg_properties);
 }
 
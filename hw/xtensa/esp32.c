@@ -11,6 +11,7 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/error-report.h"
+#include "qemu/option.h"
 #include "qapi/error.h"
 #include "qemu-common.h"
 #include "hw/hw.h"
@@ -25,21 +26,27 @@
 #include "hw/misc/esp32_rtc_cntl.h"
 #include "hw/misc/esp32_rng.h"
 #include "hw/misc/esp32_sha.h"
+#include "hw/misc/esp32_aes.h"
+#include "hw/misc/esp32_rsa.h"
 #include "hw/timer/esp32_frc_timer.h"
 #include "hw/timer/esp32_timg.h"
 #include "hw/ssi/esp32_spi.h"
 #include "hw/i2c/esp32_i2c.h"
 #include "hw/nvram/esp32_efuse.h"
+#include "hw/misc/sx127x.h"
 #include "hw/xtensa/xtensa_memory.h"
+#include "hw/xtensa/esp32_rom_hooks.h"
 #include "hw/misc/unimp.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
 #include "sysemu/reset.h"
 #include "sysemu/runstate.h"
 #include "sysemu/blockdev.h"
 #include "sysemu/block-backend.h"
 #include "exec/exec-all.h"
+#include "migration/vmstate.h"
 #include "net/net.h"
 #include "elf.h"
 
@@ -48,6 +55,9 @@
 
 #define TYPE_ESP32_CPU XTENSA_CPU_TYPE_NAME("esp32")
 
+#define TYPE_ESP32_MACHINE MACHINE_TYPE_NAME("esp32")
+#define ESP32_MACHINE(obj) OBJECT_CHECK(Esp32MachineState, (obj), TYPE_ESP32_MACHINE)
+
 typedef struct XtensaCPU XtensaCPU;
 
 
@@ -103,6 +113,8 @@ typedef struct Esp32SocState {
     Esp32SpiState spi[ESP32_SPI_COUNT];
     Esp32I2CState i2c[ESP32_I2C_COUNT];
     Esp32ShaState sha;
+    Esp32AesState aes;
+    Esp32RsaState rsa;
     Esp32EfuseState efuse;
     DeviceState *eth;
 
@@ -111,6 +123,30 @@ typedef struct Esp32SocState {
     uint32_t requested_reset;
 } Esp32SocState;
 
+typedef enum Esp32FlashMmapMode {
+    ESP32_FLASH_MMAP_OFF,
+    ESP32_FLASH_MMAP_PRIVATE,
+    ESP32_FLASH_MMAP_SHARED,
+    ESP32_FLASH_MMAP_MAX
+} Esp32FlashMmapMode;
+
+static const char *const esp32_flash_mmap_mode_names[ESP32_FLASH_MMAP_MAX] = {
+    [ESP32_FLASH_MMAP_OFF] = "off",
+    [ESP32_FLASH_MMAP_PRIVATE] = "private",
+    [ESP32_FLASH_MMAP_SHARED] = "shared",
+};
+
+typedef struct Esp32MachineState {
+    MachineState parent_obj;
+
+    bool lazy_cache_fill;
+    Esp32FlashMmapMode flash_mmap;
+    bool lora;
+    bool idle_warp;
+    bool busy_wait_warp;
+    bool rom_hooks;
+} Esp32MachineState;
+
 
 static void esp32_dig_reset(void *opaque, int n, int level)
 {
@@ -189,6 +225,8 @@ static void esp32_soc_reset(DeviceState *dev)
     if (s->requested_reset & ESP32_SOC_RESET_PERIPH) {
         device_cold_reset(DEVICE(&s->dport));
         device_cold_reset(DEVICE(&s->sha));
+        device_cold_reset(DEVICE(&s->aes));
+        device_cold_reset(DEVICE(&s->rsa));
         device_cold_reset(DEVICE(&s->gpio));
         for (int i = 0; i < ESP32_UART_COUNT; ++i) {
             device_cold_reset(DEVICE(&s->uart));
@@ -260,7 +298,25 @@ static void esp32_clk_update(void* opaque, int n, int level)
     qdev_prop_set_int32(DEVICE(&s->frc_timer), "apb_freq", apb_clk_freq);
     qdev_prop_set_int32(DEVICE(&s->timg[0]), "apb_freq", apb_clk_freq);
     qdev_prop_set_int32(DEVICE(&s->timg[1]), "apb_freq", apb_clk_freq);
-    *(uint32_t*)(&s->cpu[0].env.config->clock_freq_khz) = cpu_clk_freq / 1000;
+    for (int i = 0; i < ESP32_UART_COUNT; ++i) {
+        qdev_prop_set_int32(DEVICE(&s->uart[i]), "apb_freq", apb_clk_freq);
+    }
+    for (int i = 0; i < ESP32_SPI_COUNT; ++i) {
+        qdev_prop_set_int32(DEVICE(&s->spi[i]), "apb_freq", apb_clk_freq);
+    }
+    for (int i = 0; i < ESP32_I2C_COUNT; ++i) {
+        qdev_prop_set_int32(DEVICE(&s->i2c[i]), "apb_freq", apb_clk_freq);
+    }
+    atomic_set((uint32_t *)&s->cpu[0].env.config->clock_freq_khz, cpu_clk_freq / 1000);
+}
+
+static void esp32_flash_write(void* opaque, int n, int level)
+{
+    Esp32SocState *s = ESP32_SOC(opaque);
+    if (!level) {
+        return;
+    }
+    esp32_dport_flash_written(&s->dport, s->spi[1].flash_write_addr, s->spi[1].flash_write_len);
 }
 
 static void esp32_soc_add_periph_device(MemoryRegion *dest, void* dev, hwaddr dport_base_addr)
@@ -366,8 +422,18 @@ static void esp32_soc_realize(DeviceState *dev, Error **errp)
     object_property_set_bool(OBJECT(&s->sha), true, "realized", &error_abort);
     esp32_soc_add_periph_device(sys_mem, &s->sha, DR_REG_SHA_BASE);
 
+    object_property_set_bool(OBJECT(&s->aes), true, "realized", &error_abort);
+    esp32_soc_add_periph_device(sys_mem, &s->aes, DR_REG_AES_BASE);
+
+    object_property_set_bool(OBJECT(&s->rsa), true, "realized", &error_abort);
+    esp32_soc_add_periph_device(sys_mem, &s->rsa, DR_REG_RSA_BASE);
+    sysbus_connect_irq(SYS_BUS_DEVICE(&s->rsa), 0,
+                       qdev_get_gpio_in(intmatrix_dev, ETS_RSA_INTR_SOURCE));
+
     object_property_set_bool(OBJECT(&s->rtc_cntl), true, "realized", &error_abort);
     esp32_soc_add_periph_device(sys_mem, &s->rtc_cntl, DR_REG_RTCCNTL_BASE);
+    sysbus_connect_irq(SYS_BUS_DEVICE(&s->rtc_cntl), 0,
+                       qdev_get_gpio_in(intmatrix_dev, ETS_RTC_CORE_INTR_SOURCE));
 
     qdev_connect_gpio_out_named(DEVICE(&s->rtc_cntl), ESP32_RTC_DIG_RESET_GPIO, 0,
                                 qdev_get_gpio_in_named(dev, ESP32_RTC_DIG_RESET_GPIO, 0));
@@ -382,6 +448,10 @@ static void esp32_soc_realize(DeviceState *dev, Error **errp)
 
     object_property_set_bool(OBJECT(&s->gpio), true, "realized", &error_abort);
     esp32_soc_add_periph_device(sys_mem, &s->gpio, DR_REG_GPIO_BASE);
+    sysbus_connect_irq(SYS_BUS_DEVICE(&s->gpio), 0,
+                       qdev_get_gpio_in(intmatrix_dev, ETS_GPIO_INTR_SOURCE));
+    sysbus_connect_irq(SYS_BUS_DEVICE(&s->gpio), 1,
+                       qdev_get_gpio_in(intmatrix_dev, ETS_GPIO_NMI_SOURCE));
 
     for (int i = 0; i < ESP32_UART_COUNT; ++i) {
         const hwaddr uart_base[] = {DR_REG_UART_BASE, DR_REG_UART1_BASE, DR_REG_UART2_BASE};
@@ -432,7 +502,15 @@ static void esp32_soc_realize(DeviceState *dev, Error **errp)
 
         sysbus_connect_irq(SYS_BUS_DEVICE(&s->spi[i]), 0,
                            qdev_get_gpio_in(intmatrix_dev, ETS_SPI0_INTR_SOURCE + i));
+        if (i > 0) {
+            /* SPI0 is used by the cache and has no DMA interrupt source */
+            sysbus_connect_irq(SYS_BUS_DEVICE(&s->spi[i]), 1,
+                               qdev_get_gpio_in(intmatrix_dev, ETS_SPI1_DMA_INTR_SOURCE + i - 1));
+        }
     }
+    /* SPI1 is the one used by software to program the flash */
+    qdev_connect_gpio_out_named(DEVICE(&s->spi[1]), ESP32_SPI_FLASH_WRITE_GPIO, 0,
+                                qdev_get_gpio_in_named(dev, ESP32_SPI_FLASH_WRITE_GPIO, 0));
 
     for (int i = 0; i < ESP32_I2C_COUNT; i++) {
         const hwaddr i2c_base[] = {
@@ -546,6 +624,12 @@ static void esp32_soc_init(Object *obj)
     object_initialize_child(obj, "sha", &s->sha, sizeof(s->sha),
                                 TYPE_ESP32_SHA, &error_abort, NULL);
 
+    object_initialize_child(obj, "aes", &s->aes, sizeof(s->aes),
+                                TYPE_ESP32_AES, &error_abort, NULL);
+
+    object_initialize_child(obj, "rsa", &s->rsa, sizeof(s->rsa),
+                                TYPE_ESP32_RSA, &error_abort, NULL);
+
     object_initialize_child(obj, "efuse", &s->efuse, sizeof(s->efuse),
                                     TYPE_ESP32_EFUSE, &error_abort, NULL);
 
@@ -554,10 +638,32 @@ static void esp32_soc_init(Object *obj)
     qdev_init_gpio_in_named(DEVICE(s), esp32_cpu_reset, ESP32_RTC_CPU_RESET_GPIO, ESP32_CPU_COUNT);
     qdev_init_gpio_in_named(DEVICE(s), esp32_cpu_stall, ESP32_RTC_CPU_STALL_GPIO, ESP32_CPU_COUNT);
     qdev_init_gpio_in_named(DEVICE(s), esp32_clk_update, ESP32_RTC_CLK_UPDATE_GPIO, 1);
+    qdev_init_gpio_in_named(DEVICE(s), esp32_flash_write, ESP32_SPI_FLASH_WRITE_GPIO, 1);
     qdev_init_gpio_in_named(DEVICE(s), esp32_timg_cpu_reset, ESP32_TIMG_WDT_CPU_RESET_GPIO, 2);
     qdev_init_gpio_in_named(DEVICE(s), esp32_timg_sys_reset, ESP32_TIMG_WDT_SYS_RESET_GPIO, 2);
 }
 
+/* Peripherals and CPUs migrate their own state, and are loaded before the SoC.
+ * Clock frequencies propagated from RTC_CNTL and DPORT settings are not
+ * migrated, recompute them here.
+ */
+static int esp32_soc_post_load(void *opaque, int version_id)
+{
+    esp32_clk_update(opaque, 0, 1);
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp32_soc = {
+    .name = TYPE_ESP32_SOC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = esp32_soc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(requested_reset, Esp32SocState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property esp32_soc_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -568,6 +674,7 @@ static void esp32_soc_class_init(ObjectClass *klass, void *data)
 
     dc->reset = esp32_soc_reset;
     dc->realize = esp32_soc_realize;
+    dc->vmsd = &vmstate_esp32_soc;
     device_class_set_props(dc, esp32_soc_properties);
 }
 
@@ -594,16 +701,55 @@ static uint64_t translate_phys_addr(void *opaque, uint64_t addr)
     return cpu_get_phys_page_debug(CPU(cpu), addr);
 }
 
+static MemoryRegion *esp32_machine_map_flash(Esp32MachineState *ms, DriveInfo *dinfo, BlockBackend *blk)
+{
+    if (ms->flash_mmap == ESP32_FLASH_MMAP_OFF) {
+        return NULL;
+    }
+#ifdef CONFIG_POSIX
+    const char *filename = qemu_opt_get(dinfo->opts, "file");
+    const char *format = bdrv_get_format_name(blk_bs(blk));
+    if (filename == NULL || format == NULL || strcmp(format, "raw") != 0) {
+        error_report("Error: flash-mmap requires a raw flash image file");
+        exit(1);
+    }
+
+    int64_t size = blk_getlength(blk);
+    if (size < 0) {
+        error_report("Error: could not get the size of flash image '%s'", filename);
+        exit(1);
+    }
+
+    MemoryRegion *flash_mem = g_new(MemoryRegion, 1);
+    uint32_t ram_flags = (ms->flash_mmap == ESP32_FLASH_MMAP_SHARED) ? RAM_SHARED : 0;
+    memory_region_init_ram_from_file(flash_mem, NULL, "esp32.flash", size, 0,
+                                     ram_flags, filename, &error_fatal);
+    return flash_mem;
+#else
+    error_report("Error: flash-mmap is not supported on this host");
+    exit(1);
+#endif
+}
+
 static void esp32_machine_init_spi_flash(MachineState *machine, Esp32SocState *s, BlockBackend* blk)
 {
     /* "main" flash chip is attached to SPI1 */
     DeviceState *spi_master = DEVICE(&s->spi[1]);
     SSIBus* spi_bus = (SSIBus *)qdev_get_child_bus(spi_master, "spi");
     DeviceState *flash_dev = ssi_create_slave_no_init(spi_bus, "gd25q32");
-    qdev_prop_set_drive(flash_dev, "drive", blk, &error_fatal);
+    /* A private mapping keeps the writes to itself, the drive is only read */
+    if (!s->dport.flash_mem || ESP32_MACHINE(machine)->flash_mmap != ESP32_FLASH_MMAP_PRIVATE) {
+        qdev_prop_set_drive(flash_dev, "drive", blk, &error_fatal);
+    }
+    if (s->dport.flash_mem) {
+        /* Share the mapping, so that flash writes are seen by the cache */
+        object_property_set_link(OBJECT(flash_dev), OBJECT(s->dport.flash_mem),
+                                 "storage", &error_fatal);
+    }
     qdev_init_nofail(flash_dev);
     qdev_connect_gpio_out_named(spi_master, SSI_GPIO_CS, 0,
                                 qdev_get_gpio_in_named(flash_dev, SSI_GPIO_CS, 0));
+    s->dport.flash_dev = flash_dev;
 }
 
 static void esp32_machine_init_i2c(Esp32SocState *s)
@@ -620,6 +766,28 @@ static void esp32_machine_init_i2c(Esp32SocState *s)
     }
 }
 
+/* SX127x radio wired as on TTGO LoRa32 and T-Beam boards */
+#define ESP32_LORA_SPI          3       /* VSPI */
+#define ESP32_LORA_NSS_GPIO     18
+#define ESP32_LORA_RESET_GPIO   14
+#define ESP32_LORA_DIO0_GPIO    26
+
+static void esp32_machine_init_lora(Esp32SocState *s)
+{
+    DeviceState *spi_master = DEVICE(&s->spi[ESP32_LORA_SPI]);
+    SSIBus *spi_bus = (SSIBus *)qdev_get_child_bus(spi_master, "spi");
+    DeviceState *gpio_dev = DEVICE(&s->gpio);
+    DeviceState *radio_dev = ssi_create_slave(spi_bus, TYPE_SX127X);
+
+    /* Drivers toggle NSS as a GPIO rather than using the SPI controller CS */
+    qdev_connect_gpio_out(gpio_dev, ESP32_LORA_NSS_GPIO,
+                          qdev_get_gpio_in_named(radio_dev, SSI_GPIO_CS, 0));
+    qdev_connect_gpio_out(gpio_dev, ESP32_LORA_RESET_GPIO,
+                          qdev_get_gpio_in_named(radio_dev, SX127X_GPIO_RESET, 0));
+    qdev_connect_gpio_out_named(radio_dev, SX127X_GPIO_DIO, 0,
+                                qdev_get_gpio_in(gpio_dev, ESP32_LORA_DIO0_GPIO));
+}
+
 static void esp32_machine_init_openeth(Esp32SocState *ss)
 {
     SysBusDevice *sbd;
@@ -646,6 +814,7 @@ static void esp32_machine_init_openeth(Esp32SocState *ss)
 
 static void esp32_machine_inst_init(MachineState *machine)
 {
+    Esp32MachineState *ms = ESP32_MACHINE(machine);
     Esp32SocState *s = g_new0(Esp32SocState, 1);
 
     BlockBackend* blk = NULL;
@@ -662,7 +831,9 @@ static void esp32_machine_inst_init(MachineState *machine)
 
     if (blk) {
         s->dport.flash_blk = blk;
+        s->dport.flash_mem = esp32_machine_map_flash(ms, dinfo, blk);
     }
+    qdev_prop_set_bit(DEVICE(&s->dport), "lazy-cache-fill", ms->lazy_cache_fill);
     qdev_prop_set_chr(DEVICE(s), "serial0", serial_hd(0));
 
     object_property_set_bool(OBJECT(s), true, "realized", &error_abort);
@@ -673,6 +844,15 @@ static void esp32_machine_inst_init(MachineState *machine)
 
     esp32_machine_init_i2c(s);
 
+    if (ms->lora) {
+        esp32_machine_init_lora(s);
+    }
+
+    qemu_set_idle_warp(ms->idle_warp);
+    for (int i = 0; i < ESP32_CPU_COUNT; ++i) {
+        xtensa_set_ccount_warp(&s->cpu[i].env, ms->busy_wait_warp);
+    }
+
     esp32_machine_init_openeth(s);
 
     /* Need MMU initialized prior to ELF loading,
@@ -712,17 +892,149 @@ static void esp32_machine_inst_init(MachineState *machine)
             exit(1);
         }
         g_free(rom_binary);
+
+        if (ms->rom_hooks) {
+            esp32_rom_hooks_init(s->cpu, ESP32_CPU_COUNT, s->dport.flash_dev);
+        }
+    }
+
+    if (ms->rom_hooks && load_elf_filename) {
+        warn_report("rom-hooks has no effect when booting from -kernel or -bios");
     }
 }
 
+static bool esp32_machine_get_lazy_cache_fill(Object *obj, Error **errp)
+{
+    return ESP32_MACHINE(obj)->lazy_cache_fill;
+}
+
+static void esp32_machine_set_lazy_cache_fill(Object *obj, bool value, Error **errp)
+{
+    ESP32_MACHINE(obj)->lazy_cache_fill = value;
+}
+
+static bool esp32_machine_get_lora(Object *obj, Error **errp)
+{
+    return ESP32_MACHINE(obj)->lora;
+}
+
+static void esp32_machine_set_lora(Object *obj, bool value, Error **errp)
+{
+    ESP32_MACHINE(obj)->lora = value;
+}
+
+static bool esp32_machine_get_idle_warp(Object *obj, Error **errp)
+{
+    return ESP32_MACHINE(obj)->idle_warp;
+}
+
+static void esp32_machine_set_idle_warp(Object *obj, bool value, Error **errp)
+{
+    ESP32_MACHINE(obj)->idle_warp = value;
+}
+
+static bool esp32_machine_get_rom_hooks(Object *obj, Error **errp)
+{
+    return ESP32_MACHINE(obj)->rom_hooks;
+}
+
+static void esp32_machine_set_rom_hooks(Object *obj, bool value, Error **errp)
+{
+    ESP32_MACHINE(obj)->rom_hooks = value;
+}
+
+static bool esp32_machine_get_busy_wait_warp(Object *obj, Error **errp)
+{
+    return ESP32_MACHINE(obj)->busy_wait_warp;
+}
+
+static void esp32_machine_set_busy_wait_warp(Object *obj, bool value,
+                                             Error **errp)
+{
+    ESP32_MACHINE(obj)->busy_wait_warp = value;
+}
+
+static char *esp32_machine_get_flash_mmap(Object *obj, Error **errp)
+{
+    return g_strdup(esp32_flash_mmap_mode_names[ESP32_MACHINE(obj)->flash_mmap]);
+}
+
+static void esp32_machine_set_flash_mmap(Object *obj, const char *value, Error **errp)
+{
+    for (int i = 0; i < ESP32_FLASH_MMAP_MAX; ++i) {
+        if (strcmp(value, esp32_flash_mmap_mode_names[i]) == 0) {
+            ESP32_MACHINE(obj)->flash_mmap = i;
+            return;
+        }
+    }
+    error_setg(errp, "Invalid flash-mmap value '%s', expected off, private or shared", value);
+}
+
 /* Initialize machine type */
-static void esp32_machine_init(MachineClass *mc)
+static void esp32_machine_class_init(ObjectClass *oc, void *data)
 {
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "Espressif ESP32 machine";
     mc->init = esp32_machine_inst_init;
     mc->max_cpus = 2;
     mc->default_cpus = 2;
+
+    object_class_property_add_bool(oc, "lazy-cache-fill",
+                                   esp32_machine_get_lazy_cache_fill,
+                                   esp32_machine_set_lazy_cache_fill, NULL);
+    object_class_property_set_description(oc, "lazy-cache-fill",
+                                          "Read flash cache pages on first access "
+                                          "instead of when the cache is enabled", NULL);
+
+    object_class_property_add_str(oc, "flash-mmap",
+                                  esp32_machine_get_flash_mmap,
+                                  esp32_machine_set_flash_mmap, NULL);
+    object_class_property_set_description(oc, "flash-mmap",
+                                          "Map a raw flash image file into memory "
+                                          "instead of copying it (off, private, shared)", NULL);
+
+    object_class_property_add_bool(oc, "lora",
+                                   esp32_machine_get_lora,
+                                   esp32_machine_set_lora, NULL);
+    object_class_property_set_description(oc, "lora",
+                                          "Attach an SX127x LoRa radio to VSPI, "
+                                          "NSS on GPIO18, RESET on GPIO14, DIO0 on GPIO26", NULL);
+
+    object_class_property_add_bool(oc, "idle-warp",
+                                   esp32_machine_get_idle_warp,
+                                   esp32_machine_set_idle_warp, NULL);
+    object_class_property_set_description(oc, "idle-warp",
+                                          "Advance virtual time to the next timer "
+                                          "deadline when both CPUs are in WAITI", NULL);
+
+    object_class_property_add_bool(oc, "busy-wait-warp",
+                                   esp32_machine_get_busy_wait_warp,
+                                   esp32_machine_set_busy_wait_warp, NULL);
+    object_class_property_set_description(oc, "busy-wait-warp",
+                                          "Advance virtual time while a CPU spins "
+                                          "on CCOUNT, e.g. in ets_delay_us", NULL);
+
+    object_class_property_add_bool(oc, "rom-hooks",
+                                   esp32_machine_get_rom_hooks,
+                                   esp32_machine_set_rom_hooks, NULL);
+    object_class_property_set_description(oc, "rom-hooks",
+                                          "Run memcpy/memset, crc32_le, MD5 and SPIRead "
+                                          "ROM routines natively when booting the ROM "
+                                          "image, see 'info hle'", NULL);
+}
+
+static const TypeInfo esp32_machine_info = {
+    .name = TYPE_ESP32_MACHINE,
+    .parent = TYPE_MACHINE,
+    .instance_size = sizeof(Esp32MachineState),
+    .class_init = esp32_machine_class_init,
+};
+
+static void esp32_machine_register_types(void)
+{
+    type_register_static(&esp32_machine_info);
 }
 
-DEFINE_MACHINE("esp32", esp32_machine_init)
+type_init(esp32_machine_register_types)
 
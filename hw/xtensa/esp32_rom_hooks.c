@@ -0,0 +1,395 @@
+/*
+ * Native implementations of ESP32 ROM routines
+ *
+ * Hot routines of the revision 0 ROM (esp32-r0-rom.bin) are run on the
+ * host instead of being translated, with the same effect on guest memory
+ * and on the caller's registers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+#include "qemu/bswap.h"
+#include "exec/memory.h"
+#include "hw/block/flash.h"
+#include "hw/loader.h"
+#include "hw/xtensa/esp32_rom_hooks.h"
+#include <zlib.h>
+
+#define ROM_HOOK_CHUNK 4096
+
+/* First byte of ENTRY as, imm: op0 = 6, n = 3, m = 0 */
+#define ENTRY_OPCODE         0x36
+#define ENTRY_OPCODE_MASK    0xff
+
+#define SPI_FLASH_RESULT_OK  0
+#define SPI_FLASH_RESULT_ERR 1
+
+static void rom_read(CPUXtensaState *env, uint32_t addr, void *buf, uint32_t len)
+{
+    address_space_read(env_cpu(env)->as, addr, MEMTXATTRS_UNSPECIFIED, buf, len);
+}
+
+static void rom_write(CPUXtensaState *env, uint32_t addr, const void *buf, uint32_t len)
+{
+    address_space_write(env_cpu(env)->as, addr, MEMTXATTRS_UNSPECIFIED, buf, len);
+}
+
+/* void *memmove(void *dst, const void *src, size_t n), also used for memcpy */
+static uint32_t rom_memmove(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    uint32_t dst = args[0], src = args[1], n = args[2];
+    bool backwards = dst > src && dst - src < n;
+    uint8_t buf[ROM_HOOK_CHUNK];
+
+    for (uint32_t done = 0; done < n; ) {
+        uint32_t len = MIN(n - done, ROM_HOOK_CHUNK);
+        uint32_t off = backwards ? n - done - len : done;
+
+        rom_read(env, src + off, buf, len);
+        rom_write(env, dst + off, buf, len);
+        done += len;
+    }
+    return dst;
+}
+
+/* void *memset(void *dst, int c, size_t n) */
+static uint32_t rom_memset(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    uint32_t dst = args[0], n = args[2];
+    uint8_t buf[ROM_HOOK_CHUNK];
+
+    memset(buf, args[1], MIN(n, ROM_HOOK_CHUNK));
+    for (uint32_t done = 0; done < n; ) {
+        uint32_t len = MIN(n - done, ROM_HOOK_CHUNK);
+
+        rom_write(env, dst + done, buf, len);
+        done += len;
+    }
+    return dst;
+}
+
+/* int memcmp(const void *a, const void *b, size_t n) */
+static uint32_t rom_memcmp(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    uint32_t a = args[0], b = args[1], n = args[2];
+    uint8_t buf_a[ROM_HOOK_CHUNK], buf_b[ROM_HOOK_CHUNK];
+
+    for (uint32_t done = 0; done < n; ) {
+        uint32_t len = MIN(n - done, ROM_HOOK_CHUNK);
+
+        rom_read(env, a + done, buf_a, len);
+        rom_read(env, b + done, buf_b, len);
+        for (uint32_t i = 0; i < len; ++i) {
+            if (buf_a[i] != buf_b[i]) {
+                return buf_a[i] - buf_b[i];
+            }
+        }
+        done += len;
+    }
+    return 0;
+}
+
+/*
+ * uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+ * The ROM inverts the CRC on entry and on exit, just like zlib does.
+ */
+static uint32_t rom_crc32_le(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    uint32_t crc = args[0], addr = args[1], n = args[2];
+    uint8_t buf[ROM_HOOK_CHUNK];
+
+    for (uint32_t done = 0; done < n; ) {
+        uint32_t len = MIN(n - done, ROM_HOOK_CHUNK);
+
+        rom_read(env, addr + done, buf, len);
+        crc = crc32(crc, buf, len);
+        done += len;
+    }
+    return crc;
+}
+
+/*
+ * struct MD5Context { uint32_t buf[4]; uint32_t bits[2]; uint8_t in[64]; }
+ * as used by the ROM MD5Init/MD5Update/MD5Final.
+ */
+#define MD5_CTX_BUF     0
+#define MD5_CTX_BITS    16
+#define MD5_CTX_IN      24
+#define MD5_CTX_SIZE    88
+
+typedef struct RomMD5Context {
+    uint32_t buf[4];
+    uint32_t bits[2];
+    uint8_t in[64];
+} RomMD5Context;
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_s[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21,
+};
+
+static void md5_transform(uint32_t buf[4], const uint8_t block[64])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    uint32_t m[16];
+
+    for (int i = 0; i < 16; ++i) {
+        m[i] = ldl_le_p(block + i * 4);
+    }
+    for (int i = 0; i < 64; ++i) {
+        uint32_t f, tmp;
+        int g;
+
+        switch (i / 16) {
+        case 0:
+            f = d ^ (b & (c ^ d));
+            g = i;
+            break;
+        case 1:
+            f = c ^ (d & (b ^ c));
+            g = (5 * i + 1) % 16;
+            break;
+        case 2:
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+            break;
+        default:
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+            break;
+        }
+        tmp = d;
+        d = c;
+        c = b;
+        b += rol32(a + f + md5_k[i] + m[g], md5_s[(i / 16) * 4 + i % 4]);
+        a = tmp;
+    }
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void rom_md5_load(CPUXtensaState *env, uint32_t addr, RomMD5Context *ctx)
+{
+    uint8_t raw[MD5_CTX_SIZE];
+
+    rom_read(env, addr, raw, sizeof(raw));
+    for (int i = 0; i < 4; ++i) {
+        ctx->buf[i] = ldl_le_p(raw + MD5_CTX_BUF + i * 4);
+    }
+    for (int i = 0; i < 2; ++i) {
+        ctx->bits[i] = ldl_le_p(raw + MD5_CTX_BITS + i * 4);
+    }
+    memcpy(ctx->in, raw + MD5_CTX_IN, sizeof(ctx->in));
+}
+
+static void rom_md5_store(CPUXtensaState *env, uint32_t addr, const RomMD5Context *ctx)
+{
+    uint8_t raw[MD5_CTX_SIZE];
+
+    for (int i = 0; i < 4; ++i) {
+        stl_le_p(raw + MD5_CTX_BUF + i * 4, ctx->buf[i]);
+    }
+    for (int i = 0; i < 2; ++i) {
+        stl_le_p(raw + MD5_CTX_BITS + i * 4, ctx->bits[i]);
+    }
+    memcpy(raw + MD5_CTX_IN, ctx->in, sizeof(ctx->in));
+    rom_write(env, addr, raw, sizeof(raw));
+}
+
+/* void MD5Init(struct MD5Context *ctx) */
+static uint32_t rom_md5_init(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    RomMD5Context ctx;
+
+    rom_md5_load(env, args[0], &ctx);
+    ctx.buf[0] = 0x67452301;
+    ctx.buf[1] = 0xefcdab89;
+    ctx.buf[2] = 0x98badcfe;
+    ctx.buf[3] = 0x10325476;
+    ctx.bits[0] = 0;
+    ctx.bits[1] = 0;
+    rom_md5_store(env, args[0], &ctx);
+    return args[0];
+}
+
+/* void MD5Update(struct MD5Context *ctx, const unsigned char *buf, unsigned len) */
+static uint32_t rom_md5_update(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    uint32_t addr = args[1], len = args[2];
+    RomMD5Context ctx;
+    uint32_t t;
+
+    rom_md5_load(env, args[0], &ctx);
+
+    t = ctx.bits[0];
+    ctx.bits[0] = t + (len << 3);
+    if (ctx.bits[0] < t) {
+        ctx.bits[1]++;
+    }
+    ctx.bits[1] += len >> 29;
+
+    /* Bytes already in ctx.in */
+    t = (t >> 3) & 0x3f;
+    if (t) {
+        uint32_t fill = 64 - t;
+
+        if (len < fill) {
+            rom_read(env, addr, ctx.in + t, len);
+            rom_md5_store(env, args[0], &ctx);
+            return args[0];
+        }
+        rom_read(env, addr, ctx.in + t, fill);
+        md5_transform(ctx.buf, ctx.in);
+        addr += fill;
+        len -= fill;
+    }
+    while (len >= 64) {
+        rom_read(env, addr, ctx.in, 64);
+        md5_transform(ctx.buf, ctx.in);
+        addr += 64;
+        len -= 64;
+    }
+    rom_read(env, addr, ctx.in, len);
+
+    rom_md5_store(env, args[0], &ctx);
+    return args[0];
+}
+
+/* void MD5Final(unsigned char digest[16], struct MD5Context *ctx) */
+static uint32_t rom_md5_final(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    uint8_t digest[16];
+    RomMD5Context ctx;
+    uint32_t count;
+    uint8_t *p;
+
+    rom_md5_load(env, args[1], &ctx);
+
+    count = (ctx.bits[0] >> 3) & 0x3f;
+    p = ctx.in + count;
+    *p++ = 0x80;
+    count = 64 - 1 - count;
+    if (count < 8) {
+        memset(p, 0, count);
+        md5_transform(ctx.buf, ctx.in);
+        memset(ctx.in, 0, 56);
+    } else {
+        memset(p, 0, count - 8);
+    }
+    stl_le_p(ctx.in + 56, ctx.bits[0]);
+    stl_le_p(ctx.in + 60, ctx.bits[1]);
+    md5_transform(ctx.buf, ctx.in);
+
+    for (int i = 0; i < 4; ++i) {
+        stl_le_p(digest + i * 4, ctx.buf[i]);
+    }
+    rom_write(env, args[0], digest, sizeof(digest));
+
+    /* The context is wiped, in case it is sensitive */
+    memset(&ctx, 0, sizeof(ctx));
+    rom_md5_store(env, args[1], &ctx);
+    return args[0];
+}
+
+/*
+ * SpiFlashOpResult SPIRead(uint32_t src_addr, uint32_t *dest, int32_t len)
+ * Reads the flash device rather than its drive, which may not have
+ * the programmed data yet.
+ */
+static uint32_t rom_spi_read(CPUXtensaState *env, const uint32_t *args, void *opaque)
+{
+    DeviceState *flash_dev = opaque;
+    uint32_t src = args[0], dst = args[1], n = args[2];
+    bool locked = qemu_mutex_iothread_locked();
+    uint32_t ret = SPI_FLASH_RESULT_OK;
+    uint8_t buf[ROM_HOOK_CHUNK];
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    if ((int32_t) n < 0) {
+        ret = SPI_FLASH_RESULT_ERR;
+        n = 0;
+    }
+    for (uint32_t done = 0; done < n; ) {
+        uint32_t len = MIN(n - done, ROM_HOOK_CHUNK);
+
+        if (m25p80_read(flash_dev, src + done, buf, len) < 0) {
+            ret = SPI_FLASH_RESULT_ERR;
+            break;
+        }
+        rom_write(env, dst + done, buf, len);
+        done += len;
+    }
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
+static const XtensaHleHook esp32_rom_hooks[] = {
+    { .name = "memcmp", .pc = 0x4000c260, .fn = rom_memcmp },
+    { .name = "memcpy", .pc = 0x4000c2c8, .fn = rom_memmove },
+    { .name = "memmove", .pc = 0x4000c3c0, .fn = rom_memmove },
+    { .name = "memset", .pc = 0x4000c44c, .fn = rom_memset },
+    { .name = "crc32_le", .pc = 0x4005cfec, .fn = rom_crc32_le },
+    { .name = "MD5Init", .pc = 0x4005da7c, .fn = rom_md5_init },
+    { .name = "MD5Update", .pc = 0x4005da9c, .fn = rom_md5_update },
+    { .name = "MD5Final", .pc = 0x4005db1c, .fn = rom_md5_final },
+    { .name = "SPIRead", .pc = 0x40062ed8, .fn = rom_spi_read },
+};
+
+void esp32_rom_hooks_init(XtensaCPU *cpus, unsigned n_cpus,
+                          DeviceState *flash_dev)
+{
+    XtensaHleHook *hooks = g_new(XtensaHleHook, ARRAY_SIZE(esp32_rom_hooks));
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(esp32_rom_hooks); ++i) {
+        const uint8_t *insn = rom_ptr(esp32_rom_hooks[i].pc, 1);
+
+        /* Another ROM revision would have other code at these addresses */
+        if (!insn || (insn[0] & ENTRY_OPCODE_MASK) != ENTRY_OPCODE) {
+            warn_report("ROM routine %s at 0x%08x does not start with ENTRY, "
+                        "running it without a hook",
+                        esp32_rom_hooks[i].name, esp32_rom_hooks[i].pc);
+            continue;
+        }
+        hooks[n] = esp32_rom_hooks[i];
+        if (hooks[n].fn == rom_spi_read) {
+            if (!flash_dev) {
+                continue;
+            }
+            hooks[n].opaque = flash_dev;
+        }
+        ++n;
+    }
+    for (unsigned i = 0; i < n_cpus; ++i) {
+        xtensa_set_hle_hooks(&cpus[i].env, hooks, n);
+    }
+}
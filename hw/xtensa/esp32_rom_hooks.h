@@ -0,0 +1,21 @@
+/*
+ * Native implementations of ESP32 ROM routines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#ifndef ESP32_ROM_HOOKS_H
+#define ESP32_ROM_HOOKS_H
+
+#include "cpu.h"
+
+/*
+ * Hook the ROM routines of all CPUs. The ROM image must have been
+ * registered with the loader, each hooked address is checked in it.
+ */
+void esp32_rom_hooks_init(XtensaCPU *cpus, unsigned n_cpus,
+                          DeviceState *flash_dev);
+
+#endif
@@ -68,6 +68,9 @@ uint32_t nand_getbuswidth(DeviceState *dev);
 /* onenand.c */
 void *onenand_raw_otp(DeviceState *onenand_device);
 
+/* m25p80.c */
+int m25p80_read(DeviceState *dev, uint32_t addr, void *buf, uint32_t len);
+
 /* ecc.c */
 typedef struct {
     uint8_t cp;		/* Column parity */
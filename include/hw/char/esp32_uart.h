@@ -8,6 +8,12 @@
 
 #define UART_FIFO_LENGTH 128
 
+/* Used while the guest hasn't configured the clock divider */
+#define UART_DEFAULT_BAUD_RATE 115200
+
+/* REF_TICK, selected as the baud clock when CONF0.TICK_REF_ALWAYS_ON is 0 */
+#define UART_REF_TICK_FREQ 1000000
+
 #define TYPE_ESP32_UART "esp_soc.uart"
 #define ESP32_UART(obj) OBJECT_CHECK(ESP32UARTState, (obj), TYPE_ESP32_UART)
 
@@ -37,7 +43,6 @@ REG32(UART_INT_CLR, 0x10)
     FIELD(UART_INT_CLR, RXFIFO_TOUT, 8, 1)
     FIELD(UART_INT_CLR, TX_DONE, 14, 1)
 
-/* TODO: implement */
 REG32(UART_CLKDIV, 0x14)
     FIELD(UART_CLKDIV, CLKDIV, 0, 20)
     FIELD(UART_CLKDIV, CLKDIV_FRAG, 20, 4)
@@ -55,8 +60,11 @@ REG32(UART_LOWPULSE, 0x28)
 REG32(UART_HIGHPULSE, 0x2c)
 REG32(UART_RXD_CNT, 0x30)
 
-/* TODO: implement */
 REG32(UART_CONF0, 0x20)
+    FIELD(UART_CONF0, TICK_REF_ALWAYS_ON, 27, 1)
+    FIELD(UART_CONF0, STOP_BIT_NUM, 4, 2)
+    FIELD(UART_CONF0, BIT_NUM, 2, 2)
+    FIELD(UART_CONF0, PARITY_EN, 1, 1)
 REG32(UART_CONF1, 0x24)
     FIELD(UART_CONF1, TOUT_EN, 31, 1)
     FIELD(UART_CONF1, TOUT_THRD, 24, 7)
@@ -81,6 +89,15 @@ typedef struct ESPUARTState {
     Fifo8 rx_fifo;
     Fifo8 tx_fifo;
     guint tx_watch_handle;
+    QEMUBH *tx_bh;
+    /* Accurate baud mode: end of the frame being shifted out of the TX FIFO */
+    QEMUTimer tx_timer;
+    int64_t tx_next_ns;
+
+    /* properties */
+    bool tx_coalesce;
+    bool accurate_baud;
+    uint32_t apb_freq;
 
     uint32_t reg[UART_REG_CNT];
     bool autobaud_en;
@@ -3,11 +3,67 @@
 #include "hw/sysbus.h"
 #include "hw/hw.h"
 #include "hw/registerfields.h"
+#include "chardev/char-fe.h"
 
 #define TYPE_ESP32_GPIO "esp32.gpio"
 #define ESP32_GPIO(obj) OBJECT_CHECK(Esp32GpioState, (obj), TYPE_ESP32_GPIO)
 
+#define ESP32_GPIO_COUNT        40
+#define ESP32_GPIO_MASK         ((1ULL << ESP32_GPIO_COUNT) - 1)
+#define ESP32_GPIO_IN_SIGNALS   256
+
+REG32(GPIO_OUT, 0x0004)
+REG32(GPIO_OUT_W1TS, 0x0008)
+REG32(GPIO_OUT_W1TC, 0x000c)
+REG32(GPIO_OUT1, 0x0010)
+REG32(GPIO_OUT1_W1TS, 0x0014)
+REG32(GPIO_OUT1_W1TC, 0x0018)
+REG32(GPIO_ENABLE, 0x0020)
+REG32(GPIO_ENABLE_W1TS, 0x0024)
+REG32(GPIO_ENABLE_W1TC, 0x0028)
+REG32(GPIO_ENABLE1, 0x002c)
+REG32(GPIO_ENABLE1_W1TS, 0x0030)
+REG32(GPIO_ENABLE1_W1TC, 0x0034)
 REG32(GPIO_STRAP, 0x0038)
+REG32(GPIO_IN, 0x003c)
+REG32(GPIO_IN1, 0x0040)
+REG32(GPIO_STATUS, 0x0044)
+REG32(GPIO_STATUS_W1TS, 0x0048)
+REG32(GPIO_STATUS_W1TC, 0x004c)
+REG32(GPIO_STATUS1, 0x0050)
+REG32(GPIO_STATUS1_W1TS, 0x0054)
+REG32(GPIO_STATUS1_W1TC, 0x0058)
+REG32(GPIO_ACPU_INT, 0x0060)
+REG32(GPIO_ACPU_NMI_INT, 0x0064)
+REG32(GPIO_PCPU_INT, 0x0068)
+REG32(GPIO_PCPU_NMI_INT, 0x006c)
+REG32(GPIO_ACPU_INT1, 0x0074)
+REG32(GPIO_ACPU_NMI_INT1, 0x0078)
+REG32(GPIO_PCPU_INT1, 0x007c)
+REG32(GPIO_PCPU_NMI_INT1, 0x0080)
+REG32(GPIO_PIN0, 0x0088)
+    FIELD(GPIO_PIN0, INT_ENA, 13, 5)
+    FIELD(GPIO_PIN0, INT_TYPE, 7, 3)
+REG32(GPIO_FUNC0_IN_SEL_CFG, 0x0130)
+REG32(GPIO_FUNC0_OUT_SEL_CFG, 0x0530)
+    FIELD(GPIO_FUNC0_OUT_SEL_CFG, OUT_SEL, 0, 9)
+
+#define ESP32_GPIO_INT_ENA_APP      BIT(0)
+#define ESP32_GPIO_INT_ENA_APP_NMI  BIT(1)
+#define ESP32_GPIO_INT_ENA_PRO      BIT(2)
+#define ESP32_GPIO_INT_ENA_PRO_NMI  BIT(3)
+
+typedef enum Esp32GpioIntType {
+    ESP32_GPIO_INT_DISABLE,
+    ESP32_GPIO_INT_POSEDGE,
+    ESP32_GPIO_INT_NEGEDGE,
+    ESP32_GPIO_INT_ANYEDGE,
+    ESP32_GPIO_INT_LOW_LEVEL,
+    ESP32_GPIO_INT_HIGH_LEVEL,
+} Esp32GpioIntType;
+
+/* Output selection which drives the pad from the GPIO_OUT registers */
+#define ESP32_GPIO_OUT_SEL_GPIO     0x100
 
 #define ESP32_STRAP_MODE_FLASH_BOOT 0x12
 #define ESP32_STRAP_MODE_UART_BOOT  0x0f
@@ -17,6 +73,23 @@ typedef struct Esp32GpioState {
 
     MemoryRegion iomem;
     qemu_irq irq;
+    qemu_irq nmi_irq;
+    qemu_irq pin_out[ESP32_GPIO_COUNT];
+    CharBackend chr;
+    /* partial pin event line received from the chardev */
+    char rx_line[32];
+    uint32_t rx_line_len;
+
     uint32_t strap_mode;
-} Esp32GpioState;
 
+    uint64_t out;
+    uint64_t enable;
+    uint64_t status;
+    /* levels driven onto the pads from outside: qdev GPIO inputs or chardev */
+    uint64_t in_ext;
+    /* current pad levels */
+    uint64_t level;
+    uint32_t pin[ESP32_GPIO_COUNT];
+    uint32_t func_in_sel[ESP32_GPIO_IN_SIGNALS];
+    uint32_t func_out_sel[ESP32_GPIO_COUNT];
+} Esp32GpioState;
@@ -3,6 +3,7 @@
 
 #include "hw/sysbus.h"
 #include "qemu/fifo8.h"
+#include "qemu/timer.h"
 #include "hw/i2c/bitbang_i2c.h"
 
 #define TYPE_ESP32_I2C "esp32.i2c"
@@ -172,9 +173,18 @@ typedef struct Esp32I2CState {
     i2c_int_reg_t i2c_int_ena_reg;
     i2c_int_reg_t i2c_int_status_reg;
     i2c_comd_reg_t i2c_comd_reg[I2C_COMD_REG_COUNT];
+    uint32_t scl_low_period;
+    uint32_t scl_high_period;
 
     Fifo8 rx_fifo;
     Fifo8 tx_fifo;
+
+    /* Command list executed, waiting for the SCL time it takes to elapse */
+    bool trans_busy;
+    uint16_t pending_done;
+    i2c_int_reg_t pending_int;
+    QEMUTimer trans_timer;
+    uint32_t apb_freq;
 } Esp32I2CState;
 
 #endif /* ESP32_I2C_H */
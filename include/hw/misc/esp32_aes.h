@@ -0,0 +1,33 @@
+#pragma once
+
+#include "hw/hw.h"
+#include "hw/sysbus.h"
+#include "hw/registerfields.h"
+#include "hw/misc/esp32_reg.h"
+#include "crypto/cipher.h"
+
+#define TYPE_ESP32_AES "misc.esp32.aes"
+#define ESP32_AES(obj) OBJECT_CHECK(Esp32AesState, (obj), TYPE_ESP32_AES)
+
+#define ESP32_AES_KEY_REG_CNT     8
+#define ESP32_AES_TEXT_REG_CNT    4
+
+REG32(AES_START, 0x00)
+REG32(AES_IDLE, 0x04)
+REG32(AES_MODE, 0x08)
+    FIELD(AES_MODE, KEYLEN, 0, 2)
+    FIELD(AES_MODE, DECRYPT, 2, 1)
+REG32(AES_KEY_0, 0x10)
+REG32(AES_TEXT_0, 0x30)
+REG32(AES_ENDIAN, 0x40)
+
+typedef struct Esp32AesState {
+    SysBusDevice parent_obj;
+    MemoryRegion iomem;
+    uint32_t mode;
+    uint32_t endian;
+    uint32_t key[ESP32_AES_KEY_REG_CNT];
+    uint32_t text[ESP32_AES_TEXT_REG_CNT];
+    /* expanded key for the current key and mode, created on first use */
+    QCryptoCipher *cipher;
+} Esp32AesState;
@@ -21,6 +21,13 @@ typedef struct Esp32IntMatrixState {
     MemoryRegion iomem;
     qemu_irq *outputs[ESP32_CPU_COUNT];
     uint8_t irq_map[ESP32_CPU_COUNT][ESP32_INT_MATRIX_INPUTS];
+    /* CPU extint index each source is routed to, -1 if not connected.
+     * Derived from irq_map when it is written.
+     */
+    int8_t irq_route[ESP32_CPU_COUNT][ESP32_INT_MATRIX_INPUTS];
+    /* Last level of each source, so that only rising edges are counted */
+    bool irq_level[ESP32_INT_MATRIX_INPUTS];
+    uint64_t irq_count[ESP32_INT_MATRIX_INPUTS];
 
     /* properties */
     XtensaCPU *cpu[ESP32_CPU_COUNT];
@@ -43,6 +50,36 @@ typedef enum Esp32CacheRegionType {
     ESP32_ICACHE,
 } Esp32CacheRegionType;
 
+typedef struct Esp32CacheRegionState Esp32CacheRegionState;
+
+/* In lazy fill mode, a mapped page which hasn't been read from flash yet
+ * is covered by an I/O region. The first access to it fills the page and
+ * disables the trap.
+ * When the flash image is memory-mapped, a mapped page is instead a read-only
+ * alias into the flash memory region, and nothing is copied.
+ * A page with an invalid MMU entry is covered by an alias of the illegal
+ * access trap, leaving the data in the cache RAM page untouched.
+ */
+typedef struct Esp32CachePageState {
+    Esp32CacheRegionState* crs;
+    int index;
+    MemoryRegion fill_trap_mem;
+    MemoryRegion flash_alias_mem;
+    MemoryRegion invalid_alias_mem;
+
+    /* Flash page currently held in the cache RAM page, so that a remap of the
+     * same page (e.g. after a reset) doesn't read it from flash again.
+     */
+    bool filled;
+    uint32_t filled_addr;
+
+    /* snapshot of the subregion state above, only used for migration */
+    bool fill_pending;
+    bool flash_mapped;
+    uint32_t flash_offset;
+    bool invalid;
+} Esp32CachePageState;
+
 typedef struct Esp32CacheRegionState {
     Esp32CacheState* cache;
     MemoryRegion mem;
@@ -53,6 +90,7 @@ typedef struct Esp32CacheRegionState {
     bool illegal_access_trap_en;
     bool illegal_access_status;
     uint16_t mmu_table[ESP32_CACHE_PAGES_PER_REGION];
+    Esp32CachePageState pages[ESP32_CACHE_PAGES_PER_REGION];
 } Esp32CacheRegionState;
 
 typedef struct Esp32CacheState {
@@ -77,6 +115,9 @@ typedef struct Esp32DportState {
     Esp32CrosscoreInt   crosscore_int;
     Esp32CacheState cache_state[ESP32_CPU_COUNT];
     BlockBackend *flash_blk;
+    MemoryRegion *flash_mem;
+    /* SPI flash device on flash_blk, pages are read from its contents */
+    DeviceState *flash_dev;
     qemu_irq appcpu_stall_req;
     qemu_irq appcpu_reset_req;
     qemu_irq clk_update_req;
@@ -87,9 +128,18 @@ typedef struct Esp32DportState {
     uint32_t appcpu_boot_addr;
     uint32_t cpuperiod_sel;
     uint32_t cache_ill_trap_en_reg;
+
+    /* properties */
+    bool lazy_cache_fill;
+
+    /* statistics */
+    uint64_t cache_pages_mapped;
+    uint64_t cache_pages_filled;
+    uint64_t cache_pages_reused;
 } Esp32DportState;
 
 void esp32_dport_clear_ill_trap_state(Esp32DportState* s);
+void esp32_dport_flash_written(Esp32DportState* s, uint32_t addr, uint32_t len);
 
 #define ESP32_DPORT_APPCPU_STALL_GPIO   "appcpu-stall"
 #define ESP32_DPORT_APPCPU_RESET_GPIO   "appcpu-reset"
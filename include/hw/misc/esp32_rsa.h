@@ -0,0 +1,41 @@
+#pragma once
+
+#include "hw/hw.h"
+#include "hw/sysbus.h"
+#include "hw/registerfields.h"
+#include "hw/misc/esp32_reg.h"
+
+#define TYPE_ESP32_RSA "misc.esp32.rsa"
+#define ESP32_RSA(obj) OBJECT_CHECK(Esp32RsaState, (obj), TYPE_ESP32_RSA)
+
+/* Each operand memory block holds up to 4096 bits, least significant word first */
+#define ESP32_RSA_MEM_WORDS     128
+#define ESP32_RSA_MEM_SIZE      (ESP32_RSA_MEM_WORDS * 4)
+
+typedef enum Esp32RsaMem {
+    ESP32_RSA_MEM_M,
+    ESP32_RSA_MEM_Z,
+    ESP32_RSA_MEM_Y,
+    ESP32_RSA_MEM_X,
+    ESP32_RSA_MEM_COUNT
+} Esp32RsaMem;
+
+REG32(RSA_M_DASH, 0x800)
+REG32(RSA_MODEXP_MODE, 0x804)
+REG32(RSA_MODEXP_START, 0x808)
+REG32(RSA_MULT_MODE, 0x80c)
+REG32(RSA_MULT_START, 0x810)
+REG32(RSA_INTERRUPT, 0x814)
+REG32(RSA_CLEAN, 0x818)
+
+typedef struct Esp32RsaState {
+    SysBusDevice parent_obj;
+    MemoryRegion iomem;
+    qemu_irq irq;
+
+    uint32_t mem[ESP32_RSA_MEM_COUNT][ESP32_RSA_MEM_WORDS];
+    uint32_t m_dash;
+    uint32_t modexp_mode;
+    uint32_t mult_mode;
+    uint32_t int_raw;
+} Esp32RsaState;
@@ -3,6 +3,7 @@
 #include "hw/hw.h"
 #include "hw/sysbus.h"
 #include "hw/registerfields.h"
+#include "qemu/timer.h"
 #include "target/xtensa/cpu.h"
 #include "target/xtensa/cpu-qom.h"
 #include "hw/misc/esp32_reg.h"
@@ -49,6 +50,12 @@ typedef enum Esp32SlowClkSel {
     ESP32_SLOW_CLK_8MD256 = 2
 } Esp32SlowClkSel;
 
+/* Bits of the WAKEUP_ENA and WAKEUP_CAUSE fields */
+#define ESP32_RTC_EXT0_TRIG_EN      BIT(0)
+#define ESP32_RTC_EXT1_TRIG_EN      BIT(1)
+#define ESP32_RTC_GPIO_TRIG_EN      BIT(2)
+#define ESP32_RTC_TIMER_TRIG_EN     BIT(3)
+
 typedef struct Esp32RtcCntlState {
     SysBusDevice parent_obj;
 
@@ -75,6 +82,24 @@ typedef struct Esp32RtcCntlState {
     uint32_t scratch_reg[ESP32_RTC_CNTL_SCRATCH_REG_COUNT];
     Esp32ResetCause reset_cause[ESP32_CPU_COUNT];
     bool stat_vector_sel[ESP32_CPU_COUNT];
+
+    /* Sleep: the CPUs are stalled until the wakeup timer fires. On wakeup
+     * from deep sleep the digital part is reset, the RTC part keeps its state.
+     */
+    uint64_t slp_timer;
+    bool slp_timer_alarm_en;
+    uint32_t wakeup_ena;
+    uint32_t wakeup_cause;
+    uint32_t dig_pwc_reg;
+    uint32_t int_ena;
+    uint32_t int_raw;
+    bool sleeping;
+    bool deep_sleep;
+    QEMUTimer *wakeup_timer;
+
+    /* register images of the enum fields above, only used for migration */
+    uint32_t clk_conf_reg;
+    uint32_t reset_state_reg;
 } Esp32RtcCntlState;
 
 REG32(RTC_CNTL_OPTIONS0, 0x00)
@@ -84,18 +109,39 @@ REG32(RTC_CNTL_OPTIONS0, 0x00)
     FIELD(RTC_CNTL_OPTIONS0, SW_STALL_PROCPU_C0, 2, 2)
     FIELD(RTC_CNTL_OPTIONS0, SW_STALL_APPCPU_C0, 0, 2)
 
+REG32(RTC_CNTL_SLP_TIMER0, 0x04)
+REG32(RTC_CNTL_SLP_TIMER1, 0x08)
+    FIELD(RTC_CNTL_SLP_TIMER1, SLP_VAL_HI, 0, 16)
+    FIELD(RTC_CNTL_SLP_TIMER1, MAIN_TIMER_ALARM_EN, 16, 1)
+
 REG32(RTC_CNTL_TIME_UPDATE, 0xc)
     FIELD(RTC_CNTL_TIME_UPDATE, UPDATE, 31, 1)
     FIELD(RTC_CNTL_TIME_UPDATE, VALID, 30, 1)
 REG32(RTC_CNTL_TIME0, 0x10)
 REG32(RTC_CNTL_TIME1, 0x14)
 
+REG32(RTC_CNTL_STATE0, 0x18)
+    FIELD(RTC_CNTL_STATE0, SLEEP_EN, 31, 1)
+    FIELD(RTC_CNTL_STATE0, SLP_REJECT, 30, 1)
+    FIELD(RTC_CNTL_STATE0, SLP_WAKEUP, 29, 1)
+
 REG32(RTC_CNTL_RESET_STATE, 0x34)
     FIELD(RTC_CNTL_RESET_STATE, PROCPU_STAT_VECTOR_SEL, 13, 1)
     FIELD(RTC_CNTL_RESET_STATE, APPCPU_STAT_VECTOR_SEL, 12, 1)
     FIELD(RTC_CNTL_RESET_STATE, RESET_CAUSE_APPCPU, 6, 6)
     FIELD(RTC_CNTL_RESET_STATE, RESET_CAUSE_PROCPU, 0, 6)
 
+REG32(RTC_CNTL_WAKEUP_STATE, 0x38)
+    FIELD(RTC_CNTL_WAKEUP_STATE, WAKEUP_ENA, 14, 11)
+    FIELD(RTC_CNTL_WAKEUP_STATE, WAKEUP_CAUSE, 0, 11)
+
+REG32(RTC_CNTL_INT_ENA, 0x3c)
+REG32(RTC_CNTL_INT_RAW, 0x40)
+REG32(RTC_CNTL_INT_ST, 0x44)
+REG32(RTC_CNTL_INT_CLR, 0x48)
+    FIELD(RTC_CNTL_INT, SLP_WAKEUP, 0, 1)
+    FIELD(RTC_CNTL_INT, SLP_REJECT, 1, 1)
+
 REG32(RTC_CNTL_STORE0, 0x4c)
 REG32(RTC_CNTL_STORE1, 0x50)
 REG32(RTC_CNTL_STORE2, 0x54)
@@ -106,6 +152,9 @@ REG32(RTC_CNTL_CLK_CONF, 0x70)
     FIELD(RTC_CNTL_CLK_CONF, FAST_CLK_RTC_SEL, 29, 1)
     FIELD(RTC_CNTL_CLK_CONF, SOC_CLK_SEL, 27, 2)
 
+REG32(RTC_CNTL_DIG_PWC, 0x8c)
+    FIELD(RTC_CNTL_DIG_PWC, DG_WRAP_PD_EN, 31, 1)
+
 REG32(RTC_CNTL_SW_CPU_STALL, 0xac)
     FIELD(RTC_CNTL_SW_CPU_STALL, PROCPU_C1, 26, 6)
     FIELD(RTC_CNTL_SW_CPU_STALL, APPCPU_C1, 20, 6)
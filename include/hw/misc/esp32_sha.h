@@ -9,14 +9,17 @@
 #define ESP32_SHA(obj) OBJECT_CHECK(Esp32ShaState, (obj), TYPE_ESP32_SHA)
 
 #define ESP32_SHA_TEXT_REG_CNT    32
+#define ESP32_SHA256_HASH_WORDS   8
+#define ESP32_SHA512_HASH_WORDS   8
 
 typedef struct Esp32ShaState {
     SysBusDevice parent_obj;
     MemoryRegion iomem;
     uint32_t text[ESP32_SHA_TEXT_REG_CNT];
-    uint8_t* full_text;
-    uint32_t full_text_reserved;
-    uint32_t full_text_len;
+    /* intermediate hash state; SHA-1 and SHA-256 use hash32,
+     * SHA-384 and SHA-512 use hash64 */
+    uint32_t hash32[ESP32_SHA256_HASH_WORDS];
+    uint64_t hash64[ESP32_SHA512_HASH_WORDS];
 } Esp32ShaState;
 
 #define SHA_REG_GROUP(name, base) \
@@ -0,0 +1,9 @@
+#pragma once
+
+#define TYPE_SX127X "sx127x"
+
+/* Named GPIO output, DIO0..DIO5 interrupt lines */
+#define SX127X_GPIO_DIO     "sx127x.dio"
+#define SX127X_DIO_COUNT    6
+/* Named GPIO input, active low reset */
+#define SX127X_GPIO_RESET   "sx127x.reset"
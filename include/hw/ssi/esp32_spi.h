@@ -3,6 +3,7 @@
 #include "hw/hw.h"
 #include "hw/registerfields.h"
 #include "hw/ssi/ssi.h"
+#include "qemu/timer.h"
 
 #define TYPE_ESP32_SPI "ssi.esp32.spi"
 #define ESP32_SPI(obj) OBJECT_CHECK(Esp32SpiState, (obj), TYPE_ESP32_SPI)
@@ -10,14 +11,28 @@
 #define ESP32_SPI_CS_COUNT      3
 #define ESP32_SPI_BUF_WORDS     16
 
+/* Pulsed after a command which modifies the flash contents;
+ * flash_write_addr and flash_write_len describe the affected range.
+ */
+#define ESP32_SPI_FLASH_WRITE_GPIO "flash-write"
+
+/* DMA link addresses are offsets into the internal SRAM region */
+#define ESP32_SPI_DMA_ADDR_BASE     0x3ff00000
+/* Upper bound on the descriptors processed per transfer, guards against loops */
+#define ESP32_SPI_DMA_MAX_DESC      4096
+
 typedef struct Esp32SpiState {
     SysBusDevice parent_obj;
 
     MemoryRegion iomem;
     qemu_irq irq;
+    qemu_irq dma_irq;
     qemu_irq cs_gpio[ESP32_SPI_CS_COUNT];
     int num_cs;
     SSIBus *spi;
+    qemu_irq flash_write_req;
+    uint32_t flash_write_addr;
+    uint32_t flash_write_len;
 
     uint32_t addr_reg;
     uint32_t ctrl_reg;
@@ -30,7 +45,27 @@ typedef struct Esp32SpiState {
     uint32_t mosi_dlen_reg;
     uint32_t miso_dlen_reg;
     uint32_t pin_reg;
+    uint32_t clock_reg;
+    uint32_t slave_reg;
     uint32_t data_reg[ESP32_SPI_BUF_WORDS];
+
+    /* USR transaction in progress, completes when trans_done_timer fires */
+    bool usr_busy;
+    QEMUTimer trans_done_timer;
+    uint32_t apb_freq;
+
+    uint32_t dma_conf_reg;
+    uint32_t dma_out_link_reg;
+    uint32_t dma_in_link_reg;
+    uint32_t dma_int_ena;
+    uint32_t dma_int_raw;
+    uint32_t dma_in_suc_eof_des_addr;
+    uint32_t dma_out_eof_des_addr;
+    /* DMA interrupts raised when the transaction completes */
+    uint32_t dma_int_pending;
+    /* set by the START bit of the link registers, consumed by the next USR command */
+    bool dma_out_active;
+    bool dma_in_active;
 } Esp32SpiState;
 
 
@@ -59,6 +94,10 @@ REG32(SPI_STATUS, 0x10)
 
 REG32(SPI_CTRL1, 0x0c)
 REG32(SPI_CTRL2, 0x14)
+REG32(SPI_CLOCK, 0x18)
+    FIELD(SPI_CLOCK, CLK_EQU_SYSCLK, 31, 1)
+    FIELD(SPI_CLOCK, CLKDIV_PRE, 18, 13)
+    FIELD(SPI_CLOCK, CLKCNT_N, 12, 6)
 REG32(SPI_USER, 0x1C)
     FIELD(SPI_USER, COMMAND, 31, 1)
     FIELD(SPI_USER, ADDR, 30, 1)
@@ -79,10 +118,54 @@ REG32(SPI_USER2, 0x24)
 REG32(SPI_MOSI_DLEN, 0x28)
 REG32(SPI_MISO_DLEN, 0x2c)
 REG32(SPI_PIN, 0x34)
+REG32(SPI_SLAVE, 0x38)
+    FIELD(SPI_SLAVE, TRANS_INTEN, 9, 1)
+    FIELD(SPI_SLAVE, TRANS_DONE, 4, 1)
+
 REG32(SPI_W0, 0x80)
 REG32(SPI_EXT0, 0xF0)
 REG32(SPI_EXT1, 0xF4)
 REG32(SPI_EXT2, 0xF8)
 REG32(SPI_EXT3, 0xFC)
 
+REG32(SPI_DMA_CONF, 0x100)
+    FIELD(SPI_DMA_CONF, OUT_AUTO_WRBACK, 8, 1)
+    FIELD(SPI_DMA_CONF, OUT_RST, 3, 1)
+    FIELD(SPI_DMA_CONF, IN_RST, 2, 1)
+
+REG32(SPI_DMA_OUT_LINK, 0x104)
+    FIELD(SPI_DMA_OUT_LINK, RESTART, 30, 1)
+    FIELD(SPI_DMA_OUT_LINK, START, 29, 1)
+    FIELD(SPI_DMA_OUT_LINK, STOP, 28, 1)
+    FIELD(SPI_DMA_OUT_LINK, ADDR, 0, 20)
+
+REG32(SPI_DMA_IN_LINK, 0x108)
+    FIELD(SPI_DMA_IN_LINK, RESTART, 30, 1)
+    FIELD(SPI_DMA_IN_LINK, START, 29, 1)
+    FIELD(SPI_DMA_IN_LINK, STOP, 28, 1)
+    FIELD(SPI_DMA_IN_LINK, ADDR, 0, 20)
+
+REG32(SPI_DMA_STATUS, 0x10c)
+REG32(SPI_DMA_INT_ENA, 0x110)
+REG32(SPI_DMA_INT_RAW, 0x114)
+REG32(SPI_DMA_INT_ST, 0x118)
+REG32(SPI_DMA_INT_CLR, 0x11c)
+    FIELD(SPI_DMA_INT, OUT_TOTAL_EOF, 8, 1)
+    FIELD(SPI_DMA_INT, OUT_EOF, 7, 1)
+    FIELD(SPI_DMA_INT, OUT_DONE, 6, 1)
+    FIELD(SPI_DMA_INT, IN_SUC_EOF, 5, 1)
+    FIELD(SPI_DMA_INT, IN_DONE, 3, 1)
+    FIELD(SPI_DMA_INT, INLINK_DSCR_ERROR, 2, 1)
+    FIELD(SPI_DMA_INT, OUTLINK_DSCR_ERROR, 1, 1)
+    FIELD(SPI_DMA_INT, INLINK_DSCR_EMPTY, 0, 1)
+
+REG32(SPI_IN_SUC_EOF_DES_ADDR, 0x124)
+REG32(SPI_OUT_EOF_DES_ADDR, 0x138)
+
+/* DMA linked list descriptor, as laid out in memory (lldesc_t) */
+FIELD(SPI_DMA_DESC, SIZE, 0, 12)
+FIELD(SPI_DMA_DESC, LENGTH, 12, 12)
+FIELD(SPI_DMA_DESC, EOF, 30, 1)
+FIELD(SPI_DMA_DESC, OWNER, 31, 1)
+
 
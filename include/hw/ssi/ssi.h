@@ -57,6 +57,15 @@ struct SSISlaveClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSISlave *dev, uint32_t val);
+
+    /* Optional fast path for multi-byte transfers. Used by ssi_transfer_bulk
+     * when this device is the only one selected on the bus. Either tx or rx
+     * may be NULL, and both may point to the same buffer. Returns the number
+     * of bytes consumed from the start of the buffer; the remainder is sent
+     * through transfer() one byte at a time.
+     */
+    uint32_t (*transfer_bulk)(SSISlave *dev, const uint8_t *tx, uint8_t *rx,
+                              uint32_t len);
 };
 
 struct SSISlave {
@@ -85,6 +94,11 @@ DeviceState *ssi_create_slave_no_init(SSIBus *bus, const char *name);
 SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
+/* Transfer len bytes. A NULL tx sends zeroes, a NULL rx discards the data
+ * received. tx and rx may point to the same buffer.
+ */
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       uint32_t len);
 
 /* Automatically connect all children nodes a spi controller as slaves */
 void ssi_auto_connect_slaves(DeviceState *parent, qemu_irq *cs_lines,
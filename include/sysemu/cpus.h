@@ -30,6 +30,16 @@ void cpu_synchronize_all_post_init(void);
 void cpu_synchronize_all_pre_loadvm(void);
 
 void qtest_clock_warp(int64_t dest);
+/*
+ * Jump QEMU_CLOCK_VIRTUAL to the next timer deadline whenever all vCPUs
+ * are idle, without enabling icount.
+ */
+void qemu_set_idle_warp(bool enable);
+/*
+ * Advance QEMU_CLOCK_VIRTUAL by at most @delta ns, but not past the next
+ * timer deadline, to skip a guest busy-wait loop. No-op with icount.
+ */
+int64_t qemu_busy_wait_warp(int64_t delta);
 
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
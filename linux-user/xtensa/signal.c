@@ -184,10 +184,10 @@ void setup_rt_frame(int sig, struct target_sigaction *ka,
         __put_user(0x00, &frame->retcode[5]);
 #endif
     }
-    memset(env->regs, 0, sizeof(env->regs));
+    xtensa_rotate_window(env, -env->sregs[WINDOW_BASE]);
+    memset(env->regs, 0, 16 * sizeof(uint32_t));
     env->pc = ka->_sa_handler;
     env->regs[1] = frame_addr;
-    env->sregs[WINDOW_BASE] = 0;
     env->sregs[WINDOW_START] = 1;
 
     abi_call0 = (env->sregs[PS] & PS_WOE) == 0;
@@ -226,7 +226,7 @@ static void restore_sigcontext(CPUXtensaState *env,
     __get_user(env->sregs[LEND], &sc->sc_lend);
     __get_user(env->sregs[LCOUNT], &sc->sc_lcount);
 
-    env->sregs[WINDOW_BASE] = 0;
+    xtensa_rotate_window(env, -env->sregs[WINDOW_BASE]);
     env->sregs[WINDOW_START] = 1;
     env->sregs[PS] = deposit32(env->sregs[PS],
                                PS_CALLINC_SHIFT,
@@ -8,9 +8,12 @@ static inline void cpu_clone_regs_child(CPUXtensaState *env,
                                         target_ulong newsp,
                                         unsigned flags)
 {
+    /* env was copied from the parent, rebase the window onto our phys_regs */
+    xtensa_sync_phys_from_window(env);
+    xtensa_sync_window_from_phys(env);
     if (newsp) {
+        xtensa_rotate_window(env, -env->sregs[WINDOW_BASE]);
         env->regs[1] = newsp;
-        env->sregs[WINDOW_BASE] = 0;
         env->sregs[WINDOW_START] = 0x1;
     }
     env->regs[2] = 0;
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "monitor-internal.h"
+#include "chardev/char-mux.h"
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
 #include "qapi/qapi-emit-events.h"
@@ -590,6 +591,65 @@ void monitor_cleanup(void)
     }
 }
 
+/* Park the monitor I/O thread while x-fork forks, see monitor_fork_prepare() */
+static QemuSemaphore mon_fork_parked;
+static QemuSemaphore mon_fork_resume;
+
+static void monitor_fork_park_bh(void *opaque)
+{
+    qemu_sem_post(&mon_fork_parked);
+    qemu_sem_wait(&mon_fork_resume);
+}
+
+/*
+ * Only the thread calling fork() survives in the child, so no lock that
+ * the monitor I/O thread may hold can be used there. Make the I/O thread
+ * wait in a bottom half, where it holds none of them, until
+ * monitor_fork_parent() is called in the parent.
+ */
+void monitor_fork_prepare(void)
+{
+    if (!mon_iothread) {
+        return;
+    }
+    aio_bh_schedule_oneshot(iothread_get_aio_context(mon_iothread),
+                            monitor_fork_park_bh, NULL);
+    qemu_sem_wait(&mon_fork_parked);
+}
+
+void monitor_fork_parent(void)
+{
+    if (mon_iothread) {
+        qemu_sem_post(&mon_fork_resume);
+    }
+}
+
+/*
+ * Detach a child process created by x-fork from the monitors, whose
+ * connections still belong to the parent. Requests the parent has queued
+ * are dropped and the monitor chardevs are closed, so that the child does
+ * not keep the parent's sockets open. A monitor on a mux chardev shares
+ * it with a frontend and only loses its handlers.
+ */
+void monitor_fork_child(void)
+{
+    Monitor *mon;
+
+    QTAILQ_FOREACH(mon, &mon_list, entry) {
+        Chardev *chr = qemu_chr_fe_get_driver(&mon->chr);
+
+        mon->skip_flush = true;
+        mon->use_io_thread = false;
+        if (monitor_is_qmp(mon)) {
+            monitor_qmp_fork_child(container_of(mon, MonitorQMP, common));
+        }
+        qemu_chr_fe_deinit(&mon->chr, chr && !CHARDEV_IS_MUX(chr));
+    }
+
+    /* The I/O thread did not survive fork(), never try to join it */
+    mon_iothread = NULL;
+}
+
 static void monitor_qapi_event_init(void)
 {
     monitor_qapi_event_state = g_hash_table_new(qapi_event_throttle_hash,
@@ -600,6 +660,8 @@ void monitor_init_globals_core(void)
 {
     monitor_qapi_event_init();
     qemu_mutex_init(&monitor_lock);
+    qemu_sem_init(&mon_fork_parked, 0);
+    qemu_sem_init(&mon_fork_resume, 0);
 
     /*
      * The dispatcher BH must run in the main loop thread, since we
@@ -373,6 +373,14 @@ static void monitor_qmp_event(void *opaque, QEMUChrEvent event)
     }
 }
 
+/* Drop the requests queued by the parent of an x-fork child */
+void monitor_qmp_fork_child(MonitorQMP *mon)
+{
+    qemu_mutex_lock(&mon->qmp_queue_lock);
+    monitor_qmp_cleanup_req_queue_locked(mon);
+    qemu_mutex_unlock(&mon->qmp_queue_lock);
+}
+
 void monitor_data_destroy_qmp(MonitorQMP *mon)
 {
     json_message_parser_destroy(&mon->parser);
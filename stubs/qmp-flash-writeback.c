@@ -0,0 +1,15 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-block.h"
+
+FlashWritebackInfoList *qmp_query_flash_writeback(Error **errp)
+{
+    return NULL;
+}
+
+void qmp_flash_writeback_flush(bool has_path, const char *path, Error **errp)
+{
+    if (has_path) {
+        error_setg(errp, "Path '%s' does not refer to a SPI flash device", path);
+    }
+}
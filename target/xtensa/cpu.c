@@ -99,6 +99,7 @@ static void xtensa_cpu_reset(DeviceState *dev)
     env->sregs[CONFIGID0] = env->config->configid[0];
     env->sregs[CONFIGID1] = env->config->configid[1];
     env->exclusive_addr = -1;
+    xtensa_sync_window_from_phys(env);
 
 #ifndef CONFIG_USER_ONLY
     reset_mmu(env);
@@ -160,6 +161,7 @@ static void xtensa_cpu_initfn(Object *obj)
 
     cpu_set_cpustate_pointers(cpu);
     env->config = xcc->config;
+    env->regs = env->phys_regs;
 
 #ifndef CONFIG_USER_ONLY
     env->address_space_er = g_malloc(sizeof(*env->address_space_er));
@@ -170,11 +172,6 @@ static void xtensa_cpu_initfn(Object *obj)
 #endif
 }
 
-static const VMStateDescription vmstate_xtensa_cpu = {
-    .name = "cpu",
-    .unmigratable = 1,
-};
-
 static void xtensa_cpu_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -204,7 +201,9 @@ static void xtensa_cpu_class_init(ObjectClass *oc, void *data)
     cc->debug_excp_handler = xtensa_breakpoint_handler;
     cc->disas_set_info = xtensa_cpu_disas_set_info;
     cc->tcg_initialize = xtensa_translate_init;
-    dc->vmsd = &vmstate_xtensa_cpu;
+#ifndef CONFIG_USER_ONLY
+    cc->vmsd = &vmstate_xtensa_cpu;
+#endif
 }
 
 static const TypeInfo xtensa_cpu_type_info = {
@@ -321,6 +321,11 @@ typedef struct xtensa_tlb {
     unsigned nrefillentries;
 } xtensa_tlb;
 
+typedef union xtensa_freg {
+    float32 f32[2];
+    float64 f64;
+} xtensa_freg;
+
 typedef struct xtensa_mpu_entry {
     uint32_t vaddr;
     uint32_t attr;
@@ -423,6 +428,8 @@ typedef struct XtensaOpcodeTranslators {
 extern const XtensaOpcodeTranslators xtensa_core_opcodes;
 extern const XtensaOpcodeTranslators xtensa_fpu2000_opcodes;
 
+typedef struct XtensaDecodeCache XtensaDecodeCache;
+
 struct XtensaConfig {
     const char *name;
     uint64_t options;
@@ -472,6 +479,7 @@ struct XtensaConfig {
     const XtensaOpcodeTranslators **opcode_translators;
     xtensa_regfile a_regfile;
     void ***regfile;
+    XtensaDecodeCache *decode_cache;
 
     uint32_t clock_freq_khz;
 
@@ -501,17 +509,37 @@ enum {
 };
 #endif
 
+#ifndef CONFIG_USER_ONLY
+#define XTENSA_HLE_MAX_ARGS 6
+
+/*
+ * High-level emulation of a guest routine: when execution reaches @pc, the
+ * routine is run natively by @fn with the caller's arguments and the CPU
+ * returns to the caller with the value returned by @fn in a2.
+ */
+typedef struct XtensaHleHook {
+    const char *name;
+    uint32_t pc;
+    uint32_t (*fn)(struct CPUXtensaState *env, const uint32_t *args,
+                   void *opaque);
+    void *opaque;
+    uint64_t hits;
+} XtensaHleHook;
+#endif
+
 typedef struct CPUXtensaState {
     const XtensaConfig *config;
-    uint32_t regs[16];
+    /*
+     * Current register window: points at phys_regs[WINDOW_BASE * 4].
+     * A window that wraps past the last physical register continues
+     * into the tail of phys_regs, see xtensa_sync_window_from_phys.
+     */
+    uint32_t *regs;
     uint32_t pc;
     uint32_t sregs[256];
     uint32_t uregs[256];
-    uint32_t phys_regs[MAX_NAREG];
-    union {
-        float32 f32[2];
-        float64 f64;
-    } fregs[16];
+    uint32_t phys_regs[MAX_NAREG + 12];
+    xtensa_freg fregs[16];
     float_status fp_status;
     uint32_t windowbase_next;
     uint32_t exclusive_addr;
@@ -533,6 +561,13 @@ typedef struct CPUXtensaState {
     uint64_t time_base;
     uint64_t ccount_time;
     uint32_t ccount_base;
+    /* RSR.CCOUNT busy-wait detection, see xtensa_set_ccount_warp */
+    bool ccount_warp;
+    uint32_t ccount_spin_pc;
+    unsigned ccount_spin_reads;
+
+    XtensaHleHook *hle_hooks;
+    unsigned n_hle_hooks;
 #endif
 
     int exception_taken;
@@ -578,6 +613,10 @@ void xtensa_cpu_do_unaligned_access(CPUState *cpu, vaddr addr,
                                     MMUAccessType access_type,
                                     int mmu_idx, uintptr_t retaddr);
 
+#ifndef CONFIG_USER_ONLY
+extern const VMStateDescription vmstate_xtensa_cpu;
+#endif
+
 #define cpu_signal_handler cpu_xtensa_signal_handler
 #define cpu_list xtensa_cpu_list
 
@@ -599,6 +638,10 @@ void xtensa_cpu_do_unaligned_access(CPUState *cpu, vaddr addr,
 
 void xtensa_collect_sr_names(const XtensaConfig *config);
 void xtensa_translate_init(void);
+void xtensa_decode_cache_init(XtensaConfig *config);
+void xtensa_decode_cache_stats(const XtensaConfig *config,
+                               uint64_t *hits, uint64_t *misses,
+                               unsigned *used, unsigned *size);
 void **xtensa_get_regfile_by_name(const char *name);
 void xtensa_breakpoint_handler(CPUState *cs);
 void xtensa_register_core(XtensaConfigList *node);
@@ -613,6 +656,7 @@ void xtensa_sync_window_from_phys(CPUXtensaState *env);
 void xtensa_sync_phys_from_window(CPUXtensaState *env);
 void xtensa_rotate_window(CPUXtensaState *env, uint32_t delta);
 void xtensa_restore_owb(CPUXtensaState *env);
+void xtensa_restore_dbreak(CPUXtensaState *env);
 void debug_exception_env(CPUXtensaState *new_env, uint32_t cause);
 
 static inline void xtensa_select_static_vectors(CPUXtensaState *env,
@@ -622,6 +666,13 @@ static inline void xtensa_select_static_vectors(CPUXtensaState *env,
     env->static_vectors = n;
 }
 void xtensa_runstall(CPUXtensaState *env, bool runstall);
+void xtensa_set_hle_hooks(CPUXtensaState *env,
+                          XtensaHleHook *hooks, unsigned n_hooks);
+/*
+ * When enabled, a CPU that keeps reading CCOUNT at the same PC in a tight
+ * loop moves the virtual clock forward instead of spinning in real time.
+ */
+void xtensa_set_ccount_warp(CPUXtensaState *env, bool enable);
 
 #define XTENSA_OPTION_BIT(opt) (((uint64_t)1) << (opt))
 #define XTENSA_OPTION_ALL (~(uint64_t)0)
@@ -707,8 +758,6 @@ static inline int cpu_mmu_index(CPUXtensaState *env, bool ifetch)
 #define XTENSA_TBFLAG_CPENABLE_MASK 0x3fc0
 #define XTENSA_TBFLAG_CPENABLE_SHIFT 6
 #define XTENSA_TBFLAG_EXCEPTION 0x4000
-#define XTENSA_TBFLAG_WINDOW_MASK 0x18000
-#define XTENSA_TBFLAG_WINDOW_SHIFT 15
 #define XTENSA_TBFLAG_YIELD 0x20000
 #define XTENSA_TBFLAG_CWOE 0x40000
 #define XTENSA_TBFLAG_CALLINC_MASK 0x180000
@@ -782,15 +831,9 @@ static inline void cpu_get_tb_cpu_state(CPUXtensaState *env, target_ulong *pc,
     }
     if (xtensa_option_enabled(env->config, XTENSA_OPTION_WINDOWED_REGISTER) &&
         (env->sregs[PS] & (PS_WOE | PS_EXCM)) == PS_WOE) {
-        uint32_t windowstart = xtensa_replicate_windowstart(env) >>
-            (env->sregs[WINDOW_BASE] + 1);
-        uint32_t w = ctz32(windowstart | 0x8);
-
-        *flags |= (w << XTENSA_TBFLAG_WINDOW_SHIFT) | XTENSA_TBFLAG_CWOE;
+        *flags |= XTENSA_TBFLAG_CWOE;
         *flags |= extract32(env->sregs[PS], PS_CALLINC_SHIFT,
                             PS_CALLINC_LEN) << XTENSA_TBFLAG_CALLINC_SHIFT;
-    } else {
-        *flags |= 3 << XTENSA_TBFLAG_WINDOW_SHIFT;
     }
     if (env->yield_needed) {
         *flags |= XTENSA_TBFLAG_YIELD;
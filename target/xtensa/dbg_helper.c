@@ -111,6 +111,23 @@ void HELPER(wsr_dbreaka)(CPUXtensaState *env, uint32_t i, uint32_t v)
     env->sregs[DBREAKA + i] = v;
 }
 
+/* Re-create watchpoints from DBREAKA/DBREAKC, e.g. after loading a snapshot */
+void xtensa_restore_dbreak(CPUXtensaState *env)
+{
+    unsigned i;
+
+    for (i = 0; i < env->config->ndbreak; ++i) {
+        uint32_t dbreakc = env->sregs[DBREAKC + i];
+
+        if (dbreakc & DBREAKC_SB_LB) {
+            set_dbreak(env, i, env->sregs[DBREAKA + i], dbreakc);
+        } else if (env->cpu_watchpoint[i]) {
+            cpu_watchpoint_remove_by_ref(env_cpu(env), env->cpu_watchpoint[i]);
+            env->cpu_watchpoint[i] = NULL;
+        }
+    }
+}
+
 void HELPER(wsr_dbreakc)(CPUXtensaState *env, uint32_t i, uint32_t v)
 {
     if ((env->sregs[DBREAKC + i] ^ v) & (DBREAKC_SB_LB | DBREAKC_MASK)) {
@@ -143,6 +143,7 @@ static void init_libisa(XtensaConfig *config)
 #endif
     }
     xtensa_collect_sr_names(config);
+    xtensa_decode_cache_init(config);
 }
 
 static void xtensa_finalize_config(XtensaConfig *config)
@@ -335,4 +336,18 @@ void xtensa_runstall(CPUXtensaState *env, bool runstall)
         qemu_cpu_kick(cpu);
     }
 }
+
+/* Must be called before the CPU starts translating code */
+void xtensa_set_hle_hooks(CPUXtensaState *env,
+                          XtensaHleHook *hooks, unsigned n_hooks)
+{
+    env->hle_hooks = hooks;
+    env->n_hle_hooks = n_hooks;
+}
+
+void xtensa_set_ccount_warp(CPUXtensaState *env, bool enable)
+{
+    env->ccount_warp = enable;
+    env->ccount_spin_reads = 0;
+}
 #endif
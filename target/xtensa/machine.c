@@ -0,0 +1,132 @@
+/*
+ * Xtensa CPU migration state
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "qemu/timer.h"
+#include "migration/cpu.h"
+
+static const VMStateDescription vmstate_xtensa_freg = {
+    .name = "cpu/freg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_FLOAT64(f64, xtensa_freg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_xtensa_tlb_entry = {
+    .name = "cpu/tlb_entry",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(vaddr, xtensa_tlb_entry),
+        VMSTATE_UINT32(paddr, xtensa_tlb_entry),
+        VMSTATE_UINT8(asid, xtensa_tlb_entry),
+        VMSTATE_UINT8(attr, xtensa_tlb_entry),
+        VMSTATE_BOOL(variable, xtensa_tlb_entry),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_xtensa_mpu_entry = {
+    .name = "cpu/mpu_entry",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(vaddr, xtensa_mpu_entry),
+        VMSTATE_UINT32(attr, xtensa_mpu_entry),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int xtensa_cpu_post_load(void *opaque, int version_id)
+{
+    XtensaCPU *cpu = opaque;
+    CPUXtensaState *env = &cpu->env;
+    uint64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    unsigned i;
+
+    xtensa_sync_window_from_phys(env);
+    HELPER(wur_fcr)(env, env->uregs[FCR]);
+
+    /*
+     * CCOMPARE timers are rearmed relative to the last CCOUNT sample.
+     * A comparator which has already matched is armed for the next
+     * wraparound, as the hardware would do.
+     */
+    if (xtensa_option_enabled(env->config, XTENSA_OPTION_TIMER_INTERRUPT)) {
+        for (i = 0; i < env->config->nccompare; ++i) {
+            uint64_t dcc = (uint64_t)(env->sregs[CCOMPARE + i] -
+                                      env->sregs[CCOUNT] - 1) + 1;
+            uint64_t expire = env->ccount_time +
+                (dcc * 1000000) / env->config->clock_freq_khz;
+
+            if (expire <= now) {
+                uint64_t period = (UINT64_C(1) << 32) * 1000000 /
+                    env->config->clock_freq_khz;
+
+                expire += ((now - expire) / period + 1) * period;
+            }
+            timer_mod(env->ccompare[i].timer, expire);
+        }
+    }
+
+    xtensa_restore_dbreak(env);
+    check_interrupts(env);
+    return 0;
+}
+
+static int xtensa_cpu_pre_save(void *opaque)
+{
+    XtensaCPU *cpu = opaque;
+
+    xtensa_sync_phys_from_window(&cpu->env);
+    return 0;
+}
+
+const VMStateDescription vmstate_xtensa_cpu = {
+    .name = "cpu",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = xtensa_cpu_pre_save,
+    .post_load = xtensa_cpu_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(env.pc, XtensaCPU),
+        VMSTATE_UINT32_ARRAY(env.sregs, XtensaCPU, 256),
+        VMSTATE_UINT32_ARRAY(env.uregs, XtensaCPU, 256),
+        VMSTATE_UINT32_SUB_ARRAY(env.phys_regs, XtensaCPU, 0, MAX_NAREG),
+        VMSTATE_STRUCT_ARRAY(env.fregs, XtensaCPU, 16, 1,
+                             vmstate_xtensa_freg, xtensa_freg),
+        VMSTATE_UINT8(env.fp_status.float_exception_flags, XtensaCPU),
+        VMSTATE_UINT32(env.windowbase_next, XtensaCPU),
+        VMSTATE_UINT32(env.exclusive_addr, XtensaCPU),
+        VMSTATE_UINT32(env.exclusive_val, XtensaCPU),
+        VMSTATE_STRUCT_2DARRAY(env.itlb, XtensaCPU, 7, MAX_TLB_WAY_SIZE, 1,
+                               vmstate_xtensa_tlb_entry, xtensa_tlb_entry),
+        VMSTATE_STRUCT_2DARRAY(env.dtlb, XtensaCPU, 10, MAX_TLB_WAY_SIZE, 1,
+                               vmstate_xtensa_tlb_entry, xtensa_tlb_entry),
+        VMSTATE_STRUCT_ARRAY(env.mpu_fg, XtensaCPU,
+                             MAX_MPU_FOREGROUND_SEGMENTS, 1,
+                             vmstate_xtensa_mpu_entry, xtensa_mpu_entry),
+        VMSTATE_UINT32(env.autorefill_idx, XtensaCPU),
+        VMSTATE_BOOL(env.runstall, XtensaCPU),
+        VMSTATE_INT32(env.pending_irq_level, XtensaCPU),
+        VMSTATE_UINT64(env.time_base, XtensaCPU),
+        VMSTATE_UINT64(env.ccount_time, XtensaCPU),
+        VMSTATE_UINT32(env.ccount_base, XtensaCPU),
+        VMSTATE_INT32(env.exception_taken, XtensaCPU),
+        VMSTATE_INT32(env.yield_needed, XtensaCPU),
+        VMSTATE_UINT32(env.static_vectors, XtensaCPU),
+        VMSTATE_END_OF_LIST()
+    }
+};
@@ -37,3 +37,44 @@ void hmp_info_tlb(Monitor *mon, const QDict *qdict)
     }
     dump_mmu(env1);
 }
+
+void hmp_info_hle(Monitor *mon, const QDict *qdict)
+{
+    CPUArchState *env1 = mon_get_cpu_env();
+    unsigned i;
+
+    if (!env1) {
+        monitor_printf(mon, "No CPU available\n");
+        return;
+    }
+    if (!env1->n_hle_hooks) {
+        monitor_printf(mon, "No routines are emulated natively\n");
+        return;
+    }
+    for (i = 0; i < env1->n_hle_hooks; ++i) {
+        XtensaHleHook *hook = env1->hle_hooks + i;
+
+        monitor_printf(mon, "0x%08x %-20s %" PRIu64 "\n",
+                       hook->pc, hook->name, atomic_read_u64(&hook->hits));
+    }
+}
+
+void hmp_info_decode_cache(Monitor *mon, const QDict *qdict)
+{
+    CPUArchState *env1 = mon_get_cpu_env();
+    uint64_t hits, misses;
+    unsigned used, size;
+
+    if (!env1) {
+        monitor_printf(mon, "No CPU available\n");
+        return;
+    }
+    xtensa_decode_cache_stats(env1->config, &hits, &misses, &used, &size);
+    monitor_printf(mon, "entries %u/%u\n", used, size);
+    monitor_printf(mon, "hits    %" PRIu64 "\n", hits);
+    monitor_printf(mon, "misses  %" PRIu64 "\n", misses);
+    if (hits + misses) {
+        monitor_printf(mon, "hit rate %.1f%%\n",
+                       100.0 * hits / (hits + misses));
+    }
+}
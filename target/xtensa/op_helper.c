@@ -34,6 +34,7 @@
 #include "exec/cpu_ldst.h"
 #include "exec/address-spaces.h"
 #include "qemu/timer.h"
+#include "sysemu/cpus.h"
 
 #ifndef CONFIG_USER_ONLY
 
@@ -44,7 +45,41 @@ void HELPER(update_ccount)(CPUXtensaState *env)
     env->ccount_time = now;
     env->sregs[CCOUNT] = env->ccount_base +
         (uint32_t)((now - env->time_base) *
-                   env->config->clock_freq_khz / 1000000);
+                   atomic_read(&env->config->clock_freq_khz) / 1000000);
+}
+
+/*
+ * A CCOUNT read from the same PC as the previous one, less than
+ * XTENSA_CCOUNT_SPIN_GAP_NS later, counts as a busy-wait iteration.
+ * After XTENSA_CCOUNT_SPIN_READS of them every further read advances
+ * the virtual clock by XTENSA_CCOUNT_SPIN_WARP_NS.
+ */
+#define XTENSA_CCOUNT_SPIN_READS 16
+#define XTENSA_CCOUNT_SPIN_GAP_NS 2000
+#define XTENSA_CCOUNT_SPIN_WARP_NS 10000
+
+/* RSR.CCOUNT: doesn't touch TCG globals, the translator keeps the SR */
+uint32_t HELPER(rsr_ccount)(CPUXtensaState *env, uint32_t pc)
+{
+    uint64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (env->ccount_warp) {
+        if (pc == env->ccount_spin_pc &&
+            now - env->ccount_time < XTENSA_CCOUNT_SPIN_GAP_NS) {
+            if (env->ccount_spin_reads < XTENSA_CCOUNT_SPIN_READS) {
+                ++env->ccount_spin_reads;
+            } else if (qemu_busy_wait_warp(XTENSA_CCOUNT_SPIN_WARP_NS)) {
+                now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            }
+        } else {
+            env->ccount_spin_pc = pc;
+            env->ccount_spin_reads = 0;
+        }
+    }
+    env->ccount_time = now;
+    return env->ccount_base +
+        (uint32_t)((now - env->time_base) *
+                   atomic_read(&env->config->clock_freq_khz) / 1000000);
 }
 
 void HELPER(wsr_ccount)(CPUXtensaState *env, uint32_t v)
@@ -67,7 +102,8 @@ void HELPER(update_ccompare)(CPUXtensaState *env, uint32_t i)
     HELPER(update_ccount)(env);
     dcc = (uint64_t)(env->sregs[CCOMPARE + i] - env->sregs[CCOUNT] - 1) + 1;
     timer_mod(env->ccompare[i].timer,
-              env->ccount_time + (dcc * 1000000) / env->config->clock_freq_khz);
+              env->ccount_time + (dcc * 1000000) /
+              atomic_read(&env->config->clock_freq_khz));
     env->yield_needed = 1;
 }
 
@@ -196,6 +232,48 @@ void HELPER(wsr_memctl)(CPUXtensaState *env, uint32_t v)
     env->sregs[MEMCTL] = v & env->config->memctl_mask;
 }
 
+/* Caller's register @i, which may be outside of the current window */
+static uint32_t xtensa_hle_arg(CPUXtensaState *env, unsigned i)
+{
+    if (i < 16) {
+        return env->regs[i];
+    }
+    return env->phys_regs[(env->sregs[WINDOW_BASE] * 4 + i) %
+                          env->config->nareg];
+}
+
+/*
+ * Called instead of the first instruction of a hooked routine. ENTRY has
+ * not run yet, so the arguments are in the caller's window, starting at
+ * a(CALLINC * 4 + 2), and the return address is in a(CALLINC * 4).
+ */
+void HELPER(hle_hook)(CPUXtensaState *env, uint32_t i)
+{
+    XtensaHleHook *hook = env->hle_hooks + i;
+    uint32_t args[XTENSA_HLE_MAX_ARGS];
+    unsigned callinc = 0;
+    unsigned j;
+
+    if (xtensa_option_enabled(env->config, XTENSA_OPTION_WINDOWED_REGISTER)) {
+        callinc = extract32(env->sregs[PS], PS_CALLINC_SHIFT, PS_CALLINC_LEN);
+        xtensa_sync_phys_from_window(env);
+    }
+    for (j = 0; j < XTENSA_HLE_MAX_ARGS; ++j) {
+        args[j] = xtensa_hle_arg(env, callinc * 4 + 2 + j);
+    }
+
+    /* Both CPUs may share the table, an occasional lost hit is fine */
+    atomic_set_u64(&hook->hits, atomic_read_u64(&hook->hits) + 1);
+    env->regs[callinc * 4 + 2] = hook->fn(env, args, hook->opaque);
+
+    if (callinc) {
+        env->pc = (env->regs[callinc * 4] & 0x3fffffff) |
+            (env->pc & 0xc0000000);
+    } else {
+        env->pc = env->regs[0];
+    }
+}
+
 #endif
 
 uint32_t HELPER(rer)(CPUXtensaState *env, uint32_t addr)
@@ -36,6 +36,8 @@
 #include "tcg/tcg-op.h"
 #include "qemu/log.h"
 #include "qemu/qemu-print.h"
+#include "qemu/rcu.h"
+#include "qemu/stats64.h"
 #include "exec/cpu_ldst.h"
 #include "hw/semihosting/semihost.h"
 #include "exec/translator.h"
@@ -55,6 +57,7 @@ struct DisasContext {
     int ring;
     uint32_t lbeg_off;
     uint32_t lend;
+    TCGLabel *loop_label;
 
     bool sar_5bit;
     bool sar_m32_5bit;
@@ -62,6 +65,7 @@ struct DisasContext {
     TCGv_i32 sar_m32;
 
     unsigned window;
+    bool window_checked;
     unsigned callinc;
     bool cwoe;
 
@@ -77,6 +81,7 @@ struct DisasContext {
 };
 
 static TCGv_i32 cpu_pc;
+static TCGv_ptr cpu_regs_ptr;
 static TCGv_i32 cpu_R[16];
 static TCGv_i32 cpu_FR[16];
 static TCGv_i32 cpu_MR[4];
@@ -156,9 +161,12 @@ void xtensa_translate_init(void)
     cpu_pc = tcg_global_mem_new_i32(cpu_env,
             offsetof(CPUXtensaState, pc), "pc");
 
+    cpu_regs_ptr = tcg_global_mem_new_ptr(cpu_env,
+            offsetof(CPUXtensaState, regs), "regs");
+
     for (i = 0; i < 16; i++) {
-        cpu_R[i] = tcg_global_mem_new_i32(cpu_env,
-                                          offsetof(CPUXtensaState, regs[i]),
+        cpu_R[i] = tcg_global_mem_new_i32(cpu_regs_ptr,
+                                          i * sizeof(uint32_t),
                                           regnames[i]);
     }
 
@@ -414,6 +422,30 @@ static void gen_callw_slot(DisasContext *dc, int callinc, TCGv_i32 dest,
     gen_jump_slot(dc, dest, slot);
 }
 
+/*
+ * A TB that starts at LBEG and reaches LEND holds the whole loop body.
+ * Its back edge branches straight to the start of the TB, leaving only
+ * for a pending exit request, the same check the TB prologue does.
+ */
+static bool gen_loop_back_edge(DisasContext *dc, int slot)
+{
+    TCGv_i32 count;
+
+    if (!dc->loop_label || slot < 0 ||
+        (dc->op_flags & XTENSA_OP_POSTPROCESS) ||
+        dc->base.pc_next - dc->lbeg_off != dc->base.pc_first) {
+        return false;
+    }
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, cpu_env,
+                   offsetof(XtensaCPU, neg.icount_decr.u32) -
+                   offsetof(XtensaCPU, env));
+    tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
+    tcg_temp_free(count);
+    tcg_gen_br(dc->loop_label);
+    return true;
+}
+
 static bool gen_check_loop_end(DisasContext *dc, int slot)
 {
     if (dc->base.pc_next == dc->lend) {
@@ -421,10 +453,12 @@ static bool gen_check_loop_end(DisasContext *dc, int slot)
 
         tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_SR[LCOUNT], 0, label);
         tcg_gen_subi_i32(cpu_SR[LCOUNT], cpu_SR[LCOUNT], 1);
-        if (dc->lbeg_off) {
-            gen_jumpi(dc, dc->base.pc_next - dc->lbeg_off, slot);
-        } else {
-            gen_jump(dc, cpu_SR[LBEG]);
+        if (!gen_loop_back_edge(dc, slot)) {
+            if (dc->lbeg_off) {
+                gen_jumpi(dc, dc->base.pc_next - dc->lbeg_off, slot);
+            } else {
+                gen_jump(dc, cpu_SR[LBEG]);
+            }
         }
         gen_set_label(label);
         gen_jumpi(dc, dc->base.pc_next, -1);
@@ -544,17 +578,47 @@ static void gen_waiti(DisasContext *dc, uint32_t imm4)
 }
 #endif
 
+/*
+ * Registers of the first dc->window windows after WINDOW_BASE are known to
+ * be free of live frames. Anything beyond that is tested inline against
+ * WINDOW_START; the helper is only called to raise the overflow exception.
+ * A TB emits at most one such test: an instruction that would need a
+ * second one starts a new TB instead, unless that would upset icount.
+ */
 static bool gen_window_check(DisasContext *dc, uint32_t mask)
 {
     unsigned r = 31 - clz32(mask);
+    unsigned w = r / 4;
+
+    if (w > dc->window) {
+        TCGLabel *label;
+        TCGv_i32 ws;
+        TCGv_i32 tmp;
+
+        if (dc->window_checked && !dc->icount &&
+            !(tb_cflags(dc->base.tb) & CF_USE_ICOUNT)) {
+            dc->base.pc_next = dc->pc;
+            dc->base.is_jmp = DISAS_TOO_MANY;
+            return false;
+        }
 
-    if (r / 4 > dc->window) {
-        TCGv_i32 pc = tcg_const_i32(dc->pc);
-        TCGv_i32 w = tcg_const_i32(r / 4);
-
-        gen_helper_window_check(cpu_env, pc, w);
-        dc->base.is_jmp = DISAS_NORETURN;
-        return false;
+        label = gen_new_label();
+        ws = tcg_temp_new_i32();
+        tmp = tcg_temp_new_i32();
+        tcg_gen_shli_i32(ws, cpu_SR[WINDOW_START], dc->config->nareg / 4);
+        tcg_gen_or_i32(ws, ws, cpu_SR[WINDOW_START]);
+        tcg_gen_addi_i32(tmp, cpu_SR[WINDOW_BASE], 1);
+        tcg_gen_shr_i32(ws, ws, tmp);
+        tcg_gen_andi_i32(ws, ws, (1u << w) - 1);
+        tcg_gen_brcondi_i32(TCG_COND_EQ, ws, 0, label);
+        tcg_gen_movi_i32(tmp, dc->pc);
+        tcg_gen_movi_i32(ws, w);
+        gen_helper_window_check(cpu_env, tmp, ws);
+        gen_set_label(label);
+        tcg_temp_free(ws);
+        tcg_temp_free(tmp);
+        dc->window = w;
+        dc->window_checked = true;
     }
     return true;
 }
@@ -856,50 +920,179 @@ static int arg_copy_compare(const void *a, const void *b)
         -1 : (pa->resource > pb->resource ? 1 : 0);
 }
 
-static void disas_xtensa_insn(CPUXtensaState *env, DisasContext *dc)
+/*
+ * Decoded instructions are cached per core configuration, keyed by the
+ * instruction bytes, so that retranslating the same code (e.g. after a
+ * TB flush) does not go through libisa again. Entries hold everything
+ * that does not depend on the translation context: opcodes, decoded
+ * operands and the FLIX slot evaluation order.
+ *
+ * The cache is shared by all cores with the same configuration, so it
+ * is looked up without a lock: translation runs inside the RCU read-side
+ * critical section of cpu_exec(), entries are published with
+ * atomic_xchg() and replaced ones are freed after a grace period.
+ */
+#define XTENSA_DECODE_CACHE_BITS 12
+#define XTENSA_DECODE_CACHE_SIZE (1u << XTENSA_DECODE_CACHE_BITS)
+
+typedef struct XtensaDecodedArg {
+    uint32_t v;
+    int opnd;
+    bool pcrel;
+    void **register_file;
+} XtensaDecodedArg;
+
+typedef struct XtensaDecodedSlot {
+    XtensaOpcodeOps *ops;
+    xtensa_opcode opc;
+    unsigned n_arg;
+    XtensaDecodedArg arg[MAX_OPCODE_ARGS];
+} XtensaDecodedSlot;
+
+typedef struct XtensaDecodedCopy {
+    uint32_t resource;
+    unsigned slot;
+    unsigned arg;
+} XtensaDecodedCopy;
+
+typedef struct XtensaDecodedInsn {
+    struct rcu_head rcu;
+    unsigned len;
+    unsigned char b[MAX_INSN_LENGTH];
+    uint32_t windowed_register;
+    unsigned slots;
+    unsigned order[MAX_INSN_SLOTS];
+    unsigned n_arg_copy;
+    XtensaDecodedCopy *arg_copy;
+    XtensaDecodedSlot slot[];
+} XtensaDecodedInsn;
+
+struct XtensaDecodeCache {
+    Stat64 hits;
+    Stat64 misses;
+    XtensaDecodedInsn *entry[XTENSA_DECODE_CACHE_SIZE];
+};
+
+void xtensa_decode_cache_init(XtensaConfig *config)
 {
-    xtensa_isa isa = dc->config->isa;
-    unsigned char b[MAX_INSN_LENGTH] = {translator_ldub(env, dc->pc)};
-    unsigned len = xtensa_op0_insn_len(dc, b[0]);
-    xtensa_format fmt;
-    int slot, slots;
+    config->decode_cache = g_new0(XtensaDecodeCache, 1);
+}
+
+void xtensa_decode_cache_stats(const XtensaConfig *config,
+                               uint64_t *hits, uint64_t *misses,
+                               unsigned *used, unsigned *size)
+{
+    XtensaDecodeCache *cache = config->decode_cache;
     unsigned i;
-    uint32_t op_flags = 0;
-    struct slot_prop slot_prop[MAX_INSN_SLOTS];
-    struct slot_prop *ordered[MAX_INSN_SLOTS];
-    struct opcode_arg_copy arg_copy[MAX_INSN_SLOTS * MAX_OPCODE_ARGS];
-    unsigned n_arg_copy = 0;
-    uint32_t debug_cause = 0;
-    uint32_t windowed_register = 0;
-    uint32_t coprocessor = 0;
 
-    if (len == XTENSA_UNDEFINED) {
-        qemu_log_mask(LOG_GUEST_ERROR,
-                      "unknown instruction length (pc = %08x)\n",
-                      dc->pc);
-        gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
+    *hits = 0;
+    *misses = 0;
+    *used = 0;
+    *size = XTENSA_DECODE_CACHE_SIZE;
+    if (!cache) {
         return;
     }
+    *hits = stat64_get(&cache->hits);
+    *misses = stat64_get(&cache->misses);
+    for (i = 0; i < XTENSA_DECODE_CACHE_SIZE; ++i) {
+        *used += atomic_read(&cache->entry[i]) != NULL;
+    }
+}
 
-    dc->base.pc_next = dc->pc + len;
-    for (i = 1; i < len; ++i) {
-        b[i] = translator_ldub(env, dc->pc + i);
+static void xtensa_decoded_insn_free(XtensaDecodedInsn *insn)
+{
+    if (insn) {
+        g_free(insn->arg_copy);
+        g_free(insn);
+    }
+}
+
+static unsigned xtensa_decode_cache_hash(const unsigned char *b, unsigned len)
+{
+    uint32_t h = 2166136261u;
+    unsigned i;
+
+    for (i = 0; i < len; ++i) {
+        h = (h ^ b[i]) * 16777619u;
+    }
+    return (h ^ (h >> XTENSA_DECODE_CACHE_BITS)) &
+        (XTENSA_DECODE_CACHE_SIZE - 1);
+}
+
+/*
+ * Fill slot_prop, ordered and arg_copy for the instruction at dc->pc
+ * from its decoded form. Return the number of arg_copy records.
+ */
+static unsigned xtensa_decoded_insn_apply(DisasContext *dc,
+                                          const XtensaDecodedInsn *insn,
+                                          struct slot_prop *slot_prop,
+                                          struct slot_prop **ordered,
+                                          struct opcode_arg_copy *arg_copy)
+{
+    xtensa_isa isa = dc->config->isa;
+    unsigned slot, i;
+
+    for (slot = 0; slot < insn->slots; ++slot) {
+        const XtensaDecodedSlot *ds = insn->slot + slot;
+        OpcodeArg *arg = slot_prop[slot].arg;
+
+        slot_prop[slot].ops = ds->ops;
+        for (i = 0; i < ds->n_arg; ++i) {
+            const XtensaDecodedArg *da = ds->arg + i;
+            uint32_t v = da->v;
+
+            arg[i].raw_imm = v;
+            if (da->pcrel) {
+                xtensa_operand_undo_reloc(isa, ds->opc, da->opnd, &v, dc->pc);
+            }
+            arg[i].imm = v;
+            if (da->register_file) {
+                arg[i].in = da->register_file[da->v];
+                arg[i].out = da->register_file[da->v];
+            }
+        }
+        ordered[slot] = slot_prop + insn->order[slot];
     }
+    for (i = 0; i < insn->n_arg_copy; ++i) {
+        const XtensaDecodedCopy *copy = insn->arg_copy + i;
+
+        arg_copy[i].resource = copy->resource;
+        arg_copy[i].arg = slot_prop[copy->slot].arg + copy->arg;
+    }
+    return insn->n_arg_copy;
+}
+
+/*
+ * Decode an instruction with libisa. Log and return NULL if it cannot
+ * be translated.
+ */
+static XtensaDecodedInsn *xtensa_decode_insn(DisasContext *dc,
+                                             const unsigned char *b,
+                                             unsigned len)
+{
+    xtensa_isa isa = dc->config->isa;
+    XtensaDecodedInsn *insn;
+    xtensa_format fmt;
+    int slot, slots;
+
     xtensa_insnbuf_from_chars(isa, dc->insnbuf, b, len);
     fmt = xtensa_format_decode(isa, dc->insnbuf);
     if (fmt == XTENSA_UNDEFINED) {
         qemu_log_mask(LOG_GUEST_ERROR,
                       "unrecognized instruction format (pc = %08x)\n",
                       dc->pc);
-        gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
-        return;
+        return NULL;
     }
     slots = xtensa_format_num_slots(isa, fmt);
+    insn = g_malloc0(sizeof(*insn) + slots * sizeof(insn->slot[0]));
+    insn->len = len;
+    memcpy(insn->b, b, len);
+    insn->slots = slots;
+
     for (slot = 0; slot < slots; ++slot) {
+        XtensaDecodedSlot *ds = insn->slot + slot;
         xtensa_opcode opc;
-        int opnd, vopnd, opnds;
-        OpcodeArg *arg = slot_prop[slot].arg;
-        XtensaOpcodeOps *ops;
+        int opnd, opnds;
 
         xtensa_format_get_slot(isa, fmt, slot, dc->insnbuf, dc->slotbuf);
         opc = xtensa_opcode_decode(isa, fmt, slot, dc->slotbuf);
@@ -907,75 +1100,68 @@ static void disas_xtensa_insn(CPUXtensaState *env, DisasContext *dc)
             qemu_log_mask(LOG_GUEST_ERROR,
                           "unrecognized opcode in slot %d (pc = %08x)\n",
                           slot, dc->pc);
-            gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
-            return;
+            goto fail;
+        }
+        ds->opc = opc;
+        ds->ops = dc->config->opcode_ops[opc];
+        if (!ds->ops) {
+            qemu_log_mask(LOG_UNIMP,
+                          "unimplemented opcode '%s' in slot %d (pc = %08x)\n",
+                          xtensa_opcode_name(isa, opc), slot, dc->pc);
+            goto fail;
         }
         opnds = xtensa_opcode_num_operands(isa, opc);
 
-        for (opnd = vopnd = 0; opnd < opnds; ++opnd) {
+        for (opnd = 0; opnd < opnds; ++opnd) {
             void **register_file = NULL;
+            uint32_t v;
+
+            if (!xtensa_operand_is_register(isa, opc, opnd) &&
+                !xtensa_operand_is_visible(isa, opc, opnd)) {
+                continue;
+            }
+            xtensa_operand_get_field(isa, opc, opnd, fmt, slot,
+                                     dc->slotbuf, &v);
+            xtensa_operand_decode(isa, opc, opnd, &v);
 
             if (xtensa_operand_is_register(isa, opc, opnd)) {
                 xtensa_regfile rf = xtensa_operand_regfile(isa, opc, opnd);
 
                 register_file = dc->config->regfile[rf];
-
                 if (rf == dc->config->a_regfile) {
-                    uint32_t v;
-
-                    xtensa_operand_get_field(isa, opc, opnd, fmt, slot,
-                                             dc->slotbuf, &v);
-                    xtensa_operand_decode(isa, opc, opnd, &v);
-                    windowed_register |= 1u << v;
+                    insn->windowed_register |= 1u << v;
                 }
             }
             if (xtensa_operand_is_visible(isa, opc, opnd)) {
-                uint32_t v;
-
-                xtensa_operand_get_field(isa, opc, opnd, fmt, slot,
-                                         dc->slotbuf, &v);
-                xtensa_operand_decode(isa, opc, opnd, &v);
-                arg[vopnd].raw_imm = v;
-                if (xtensa_operand_is_PCrelative(isa, opc, opnd)) {
-                    xtensa_operand_undo_reloc(isa, opc, opnd, &v, dc->pc);
-                }
-                arg[vopnd].imm = v;
-                if (register_file) {
-                    arg[vopnd].in = register_file[v];
-                    arg[vopnd].out = register_file[v];
-                }
-                ++vopnd;
+                XtensaDecodedArg *da = ds->arg + ds->n_arg++;
+
+                da->v = v;
+                da->opnd = opnd;
+                da->pcrel = xtensa_operand_is_PCrelative(isa, opc, opnd);
+                da->register_file = register_file;
             }
         }
-        ops = dc->config->opcode_ops[opc];
-        slot_prop[slot].ops = ops;
+        insn->order[slot] = slot;
+    }
 
-        if (ops) {
-            op_flags |= ops->op_flags;
-        } else {
-            qemu_log_mask(LOG_UNIMP,
-                          "unimplemented opcode '%s' in slot %d (pc = %08x)\n",
-                          xtensa_opcode_name(isa, opc), slot, dc->pc);
-            op_flags |= XTENSA_OP_ILL;
-        }
-        if ((op_flags & XTENSA_OP_ILL) ||
-            (ops && ops->test_ill && ops->test_ill(dc, arg, ops->par))) {
-            gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
-            return;
-        }
-        if (ops->op_flags & XTENSA_OP_DEBUG_BREAK) {
-            debug_cause |= ops->par[0];
-        }
-        if (ops->test_overflow) {
-            windowed_register |= ops->test_overflow(dc, arg, ops->par);
-        }
-        coprocessor |= ops->coprocessor;
+    if (slots > 1) {
+        struct slot_prop *slot_prop = g_new(struct slot_prop, slots);
+        struct slot_prop *ordered[MAX_INSN_SLOTS];
+        struct opcode_arg_copy arg_copy[MAX_INSN_SLOTS * MAX_OPCODE_ARGS];
+        unsigned n_arg_copy = 0;
+        unsigned i;
+        bool ok;
+
+        for (slot = 0; slot < slots; ++slot) {
+            xtensa_opcode opc = insn->slot[slot].opc;
+            XtensaOpcodeOps *ops = insn->slot[slot].ops;
+            int opnd, vopnd, opnds;
 
-        if (slots > 1) {
             slot_prop[slot].n_in = 0;
             slot_prop[slot].n_out = 0;
             slot_prop[slot].op_flags = ops->op_flags & XTENSA_OP_LOAD_STORE;
 
+            xtensa_format_get_slot(isa, fmt, slot, dc->insnbuf, dc->slotbuf);
             opnds = xtensa_opcode_num_operands(isa, opc);
 
             for (opnd = vopnd = 0; opnd < opnds; ++opnd) {
@@ -1020,18 +1206,118 @@ static void disas_xtensa_insn(CPUXtensaState *env, DisasContext *dc)
             qsort(slot_prop[slot].out, slot_prop[slot].n_out,
                   sizeof(slot_prop[slot].out[0]), resource_compare);
         }
-    }
 
-    if (slots > 1) {
-        if (!tsort(slot_prop, ordered, slots, arg_copy, &n_arg_copy)) {
+        ok = tsort(slot_prop, ordered, slots, arg_copy, &n_arg_copy);
+        if (ok) {
+            for (slot = 0; slot < slots; ++slot) {
+                insn->order[slot] = ordered[slot] - slot_prop;
+            }
+            insn->n_arg_copy = n_arg_copy;
+            insn->arg_copy = g_new(XtensaDecodedCopy, n_arg_copy);
+            for (i = 0; i < n_arg_copy; ++i) {
+                for (slot = 0; slot < slots; ++slot) {
+                    OpcodeArg *arg = slot_prop[slot].arg;
+
+                    if (arg_copy[i].arg >= arg &&
+                        arg_copy[i].arg < arg + MAX_OPCODE_ARGS) {
+                        insn->arg_copy[i].slot = slot;
+                        insn->arg_copy[i].arg = arg_copy[i].arg - arg;
+                        break;
+                    }
+                }
+                insn->arg_copy[i].resource = arg_copy[i].resource;
+            }
+        }
+        g_free(slot_prop);
+        if (!ok) {
             qemu_log_mask(LOG_UNIMP,
                           "Circular resource dependencies (pc = %08x)\n",
                           dc->pc);
+            goto fail;
+        }
+    }
+    return insn;
+
+fail:
+    xtensa_decoded_insn_free(insn);
+    return NULL;
+}
+
+static void disas_xtensa_insn(CPUXtensaState *env, DisasContext *dc)
+{
+    XtensaDecodeCache *cache = dc->config->decode_cache;
+    unsigned char b[MAX_INSN_LENGTH] = {translator_ldub(env, dc->pc)};
+    unsigned len = xtensa_op0_insn_len(dc, b[0]);
+    XtensaDecodedInsn *insn;
+    XtensaDecodedInsn *old;
+    unsigned idx;
+    int slot, slots;
+    unsigned i;
+    uint32_t op_flags = 0;
+    struct slot_prop slot_prop[MAX_INSN_SLOTS];
+    struct slot_prop *ordered[MAX_INSN_SLOTS];
+    struct opcode_arg_copy arg_copy[MAX_INSN_SLOTS * MAX_OPCODE_ARGS];
+    unsigned n_arg_copy = 0;
+    uint32_t debug_cause = 0;
+    uint32_t windowed_register = 0;
+    uint32_t coprocessor = 0;
+
+    if (len == XTENSA_UNDEFINED) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "unknown instruction length (pc = %08x)\n",
+                      dc->pc);
+        gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
+        return;
+    }
+
+    dc->base.pc_next = dc->pc + len;
+    for (i = 1; i < len; ++i) {
+        b[i] = translator_ldub(env, dc->pc + i);
+    }
+
+    idx = xtensa_decode_cache_hash(b, len);
+    insn = atomic_rcu_read(&cache->entry[idx]);
+    if (insn && insn->len == len && memcmp(insn->b, b, len) == 0) {
+        stat64_add(&cache->hits, 1);
+        slots = insn->slots;
+        windowed_register = insn->windowed_register;
+        n_arg_copy = xtensa_decoded_insn_apply(dc, insn, slot_prop,
+                                               ordered, arg_copy);
+    } else {
+        insn = xtensa_decode_insn(dc, b, len);
+        if (!insn) {
             gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
             return;
         }
-    } else {
-        ordered[0] = slot_prop + 0;
+        slots = insn->slots;
+        windowed_register = insn->windowed_register;
+        n_arg_copy = xtensa_decoded_insn_apply(dc, insn, slot_prop,
+                                               ordered, arg_copy);
+
+        stat64_add(&cache->misses, 1);
+        old = atomic_xchg(&cache->entry[idx], insn);
+        if (old) {
+            call_rcu(old, xtensa_decoded_insn_free, rcu);
+        }
+    }
+
+    for (slot = 0; slot < slots; ++slot) {
+        OpcodeArg *arg = slot_prop[slot].arg;
+        XtensaOpcodeOps *ops = slot_prop[slot].ops;
+
+        op_flags |= ops->op_flags;
+        if ((op_flags & XTENSA_OP_ILL) ||
+            (ops->test_ill && ops->test_ill(dc, arg, ops->par))) {
+            gen_exception_cause(dc, ILLEGAL_INSTRUCTION_CAUSE);
+            return;
+        }
+        if (ops->op_flags & XTENSA_OP_DEBUG_BREAK) {
+            debug_cause |= ops->par[0];
+        }
+        if (ops->test_overflow) {
+            windowed_register |= ops->test_overflow(dc, arg, ops->par);
+        }
+        coprocessor |= ops->coprocessor;
     }
 
     if ((op_flags & XTENSA_OP_PRIVILEGED) &&
@@ -1168,9 +1454,9 @@ static void xtensa_tr_init_disas_context(DisasContextBase *dcbase,
     dc->icount = tb_flags & XTENSA_TBFLAG_ICOUNT;
     dc->cpenable = (tb_flags & XTENSA_TBFLAG_CPENABLE_MASK) >>
         XTENSA_TBFLAG_CPENABLE_SHIFT;
-    dc->window = ((tb_flags & XTENSA_TBFLAG_WINDOW_MASK) >>
-                 XTENSA_TBFLAG_WINDOW_SHIFT);
     dc->cwoe = tb_flags & XTENSA_TBFLAG_CWOE;
+    dc->window = dc->cwoe ? 0 : 3;
+    dc->window_checked = false;
     dc->callinc = ((tb_flags & XTENSA_TBFLAG_CALLINC_MASK) >>
                    XTENSA_TBFLAG_CALLINC_SHIFT);
     init_sar_tracker(dc);
@@ -1183,6 +1469,13 @@ static void xtensa_tr_tb_start(DisasContextBase *dcbase, CPUState *cpu)
     if (dc->icount) {
         dc->next_icount = tcg_temp_local_new_i32();
     }
+    /* A TB at LBEG may be able to loop internally, see gen_loop_back_edge */
+    if (dc->lbeg_off && dc->base.pc_first == dc->lend - dc->lbeg_off &&
+        !dc->icount && !dc->base.singlestep_enabled &&
+        !(tb_cflags(dc->base.tb) & CF_USE_ICOUNT)) {
+        dc->loop_label = gen_new_label();
+        gen_set_label(dc->loop_label);
+    }
 }
 
 static void xtensa_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
@@ -1206,6 +1499,31 @@ static bool xtensa_tr_breakpoint_check(DisasContextBase *dcbase, CPUState *cpu,
     return true;
 }
 
+#ifndef CONFIG_USER_ONLY
+static int xtensa_find_hle_hook(CPUXtensaState *env, uint32_t pc)
+{
+    unsigned i;
+
+    for (i = 0; i < env->n_hle_hooks; ++i) {
+        if (env->hle_hooks[i].pc == pc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void gen_hle_hook(DisasContext *dc, int hook)
+{
+    TCGv_i32 tmp = tcg_const_i32(hook);
+
+    tcg_gen_movi_i32(cpu_pc, dc->pc);
+    gen_helper_hle_hook(cpu_env, tmp);
+    tcg_temp_free(tmp);
+    dc->op_flags = 0;
+    gen_jump(dc, cpu_pc);
+}
+#endif
+
 static void xtensa_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
@@ -1242,6 +1560,18 @@ static void xtensa_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
         gen_ibreak_check(env, dc);
     }
 
+#ifndef CONFIG_USER_ONLY
+    /* Hooked routines always start a TB, see the check below */
+    if (env->hle_hooks && dc->pc == dc->base.pc_first) {
+        int hook = xtensa_find_hle_hook(env, dc->pc);
+
+        if (hook >= 0) {
+            gen_hle_hook(dc, hook);
+            return;
+        }
+    }
+#endif
+
     disas_xtensa_insn(env, dc);
 
     if (dc->icount) {
@@ -1255,6 +1585,12 @@ static void xtensa_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
          dc->pc - page_start + xtensa_insn_len(env, dc) > TARGET_PAGE_SIZE)) {
         dc->base.is_jmp = DISAS_TOO_MANY;
     }
+#ifndef CONFIG_USER_ONLY
+    if (dc->base.is_jmp == DISAS_NEXT && env->hle_hooks &&
+        xtensa_find_hle_hook(env, dc->pc) >= 0) {
+        dc->base.is_jmp = DISAS_TOO_MANY;
+    }
+#endif
 }
 
 static void xtensa_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
@@ -2201,7 +2537,14 @@ static void translate_rsr_ccount(DisasContext *dc, const OpcodeArg arg[],
     if (tb_cflags(dc->base.tb) & CF_USE_ICOUNT) {
         gen_io_start();
     }
-    gen_helper_update_ccount(cpu_env);
+    if (par[0] == CCOUNT) {
+        TCGv_i32 pc = tcg_const_i32(dc->pc);
+
+        gen_helper_rsr_ccount(cpu_SR[CCOUNT], cpu_env, pc);
+        tcg_temp_free(pc);
+    } else {
+        gen_helper_update_ccount(cpu_env);
+    }
     tcg_gen_mov_i32(arg[0].out, cpu_SR[par[0]]);
 #endif
 }
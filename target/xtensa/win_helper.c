@@ -32,38 +32,6 @@
 #include "qemu/host-utils.h"
 #include "exec/exec-all.h"
 
-static void copy_window_from_phys(CPUXtensaState *env,
-                                  uint32_t window, uint32_t phys, uint32_t n)
-{
-    assert(phys < env->config->nareg);
-    if (phys + n <= env->config->nareg) {
-        memcpy(env->regs + window, env->phys_regs + phys,
-               n * sizeof(uint32_t));
-    } else {
-        uint32_t n1 = env->config->nareg - phys;
-        memcpy(env->regs + window, env->phys_regs + phys,
-               n1 * sizeof(uint32_t));
-        memcpy(env->regs + window + n1, env->phys_regs,
-               (n - n1) * sizeof(uint32_t));
-    }
-}
-
-static void copy_phys_from_window(CPUXtensaState *env,
-                                  uint32_t phys, uint32_t window, uint32_t n)
-{
-    assert(phys < env->config->nareg);
-    if (phys + n <= env->config->nareg) {
-        memcpy(env->phys_regs + phys, env->regs + window,
-               n * sizeof(uint32_t));
-    } else {
-        uint32_t n1 = env->config->nareg - phys;
-        memcpy(env->phys_regs + phys, env->regs + window,
-               n1 * sizeof(uint32_t));
-        memcpy(env->phys_regs, env->regs + window + n1,
-               (n - n1) * sizeof(uint32_t));
-    }
-}
-
 static inline unsigned windowbase_bound(unsigned a, const CPUXtensaState *env)
 {
     return a & (env->config->nareg / 4 - 1);
@@ -74,14 +42,40 @@ static inline unsigned windowstart_bit(unsigned a, const CPUXtensaState *env)
     return 1 << windowbase_bound(a, env);
 }
 
+/*
+ * env->regs points straight into phys_regs, so rotating the window is a
+ * pointer update. The only window that needs copying is one that wraps
+ * past the last physical register: its upper part lives in the shadow
+ * tail phys_regs[nareg..], which mirrors phys_regs[0..].
+ */
+static uint32_t window_wrap(const CPUXtensaState *env)
+{
+    uint32_t phys = env->sregs[WINDOW_BASE] * 4;
+
+    assert(phys < env->config->nareg);
+    return phys + 16 > env->config->nareg ?
+        phys + 16 - env->config->nareg : 0;
+}
+
 void xtensa_sync_window_from_phys(CPUXtensaState *env)
 {
-    copy_window_from_phys(env, 0, env->sregs[WINDOW_BASE] * 4, 16);
+    uint32_t n = window_wrap(env);
+
+    env->regs = env->phys_regs + env->sregs[WINDOW_BASE] * 4;
+    if (n) {
+        memcpy(env->phys_regs + env->config->nareg, env->phys_regs,
+               n * sizeof(uint32_t));
+    }
 }
 
 void xtensa_sync_phys_from_window(CPUXtensaState *env)
 {
-    copy_phys_from_window(env, env->sregs[WINDOW_BASE] * 4, 0, 16);
+    uint32_t n = window_wrap(env);
+
+    if (n) {
+        memcpy(env->phys_regs, env->phys_regs + env->config->nareg,
+               n * sizeof(uint32_t));
+    }
 }
 
 static void xtensa_rotate_window_abs(CPUXtensaState *env, uint32_t position)
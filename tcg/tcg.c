@@ -159,6 +159,9 @@ static int tcg_out_ldst_finalize(TCGContext *s);
 
 static TCGContext **tcg_ctxs;
 static unsigned int n_tcg_ctxs;
+/* Contexts of threads that did not survive fork(), see tcg_fork_child */
+static unsigned int n_orphan_tcg_ctxs;
+static unsigned int n_adopted_tcg_ctxs;
 TCGv_env cpu_env = 0;
 
 struct tcg_region_tree {
@@ -769,10 +772,19 @@ void tcg_register_thread(void)
 void tcg_register_thread(void)
 {
     MachineState *ms = MACHINE(qdev_get_machine());
-    TCGContext *s = g_malloc(sizeof(*s));
+    TCGContext *s;
     unsigned int i, n;
     bool err;
 
+    if (atomic_read(&n_orphan_tcg_ctxs)) {
+        n = atomic_fetch_inc(&n_adopted_tcg_ctxs);
+        if (n < n_orphan_tcg_ctxs) {
+            tcg_ctx = tcg_ctxs[n];
+            return;
+        }
+    }
+
+    s = g_malloc(sizeof(*s));
     *s = tcg_init_ctx;
 
     /* Relink mem_base.  */
@@ -799,6 +811,17 @@ void tcg_register_thread(void)
     g_assert(!err);
     qemu_mutex_unlock(&region.lock);
 }
+
+/*
+ * Only the calling thread survives fork(). Let the vCPU threads that are
+ * re-created in the child take over the contexts of the parent's threads,
+ * along with their regions, instead of claiming new ones.
+ */
+void tcg_fork_child(void)
+{
+    n_orphan_tcg_ctxs = n_tcg_ctxs;
+    n_adopted_tcg_ctxs = 0;
+}
 #endif /* !CONFIG_USER_ONLY */
 
 /*
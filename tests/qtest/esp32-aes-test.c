@@ -0,0 +1,144 @@
+/*
+ * QTest testcase for the ESP32 AES accelerator
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "libqtest.h"
+
+#define DR_REG_AES_BASE     0x3ff01000
+#define AES_START           (DR_REG_AES_BASE + 0x00)
+#define AES_IDLE            (DR_REG_AES_BASE + 0x04)
+#define AES_MODE            (DR_REG_AES_BASE + 0x08)
+#define AES_KEY(i)          (DR_REG_AES_BASE + 0x10 + (i) * 4)
+#define AES_TEXT(i)         (DR_REG_AES_BASE + 0x30 + (i) * 4)
+
+#define AES_MODE_DECRYPT    4
+
+/* FIPS-197 appendix C example vectors */
+static const uint8_t key[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+};
+
+static const uint8_t plaintext[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+
+static const char *const ciphertext[] = {
+    "69c4e0d86a7b0430d8cdb78070b4c55a",
+    "dda97ca4864cdfe06eaf70a0ec0d7191",
+    "8ea2b7ca516745bfeafc49904b496089",
+};
+
+/* Load the key the way ESP-IDF does, as little-endian words in memory order */
+static void aes_set_key(QTestState *qts, int keylen_sel, bool decrypt)
+{
+    for (int i = 0; i < (16 + 8 * keylen_sel) / 4; ++i) {
+        qtest_writel(qts, AES_KEY(i), ldl_le_p(key + i * 4));
+    }
+    qtest_writel(qts, AES_MODE, keylen_sel + (decrypt ? AES_MODE_DECRYPT : 0));
+}
+
+static void aes_block(QTestState *qts, const uint8_t *in, uint8_t *out)
+{
+    for (int i = 0; i < 4; ++i) {
+        qtest_writel(qts, AES_TEXT(i), ldl_le_p(in + i * 4));
+    }
+    qtest_writel(qts, AES_START, 1);
+    g_assert_cmpuint(qtest_readl(qts, AES_IDLE), ==, 1);
+    for (int i = 0; i < 4; ++i) {
+        stl_le_p(out + i * 4, qtest_readl(qts, AES_TEXT(i)));
+    }
+}
+
+static char *aes_hex(const uint8_t *block)
+{
+    GString *result = g_string_new(NULL);
+
+    for (int i = 0; i < 16; ++i) {
+        g_string_append_printf(result, "%02x", block[i]);
+    }
+    return g_string_free(result, false);
+}
+
+static void test_aes_kat(const void *data)
+{
+    int keylen_sel = GPOINTER_TO_INT(data);
+    QTestState *qts = qtest_init("-machine esp32");
+    uint8_t ct[16], pt[16];
+    char *hex;
+
+    aes_set_key(qts, keylen_sel, false);
+    aes_block(qts, plaintext, ct);
+    hex = aes_hex(ct);
+    g_assert_cmpstr(hex, ==, ciphertext[keylen_sel]);
+    g_free(hex);
+
+    aes_set_key(qts, keylen_sel, true);
+    aes_block(qts, ct, pt);
+    g_assert(memcmp(pt, plaintext, sizeof(pt)) == 0);
+
+    qtest_quit(qts);
+}
+
+/* Changing a single key word must take effect on the next block */
+static void test_aes_key_change(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+    uint8_t ct1[16], ct2[16];
+
+    aes_set_key(qts, 0, false);
+    aes_block(qts, plaintext, ct1);
+    qtest_writel(qts, AES_KEY(3), 0);
+    aes_block(qts, plaintext, ct2);
+    g_assert(memcmp(ct1, ct2, sizeof(ct1)) != 0);
+    qtest_writel(qts, AES_KEY(3), ldl_le_p(key + 12));
+    aes_block(qts, plaintext, ct2);
+    g_assert(memcmp(ct1, ct2, sizeof(ct1)) == 0);
+
+    qtest_quit(qts);
+}
+
+static void test_aes_speed(void)
+{
+    const size_t data_size = 256 * KiB;
+    QTestState *qts = qtest_init("-machine esp32");
+    uint8_t block[16] = { 0 };
+
+    aes_set_key(qts, 2, false);
+    g_test_timer_start();
+    for (size_t off = 0; off < data_size; off += sizeof(block)) {
+        aes_block(qts, block, block);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("aes-256: %zu kB in %.3f s, %.2f kB/s", data_size / KiB,
+                   g_test_timer_last(), data_size / KiB / g_test_timer_last());
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_data_func("/esp32/aes/aes128", GINT_TO_POINTER(0), test_aes_kat);
+    qtest_add_data_func("/esp32/aes/aes192", GINT_TO_POINTER(1), test_aes_kat);
+    qtest_add_data_func("/esp32/aes/aes256", GINT_TO_POINTER(2), test_aes_kat);
+    qtest_add_func("/esp32/aes/key_change", test_aes_key_change);
+    if (g_test_perf()) {
+        qtest_add_func("/esp32/aes/speed", test_aes_speed);
+    }
+
+    return g_test_run();
+}
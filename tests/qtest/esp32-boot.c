@@ -0,0 +1,107 @@
+/*
+ * ESP32 qtest helpers for running hand-assembled guest code
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "esp32-boot.h"
+
+#define DR_REG_RTCCNTL_BASE         0x3ff48000
+#define RTC_CNTL_OPTIONS0           (DR_REG_RTCCNTL_BASE + 0x0)
+#define RTC_CNTL_SW_PROCPU_RESET    BIT(5)
+#define RTC_CNTL_RESET_STATE        (DR_REG_RTCCNTL_BASE + 0x34)
+
+#define DR_REG_DPORT_BASE           0x3ff00000
+#define DPORT_APPCPU_RESET          (DR_REG_DPORT_BASE + 0x2c)
+#define DPORT_APPCPU_CLK            (DR_REG_DPORT_BASE + 0x30)
+#define DPORT_APPCPU_RUNSTALL       (DR_REG_DPORT_BASE + 0x34)
+
+#define LITERAL_POOL                (ESP32_PROGRAM_BASE + 4)
+#define LITERAL_POOL_SIZE           15
+#define PROGRAM_START               (LITERAL_POOL + LITERAL_POOL_SIZE * 4)
+
+#define WAIT_TIMEOUT_MS             10000
+
+static void put_insn(Esp32Program *p, uint32_t insn)
+{
+    uint32_t off = p->pc - ESP32_PROGRAM_BASE;
+
+    g_assert_cmpuint(off + 3, <=, sizeof(p->code));
+    p->code[off] = insn;
+    p->code[off + 1] = insn >> 8;
+    p->code[off + 2] = insn >> 16;
+    p->pc += 3;
+}
+
+void esp32_program_init(Esp32Program *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->pc = ESP32_PROGRAM_BASE;
+    put_insn(p, XT_J(PROGRAM_START - (ESP32_PROGRAM_BASE + 4)));
+    p->pc = PROGRAM_START;
+}
+
+void esp32_program_emit(Esp32Program *p, uint32_t insn)
+{
+    put_insn(p, insn);
+}
+
+void esp32_program_movi32(Esp32Program *p, unsigned t, uint32_t value)
+{
+    uint32_t lit = LITERAL_POOL + p->n_literals * 4;
+    int32_t off = (int32_t)(lit - ((p->pc + 3) & ~3)) >> 2;
+
+    g_assert_cmpuint(p->n_literals, <, LITERAL_POOL_SIZE);
+    stl_le_p(p->code + lit - ESP32_PROGRAM_BASE, value);
+    p->n_literals++;
+    put_insn(p, 0x000001 | ((off & 0xffff) << 8) | (t << 4));
+}
+
+int32_t esp32_program_offset(const Esp32Program *p, uint32_t target)
+{
+    return target - (p->pc + 4);
+}
+
+void esp32_program_org(Esp32Program *p, uint32_t addr)
+{
+    g_assert_cmphex(addr, >=, p->pc);
+    while (addr - p->pc >= 3) {
+        put_insn(p, XT_NOP);
+    }
+    p->pc = addr;
+}
+
+void esp32_program_load(QTestState *qts, const Esp32Program *p)
+{
+    qtest_memwrite(qts, ESP32_PROGRAM_BASE, p->code, sizeof(p->code));
+    /* Both CPUs use the RTC memory reset vector from now on */
+    qtest_writel(qts, RTC_CNTL_RESET_STATE, 0);
+    qtest_writel(qts, RTC_CNTL_OPTIONS0, RTC_CNTL_SW_PROCPU_RESET);
+    qtest_qmp_eventwait(qts, "RESET");
+}
+
+void esp32_program_start_appcpu(QTestState *qts)
+{
+    qtest_writel(qts, DPORT_APPCPU_CLK, 1);
+    qtest_writel(qts, DPORT_APPCPU_RUNSTALL, 0);
+    qtest_writel(qts, DPORT_APPCPU_RESET, 1);
+    qtest_writel(qts, DPORT_APPCPU_RESET, 0);
+}
+
+void esp32_program_wait(QTestState *qts, uint32_t addr, uint32_t val)
+{
+    for (int i = 0; i < WAIT_TIMEOUT_MS; ++i) {
+        if (qtest_readl(qts, addr) == val) {
+            return;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmphex(qtest_readl(qts, addr), ==, val);
+}
@@ -0,0 +1,103 @@
+/*
+ * ESP32 qtest helpers for running hand-assembled guest code
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#ifndef TEST_ESP32_BOOT_H
+#define TEST_ESP32_BOOT_H
+
+#include "libqtest.h"
+
+/* PRO CPU reset vector with PROCPU_STAT_VECTOR_SEL cleared: RTC slow memory */
+#define ESP32_PROGRAM_BASE          0x50000000
+#define ESP32_PROGRAM_SIZE          0x800
+/* Scratch words for the test to poll, past the end of the program */
+#define ESP32_PROGRAM_DATA          (ESP32_PROGRAM_BASE + 0x1000)
+/* With VECBASE set to ESP32_PROGRAM_BASE, level-1 interrupts land here */
+#define ESP32_PROGRAM_KERNEL_VECTOR (ESP32_PROGRAM_BASE + 0x300)
+
+/* The APB clock after reset, which is also the CCOUNT rate */
+#define ESP32_XTAL_FREQ             40000000
+
+/* Special registers */
+#define XT_SR_INTCLEAR      227
+#define XT_SR_INTENABLE     228
+#define XT_SR_PS            230
+#define XT_SR_VECBASE       231
+#define XT_SR_CCOUNT        234
+#define XT_SR_PRID          235
+#define XT_SR_CCOMPARE0     240
+
+/* CCOMPARE0 interrupt number */
+#define XT_TIMER0_INTERRUPT 6
+
+/* PRID values of the two cores */
+#define ESP32_PRID_PRO      0xcdcd
+#define ESP32_PRID_APP      0xabab
+
+/* Instruction encodings; branch offsets are relative to the branch PC + 4 */
+#define XT_NOP              0x0020f0
+#define XT_RSYNC            0x002010
+#define XT_MEMW             0x0020c0
+#define XT_WAITI(s)         (0x007000 | ((s) << 8))
+#define XT_RSR(sr, t)       (0x030000 | ((sr) << 8) | ((t) << 4))
+#define XT_WSR(sr, t)       (0x130000 | ((sr) << 8) | ((t) << 4))
+#define XT_ADD(r, s, t)     (0x800000 | ((r) << 12) | ((s) << 8) | ((t) << 4))
+#define XT_SUB(r, s, t)     (0xc00000 | ((r) << 12) | ((s) << 8) | ((t) << 4))
+#define XT_L32I(t, s, off)  (0x002002 | (((off) / 4) << 16) | ((s) << 8) | ((t) << 4))
+#define XT_S32I(t, s, off)  (0x006002 | (((off) / 4) << 16) | ((s) << 8) | ((t) << 4))
+#define XT_ADDI(t, s, imm)  (0x00c002 | (((imm) & 0xff) << 16) | ((s) << 8) | ((t) << 4))
+#define XT_MOVI(t, imm)     (0x00a002 | (((imm) & 0xff) << 16) | \
+                             ((((imm) >> 8) & 0xf) << 8) | ((t) << 4))
+#define XT_J(off)           (0x000006 | (((off) & 0x3ffff) << 6))
+#define XT_BEQZ(s, off)     (0x000016 | (((off) & 0xfff) << 12) | ((s) << 8))
+#define XT_BNEZ(s, off)     (0x000056 | (((off) & 0xfff) << 12) | ((s) << 8))
+#define XT_BNE(s, t, off)   (0x009007 | (((off) & 0xff) << 16) | ((s) << 8) | ((t) << 4))
+#define XT_BLTU(s, t, off)  (0x003007 | (((off) & 0xff) << 16) | ((s) << 8) | ((t) << 4))
+#define XT_CALLX8(s)        (0x0000e0 | ((s) << 8))
+
+/*
+ * A program image for ESP32_PROGRAM_BASE. It starts with a jump over a
+ * literal pool, which esp32_program_movi32() fills.
+ */
+typedef struct Esp32Program {
+    uint8_t code[ESP32_PROGRAM_SIZE];
+    uint32_t pc;
+    unsigned n_literals;
+} Esp32Program;
+
+void esp32_program_init(Esp32Program *p);
+
+/* Append one 24-bit instruction */
+void esp32_program_emit(Esp32Program *p, uint32_t insn);
+
+/* Load a 32-bit constant into register t, through the literal pool */
+void esp32_program_movi32(Esp32Program *p, unsigned t, uint32_t value);
+
+/* Branch offset from the next instruction to target */
+int32_t esp32_program_offset(const Esp32Program *p, uint32_t target);
+
+/* Pad with NOPs up to addr */
+void esp32_program_org(Esp32Program *p, uint32_t addr);
+
+/*
+ * Copy the program to RTC slow memory and reset the PRO CPU into it. The
+ * machine must have been started with -S; it is left stopped.
+ */
+void esp32_program_load(QTestState *qts, const Esp32Program *p);
+
+/*
+ * Release the APP CPU, which also starts at ESP32_PROGRAM_BASE. It runs
+ * once the machine is resumed. Programs tell the CPUs apart with PRID.
+ */
+void esp32_program_start_appcpu(QTestState *qts);
+
+/* Poll a 32-bit word in guest memory until it reads val */
+void esp32_program_wait(QTestState *qts, uint32_t addr, uint32_t val);
+
+#endif /* TEST_ESP32_BOOT_H */
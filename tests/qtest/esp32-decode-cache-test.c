@@ -0,0 +1,103 @@
+/*
+ * QTest testcase for the Xtensa decoded instruction cache
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "esp32-boot.h"
+
+#define DONE_FLAG           ESP32_PROGRAM_DATA
+#define RESULT              (ESP32_PROGRAM_DATA + 4)
+#define DONE                1
+
+#define SUM_TO              100
+
+/* Counter @name of 'info decode-cache' */
+static uint64_t decode_cache_stat(QTestState *qts, const char *name)
+{
+    g_autofree char *info = qtest_hmp(qts, "info decode-cache");
+    g_auto(GStrv) lines = g_strsplit(info, "\n", -1);
+
+    for (int i = 0; lines[i]; ++i) {
+        char stat[16];
+        uint64_t v;
+
+        if (sscanf(lines[i], "%15s %" SCNu64, stat, &v) == 2 &&
+            !strcmp(stat, name)) {
+            return v;
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* RESULT = 1 + 2 + ... + SUM_TO */
+static void sum_program(Esp32Program *p)
+{
+    uint32_t loop;
+
+    esp32_program_init(p);
+    esp32_program_movi32(p, 3, ESP32_PROGRAM_DATA);
+    esp32_program_emit(p, XT_MOVI(2, 0));
+    esp32_program_emit(p, XT_MOVI(4, SUM_TO));
+    loop = p->pc;
+    esp32_program_emit(p, XT_ADD(2, 2, 4));
+    esp32_program_emit(p, XT_ADDI(4, 4, -1));
+    esp32_program_emit(p, XT_BNEZ(4, esp32_program_offset(p, loop)));
+    esp32_program_emit(p, XT_S32I(2, 3, 4));
+    esp32_program_emit(p, XT_MEMW);
+    esp32_program_emit(p, XT_MOVI(4, DONE));
+    esp32_program_emit(p, XT_S32I(4, 3, 0));
+    esp32_program_emit(p, XT_J(-4));
+}
+
+/*
+ * Writing the program again invalidates every TB translated from it, so
+ * the second run retranslates the same instruction bytes, which must
+ * come from the cache and still compute the same result.
+ */
+static void test_retranslate(void)
+{
+    Esp32Program program;
+    QTestState *qts;
+    uint64_t hits, misses;
+
+    sum_program(&program);
+
+    qts = qtest_init("-machine esp32 -accel tcg -S");
+    esp32_program_load(qts, &program);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    esp32_program_wait(qts, DONE_FLAG, DONE);
+    g_assert_cmpuint(qtest_readl(qts, RESULT), ==, SUM_TO * (SUM_TO + 1) / 2);
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+    hits = decode_cache_stat(qts, "hits");
+    misses = decode_cache_stat(qts, "misses");
+    g_assert_cmpuint(misses, >, 0);
+
+    qtest_writel(qts, DONE_FLAG, 0);
+    qtest_writel(qts, RESULT, 0);
+    esp32_program_load(qts, &program);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    esp32_program_wait(qts, DONE_FLAG, DONE);
+    g_assert_cmpuint(qtest_readl(qts, RESULT), ==, SUM_TO * (SUM_TO + 1) / 2);
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+    g_assert_cmpuint(decode_cache_stat(qts, "hits"), >, hits);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/decode-cache/retranslate", test_retranslate);
+
+    return g_test_run();
+}
@@ -0,0 +1,230 @@
+/*
+ * QTest testcase for the ESP32 flash cache and SPI flash writes
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+#define DR_REG_DPORT_BASE           0x3ff00000
+#define DPORT_PRO_CACHE_CTRL        (DR_REG_DPORT_BASE + 0x40)
+#define DPORT_PRO_CACHE_CTRL1       (DR_REG_DPORT_BASE + 0x44)
+#define DPORT_PRO_FLASH_MMU_TABLE   0x3ff10000
+
+#define DR_REG_SPI1_BASE            0x3ff42000
+#define SPI_CMD                     (DR_REG_SPI1_BASE + 0x00)
+#define SPI_ADDR                    (DR_REG_SPI1_BASE + 0x04)
+#define SPI_W0                      (DR_REG_SPI1_BASE + 0x80)
+
+#define SPI_CMD_WREN                BIT(30)
+#define SPI_CMD_PP                  BIT(25)
+
+#define CACHE_FLUSH_ENA             BIT(4)
+#define CACHE_ENA                   BIT(3)
+#define MMU_INVALID                 0x100
+
+#define FLASH_SIZE                  (4 * 1024 * 1024)
+#define FLASH_PAGE                  1
+#define CACHE_PAGE_SIZE             0x10000
+#define DROM0_BASE                  0x3f400000
+#define PROGRAM_WORDS               8
+#define MMU_PAGES                   64
+
+/* Known data in FLASH_PAGE of the images created by the tests */
+#define PATTERN_OFFSET              0x100
+#define PATTERN_WORDS               16
+#define PATTERN(i)                  (0xa5000000 | (i))
+
+static void cache_flush(QTestState *qts)
+{
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL, CACHE_ENA | CACHE_FLUSH_ENA);
+}
+
+static uint64_t flash_dirty_bytes(QTestState *qts)
+{
+    QDict *rsp = qtest_qmp(qts, "{ 'execute': 'query-flash-writeback' }");
+    QList *list = qdict_get_qlist(rsp, "return");
+    QDict *info = qobject_to(QDict, qlist_peek(list));
+    uint64_t dirty;
+
+    g_assert(info);
+    g_assert(qdict_get_bool(info, "write-back"));
+    dirty = qdict_get_int(info, "dirty-bytes");
+    qobject_unref(rsp);
+    return dirty;
+}
+
+static uint64_t dport_counter(QTestState *qts, const char *name)
+{
+    QDict *rsp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': {"
+                           " 'path': '/machine/soc/dport', 'property': %s } }",
+                           name);
+    uint64_t val = qdict_get_int(rsp, "return");
+
+    qobject_unref(rsp);
+    return val;
+}
+
+/* Create a flash image filled with 'fill', with a pattern in FLASH_PAGE */
+static char *flash_image_create(uint8_t fill)
+{
+    char *image_path;
+    int fd = g_file_open_tmp("esp32-flash-test-XXXXXX", &image_path, NULL);
+    g_autofree uint8_t *image = g_malloc(FLASH_SIZE);
+
+    g_assert(fd >= 0);
+    memset(image, fill, FLASH_SIZE);
+    for (int i = 0; i < PATTERN_WORDS; ++i) {
+        stl_le_p(image + FLASH_PAGE * CACHE_PAGE_SIZE + PATTERN_OFFSET + i * 4,
+                 PATTERN(i));
+    }
+    g_assert_cmpint(write(fd, image, FLASH_SIZE), ==, FLASH_SIZE);
+    close(fd);
+    return image_path;
+}
+
+/* Program the start of FLASH_PAGE through SPI1 */
+static void flash_program(QTestState *qts)
+{
+    for (int i = 0; i < PROGRAM_WORDS; ++i) {
+        qtest_writel(qts, SPI_W0 + i * 4, 0x5a000000 | i);
+    }
+    qtest_writel(qts, SPI_CMD, SPI_CMD_WREN);
+    qtest_writel(qts, SPI_ADDR, ((PROGRAM_WORDS * 4) << 24) |
+                                (FLASH_PAGE * CACHE_PAGE_SIZE));
+    qtest_writel(qts, SPI_CMD, SPI_CMD_PP);
+}
+
+/*
+ * In lazy fill mode, mapping pages reads nothing from flash. Each page is
+ * filled on its first access.
+ */
+static void test_lazy_fill(void)
+{
+    char *image_path = flash_image_create(0x00);
+    QTestState *qts;
+
+    qts = qtest_initf("-machine esp32,lazy-cache-fill=on "
+                      "-drive file=%s,if=mtd,format=raw", image_path);
+
+    /* All entries are valid after reset, entry 0 points at FLASH_PAGE */
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL1, 0);
+    qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE, FLASH_PAGE);
+    cache_flush(qts);
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-mapped"), >=, MMU_PAGES);
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-filled"), ==, 0);
+
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE + PATTERN_OFFSET), ==, PATTERN(0));
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-filled"), ==, 1);
+    for (int i = 0; i < PATTERN_WORDS; ++i) {
+        g_assert_cmphex(qtest_readl(qts, DROM0_BASE + PATTERN_OFFSET + i * 4), ==,
+                        PATTERN(i));
+    }
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE), ==, 0);
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-filled"), ==, 1);
+
+    /* The next page is only filled now */
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE + CACHE_PAGE_SIZE), ==, 0);
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-filled"), ==, 2);
+
+    qtest_quit(qts);
+    unlink(image_path);
+    g_free(image_path);
+}
+
+/*
+ * Program a flash page in write-back mode and map it again: the cache has
+ * to see the new data before it is written to the drive.
+ */
+static void test_program_remap(void)
+{
+    char *image_path = flash_image_create(0xff);
+    QTestState *qts;
+
+    qts = qtest_initf("-machine esp32 -drive file=%s,if=mtd,format=raw "
+                      "-global gd25q32.write-back=on "
+                      "-global gd25q32.write-back-interval=0", image_path);
+
+    /* Map the erased page into DROM0 */
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL1, 0);
+    qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE, FLASH_PAGE);
+    cache_flush(qts);
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE), ==, 0xffffffff);
+
+    flash_program(qts);
+    g_assert_cmpuint(flash_dirty_bytes(qts), >, 0);
+
+    /* Unmap and map the page again, as the ROM does after a write */
+    qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE, MMU_INVALID);
+    cache_flush(qts);
+    qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE, FLASH_PAGE);
+    cache_flush(qts);
+
+    for (int i = 0; i < PROGRAM_WORDS; ++i) {
+        g_assert_cmphex(qtest_readl(qts, DROM0_BASE + i * 4), ==, 0x5a000000 | i);
+    }
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE + PROGRAM_WORDS * 4), ==, 0xffffffff);
+    /* Nothing was written to the drive in between */
+    g_assert_cmpuint(flash_dirty_bytes(qts), >, 0);
+
+    qtest_quit(qts);
+    unlink(image_path);
+    g_free(image_path);
+}
+
+/*
+ * With flash-mmap=private, flash writes only go to the private mapping and
+ * the image file stays as it was. With flash-mmap=shared they reach the file.
+ */
+static void test_mmap_write(gconstpointer data)
+{
+    bool shared = GPOINTER_TO_INT(data);
+    char *image_path = flash_image_create(0xff);
+    g_autofree uint8_t *image = NULL;
+    QTestState *qts;
+    gsize len;
+
+    qts = qtest_initf("-machine esp32,flash-mmap=%s "
+                      "-drive file=%s,if=mtd,format=raw",
+                      shared ? "shared" : "private", image_path);
+
+    /* The guest sees its own write through the cache in both modes */
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL1, 0);
+    qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE, FLASH_PAGE);
+    cache_flush(qts);
+    flash_program(qts);
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE), ==, 0x5a000000);
+    qtest_quit(qts);
+
+    g_assert(g_file_get_contents(image_path, (gchar **) &image, &len, NULL));
+    g_assert_cmpuint(len, ==, FLASH_SIZE);
+    for (int i = 0; i < PROGRAM_WORDS; ++i) {
+        g_assert_cmphex(ldl_le_p(image + FLASH_PAGE * CACHE_PAGE_SIZE + i * 4), ==,
+                        shared ? 0x5a000000 | i : 0xffffffff);
+    }
+
+    unlink(image_path);
+    g_free(image_path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/flash/lazy_fill", test_lazy_fill);
+    qtest_add_func("/esp32/flash/program_remap", test_program_remap);
+    qtest_add_data_func("/esp32/flash/mmap_private_write", GINT_TO_POINTER(false),
+                        test_mmap_write);
+    qtest_add_data_func("/esp32/flash/mmap_shared_write", GINT_TO_POINTER(true),
+                        test_mmap_write);
+
+    return g_test_run();
+}
@@ -0,0 +1,101 @@
+/*
+ * QTest testcase for x-fork on the ESP32 machine
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define CHILD_WAIT_US               (10 * 1000 * 1000)
+#define CHILD_POLL_US               (10 * 1000)
+
+/* A child that crashed stays a zombie until the parent reaps it */
+static bool child_alive(pid_t pid)
+{
+    g_autofree char *path = g_strdup_printf("/proc/%d/stat", pid);
+    g_autofree char *stat = NULL;
+    char *state;
+
+    if (kill(pid, 0) != 0) {
+        return false;
+    }
+    if (!g_file_get_contents(path, &stat, NULL, NULL)) {
+        return true;
+    }
+    state = strrchr(stat, ')');
+    return state && state[1] == ' ' && state[2] != 'Z';
+}
+
+/*
+ * Fork a child off a stopped VM, swapping the serial chardev to a file.
+ * The child has re-created its vCPUs and applied the chardev-change once
+ * the file exists; the parent must stay stopped.
+ *
+ * The child does not detach the qtest chardev, so only QMP is used once
+ * the child exists.
+ */
+static void test_fork_chardev_change(void)
+{
+    char template[] = "/tmp/esp32-fork-test-XXXXXX";
+    char *tmpdir = mkdtemp(template);
+    g_assert(tmpdir);
+    char *parent_log = g_strdup_printf("%s/parent.log", tmpdir);
+    char *child_log = g_strdup_printf("%s/child.log", tmpdir);
+    QTestState *qts;
+    QDict *rsp, *ret;
+    pid_t pid;
+    int waited;
+
+    qts = qtest_initf("-machine esp32 -accel tcg -S "
+                      "-chardev file,id=ser,path=%s -serial chardev:ser",
+                      parent_log);
+
+    rsp = qtest_qmp(qts,
+                    "{ 'execute': 'x-fork', 'arguments': {"
+                    "  'chardevs': [ { 'id': 'ser', 'backend': {"
+                    "    'type': 'file', 'data': { 'out': %s } } } ] } }",
+                    child_log);
+    g_assert(qdict_haskey(rsp, "return"));
+    ret = qdict_get_qdict(rsp, "return");
+    pid = qdict_get_int(ret, "pid");
+    g_assert_cmpint(pid, >, 0);
+    qobject_unref(rsp);
+
+    for (waited = 0; !g_file_test(child_log, G_FILE_TEST_EXISTS);
+         waited += CHILD_POLL_US) {
+        g_assert_cmpint(waited, <, CHILD_WAIT_US);
+        g_usleep(CHILD_POLL_US);
+    }
+    /* The child survived vm_start with its re-created vCPUs */
+    g_usleep(CHILD_POLL_US);
+    g_assert(child_alive(pid));
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'query-status' }");
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(!qdict_get_bool(ret, "running"));
+    qobject_unref(rsp);
+
+    kill(pid, SIGKILL);
+    qtest_quit(qts);
+
+    unlink(child_log);
+    unlink(parent_log);
+    rmdir(tmpdir);
+    g_free(child_log);
+    g_free(parent_log);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/fork/chardev_change", test_fork_chardev_change);
+
+    return g_test_run();
+}
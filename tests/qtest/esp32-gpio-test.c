@@ -0,0 +1,170 @@
+/*
+ * QTest testcase for the ESP32 GPIO
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "libqtest.h"
+
+#define DR_REG_GPIO_BASE            0x3ff44000
+
+#define GPIO_OUT_W1TS               (DR_REG_GPIO_BASE + 0x08)
+#define GPIO_OUT_W1TC               (DR_REG_GPIO_BASE + 0x0c)
+#define GPIO_ENABLE_W1TS            (DR_REG_GPIO_BASE + 0x24)
+#define GPIO_IN                     (DR_REG_GPIO_BASE + 0x3c)
+#define GPIO_STATUS                 (DR_REG_GPIO_BASE + 0x44)
+#define GPIO_STATUS_W1TC            (DR_REG_GPIO_BASE + 0x4c)
+#define GPIO_PCPU_INT               (DR_REG_GPIO_BASE + 0x68)
+#define GPIO_PIN_REG(n)             (DR_REG_GPIO_BASE + 0x88 + (n) * 4)
+#define GPIO_PIN_INT_TYPE(t)        ((t) << 7)
+#define GPIO_PIN_INT_ENA_PRO        (BIT(2) << 13)
+
+#define GPIO_INT_POSEDGE            1
+#define GPIO_INT_HIGH_LEVEL         5
+
+#define OUTPUT_PIN                  2
+#define EDGE_PIN                    5
+#define LEVEL_PIN                   6
+
+#define WAIT_TIMEOUT_MS             5000
+
+static QTestState *gpio_init(int *sock)
+{
+    int sv[2];
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    *sock = sv[0];
+    return qtest_initf("-machine esp32 -chardev socket,id=gpio,fd=%d "
+                       "-global driver=esp32.gpio,property=chardev,value=gpio",
+                       sv[1]);
+}
+
+static void expect_event(int sock, int pin, int level)
+{
+    g_autofree char *expected = g_strdup_printf("%d %d\n", pin, level);
+    size_t len = strlen(expected);
+    char buf[16] = { 0 };
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t r = read(sock, buf + got, len - got);
+        g_assert_cmpint(r, >, 0);
+        got += r;
+    }
+    g_assert_cmpstr(buf, ==, expected);
+}
+
+/* Set the external level of a pad and wait for it to show in GPIO_IN */
+static void set_input(QTestState *qts, int sock, int pin, int level)
+{
+    g_autofree char *event = g_strdup_printf("%d %d\n", pin, level);
+
+    g_assert_cmpint(write(sock, event, strlen(event)), ==, strlen(event));
+    for (int i = 0; i < WAIT_TIMEOUT_MS; ++i) {
+        if (extract32(qtest_readl(qts, GPIO_IN), pin, 1) == level) {
+            return;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmpuint(extract32(qtest_readl(qts, GPIO_IN), pin, 1), ==, level);
+}
+
+static void test_output(void)
+{
+    int sock;
+    QTestState *qts = gpio_init(&sock);
+
+    qtest_writel(qts, GPIO_ENABLE_W1TS, BIT(OUTPUT_PIN));
+    qtest_writel(qts, GPIO_OUT_W1TS, BIT(OUTPUT_PIN));
+    expect_event(sock, OUTPUT_PIN, 1);
+    g_assert_cmphex(qtest_readl(qts, GPIO_IN) & BIT(OUTPUT_PIN), ==, BIT(OUTPUT_PIN));
+
+    qtest_writel(qts, GPIO_OUT_W1TC, BIT(OUTPUT_PIN));
+    expect_event(sock, OUTPUT_PIN, 0);
+    g_assert_cmphex(qtest_readl(qts, GPIO_IN) & BIT(OUTPUT_PIN), ==, 0);
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+static void test_input(void)
+{
+    int sock;
+    QTestState *qts = gpio_init(&sock);
+
+    set_input(qts, sock, EDGE_PIN, 1);
+    set_input(qts, sock, EDGE_PIN, 0);
+
+    /* A pad whose output is enabled ignores the external level */
+    qtest_writel(qts, GPIO_ENABLE_W1TS, BIT(OUTPUT_PIN));
+    g_assert_cmpint(write(sock, "2 1\n", 4), ==, 4);
+    set_input(qts, sock, EDGE_PIN, 1);
+    g_assert_cmphex(qtest_readl(qts, GPIO_IN) & BIT(OUTPUT_PIN), ==, 0);
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+static void test_edge_interrupt(void)
+{
+    int sock;
+    QTestState *qts = gpio_init(&sock);
+
+    qtest_writel(qts, GPIO_PIN_REG(EDGE_PIN),
+                 GPIO_PIN_INT_TYPE(GPIO_INT_POSEDGE) | GPIO_PIN_INT_ENA_PRO);
+    set_input(qts, sock, EDGE_PIN, 1);
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, BIT(EDGE_PIN));
+    g_assert_cmphex(qtest_readl(qts, GPIO_PCPU_INT), ==, BIT(EDGE_PIN));
+
+    /* Once cleared, the interrupt stays clear until the next rising edge */
+    qtest_writel(qts, GPIO_STATUS_W1TC, BIT(EDGE_PIN));
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, 0);
+    set_input(qts, sock, EDGE_PIN, 0);
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, 0);
+    set_input(qts, sock, EDGE_PIN, 1);
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, BIT(EDGE_PIN));
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+static void test_level_interrupt(void)
+{
+    int sock;
+    QTestState *qts = gpio_init(&sock);
+
+    qtest_writel(qts, GPIO_PIN_REG(LEVEL_PIN),
+                 GPIO_PIN_INT_TYPE(GPIO_INT_HIGH_LEVEL) | GPIO_PIN_INT_ENA_PRO);
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, 0);
+    set_input(qts, sock, LEVEL_PIN, 1);
+    g_assert_cmphex(qtest_readl(qts, GPIO_PCPU_INT), ==, BIT(LEVEL_PIN));
+
+    /* Clearing the status has no effect while the level persists */
+    qtest_writel(qts, GPIO_STATUS_W1TC, BIT(LEVEL_PIN));
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, BIT(LEVEL_PIN));
+
+    set_input(qts, sock, LEVEL_PIN, 0);
+    qtest_writel(qts, GPIO_STATUS_W1TC, BIT(LEVEL_PIN));
+    g_assert_cmphex(qtest_readl(qts, GPIO_STATUS), ==, 0);
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/gpio/output", test_output);
+    qtest_add_func("/esp32/gpio/input", test_input);
+    qtest_add_func("/esp32/gpio/edge_interrupt", test_edge_interrupt);
+    qtest_add_func("/esp32/gpio/level_interrupt", test_level_interrupt);
+
+    return g_test_run();
+}
@@ -0,0 +1,213 @@
+/*
+ * QTest testcase for the ESP32 I2C controller command list execution
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "libqtest.h"
+
+#define DR_REG_I2C_EXT_BASE     0x3ff53000
+#define I2C_SCL_LOW_PERIOD      (DR_REG_I2C_EXT_BASE + 0x00)
+#define I2C_CTR                 (DR_REG_I2C_EXT_BASE + 0x04)
+#define I2C_FIFO_DATA           (DR_REG_I2C_EXT_BASE + 0x1c)
+#define I2C_INT_RAW             (DR_REG_I2C_EXT_BASE + 0x20)
+#define I2C_INT_CLR             (DR_REG_I2C_EXT_BASE + 0x24)
+#define I2C_SCL_HIGH_PERIOD     (DR_REG_I2C_EXT_BASE + 0x38)
+#define I2C_COMD(n)             (DR_REG_I2C_EXT_BASE + 0x58 + (n) * 4)
+
+#define I2C_CTR_TRANS_START     BIT(5)
+#define I2C_INT_TRANS_COMPLETE  BIT(7)
+#define I2C_INT_ACK_ERR         BIT(10)
+#define I2C_COMD_DONE           BIT(31)
+
+#define I2C_OP_RSTART           0
+#define I2C_OP_WRITE            1
+#define I2C_OP_STOP             3
+#define I2C_COMD_VAL(op, n)     (((op) << 11) | BIT(8) | (n))
+
+/* The machine has an SSD1306 display at this address on I2C0 */
+#define SSD1306_ADDR            0x3c
+
+/* 100 kHz SCL from the 80 MHz APB clock: 10 us per bit */
+#define SCL_HALF_PERIOD         400
+#define SCL_BIT_NS              10000
+
+/* SSD1306 control bytes, and the console scaling of the model */
+#define SSD1306_CTRL_CMD        0x80
+#define SSD1306_CTRL_DATA       0x40
+#define SSD1306_MAGNIFY         4
+#define SSD1306_WIDTH           128
+#define SSD1306_HEIGHT          64
+
+static void i2c_write_start(QTestState *qts, uint8_t addr, const uint8_t *data, int len)
+{
+    qtest_writel(qts, I2C_SCL_LOW_PERIOD, SCL_HALF_PERIOD);
+    qtest_writel(qts, I2C_SCL_HIGH_PERIOD, SCL_HALF_PERIOD);
+    qtest_writel(qts, I2C_FIFO_DATA, addr << 1);
+    for (int i = 0; i < len; ++i) {
+        qtest_writel(qts, I2C_FIFO_DATA, data[i]);
+    }
+    qtest_writel(qts, I2C_COMD(0), I2C_COMD_VAL(I2C_OP_RSTART, 0));
+    qtest_writel(qts, I2C_COMD(1), I2C_COMD_VAL(I2C_OP_WRITE, len + 1));
+    qtest_writel(qts, I2C_COMD(2), I2C_COMD_VAL(I2C_OP_STOP, 0));
+    qtest_writel(qts, I2C_CTR, I2C_CTR_TRANS_START);
+}
+
+static void test_write_timing(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+    /* Display off, display on */
+    const uint8_t cmd[] = { 0x80, 0xae, 0x80, 0xaf };
+    /* start + 5 bytes with ACK + stop */
+    const int64_t trans_ns = (1 + 5 * 9 + 1) * SCL_BIT_NS;
+
+    i2c_write_start(qts, SSD1306_ADDR, cmd, sizeof(cmd));
+    g_assert_cmphex(qtest_readl(qts, I2C_COMD(2)) & I2C_COMD_DONE, ==, 0);
+
+    qtest_clock_step(qts, trans_ns - SCL_BIT_NS);
+    g_assert_cmphex(qtest_readl(qts, I2C_COMD(1)) & I2C_COMD_DONE, ==, 0);
+
+    qtest_clock_step(qts, 2 * SCL_BIT_NS);
+    for (int i = 0; i < 3; ++i) {
+        g_assert_cmphex(qtest_readl(qts, I2C_COMD(i)) & I2C_COMD_DONE, ==, I2C_COMD_DONE);
+    }
+    g_assert_cmphex(qtest_readl(qts, I2C_INT_RAW) & (I2C_INT_TRANS_COMPLETE | I2C_INT_ACK_ERR),
+                    ==, I2C_INT_TRANS_COMPLETE);
+
+    qtest_quit(qts);
+}
+
+static void test_nack(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+    const uint8_t data[] = { 0x00 };
+
+    i2c_write_start(qts, 0x50, data, sizeof(data));
+    qtest_clock_step(qts, 100 * SCL_BIT_NS);
+
+    /* Execution stops at the write which wasn't acknowledged */
+    g_assert_cmphex(qtest_readl(qts, I2C_COMD(1)) & I2C_COMD_DONE, ==, I2C_COMD_DONE);
+    g_assert_cmphex(qtest_readl(qts, I2C_COMD(2)) & I2C_COMD_DONE, ==, 0);
+    g_assert_cmphex(qtest_readl(qts, I2C_INT_RAW) & (I2C_INT_TRANS_COMPLETE | I2C_INT_ACK_ERR),
+                    ==, I2C_INT_ACK_ERR);
+
+    qtest_quit(qts);
+}
+
+/* Write to the SSD1306 and wait for the transaction to complete */
+static void ssd1306_write(QTestState *qts, const uint8_t *data, int len)
+{
+    i2c_write_start(qts, SSD1306_ADDR, data, len);
+    qtest_clock_step(qts, (3 + (len + 1) * 9) * SCL_BIT_NS);
+    g_assert_cmphex(qtest_readl(qts, I2C_INT_RAW) & I2C_INT_TRANS_COMPLETE, ==,
+                    I2C_INT_TRANS_COMPLETE);
+    qtest_writel(qts, I2C_INT_CLR, 0xffffffff);
+}
+
+/* Write one byte, i.e. 8 vertical pixels, of display memory */
+static void ssd1306_write_byte(QTestState *qts, int page, int col, uint8_t val)
+{
+    const uint8_t cmd[] = {
+        SSD1306_CTRL_CMD, 0xb0 | page,
+        SSD1306_CTRL_CMD, col & 0xf,
+        SSD1306_CTRL_CMD, 0x10 | (col >> 4),
+    };
+    const uint8_t data[] = { SSD1306_CTRL_DATA, val };
+
+    ssd1306_write(qts, cmd, sizeof(cmd));
+    ssd1306_write(qts, data, sizeof(data));
+}
+
+/* Dump the first console, which is the display on I2C0, as 1 bit per pixel */
+static void ssd1306_screendump(QTestState *qts, const char *path,
+                               bool pixels[SSD1306_HEIGHT][SSD1306_WIDTH])
+{
+    const int width = SSD1306_WIDTH * SSD1306_MAGNIFY;
+    const int height = SSD1306_HEIGHT * SSD1306_MAGNIFY;
+    g_autofree char *header = g_strdup_printf("P6\n%d %d\n255\n", width, height);
+    g_autofree gchar *ppm = NULL;
+    gsize len;
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'screendump', "
+                             "'arguments': { 'filename': %s } }", path);
+    g_assert(g_file_get_contents(path, &ppm, &len, NULL));
+    g_assert_cmpuint(len, ==, strlen(header) + width * height * 3);
+    g_assert_cmpmem(ppm, strlen(header), header, strlen(header));
+
+    for (int y = 0; y < SSD1306_HEIGHT; ++y) {
+        for (int x = 0; x < SSD1306_WIDTH; ++x) {
+            int offset = strlen(header) +
+                ((y * SSD1306_MAGNIFY) * width + x * SSD1306_MAGNIFY) * 3;
+            pixels[y][x] = ppm[offset] != 0;
+        }
+    }
+}
+
+static void ssd1306_check(QTestState *qts, const char *path,
+                          uint8_t expected[SSD1306_HEIGHT / 8][SSD1306_WIDTH])
+{
+    bool pixels[SSD1306_HEIGHT][SSD1306_WIDTH];
+
+    ssd1306_screendump(qts, path, pixels);
+    for (int y = 0; y < SSD1306_HEIGHT; ++y) {
+        for (int x = 0; x < SSD1306_WIDTH; ++x) {
+            g_assert_cmpint(pixels[y][x], ==, extract32(expected[y / 8][x], y % 8, 1));
+        }
+    }
+}
+
+/*
+ * The display model converts only the columns written since the last
+ * update. Update it after each write and check that the picture is still
+ * complete: earlier writes stay, overwritten ones change.
+ */
+static void test_ssd1306_dirty_regions(void)
+{
+    char path[] = "/tmp/esp32-i2c-test-XXXXXX";
+    uint8_t expected[SSD1306_HEIGHT / 8][SSD1306_WIDTH] = { { 0 } };
+    QTestState *qts = qtest_init("-machine esp32");
+    int fd = mkstemp(path);
+
+    g_assert(fd >= 0);
+    close(fd);
+
+    ssd1306_check(qts, path, expected);
+
+    ssd1306_write_byte(qts, 2, 10, 0xff);
+    expected[2][10] = 0xff;
+    ssd1306_check(qts, path, expected);
+
+    ssd1306_write_byte(qts, 5, 100, 0x81);
+    expected[5][100] = 0x81;
+    ssd1306_check(qts, path, expected);
+
+    /* Rewriting the same value changes nothing */
+    ssd1306_write_byte(qts, 5, 100, 0x81);
+    ssd1306_check(qts, path, expected);
+
+    ssd1306_write_byte(qts, 2, 10, 0x00);
+    ssd1306_write_byte(qts, 2, 127, 0x3c);
+    expected[2][10] = 0x00;
+    expected[2][127] = 0x3c;
+    ssd1306_check(qts, path, expected);
+
+    qtest_quit(qts);
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/i2c/write_timing", test_write_timing);
+    qtest_add_func("/esp32/i2c/nack", test_nack);
+    qtest_add_func("/esp32/i2c/ssd1306_dirty_regions", test_ssd1306_dirty_regions);
+
+    return g_test_run();
+}
@@ -0,0 +1,255 @@
+/*
+ * QTest testcase for the SX127x LoRa radio on the ESP32 machine
+ *
+ * The radio is attached with -machine esp32,lora=on and accessed through
+ * VSPI, with NSS driven by a GPIO, the same way the drivers do it.
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "libqtest.h"
+
+#define DR_REG_GPIO_BASE        0x3ff44000
+#define GPIO_OUT_W1TS           (DR_REG_GPIO_BASE + 0x08)
+#define GPIO_OUT_W1TC           (DR_REG_GPIO_BASE + 0x0c)
+#define GPIO_ENABLE_W1TS        (DR_REG_GPIO_BASE + 0x24)
+#define GPIO_IN                 (DR_REG_GPIO_BASE + 0x3c)
+
+#define LORA_NSS_GPIO           18
+#define LORA_RESET_GPIO         14
+#define LORA_DIO0_GPIO          26
+
+#define DR_REG_SPI3_BASE        0x3ff65000
+#define SPI_CMD                 (DR_REG_SPI3_BASE + 0x00)
+#define SPI_CLOCK               (DR_REG_SPI3_BASE + 0x18)
+#define SPI_USER                (DR_REG_SPI3_BASE + 0x1c)
+#define SPI_MOSI_DLEN           (DR_REG_SPI3_BASE + 0x28)
+#define SPI_MISO_DLEN           (DR_REG_SPI3_BASE + 0x2c)
+#define SPI_W0                  (DR_REG_SPI3_BASE + 0x80)
+
+#define SPI_CMD_USR             BIT(18)
+#define SPI_USER_MOSI           BIT(27)
+#define SPI_USER_MISO           BIT(28)
+#define SPI_CLOCK_EQU_SYSCLK    BIT(31)
+#define SPI_BUF_LEN             64
+
+#define REG_FIFO                0x00
+#define REG_OP_MODE             0x01
+#define REG_FIFO_ADDR_PTR       0x0d
+#define REG_FIFO_TX_BASE_ADDR   0x0e
+#define REG_FIFO_RX_CURRENT_ADDR 0x10
+#define REG_IRQ_FLAGS           0x12
+#define REG_RX_NB_BYTES         0x13
+#define REG_PAYLOAD_LENGTH      0x22
+#define REG_SYNC_WORD           0x39
+#define REG_DIO_MAPPING_1       0x40
+#define REG_VERSION             0x42
+
+#define OP_MODE_LORA            0x80
+#define MODE_STDBY              0x01
+#define MODE_TX                 0x03
+#define MODE_RX_CONTINUOUS      0x05
+
+#define IRQ_TX_DONE             0x08
+#define IRQ_RX_DONE             0x40
+
+#define DIO0_RX_DONE            (0 << 6)
+#define DIO0_TX_DONE            (1 << 6)
+
+#define SX127X_VERSION          0x12
+
+/* Time for any frame used here to go over the air */
+#define AIRTIME_MAX_NS          (1000 * 1000 * 1000)
+#define WAIT_TIMEOUT_MS         5000
+
+static QTestState *lora_init(int *sock)
+{
+    QTestState *qts;
+    int sv[2];
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    *sock = sv[0];
+    qts = qtest_initf("-machine esp32,lora=on -chardev socket,id=radio,fd=%d "
+                      "-global sx127x.chardev=radio", sv[1]);
+
+    /* Deselect the radio and take it out of reset */
+    qtest_writel(qts, GPIO_OUT_W1TS, BIT(LORA_NSS_GPIO) | BIT(LORA_RESET_GPIO));
+    qtest_writel(qts, GPIO_ENABLE_W1TS, BIT(LORA_NSS_GPIO) | BIT(LORA_RESET_GPIO));
+    qtest_writel(qts, SPI_CLOCK, SPI_CLOCK_EQU_SYSCLK);
+    return qts;
+}
+
+/* Full duplex transfer of len bytes with NSS asserted around it */
+static void lora_xfer(QTestState *qts, uint8_t *buf, int len)
+{
+    g_assert_cmpint(len, <=, SPI_BUF_LEN);
+
+    for (int i = 0; i < len; i += 4) {
+        uint32_t word = 0;
+        for (int j = 0; j < 4 && i + j < len; ++j) {
+            word |= buf[i + j] << (8 * j);
+        }
+        qtest_writel(qts, SPI_W0 + i, word);
+    }
+    qtest_writel(qts, GPIO_OUT_W1TC, BIT(LORA_NSS_GPIO));
+    qtest_writel(qts, SPI_USER, SPI_USER_MOSI | SPI_USER_MISO);
+    qtest_writel(qts, SPI_MOSI_DLEN, len * 8 - 1);
+    qtest_writel(qts, SPI_MISO_DLEN, len * 8 - 1);
+    qtest_writel(qts, SPI_CMD, SPI_CMD_USR);
+    qtest_clock_step(qts, 10000);
+    g_assert_cmphex(qtest_readl(qts, SPI_CMD), ==, 0);
+    qtest_writel(qts, GPIO_OUT_W1TS, BIT(LORA_NSS_GPIO));
+
+    for (int i = 0; i < len; i += 4) {
+        uint32_t word = qtest_readl(qts, SPI_W0 + i);
+        for (int j = 0; j < 4 && i + j < len; ++j) {
+            buf[i + j] = word >> (8 * j);
+        }
+    }
+}
+
+static void lora_write(QTestState *qts, uint8_t reg, uint8_t val)
+{
+    uint8_t buf[] = { 0x80 | reg, val };
+    lora_xfer(qts, buf, sizeof(buf));
+}
+
+static uint8_t lora_read(QTestState *qts, uint8_t reg)
+{
+    uint8_t buf[] = { reg, 0 };
+    lora_xfer(qts, buf, sizeof(buf));
+    return buf[1];
+}
+
+static bool lora_dio0(QTestState *qts)
+{
+    return qtest_readl(qts, GPIO_IN) & BIT(LORA_DIO0_GPIO);
+}
+
+static void read_all(int sock, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t r = read(sock, buf + got, len - got);
+        g_assert_cmpint(r, >, 0);
+        got += r;
+    }
+}
+
+static void test_registers(void)
+{
+    int sock;
+    QTestState *qts = lora_init(&sock);
+
+    g_assert_cmphex(lora_read(qts, REG_VERSION), ==, SX127X_VERSION);
+    lora_write(qts, REG_VERSION, 0);
+    g_assert_cmphex(lora_read(qts, REG_VERSION), ==, SX127X_VERSION);
+
+    lora_write(qts, REG_SYNC_WORD, 0x34);
+    g_assert_cmphex(lora_read(qts, REG_SYNC_WORD), ==, 0x34);
+
+    /* Burst accesses auto-increment the address */
+    uint8_t buf[] = { REG_PAYLOAD_LENGTH - 1, 0, 0 };
+    lora_write(qts, REG_PAYLOAD_LENGTH, 0x2a);
+    lora_xfer(qts, buf, sizeof(buf));
+    g_assert_cmphex(buf[2], ==, 0x2a);
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+static void test_tx(void)
+{
+    static const char payload[] = "hello";
+    const int len = strlen(payload);
+    uint8_t buf[1 + sizeof(payload)];
+    int sock;
+    QTestState *qts = lora_init(&sock);
+
+    lora_write(qts, REG_OP_MODE, OP_MODE_LORA | MODE_STDBY);
+    lora_write(qts, REG_DIO_MAPPING_1, DIO0_TX_DONE);
+    lora_write(qts, REG_FIFO_ADDR_PTR, lora_read(qts, REG_FIFO_TX_BASE_ADDR));
+    buf[0] = 0x80 | REG_FIFO;
+    memcpy(buf + 1, payload, len);
+    lora_xfer(qts, buf, 1 + len);
+    lora_write(qts, REG_PAYLOAD_LENGTH, len);
+
+    lora_write(qts, REG_OP_MODE, OP_MODE_LORA | MODE_TX);
+    g_assert_cmphex(lora_read(qts, REG_IRQ_FLAGS), ==, 0);
+    g_assert_false(lora_dio0(qts));
+
+    qtest_clock_step(qts, AIRTIME_MAX_NS);
+    g_assert_cmphex(lora_read(qts, REG_IRQ_FLAGS), ==, IRQ_TX_DONE);
+    g_assert_cmphex(lora_read(qts, REG_OP_MODE), ==, OP_MODE_LORA | MODE_STDBY);
+    g_assert_true(lora_dio0(qts));
+
+    /* The frame goes out as a length byte and the payload */
+    read_all(sock, buf, 1 + len);
+    g_assert_cmpint(buf[0], ==, len);
+    g_assert_cmpmem(buf + 1, len, payload, len);
+
+    lora_write(qts, REG_IRQ_FLAGS, 0xff);
+    g_assert_cmphex(lora_read(qts, REG_IRQ_FLAGS), ==, 0);
+    g_assert_false(lora_dio0(qts));
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+static void test_rx(void)
+{
+    static const uint8_t frame[] = { 4, 'p', 'i', 'n', 'g' };
+    uint8_t buf[1 + 4];
+    int sock;
+    QTestState *qts = lora_init(&sock);
+
+    lora_write(qts, REG_OP_MODE, OP_MODE_LORA | MODE_STDBY);
+    lora_write(qts, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+    lora_write(qts, REG_OP_MODE, OP_MODE_LORA | MODE_RX_CONTINUOUS);
+    g_assert_cmpint(write(sock, frame, sizeof(frame)), ==, sizeof(frame));
+
+    /*
+     * The frame is read from the chardev by the main loop, then received
+     * once its airtime has passed.
+     */
+    for (int i = 0; i < WAIT_TIMEOUT_MS; ++i) {
+        qtest_clock_step(qts, AIRTIME_MAX_NS);
+        if (lora_read(qts, REG_IRQ_FLAGS) & IRQ_RX_DONE) {
+            break;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmphex(lora_read(qts, REG_IRQ_FLAGS) & IRQ_RX_DONE, ==, IRQ_RX_DONE);
+    g_assert_true(lora_dio0(qts));
+    g_assert_cmpuint(lora_read(qts, REG_RX_NB_BYTES), ==, 4);
+
+    lora_write(qts, REG_FIFO_ADDR_PTR, lora_read(qts, REG_FIFO_RX_CURRENT_ADDR));
+    memset(buf, 0, sizeof(buf));
+    buf[0] = REG_FIFO;
+    lora_xfer(qts, buf, sizeof(buf));
+    g_assert_cmpmem(buf + 1, 4, frame + 1, 4);
+
+    lora_write(qts, REG_IRQ_FLAGS, 0xff);
+    g_assert_false(lora_dio0(qts));
+
+    qtest_quit(qts);
+    close(sock);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/lora/registers", test_registers);
+    qtest_add_func("/esp32/lora/tx", test_tx);
+    qtest_add_func("/esp32/lora/rx", test_rx);
+
+    return g_test_run();
+}
@@ -0,0 +1,107 @@
+/*
+ * QTest testcase for the ESP32 ROM routine hooks
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "esp32-boot.h"
+
+#define ROM_MEMSET          0x4000c44c
+#define ROM_SPIREAD         0x40062ed8
+
+#define DONE_FLAG           ESP32_PROGRAM_DATA
+#define MEMSET_BUF          (ESP32_PROGRAM_DATA + 0x10)
+#define MEMSET_LEN          16
+#define MEMSET_FILL         0x5a
+
+/* Hits of the hook named @name in 'info hle', -1 if it is not listed */
+static int64_t hle_hits(QTestState *qts, const char *name)
+{
+    g_autofree char *info = qtest_hmp(qts, "info hle");
+    g_auto(GStrv) lines = g_strsplit(info, "\n", -1);
+
+    for (int i = 0; lines[i]; ++i) {
+        char hook[32];
+        unsigned pc;
+        uint64_t hits;
+
+        if (sscanf(lines[i], "0x%x %31s %" SCNu64, &pc, hook, &hits) == 3 &&
+            !strcmp(hook, name)) {
+            return hits;
+        }
+    }
+    return -1;
+}
+
+static void test_info_hle(void)
+{
+    QTestState *qts = qtest_init("-machine esp32,rom-hooks=on");
+
+    g_assert_cmpint(hle_hits(qts, "memcpy"), ==, 0);
+    g_assert_cmpint(hle_hits(qts, "MD5Update"), ==, 0);
+    /* SPIRead needs a flash chip */
+    g_assert_cmpint(hle_hits(qts, "SPIRead"), ==, -1);
+
+    qtest_quit(qts);
+}
+
+/* With -kernel or -bios the ROM routines are not at the hooked addresses */
+static void test_no_rom(void)
+{
+    QTestState *qts = qtest_init("-machine esp32,rom-hooks=on -bios /dev/null");
+    g_autofree char *info = qtest_hmp(qts, "info hle");
+
+    g_assert_nonnull(strstr(info, "No routines are emulated natively"));
+
+    qtest_quit(qts);
+}
+
+/* Call the ROM memset with CALLX8, the way compiled code does */
+static void test_memset(void)
+{
+    Esp32Program program;
+    QTestState *qts;
+    uint8_t buf[MEMSET_LEN + 4];
+    uint8_t expected[MEMSET_LEN + 4];
+
+    esp32_program_init(&program);
+    esp32_program_movi32(&program, 10, MEMSET_BUF);
+    esp32_program_emit(&program, XT_MOVI(11, MEMSET_FILL));
+    esp32_program_emit(&program, XT_MOVI(12, MEMSET_LEN));
+    esp32_program_movi32(&program, 4, ROM_MEMSET);
+    esp32_program_emit(&program, XT_CALLX8(4));
+    /* memset returns its first argument */
+    esp32_program_movi32(&program, 3, DONE_FLAG);
+    esp32_program_emit(&program, XT_S32I(10, 3, 0));
+    esp32_program_emit(&program, XT_J(-4));
+
+    qts = qtest_init("-machine esp32,rom-hooks=on -accel tcg -S");
+    esp32_program_load(qts, &program);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    esp32_program_wait(qts, DONE_FLAG, MEMSET_BUF);
+
+    qtest_memread(qts, MEMSET_BUF, buf, sizeof(buf));
+    memset(expected, MEMSET_FILL, MEMSET_LEN);
+    memset(expected + MEMSET_LEN, 0, sizeof(expected) - MEMSET_LEN);
+    g_assert_cmpmem(buf, sizeof(buf), expected, sizeof(expected));
+    g_assert_cmpint(hle_hits(qts, "memset"), ==, 1);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/rom_hooks/info_hle", test_info_hle);
+    qtest_add_func("/esp32/rom_hooks/no_rom", test_no_rom);
+    qtest_add_func("/esp32/rom_hooks/memset", test_memset);
+
+    return g_test_run();
+}
@@ -0,0 +1,177 @@
+/*
+ * QTest testcase for the ESP32 RSA accelerator
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define DR_REG_RSA_BASE     0x3ff02000
+#define RSA_MEM_M           (DR_REG_RSA_BASE + 0x000)
+#define RSA_MEM_Z           (DR_REG_RSA_BASE + 0x200)
+#define RSA_MEM_Y           (DR_REG_RSA_BASE + 0x400)
+#define RSA_MEM_X           (DR_REG_RSA_BASE + 0x600)
+#define RSA_M_DASH          (DR_REG_RSA_BASE + 0x800)
+#define RSA_MODEXP_MODE     (DR_REG_RSA_BASE + 0x804)
+#define RSA_MODEXP_START    (DR_REG_RSA_BASE + 0x808)
+#define RSA_MULT_MODE       (DR_REG_RSA_BASE + 0x80c)
+#define RSA_MULT_START      (DR_REG_RSA_BASE + 0x810)
+#define RSA_INTERRUPT       (DR_REG_RSA_BASE + 0x814)
+#define RSA_CLEAN           (DR_REG_RSA_BASE + 0x818)
+
+/* 512-bit operands, as big-endian hex strings */
+static const char rsa_m[] =
+    "d4913be582490b3b5320dff019a9067509de6e53b861afb70639f08b7f0a674d"
+    "3ce0216ce6746772b2c753574d99d19c2507759b36af971eed2ef1c113d1e9e3";
+static const char rsa_x[] =
+    "86502637205c5a84c812ab06c15930b68adb5a900030e56599e90c3b5ef74752"
+    "78015f97e1bda755fe1f014ef1d7e893b0c9049e85d62cf30e9ba56dd7d3a0ae";
+static const char rsa_y[] =
+    "090025291ee979f5558d858214dd3bf2723deaa933a0a95decd28f49f414602b"
+    "49af3aa5d629f1f033f58438d7c47d97c5e2ec79bb0e1dc57c47ba500268bfa9";
+/* R^2 mod M, where R = 2^512 */
+static const char rsa_r[] =
+    "3f683966afcb2e6f100061515cf0b9e45300a2e1e6eaef30a443c3b817015397"
+    "c78365668ee49cc276c07c641193c276b569c38aee7cd90f6ef038fa10b4a633";
+/* -M^-1 mod 2^32 */
+static const uint32_t rsa_m_dash = 0xc11f5c35;
+
+/* X ^ Y mod M */
+static const char rsa_exp[] =
+    "2d382f69e1cb6a976b680196383df4fbd440eea449e94614bbae60bcd22c8cca"
+    "48591367e57707cf02b33d89f65e0f04f785c5c04797aaaaa5c0baeb505a95f3";
+/* X ^ 65537 mod M */
+static const char rsa_exp_65537[] =
+    "3860974cf57681cf2e4a275b76eb6be079d3b55f41738f210710182ff1d8352f"
+    "292c647a8afe7d6c579eb81e68646c9ef9fa39c57e37c7e84de4e95fc6ee569b";
+/* X * Y mod M */
+static const char rsa_mulmod[] =
+    "ac413c82b6a963c928aa5c4db73c0fd8d8ea2d29cd78c5ea90ed2497bea6cbab"
+    "799ece20079ff44d567003fab57e7233b3c3d6da8295b31873797e2a29b32d2e";
+/* X * Y */
+static const char rsa_mul[] =
+    "04b8e4d718b7391a0a871ccac9950bc55ad5b344c02c8ce2a466a0269cc816ed"
+    "4bc582d4b845a770b92dc8d9d9a56aceb5df146f84cbf57d6b01d5e13eff54cf"
+    "a7ae654cf72fe2b8239a55bbfc501b1b47fa640117779d9b208255d0396630f2"
+    "18e82f244b331a7f1c3067a2c0e7cb16719bf0e4fe31656fe29f21250246e4de";
+
+/* Memory blocks hold the least significant word first */
+static void rsa_write_mem(QTestState *qts, uint32_t addr, const char *hex)
+{
+    size_t words = strlen(hex) / 8;
+
+    for (size_t i = 0; i < words; ++i) {
+        char word[9];
+
+        memcpy(word, hex + (words - 1 - i) * 8, 8);
+        word[8] = 0;
+        qtest_writel(qts, addr + i * 4, strtoul(word, NULL, 16));
+    }
+}
+
+static char *rsa_read_mem(QTestState *qts, uint32_t addr, size_t words)
+{
+    GString *result = g_string_new(NULL);
+
+    for (size_t i = words; i > 0; --i) {
+        g_string_append_printf(result, "%08x", qtest_readl(qts, addr + (i - 1) * 4));
+    }
+    return g_string_free(result, false);
+}
+
+static void rsa_run(QTestState *qts, uint32_t start_reg)
+{
+    qtest_writel(qts, RSA_INTERRUPT, 1);
+    qtest_writel(qts, start_reg, 1);
+    g_assert_cmpuint(qtest_readl(qts, RSA_INTERRUPT), ==, 1);
+    qtest_writel(qts, RSA_INTERRUPT, 1);
+    g_assert_cmpuint(qtest_readl(qts, RSA_INTERRUPT), ==, 0);
+}
+
+static void rsa_check_mem(QTestState *qts, uint32_t addr, const char *expected)
+{
+    char *result = rsa_read_mem(qts, addr, strlen(expected) / 8);
+
+    g_assert_cmpstr(result, ==, expected);
+    g_free(result);
+}
+
+static QTestState *rsa_init(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+
+    g_assert_cmpuint(qtest_readl(qts, RSA_CLEAN), ==, 1);
+    return qts;
+}
+
+static void test_rsa_modexp(void)
+{
+    QTestState *qts = rsa_init();
+
+    rsa_write_mem(qts, RSA_MEM_M, rsa_m);
+    rsa_write_mem(qts, RSA_MEM_X, rsa_x);
+    rsa_write_mem(qts, RSA_MEM_Y, rsa_y);
+    rsa_write_mem(qts, RSA_MEM_Z, rsa_r);
+    qtest_writel(qts, RSA_M_DASH, rsa_m_dash);
+    qtest_writel(qts, RSA_MODEXP_MODE, 0);
+    rsa_run(qts, RSA_MODEXP_START);
+    rsa_check_mem(qts, RSA_MEM_Z, rsa_exp);
+
+    /* Short exponent, as used for signature verification */
+    rsa_write_mem(qts, RSA_MEM_Y,
+                  "0000000000000000000000000000000000000000000000000000000000000000"
+                  "0000000000000000000000000000000000000000000000000000000000010001");
+    rsa_write_mem(qts, RSA_MEM_Z, rsa_r);
+    rsa_run(qts, RSA_MODEXP_START);
+    rsa_check_mem(qts, RSA_MEM_Z, rsa_exp_65537);
+
+    qtest_quit(qts);
+}
+
+static void test_rsa_mulmod(void)
+{
+    QTestState *qts = rsa_init();
+
+    /* Bring X into the Montgomery domain, then multiply by Y */
+    rsa_write_mem(qts, RSA_MEM_M, rsa_m);
+    rsa_write_mem(qts, RSA_MEM_X, rsa_x);
+    rsa_write_mem(qts, RSA_MEM_Z, rsa_r);
+    qtest_writel(qts, RSA_M_DASH, rsa_m_dash);
+    qtest_writel(qts, RSA_MULT_MODE, 0);
+    rsa_run(qts, RSA_MULT_START);
+    rsa_write_mem(qts, RSA_MEM_X, rsa_y);
+    rsa_run(qts, RSA_MULT_START);
+    rsa_check_mem(qts, RSA_MEM_Z, rsa_mulmod);
+
+    qtest_quit(qts);
+}
+
+static void test_rsa_mul(void)
+{
+    QTestState *qts = rsa_init();
+
+    /* Y goes into the upper half of Z, the 1024-bit product fills Z */
+    rsa_write_mem(qts, RSA_MEM_X, rsa_x);
+    rsa_write_mem(qts, RSA_MEM_Z + 512 / 8, rsa_y);
+    qtest_writel(qts, RSA_MULT_MODE, 8);
+    rsa_run(qts, RSA_MULT_START);
+    rsa_check_mem(qts, RSA_MEM_Z, rsa_mul);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/rsa/modexp", test_rsa_modexp);
+    qtest_add_func("/esp32/rsa/mulmod", test_rsa_mulmod);
+    qtest_add_func("/esp32/rsa/mul", test_rsa_mul);
+
+    return g_test_run();
+}
@@ -0,0 +1,187 @@
+/*
+ * QTest testcase for the ESP32 RTC_CNTL sleep modes
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define DR_REG_RTCCNTL_BASE         0x3ff48000
+#define RTC_CNTL_SLP_TIMER0         (DR_REG_RTCCNTL_BASE + 0x04)
+#define RTC_CNTL_SLP_TIMER1         (DR_REG_RTCCNTL_BASE + 0x08)
+#define RTC_CNTL_TIME_UPDATE        (DR_REG_RTCCNTL_BASE + 0x0c)
+#define RTC_CNTL_TIME0              (DR_REG_RTCCNTL_BASE + 0x10)
+#define RTC_CNTL_STATE0             (DR_REG_RTCCNTL_BASE + 0x18)
+#define RTC_CNTL_RESET_STATE        (DR_REG_RTCCNTL_BASE + 0x34)
+#define RTC_CNTL_WAKEUP_STATE       (DR_REG_RTCCNTL_BASE + 0x38)
+#define RTC_CNTL_INT_ENA            (DR_REG_RTCCNTL_BASE + 0x3c)
+#define RTC_CNTL_INT_RAW            (DR_REG_RTCCNTL_BASE + 0x40)
+#define RTC_CNTL_INT_CLR            (DR_REG_RTCCNTL_BASE + 0x48)
+#define RTC_CNTL_STORE0             (DR_REG_RTCCNTL_BASE + 0x4c)
+#define RTC_CNTL_DIG_PWC            (DR_REG_RTCCNTL_BASE + 0x8c)
+
+#define RTC_SLOW_MEM_BASE           0x50000000
+
+#define DR_REG_DPORT_BASE           0x3ff00000
+#define DPORT_PRO_CACHE_CTRL        (DR_REG_DPORT_BASE + 0x40)
+#define DPORT_PRO_CACHE_CTRL1       (DR_REG_DPORT_BASE + 0x44)
+#define DPORT_PRO_FLASH_MMU_TABLE   0x3ff10000
+#define CACHE_FLUSH_ENA             BIT(4)
+#define CACHE_ENA                   BIT(3)
+#define MMU_INVALID                 0x100
+#define MMU_PAGES                   64
+#define DROM0_BASE                  0x3f400000
+#define FLASH_SIZE                  (4 * 1024 * 1024)
+#define FLASH_PAGE                  1
+
+#define SLEEP_EN                    BIT(31)
+#define DG_WRAP_PD_EN               BIT(31)
+#define TIMER_TRIG_EN               BIT(3)
+#define WAKEUP_ENA_SHIFT            14
+#define DEEPSLEEP_RESET             5
+
+/* RC slow clock is selected after reset */
+#define RTC_SLOW_CLK_FREQ           150000
+#define SLEEP_TICKS                 (RTC_SLOW_CLK_FREQ / 100)
+#define SLEEP_NS                    10000000
+
+static uint32_t rtc_time_get(QTestState *qts)
+{
+    qtest_writel(qts, RTC_CNTL_TIME_UPDATE, BIT(31));
+    return qtest_readl(qts, RTC_CNTL_TIME0);
+}
+
+static void rtc_sleep_start(QTestState *qts, bool deep)
+{
+    qtest_writel(qts, RTC_CNTL_DIG_PWC, deep ? DG_WRAP_PD_EN : 0);
+    qtest_writel(qts, RTC_CNTL_WAKEUP_STATE, TIMER_TRIG_EN << WAKEUP_ENA_SHIFT);
+    qtest_writel(qts, RTC_CNTL_SLP_TIMER0, rtc_time_get(qts) + SLEEP_TICKS);
+    qtest_writel(qts, RTC_CNTL_SLP_TIMER1, 0);
+    qtest_writel(qts, RTC_CNTL_STATE0, SLEEP_EN);
+}
+
+static void test_light_sleep(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+
+    qtest_writel(qts, RTC_CNTL_INT_ENA, 1);
+    rtc_sleep_start(qts, false);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_STATE0) & SLEEP_EN, ==, SLEEP_EN);
+
+    qtest_clock_step(qts, SLEEP_NS / 2);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_STATE0) & SLEEP_EN, ==, SLEEP_EN);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_INT_RAW), ==, 0);
+
+    qtest_clock_step(qts, SLEEP_NS);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_STATE0) & SLEEP_EN, ==, 0);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_INT_RAW), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_WAKEUP_STATE) & 0x7ff, ==, TIMER_TRIG_EN);
+
+    qtest_writel(qts, RTC_CNTL_INT_CLR, 1);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_INT_RAW), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_deep_sleep(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+
+    qtest_writel(qts, RTC_CNTL_STORE0, 0x12345678);
+    qtest_writel(qts, RTC_SLOW_MEM_BASE, 0xdeadbeef);
+    rtc_sleep_start(qts, true);
+    qtest_clock_step(qts, SLEEP_NS * 2);
+
+    /* The reset requested on wakeup is handled by the main loop */
+    uint32_t cause = 0;
+    for (int i = 0; i < 100 && cause != DEEPSLEEP_RESET; ++i) {
+        cause = qtest_readl(qts, RTC_CNTL_RESET_STATE) & 0x3f;
+    }
+    g_assert_cmpuint(cause, ==, DEEPSLEEP_RESET);
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_STATE0) & SLEEP_EN, ==, 0);
+
+    /* RTC domain was not powered down */
+    g_assert_cmphex(qtest_readl(qts, RTC_CNTL_STORE0), ==, 0x12345678);
+    g_assert_cmphex(qtest_readl(qts, RTC_SLOW_MEM_BASE), ==, 0xdeadbeef);
+
+    qtest_quit(qts);
+}
+
+static uint64_t dport_counter(QTestState *qts, const char *name)
+{
+    QDict *rsp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': {"
+                           " 'path': '/machine/soc/dport', 'property': %s } }",
+                           name);
+    uint64_t val = qdict_get_int(rsp, "return");
+
+    qobject_unref(rsp);
+    return val;
+}
+
+/* Invalidate the DROM0 MMU and map one flash page, the way the ROM does */
+static void cache_map_drom0(QTestState *qts)
+{
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL1, 0);
+    for (int i = 0; i < MMU_PAGES; ++i) {
+        qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE + i * 4, MMU_INVALID);
+    }
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL, CACHE_ENA | CACHE_FLUSH_ENA);
+    qtest_writel(qts, DPORT_PRO_FLASH_MMU_TABLE, FLASH_PAGE);
+    qtest_writel(qts, DPORT_PRO_CACHE_CTRL, CACHE_ENA | CACHE_FLUSH_ENA);
+}
+
+static void test_deep_sleep_cache_reuse(void)
+{
+    char *image_path;
+    int fd = g_file_open_tmp("esp32-rtc-test-XXXXXX", &image_path, NULL);
+    g_autofree uint8_t *image = g_malloc0(FLASH_SIZE);
+    QTestState *qts;
+    uint64_t filled, reused;
+
+    g_assert(fd >= 0);
+    stl_le_p(image + FLASH_PAGE * 0x10000, 0xc0ffee00);
+    g_assert_cmpint(write(fd, image, FLASH_SIZE), ==, FLASH_SIZE);
+    close(fd);
+
+    qts = qtest_initf("-machine esp32 -drive file=%s,if=mtd,format=raw", image_path);
+    cache_map_drom0(qts);
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE), ==, 0xc0ffee00);
+    filled = dport_counter(qts, "cache-pages-filled");
+    reused = dport_counter(qts, "cache-pages-reused");
+
+    rtc_sleep_start(qts, true);
+    qtest_clock_step(qts, SLEEP_NS * 2);
+    uint32_t cause = 0;
+    for (int i = 0; i < 100 && cause != DEEPSLEEP_RESET; ++i) {
+        cause = qtest_readl(qts, RTC_CNTL_RESET_STATE) & 0x3f;
+    }
+    g_assert_cmpuint(cause, ==, DEEPSLEEP_RESET);
+
+    /* The page is mapped again after the wakeup, its data is still there */
+    cache_map_drom0(qts);
+    g_assert_cmphex(qtest_readl(qts, DROM0_BASE), ==, 0xc0ffee00);
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-reused"), >, reused);
+    g_assert_cmpuint(dport_counter(qts, "cache-pages-filled"), ==, filled);
+
+    qtest_quit(qts);
+    unlink(image_path);
+    g_free(image_path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/rtc/light_sleep", test_light_sleep);
+    qtest_add_func("/esp32/rtc/deep_sleep", test_deep_sleep);
+    qtest_add_func("/esp32/rtc/deep_sleep_cache_reuse", test_deep_sleep_cache_reuse);
+
+    return g_test_run();
+}
@@ -0,0 +1,149 @@
+/*
+ * QTest testcase for the ESP32 SHA accelerator
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "libqtest.h"
+
+#define DR_REG_SHA_BASE     0x3ff03000
+#define SHA_TEXT(i)         (DR_REG_SHA_BASE + (i) * 4)
+#define SHA_START(alg)      (DR_REG_SHA_BASE + 0x80 + (alg) * 0x10)
+#define SHA_CONTINUE(alg)   (DR_REG_SHA_BASE + 0x84 + (alg) * 0x10)
+#define SHA_LOAD(alg)       (DR_REG_SHA_BASE + 0x88 + (alg) * 0x10)
+
+typedef enum {
+    SHA1,
+    SHA256,
+    SHA384,
+    SHA512,
+} ShaAlg;
+
+static const size_t block_size[] = { 64, 64, 128, 128 };
+static const size_t digest_size[] = { 20, 32, 48, 64 };
+
+static const char msg_short[] = "abc";
+static const char msg_long[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+static const char *const digest_short[] = {
+    "a9993e364706816aba3e25717850c26c9cd0d89d",
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+    "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded163"
+    "1a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7",
+    "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+    "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+};
+
+static const char *const digest_long[] = {
+    "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+    "3391fdddfc8dc7393707a65b1b4709397cf8b1d162af05ab"
+    "fe8f450de5f36bc6b0455a8520bc4e6f5fe95b1fe3c8452b",
+    "204a8fc6dda82f0a0ced7beb8e08a41657c16ef468b228a8279be331a703c335"
+    "96fd15c13b1b07f9aa1d3bea57789ca031ad85c7a71dd70354ec631238ca3445",
+};
+
+/* The accelerator expects padded blocks, pad the message like a guest would */
+static uint8_t *sha_pad(ShaAlg alg, const uint8_t *msg, size_t len, size_t *out_len)
+{
+    size_t bs = block_size[alg];
+    size_t len_field = bs / 8;
+    size_t total = QEMU_ALIGN_UP(len + 1 + len_field, bs);
+    uint8_t *buf = g_malloc0(total);
+    uint64_t bits = (uint64_t) len * 8;
+
+    memcpy(buf, msg, len);
+    buf[len] = 0x80;
+    for (int i = 0; i < 8; ++i) {
+        buf[total - 1 - i] = bits >> (8 * i);
+    }
+    *out_len = total;
+    return buf;
+}
+
+static void sha_write_block(QTestState *qts, ShaAlg alg, const uint8_t *block)
+{
+    for (int i = 0; i < block_size[alg] / 4; ++i) {
+        qtest_writel(qts, SHA_TEXT(i), ldl_be_p(block + i * 4));
+    }
+}
+
+static char *sha_digest(QTestState *qts, ShaAlg alg, const uint8_t *msg, size_t len)
+{
+    size_t padded_len;
+    uint8_t *padded = sha_pad(alg, msg, len, &padded_len);
+    GString *result = g_string_new(NULL);
+
+    for (size_t off = 0; off < padded_len; off += block_size[alg]) {
+        sha_write_block(qts, alg, padded + off);
+        qtest_writel(qts, off == 0 ? SHA_START(alg) : SHA_CONTINUE(alg), 1);
+    }
+    qtest_writel(qts, SHA_LOAD(alg), 1);
+    for (int i = 0; i < digest_size[alg] / 4; ++i) {
+        g_string_append_printf(result, "%08x", qtest_readl(qts, SHA_TEXT(i)));
+    }
+    g_free(padded);
+    return g_string_free(result, false);
+}
+
+static void test_sha_digest(const void *data)
+{
+    ShaAlg alg = (ShaAlg) GPOINTER_TO_INT(data);
+    QTestState *qts = qtest_init("-machine esp32");
+    char *digest;
+
+    digest = sha_digest(qts, alg, (const uint8_t *) msg_short, strlen(msg_short));
+    g_assert_cmpstr(digest, ==, digest_short[alg]);
+    g_free(digest);
+
+    digest = sha_digest(qts, alg, (const uint8_t *) msg_long, strlen(msg_long));
+    g_assert_cmpstr(digest, ==, digest_long[alg]);
+    g_free(digest);
+
+    qtest_quit(qts);
+}
+
+/* Hash a firmware-sized image through the accelerator, as secure boot does */
+static void test_sha_speed(void)
+{
+    const size_t image_size = 1 * MiB;
+    QTestState *qts = qtest_init("-machine esp32");
+    uint8_t *image = g_malloc(image_size);
+    char *digest;
+
+    for (size_t i = 0; i < image_size; ++i) {
+        image[i] = i * 7 + 3;
+    }
+
+    g_test_timer_start();
+    digest = sha_digest(qts, SHA256, image, image_size);
+    g_test_timer_elapsed();
+
+    g_test_message("sha256: %zu kB in %.3f s, %.2f kB/s", image_size / KiB,
+                   g_test_timer_last(), image_size / KiB / g_test_timer_last());
+
+    g_free(digest);
+    g_free(image);
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_data_func("/esp32/sha/sha1", GINT_TO_POINTER(SHA1), test_sha_digest);
+    qtest_add_data_func("/esp32/sha/sha256", GINT_TO_POINTER(SHA256), test_sha_digest);
+    qtest_add_data_func("/esp32/sha/sha384", GINT_TO_POINTER(SHA384), test_sha_digest);
+    qtest_add_data_func("/esp32/sha/sha512", GINT_TO_POINTER(SHA512), test_sha_digest);
+    if (g_test_perf()) {
+        qtest_add_func("/esp32/sha/speed", test_sha_speed);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,290 @@
+/*
+ * QTest testcase for the ESP32 SPI controller DMA
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "libqtest.h"
+
+#define DR_REG_SPI2_BASE        0x3ff64000
+#define SPI_CMD                 (DR_REG_SPI2_BASE + 0x00)
+#define SPI_CLOCK               (DR_REG_SPI2_BASE + 0x18)
+#define SPI_USER                (DR_REG_SPI2_BASE + 0x1c)
+#define SPI_MOSI_DLEN           (DR_REG_SPI2_BASE + 0x28)
+#define SPI_MISO_DLEN           (DR_REG_SPI2_BASE + 0x2c)
+#define SPI_SLAVE               (DR_REG_SPI2_BASE + 0x38)
+#define SPI_DMA_OUT_LINK        (DR_REG_SPI2_BASE + 0x104)
+#define SPI_DMA_IN_LINK         (DR_REG_SPI2_BASE + 0x108)
+#define SPI_DMA_INT_RAW         (DR_REG_SPI2_BASE + 0x114)
+#define SPI_DMA_INT_CLR         (DR_REG_SPI2_BASE + 0x11c)
+#define SPI_IN_SUC_EOF_DES_ADDR (DR_REG_SPI2_BASE + 0x124)
+#define SPI_OUT_EOF_DES_ADDR    (DR_REG_SPI2_BASE + 0x138)
+#define SPI_DMA_CONF            (DR_REG_SPI2_BASE + 0x100)
+
+/* The same register of VSPI, where -machine esp32,lora=on puts the radio */
+#define DR_REG_SPI3_BASE        0x3ff65000
+#define VSPI(reg)               ((reg) - DR_REG_SPI2_BASE + DR_REG_SPI3_BASE)
+
+#define SPI_CMD_USR             BIT(18)
+#define SPI_USER_MOSI           BIT(27)
+#define SPI_USER_MISO           BIT(28)
+#define SPI_SLAVE_TRANS_DONE    BIT(4)
+#define SPI_LINK_START          BIT(29)
+#define SPI_CLOCK_EQU_SYSCLK    BIT(31)
+#define SPI_DMA_OUT_AUTO_WRBACK BIT(8)
+
+#define DMA_INT_IN_SUC_EOF      BIT(5)
+#define DMA_INT_OUT_EOF         BIT(7)
+
+#define DESC_OWNER              BIT(31)
+#define DESC_EOF                BIT(30)
+#define DESC_LENGTH(n)          ((n) << 12)
+#define DESC_SIZE(n)            (n)
+
+/* Descriptors and buffers in internal DRAM */
+#define DESC_BASE               0x3ffb0000
+#define BUF_BASE                0x3ffb1000
+#define XFER_LEN                300
+#define CHUNK_LEN               128
+
+#define DR_REG_GPIO_BASE        0x3ff44000
+#define GPIO_OUT_W1TS           (DR_REG_GPIO_BASE + 0x08)
+#define GPIO_OUT_W1TC           (DR_REG_GPIO_BASE + 0x0c)
+#define GPIO_ENABLE_W1TS        (DR_REG_GPIO_BASE + 0x24)
+#define LORA_NSS_GPIO           18
+#define LORA_RESET_GPIO         14
+
+#define LORA_REG_FIFO           0x00
+#define LORA_REG_OP_MODE        0x01
+#define LORA_REG_FIFO_ADDR_PTR  0x0d
+#define LORA_REG_PAYLOAD_LENGTH 0x22
+#define LORA_WRITE              0x80
+#define LORA_MODE_STDBY         0x81
+#define LORA_MODE_TX            0x83
+#define LORA_FIFO_TX_BASE       0x80
+#define LORA_PAYLOAD_LEN        40
+/* Bytes sent after the out link's EOF descriptor */
+#define LORA_PAST_EOF_LEN       16
+#define LORA_XFER_LEN           (1 + LORA_PAYLOAD_LEN + LORA_PAST_EOF_LEN)
+#define LORA_AIRTIME_MAX_NS     (1000 * 1000 * 1000)
+
+static void write_desc(QTestState *qts, uint32_t addr, uint32_t word0,
+                       uint32_t buf, uint32_t next)
+{
+    qtest_writel(qts, addr, word0);
+    qtest_writel(qts, addr + 4, buf);
+    qtest_writel(qts, addr + 8, next);
+}
+
+static void test_dma_transfer(void)
+{
+    QTestState *qts = qtest_init("-machine esp32");
+    const int n_desc = DIV_ROUND_UP(XFER_LEN, CHUNK_LEN);
+    uint32_t out_desc = DESC_BASE;
+    uint32_t in_desc = DESC_BASE + 0x100;
+    uint32_t in_buf = BUF_BASE + 0x800;
+
+    /* Outgoing data spread over a chain of descriptors */
+    for (int i = 0; i < n_desc; ++i) {
+        uint32_t len = MIN(CHUNK_LEN, XFER_LEN - i * CHUNK_LEN);
+        bool last = (i == n_desc - 1);
+        write_desc(qts, out_desc + i * 12,
+                   DESC_OWNER | (last ? DESC_EOF : 0) | DESC_LENGTH(len) | DESC_SIZE(len),
+                   BUF_BASE + i * CHUNK_LEN, last ? 0 : out_desc + (i + 1) * 12);
+        write_desc(qts, in_desc + i * 12,
+                   DESC_OWNER | DESC_SIZE(CHUNK_LEN),
+                   in_buf + i * CHUNK_LEN, last ? 0 : in_desc + (i + 1) * 12);
+    }
+    for (int i = 0; i < XFER_LEN; ++i) {
+        qtest_writeb(qts, BUF_BASE + i, i);
+        qtest_writeb(qts, in_buf + i, 0xa5);
+    }
+
+    /* 1 MHz SPI clock: 80 MHz APB divided by 80 */
+    qtest_writel(qts, SPI_CLOCK, (1 << 18) | (39 << 12) | (19 << 6) | 39);
+    qtest_writel(qts, SPI_USER, SPI_USER_MOSI | SPI_USER_MISO);
+    qtest_writel(qts, SPI_MOSI_DLEN, XFER_LEN * 8 - 1);
+    qtest_writel(qts, SPI_MISO_DLEN, XFER_LEN * 8 - 1);
+    qtest_writel(qts, SPI_DMA_OUT_LINK, SPI_LINK_START | (out_desc & 0xfffff));
+    qtest_writel(qts, SPI_DMA_IN_LINK, SPI_LINK_START | (in_desc & 0xfffff));
+    qtest_writel(qts, SPI_CMD, SPI_CMD_USR);
+
+    /* The transaction takes 2.4ms on the bus */
+    g_assert_cmphex(qtest_readl(qts, SPI_CMD), ==, SPI_CMD_USR);
+    g_assert_cmphex(qtest_readl(qts, SPI_SLAVE) & SPI_SLAVE_TRANS_DONE, ==, 0);
+    qtest_clock_step(qts, 1000000);
+    g_assert_cmphex(qtest_readl(qts, SPI_CMD), ==, SPI_CMD_USR);
+    qtest_clock_step(qts, 2000000);
+    g_assert_cmphex(qtest_readl(qts, SPI_CMD), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, SPI_SLAVE) & SPI_SLAVE_TRANS_DONE, ==, SPI_SLAVE_TRANS_DONE);
+
+    uint32_t int_raw = qtest_readl(qts, SPI_DMA_INT_RAW);
+    g_assert_cmphex(int_raw & (DMA_INT_OUT_EOF | DMA_INT_IN_SUC_EOF), ==,
+                    DMA_INT_OUT_EOF | DMA_INT_IN_SUC_EOF);
+    g_assert_cmphex(qtest_readl(qts, SPI_OUT_EOF_DES_ADDR), ==, out_desc + (n_desc - 1) * 12);
+    g_assert_cmphex(qtest_readl(qts, SPI_IN_SUC_EOF_DES_ADDR), ==, in_desc + (n_desc - 1) * 12);
+
+    /* Nothing is connected to the bus, zeroes are received */
+    for (int i = 0; i < XFER_LEN; ++i) {
+        g_assert_cmphex(qtest_readb(qts, in_buf + i), ==, 0);
+    }
+    g_assert_cmphex(qtest_readb(qts, in_buf + XFER_LEN), ==, 0xa5);
+
+    /* The in descriptors are returned to the CPU with the received length */
+    for (int i = 0; i < n_desc; ++i) {
+        uint32_t word0 = qtest_readl(qts, in_desc + i * 12);
+        uint32_t len = MIN(CHUNK_LEN, XFER_LEN - i * CHUNK_LEN);
+        bool last = (i == n_desc - 1);
+        g_assert_cmphex(word0 & DESC_OWNER, ==, 0);
+        g_assert_cmphex(word0 & DESC_EOF, ==, last ? DESC_EOF : 0);
+        g_assert_cmpuint((word0 >> 12) & 0xfff, ==, len);
+    }
+
+    qtest_writel(qts, SPI_DMA_INT_CLR, int_raw);
+    g_assert_cmphex(qtest_readl(qts, SPI_DMA_INT_RAW), ==, 0);
+
+    qtest_quit(qts);
+}
+
+/* One VSPI transaction of len bytes each way, with the radio selected */
+static void lora_dma_xfer(QTestState *qts, uint32_t out_desc, uint32_t in_desc,
+                          int len)
+{
+    qtest_writel(qts, GPIO_OUT_W1TC, BIT(LORA_NSS_GPIO));
+    qtest_writel(qts, VSPI(SPI_USER), SPI_USER_MOSI | (in_desc ? SPI_USER_MISO : 0));
+    qtest_writel(qts, VSPI(SPI_MOSI_DLEN), len * 8 - 1);
+    qtest_writel(qts, VSPI(SPI_MISO_DLEN), len * 8 - 1);
+    qtest_writel(qts, VSPI(SPI_DMA_OUT_LINK), SPI_LINK_START | (out_desc & 0xfffff));
+    if (in_desc) {
+        qtest_writel(qts, VSPI(SPI_DMA_IN_LINK), SPI_LINK_START | (in_desc & 0xfffff));
+    }
+    qtest_writel(qts, VSPI(SPI_CMD), SPI_CMD_USR);
+    qtest_clock_step(qts, 100000);
+    g_assert_cmphex(qtest_readl(qts, VSPI(SPI_CMD)), ==, 0);
+    qtest_writel(qts, GPIO_OUT_W1TS, BIT(LORA_NSS_GPIO));
+}
+
+static void lora_dma_write_reg(QTestState *qts, uint8_t reg, uint8_t val)
+{
+    qtest_writeb(qts, BUF_BASE, LORA_WRITE | reg);
+    qtest_writeb(qts, BUF_BASE + 1, val);
+    write_desc(qts, DESC_BASE, DESC_OWNER | DESC_EOF | DESC_LENGTH(2) | DESC_SIZE(2),
+               BUF_BASE, 0);
+    lora_dma_xfer(qts, DESC_BASE, 0, 2);
+}
+
+/*
+ * DMA to and from the SX127x FIFO over VSPI. The payload is gathered from
+ * a descriptor chain whose EOF descriptor is followed by one that must not
+ * be used, then read back into an in link of two descriptors.
+ */
+static void test_dma_lora(void)
+{
+    uint32_t out_desc = DESC_BASE + 0x40;
+    uint32_t in_desc = DESC_BASE + 0x80;
+    uint32_t out_buf = BUF_BASE + 0x100;
+    uint32_t in_buf = BUF_BASE + 0x200;
+    uint8_t payload[LORA_PAYLOAD_LEN];
+    uint8_t frame[1 + LORA_PAYLOAD_LEN];
+    uint8_t in[LORA_XFER_LEN];
+    uint8_t zeroes[LORA_PAST_EOF_LEN] = { 0 };
+    QTestState *qts;
+    int sv[2];
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    qts = qtest_initf("-machine esp32,lora=on -chardev socket,id=radio,fd=%d "
+                      "-global sx127x.chardev=radio", sv[1]);
+    qtest_writel(qts, GPIO_OUT_W1TS, BIT(LORA_NSS_GPIO) | BIT(LORA_RESET_GPIO));
+    qtest_writel(qts, GPIO_ENABLE_W1TS, BIT(LORA_NSS_GPIO) | BIT(LORA_RESET_GPIO));
+    qtest_writel(qts, VSPI(SPI_CLOCK), SPI_CLOCK_EQU_SYSCLK);
+    qtest_writel(qts, VSPI(SPI_DMA_CONF), SPI_DMA_OUT_AUTO_WRBACK);
+
+    lora_dma_write_reg(qts, LORA_REG_OP_MODE, LORA_MODE_STDBY);
+    lora_dma_write_reg(qts, LORA_REG_FIFO_ADDR_PTR, LORA_FIFO_TX_BASE);
+
+    /* FIFO burst write: the address byte and 7 bytes, then the rest */
+    for (int i = 0; i < LORA_PAYLOAD_LEN; ++i) {
+        payload[i] = 0x30 + i;
+    }
+    qtest_writeb(qts, out_buf, LORA_WRITE | LORA_REG_FIFO);
+    qtest_memwrite(qts, out_buf + 1, payload, LORA_PAYLOAD_LEN);
+    qtest_memset(qts, out_buf + 0x80, 0xee, LORA_PAST_EOF_LEN);
+    write_desc(qts, out_desc, DESC_OWNER | DESC_LENGTH(8) | DESC_SIZE(8),
+               out_buf, out_desc + 12);
+    write_desc(qts, out_desc + 12,
+               DESC_OWNER | DESC_EOF | DESC_LENGTH(LORA_PAYLOAD_LEN - 7) |
+               DESC_SIZE(LORA_PAYLOAD_LEN - 7),
+               out_buf + 8, out_desc + 24);
+    write_desc(qts, out_desc + 24,
+               DESC_OWNER | DESC_LENGTH(LORA_PAST_EOF_LEN) | DESC_SIZE(LORA_PAST_EOF_LEN),
+               out_buf + 0x80, 0);
+    lora_dma_xfer(qts, out_desc, 0, LORA_XFER_LEN);
+
+    g_assert_cmphex(qtest_readl(qts, VSPI(SPI_DMA_INT_RAW)) & DMA_INT_OUT_EOF, ==,
+                    DMA_INT_OUT_EOF);
+    g_assert_cmphex(qtest_readl(qts, VSPI(SPI_OUT_EOF_DES_ADDR)), ==, out_desc + 12);
+    /* Written back up to the EOF descriptor only */
+    g_assert_cmphex(qtest_readl(qts, out_desc) & DESC_OWNER, ==, 0);
+    g_assert_cmphex(qtest_readl(qts, out_desc + 12) & DESC_OWNER, ==, 0);
+    g_assert_cmphex(qtest_readl(qts, out_desc + 24) & DESC_OWNER, ==, DESC_OWNER);
+    qtest_writel(qts, VSPI(SPI_DMA_INT_CLR), 0xffffffff);
+
+    /* The radio got the payload */
+    lora_dma_write_reg(qts, LORA_REG_PAYLOAD_LENGTH, LORA_PAYLOAD_LEN);
+    lora_dma_write_reg(qts, LORA_REG_OP_MODE, LORA_MODE_TX);
+    qtest_clock_step(qts, LORA_AIRTIME_MAX_NS);
+    for (size_t got = 0; got < sizeof(frame); ) {
+        ssize_t r = read(sv[0], frame + got, sizeof(frame) - got);
+        g_assert_cmpint(r, >, 0);
+        got += r;
+    }
+    g_assert_cmpuint(frame[0], ==, LORA_PAYLOAD_LEN);
+    g_assert_cmpmem(frame + 1, LORA_PAYLOAD_LEN, payload, LORA_PAYLOAD_LEN);
+
+    /*
+     * FIFO burst read into an in link of 8 + 64 bytes. Zeroes were sent
+     * past the EOF descriptor, not the bytes of the next one.
+     */
+    lora_dma_write_reg(qts, LORA_REG_FIFO_ADDR_PTR, LORA_FIFO_TX_BASE);
+    qtest_writeb(qts, out_buf, LORA_REG_FIFO);
+    write_desc(qts, out_desc, DESC_OWNER | DESC_EOF | DESC_LENGTH(1) | DESC_SIZE(1),
+               out_buf, 0);
+    write_desc(qts, in_desc, DESC_OWNER | DESC_SIZE(8), in_buf, in_desc + 12);
+    write_desc(qts, in_desc + 12, DESC_OWNER | DESC_SIZE(64), in_buf + 8,
+               in_desc + 24);
+    write_desc(qts, in_desc + 24, DESC_OWNER | DESC_SIZE(64), in_buf + 0x80, 0);
+    qtest_memset(qts, in_buf, 0xa5, 0x100);
+    lora_dma_xfer(qts, out_desc, in_desc, LORA_XFER_LEN);
+
+    qtest_memread(qts, in_buf, in, sizeof(in));
+    g_assert_cmpmem(in + 1, LORA_PAYLOAD_LEN, payload, LORA_PAYLOAD_LEN);
+    g_assert_cmpmem(in + 1 + LORA_PAYLOAD_LEN, LORA_PAST_EOF_LEN,
+                    zeroes, LORA_PAST_EOF_LEN);
+    g_assert_cmphex(qtest_readb(qts, in_buf + sizeof(in)), ==, 0xa5);
+    g_assert_cmphex(qtest_readl(qts, VSPI(SPI_DMA_INT_RAW)) & DMA_INT_IN_SUC_EOF, ==,
+                    DMA_INT_IN_SUC_EOF);
+    g_assert_cmphex(qtest_readl(qts, VSPI(SPI_IN_SUC_EOF_DES_ADDR)), ==, in_desc + 12);
+    g_assert_cmphex(qtest_readl(qts, in_desc), ==, DESC_LENGTH(8) | DESC_SIZE(8));
+    g_assert_cmphex(qtest_readl(qts, in_desc + 12), ==,
+                    DESC_EOF | DESC_LENGTH(sizeof(in) - 8) | DESC_SIZE(64));
+    g_assert_cmphex(qtest_readl(qts, in_desc + 24) & DESC_OWNER, ==, DESC_OWNER);
+
+    qtest_quit(qts);
+    close(sv[0]);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/spi/dma_transfer", test_dma_transfer);
+    qtest_add_func("/esp32/spi/dma_lora", test_dma_lora);
+
+    return g_test_run();
+}
@@ -0,0 +1,152 @@
+/*
+ * QTest testcase for the ESP32 UART
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "libqtest.h"
+
+#define DR_REG_UART_BASE            0x3ff40000
+
+#define UART_FIFO                   (DR_REG_UART_BASE + 0x0)
+#define UART_CLKDIV                 (DR_REG_UART_BASE + 0x14)
+#define UART_STATUS                 (DR_REG_UART_BASE + 0x1c)
+#define UART_TXFIFO_CNT(status)     (((status) >> 16) & 0xff)
+#define UART_CONF0                  (DR_REG_UART_BASE + 0x20)
+#define UART_CONF0_DEFAULT          0x0000001c  /* 8 data bits, 1 stop bit */
+#define UART_TICK_REF_ALWAYS_ON     BIT(27)
+
+#define UART_FIFO_LENGTH            128
+/* Enough to fill the FIFO more than once, so the full-FIFO flush runs too */
+#define TX_DATA_LEN                 300
+
+#define APB_CLK_FREQ                40000000
+#define REF_TICK_FREQ               1000000
+/* 100000 baud, 10 bits per frame */
+#define BAUD_RATE                   100000
+#define FRAME_NS                    100000
+#define FRAME_COUNT                 4
+
+static char *serial_path(void)
+{
+    char *path = g_strdup("/tmp/esp32-uart-test-XXXXXX");
+    int fd = mkstemp(path);
+
+    g_assert(fd >= 0);
+    close(fd);
+    return path;
+}
+
+static gsize serial_output(const char *path, gchar **contents)
+{
+    gsize len;
+
+    g_assert(g_file_get_contents(path, contents, &len, NULL));
+    return len;
+}
+
+/*
+ * With tx-coalesce on, characters written to the FIFO are sent from a
+ * bottom half. Check that they all arrive, in order, and that the FIFO
+ * drains.
+ */
+static void test_tx_coalesce(void)
+{
+    char *path = serial_path();
+    QTestState *qts;
+    gchar *out;
+    gsize len;
+
+    qts = qtest_initf("-machine esp32 -serial file:%s", path);
+
+    for (int i = 0; i < TX_DATA_LEN; ++i) {
+        qtest_writel(qts, UART_FIFO, 'a' + i % 26);
+    }
+    /* The bottom half runs from the main loop, between qtest commands */
+    for (int i = 0; i < 1000; ++i) {
+        if (UART_TXFIFO_CNT(qtest_readl(qts, UART_STATUS)) == 0) {
+            break;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmpuint(UART_TXFIFO_CNT(qtest_readl(qts, UART_STATUS)), ==, 0);
+
+    len = serial_output(path, &out);
+    g_assert_cmpuint(len, ==, TX_DATA_LEN);
+    for (int i = 0; i < TX_DATA_LEN; ++i) {
+        g_assert_cmpint(out[i], ==, 'a' + i % 26);
+    }
+    g_free(out);
+
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+/*
+ * With accurate-baud on, one character leaves the TX FIFO per frame time.
+ * The frame time follows from CLKDIV and the clock selected by
+ * CONF0.TICK_REF_ALWAYS_ON: the APB clock when set, REF_TICK when clear.
+ */
+static void test_frame_timing(const void *data)
+{
+    bool ref_tick = GPOINTER_TO_INT(data);
+    char *path = serial_path();
+    QTestState *qts;
+    gchar *out;
+
+    qts = qtest_initf("-machine esp32 -serial file:%s "
+                      "-global driver=esp_soc.uart,property=accurate-baud,value=on",
+                      path);
+
+    if (ref_tick) {
+        qtest_writel(qts, UART_CONF0, UART_CONF0_DEFAULT);
+        qtest_writel(qts, UART_CLKDIV, REF_TICK_FREQ / BAUD_RATE);
+    } else {
+        qtest_writel(qts, UART_CONF0, UART_CONF0_DEFAULT | UART_TICK_REF_ALWAYS_ON);
+        qtest_writel(qts, UART_CLKDIV, APB_CLK_FREQ / BAUD_RATE);
+    }
+    for (int i = 0; i < FRAME_COUNT; ++i) {
+        qtest_writel(qts, UART_FIFO, 'a' + i);
+    }
+    g_assert_cmpuint(UART_TXFIFO_CNT(qtest_readl(qts, UART_STATUS)), ==, FRAME_COUNT);
+
+    /* Nothing is sent before the first frame is complete */
+    qtest_clock_step(qts, FRAME_NS - 1);
+    g_assert_cmpuint(UART_TXFIFO_CNT(qtest_readl(qts, UART_STATUS)), ==, FRAME_COUNT);
+    g_assert_cmpuint(serial_output(path, &out), ==, 0);
+    g_free(out);
+
+    /* Then one character per frame */
+    for (int i = 1; i <= FRAME_COUNT; ++i) {
+        qtest_clock_step(qts, i == 1 ? 1 : FRAME_NS);
+        g_assert_cmpuint(UART_TXFIFO_CNT(qtest_readl(qts, UART_STATUS)), ==,
+                         FRAME_COUNT - i);
+        g_assert_cmpuint(serial_output(path, &out), ==, i);
+        g_assert_cmpint(out[i - 1], ==, 'a' + i - 1);
+        g_free(out);
+    }
+
+    qtest_quit(qts);
+    unlink(path);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/uart/tx_coalesce", test_tx_coalesce);
+    qtest_add_data_func("/esp32/uart/frame_timing/apb", GINT_TO_POINTER(false),
+                        test_frame_timing);
+    qtest_add_data_func("/esp32/uart/frame_timing/ref_tick", GINT_TO_POINTER(true),
+                        test_frame_timing);
+
+    return g_test_run();
+}
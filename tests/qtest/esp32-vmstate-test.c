@@ -0,0 +1,174 @@
+/*
+ * QTest testcase for ESP32 snapshot/restore
+ *
+ * Saves the state of an esp32 machine to a file, restores it in a new
+ * instance, and checks that peripheral registers and a pending CCOMPARE
+ * timer survived the round trip.
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "migration-helpers.h"
+#include "esp32-boot.h"
+
+#define DR_REG_DPORT_BASE           0x3ff00000
+#define DR_REG_SHA_BASE             0x3ff03000
+#define DR_REG_UART_BASE            0x3ff40000
+#define DR_REG_FRC_TIMER_BASE       0x3ff47000
+#define DR_REG_RTCCNTL_BASE         0x3ff48000
+#define DR_REG_TIMERGROUP0_BASE     0x3ff5F000
+#define DR_REG_SPI2_BASE            0x3ff64000
+
+#define DPORT_APPCPU_BOOT_ADDR      (DR_REG_DPORT_BASE + 0x38)
+#define DPORT_PRO_MAC_INTR_MAP      (DR_REG_DPORT_BASE + 0x104)
+#define SHA_TEXT_0                  (DR_REG_SHA_BASE + 0x0)
+#define UART_CONF1                  (DR_REG_UART_BASE + 0x24)
+#define FRC_TIMER_LOAD              (DR_REG_FRC_TIMER_BASE + 0x0)
+#define RTC_CNTL_STORE0             (DR_REG_RTCCNTL_BASE + 0x4c)
+#define RTC_CNTL_STORE7             (DR_REG_RTCCNTL_BASE + 0xbc)
+#define TIMG_T0LOADLO               (DR_REG_TIMERGROUP0_BASE + 0x18)
+#define SPI_W0                      (DR_REG_SPI2_BASE + 0x80)
+
+static const struct {
+    uint32_t addr;
+    uint32_t val;
+} test_regs[] = {
+    { DPORT_APPCPU_BOOT_ADDR, 0x40080104 },
+    { DPORT_PRO_MAC_INTR_MAP, 0x0000000d },
+    { SHA_TEXT_0, 0x61626364 },
+    { UART_CONF1, 0x00006060 },
+    { FRC_TIMER_LOAD, 0x12345678 },
+    { RTC_CNTL_STORE0, 0xdeadbeef },
+    { RTC_CNTL_STORE7, 0x0badcafe },
+    { TIMG_T0LOADLO, 0x00c0ffee },
+    { SPI_W0, 0xa5a5a5a5 },
+};
+
+/* Start a new machine that waits for a snapshot and load it from path */
+static QTestState *restore_snapshot(const char *args, const char *path)
+{
+    QTestState *to = qtest_initf("-machine esp32 %s -incoming defer", args);
+    QDict *rsp;
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                       " 'arguments': { 'uri': 'exec:cat %s' } }", path);
+    qobject_unref(rsp);
+    wait_for_migration_complete(to);
+    return to;
+}
+
+static void test_snapshot_roundtrip(void)
+{
+    char template[] = "/tmp/esp32-vmstate-test-XXXXXX";
+    char *tmpdir = mkdtemp(template);
+    g_assert(tmpdir);
+    char *snapshot_path = g_strdup_printf("%s/snapshot", tmpdir);
+    char *uri = g_strdup_printf("exec:cat > %s", snapshot_path);
+    QTestState *from, *to;
+
+    from = qtest_init("-machine esp32");
+    for (int i = 0; i < ARRAY_SIZE(test_regs); ++i) {
+        qtest_writel(from, test_regs[i].addr, test_regs[i].val);
+    }
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+    qtest_quit(from);
+
+    to = restore_snapshot("", snapshot_path);
+    for (int i = 0; i < ARRAY_SIZE(test_regs); ++i) {
+        g_assert_cmphex(qtest_readl(to, test_regs[i].addr), ==, test_regs[i].val);
+    }
+    qtest_quit(to);
+
+    unlink(snapshot_path);
+    rmdir(tmpdir);
+    g_free(snapshot_path);
+    g_free(uri);
+}
+
+/*
+ * Arm CCOMPARE0 about a second ahead, snapshot the machine before it
+ * fires, and check that the restored CPU still takes the interrupt.
+ */
+#define TIMER_FLAG          ESP32_PROGRAM_DATA
+#define TIMER_ARMED         1
+#define TIMER_FIRED         2
+#define TIMER_DELAY         ESP32_XTAL_FREQ
+
+static void timer_program(Esp32Program *p)
+{
+    esp32_program_init(p);
+    esp32_program_movi32(p, 3, TIMER_FLAG);
+    esp32_program_movi32(p, 4, ESP32_PROGRAM_BASE);
+    esp32_program_emit(p, XT_WSR(XT_SR_VECBASE, 4));
+    esp32_program_movi32(p, 6, TIMER_DELAY);
+    esp32_program_emit(p, XT_RSR(XT_SR_CCOUNT, 5));
+    esp32_program_emit(p, XT_ADD(5, 5, 6));
+    esp32_program_emit(p, XT_WSR(XT_SR_CCOMPARE0, 5));
+    esp32_program_emit(p, XT_MOVI(4, 1 << XT_TIMER0_INTERRUPT));
+    esp32_program_emit(p, XT_WSR(XT_SR_INTENABLE, 4));
+    esp32_program_emit(p, XT_MOVI(4, 0));
+    esp32_program_emit(p, XT_WSR(XT_SR_PS, 4));
+    esp32_program_emit(p, XT_RSYNC);
+    esp32_program_emit(p, XT_MOVI(4, TIMER_ARMED));
+    esp32_program_emit(p, XT_S32I(4, 3, 0));
+    esp32_program_emit(p, XT_J(-4));
+
+    esp32_program_org(p, ESP32_PROGRAM_KERNEL_VECTOR);
+    esp32_program_emit(p, XT_MOVI(4, 0));
+    esp32_program_emit(p, XT_WSR(XT_SR_INTENABLE, 4));
+    esp32_program_emit(p, XT_MOVI(4, TIMER_FIRED));
+    esp32_program_emit(p, XT_S32I(4, 3, 0));
+    esp32_program_emit(p, XT_J(-4));
+}
+
+static void test_ccompare_roundtrip(void)
+{
+    char template[] = "/tmp/esp32-vmstate-test-XXXXXX";
+    char *tmpdir = mkdtemp(template);
+    g_assert(tmpdir);
+    char *snapshot_path = g_strdup_printf("%s/snapshot", tmpdir);
+    char *uri = g_strdup_printf("exec:cat > %s", snapshot_path);
+    Esp32Program program;
+    QTestState *from, *to;
+
+    timer_program(&program);
+
+    from = qtest_init("-machine esp32 -accel tcg -S");
+    esp32_program_load(from, &program);
+    qtest_qmp_assert_success(from, "{ 'execute': 'cont' }");
+    esp32_program_wait(from, TIMER_FLAG, TIMER_ARMED);
+    qtest_qmp_assert_success(from, "{ 'execute': 'stop' }");
+    g_assert_cmphex(qtest_readl(from, TIMER_FLAG), ==, TIMER_ARMED);
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+    qtest_quit(from);
+
+    to = restore_snapshot("-accel tcg -S", snapshot_path);
+    g_assert_cmphex(qtest_readl(to, TIMER_FLAG), ==, TIMER_ARMED);
+    qtest_qmp_assert_success(to, "{ 'execute': 'cont' }");
+    esp32_program_wait(to, TIMER_FLAG, TIMER_FIRED);
+    qtest_quit(to);
+
+    unlink(snapshot_path);
+    rmdir(tmpdir);
+    g_free(snapshot_path);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/vmstate/roundtrip", test_snapshot_roundtrip);
+    qtest_add_func("/esp32/vmstate/ccompare", test_ccompare_roundtrip);
+
+    return g_test_run();
+}
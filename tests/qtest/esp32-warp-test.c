@@ -0,0 +1,157 @@
+/*
+ * QTest testcase for the ESP32 idle-warp and busy-wait-warp machine options
+ *
+ * Copyright (c) 2020 Espressif Systems (Shanghai) Co. Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 or
+ * (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "esp32-boot.h"
+
+#define PRO_FLAG            ESP32_PROGRAM_DATA
+#define APP_FLAG            (ESP32_PROGRAM_DATA + 4)
+#define CPU_WAITING         1
+#define TIMER_FIRED         2
+#define DELAY_DONE          3
+
+/* Far more than the time esp32_program_wait() allows */
+#define IDLE_SECONDS        20
+
+static void idle_program(Esp32Program *p)
+{
+    uint32_t app_entry = ESP32_PROGRAM_BASE + 0x200;
+    uint32_t loop;
+
+    esp32_program_init(p);
+    esp32_program_movi32(p, 3, ESP32_PROGRAM_DATA);
+    esp32_program_emit(p, XT_RSR(XT_SR_PRID, 2));
+    esp32_program_movi32(p, 4, ESP32_PRID_APP);
+    esp32_program_emit(p, XT_BNE(2, 4, 2));
+    esp32_program_emit(p, XT_J(esp32_program_offset(p, app_entry)));
+
+    /* PRO CPU: arm CCOMPARE0 and wait for it */
+    esp32_program_movi32(p, 4, ESP32_PROGRAM_BASE);
+    esp32_program_emit(p, XT_WSR(XT_SR_VECBASE, 4));
+    esp32_program_movi32(p, 6, IDLE_SECONDS * ESP32_XTAL_FREQ);
+    esp32_program_emit(p, XT_RSR(XT_SR_CCOUNT, 5));
+    esp32_program_emit(p, XT_ADD(5, 5, 6));
+    esp32_program_emit(p, XT_WSR(XT_SR_CCOMPARE0, 5));
+    esp32_program_emit(p, XT_MOVI(4, 1 << XT_TIMER0_INTERRUPT));
+    esp32_program_emit(p, XT_WSR(XT_SR_INTENABLE, 4));
+    esp32_program_emit(p, XT_MOVI(4, 0));
+    esp32_program_emit(p, XT_WSR(XT_SR_PS, 4));
+    esp32_program_emit(p, XT_RSYNC);
+    esp32_program_emit(p, XT_MOVI(4, CPU_WAITING));
+    esp32_program_emit(p, XT_S32I(4, 3, 0));
+    loop = p->pc;
+    esp32_program_emit(p, XT_WAITI(0));
+    esp32_program_emit(p, XT_J(esp32_program_offset(p, loop)));
+
+    /* APP CPU: no interrupts enabled, so it waits forever */
+    esp32_program_org(p, app_entry);
+    esp32_program_emit(p, XT_MOVI(4, CPU_WAITING));
+    esp32_program_emit(p, XT_S32I(4, 3, 4));
+    loop = p->pc;
+    esp32_program_emit(p, XT_WAITI(0));
+    esp32_program_emit(p, XT_J(esp32_program_offset(p, loop)));
+
+    esp32_program_org(p, ESP32_PROGRAM_KERNEL_VECTOR);
+    esp32_program_emit(p, XT_MOVI(4, 0));
+    esp32_program_emit(p, XT_WSR(XT_SR_INTENABLE, 4));
+    esp32_program_emit(p, XT_MOVI(4, TIMER_FIRED));
+    esp32_program_emit(p, XT_S32I(4, 3, 0));
+    esp32_program_emit(p, XT_J(-4));
+}
+
+/*
+ * Both CPUs sit in WAITI and the only pending deadline is CCOMPARE0,
+ * IDLE_SECONDS ahead. With idle-warp the clock jumps to it right away.
+ */
+static void test_idle_warp(void)
+{
+    Esp32Program program;
+    QTestState *qts;
+    int64_t start;
+
+    idle_program(&program);
+
+    qts = qtest_init("-machine esp32,idle-warp=on -accel tcg -S");
+    esp32_program_load(qts, &program);
+    esp32_program_start_appcpu(qts);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    esp32_program_wait(qts, APP_FLAG, CPU_WAITING);
+
+    start = g_get_monotonic_time();
+    esp32_program_wait(qts, PRO_FLAG, TIMER_FIRED);
+    g_assert_cmpint(g_get_monotonic_time() - start, <,
+                    IDLE_SECONDS * G_USEC_PER_SEC / 2);
+
+    qtest_quit(qts);
+}
+
+/*
+ * The CCOUNT spin of ets_delay_us(), on both CPUs at once:
+ * start = CCOUNT; while (CCOUNT - start < cycles);
+ */
+static void delay_program(Esp32Program *p)
+{
+    uint32_t loop;
+
+    esp32_program_init(p);
+    esp32_program_movi32(p, 3, ESP32_PROGRAM_DATA);
+    esp32_program_emit(p, XT_RSR(XT_SR_PRID, 2));
+    esp32_program_movi32(p, 4, ESP32_PRID_APP);
+    esp32_program_emit(p, XT_BNE(2, 4, 2));
+    esp32_program_emit(p, XT_ADDI(3, 3, 4));
+
+    esp32_program_movi32(p, 6, IDLE_SECONDS * ESP32_XTAL_FREQ);
+    esp32_program_emit(p, XT_RSR(XT_SR_CCOUNT, 5));
+    loop = p->pc;
+    esp32_program_emit(p, XT_RSR(XT_SR_CCOUNT, 7));
+    esp32_program_emit(p, XT_SUB(7, 7, 5));
+    esp32_program_emit(p, XT_BLTU(7, 6, esp32_program_offset(p, loop)));
+    esp32_program_emit(p, XT_MOVI(4, DELAY_DONE));
+    esp32_program_emit(p, XT_S32I(4, 3, 0));
+    esp32_program_emit(p, XT_J(-4));
+}
+
+/*
+ * Both CPUs spin on CCOUNT for IDLE_SECONDS of guest time. With
+ * busy-wait-warp the spins are fast-forwarded and end well before
+ * that much wall time has passed.
+ */
+static void test_busy_wait_warp(void)
+{
+    Esp32Program program;
+    QTestState *qts;
+    int64_t start;
+
+    delay_program(&program);
+
+    qts = qtest_init("-machine esp32,busy-wait-warp=on -accel tcg -S");
+    esp32_program_load(qts, &program);
+    esp32_program_start_appcpu(qts);
+    start = g_get_monotonic_time();
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+
+    esp32_program_wait(qts, PRO_FLAG, DELAY_DONE);
+    esp32_program_wait(qts, APP_FLAG, DELAY_DONE);
+    g_assert_cmpint(g_get_monotonic_time() - start, <,
+                    IDLE_SECONDS * G_USEC_PER_SEC / 2);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/esp32/warp/idle", test_idle_warp);
+    qtest_add_func("/esp32/warp/busy-wait", test_busy_wait_warp);
+
+    return g_test_run();
+}
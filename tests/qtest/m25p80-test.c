@@ -26,6 +26,8 @@
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
 #include "libqtest-single.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 
 /*
  * ASPEED SPI Controller registers
@@ -348,6 +350,87 @@ static void test_write_page_mem(void)
     flash_reset();
 }
 
+static QDict *query_flash_writeback(void)
+{
+    QDict *rsp = qmp("{ 'execute': 'query-flash-writeback' }");
+    QList *list = qdict_get_qlist(rsp, "return");
+    QDict *info;
+
+    /* Only the FMC CE0 flash has a drive */
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    info = qobject_to(QDict, qlist_peek(list));
+    qobject_ref(info);
+    qobject_unref(rsp);
+    return info;
+}
+
+static void test_write_back(void)
+{
+    QTestState *saved_qtest = global_qtest;
+    char wb_path[] = "/tmp/qtest.m25p80.wb.XXXXXX";
+    uint32_t my_page_addr = 0x14000 * PAGE_SIZE;
+    uint8_t buf[PAGE_SIZE];
+    QDict *info, *rsp;
+    int fd, i;
+
+    fd = mkstemp(wb_path);
+    g_assert(fd >= 0);
+    g_assert(ftruncate(fd, FLASH_SIZE) == 0);
+    /* Start from an erased page, programming can only clear bits */
+    memset(buf, 0xff, PAGE_SIZE);
+    g_assert(pwrite(fd, buf, PAGE_SIZE, my_page_addr) == PAGE_SIZE);
+
+    global_qtest = qtest_initf("-m 256 -machine palmetto-bmc "
+                               "-drive file=%s,format=raw,if=mtd "
+                               "-global n25q256a.write-back=on "
+                               "-global n25q256a.write-back-interval=0",
+                               wb_path);
+
+    spi_conf(CONF_ENABLE_W0);
+    spi_ctrl_start_user();
+    writeb(ASPEED_FLASH_BASE, EN_4BYTE_ADDR);
+    writeb(ASPEED_FLASH_BASE, WREN);
+    writeb(ASPEED_FLASH_BASE, PP);
+    writel(ASPEED_FLASH_BASE, make_be32(my_page_addr));
+    for (i = 0; i < PAGE_SIZE / 4; i++) {
+        writel(ASPEED_FLASH_BASE, make_be32(my_page_addr + i * 4));
+    }
+    spi_ctrl_stop_user();
+
+    /* The page is only cached until flushed */
+    info = query_flash_writeback();
+    g_assert(qdict_get_bool(info, "write-back"));
+    g_assert_cmpint(qdict_get_int(info, "dirty-bytes"), ==, PAGE_SIZE);
+    g_assert_cmpint(qdict_get_int(info, "write-requests"), ==, 0);
+    qobject_unref(info);
+
+    g_assert(pread(fd, buf, PAGE_SIZE, my_page_addr) == PAGE_SIZE);
+    for (i = 0; i < PAGE_SIZE; i++) {
+        g_assert_cmphex(buf[i], ==, 0xff);
+    }
+
+    rsp = qmp("{ 'execute': 'flash-writeback-flush' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    info = query_flash_writeback();
+    g_assert_cmpint(qdict_get_int(info, "dirty-bytes"), ==, 0);
+    g_assert_cmpint(qdict_get_int(info, "write-requests"), ==, 1);
+    g_assert_cmpint(qdict_get_int(info, "bytes-written"), ==, PAGE_SIZE);
+    g_assert_cmpint(qdict_get_int(info, "flushes"), ==, 1);
+    qobject_unref(info);
+
+    g_assert(pread(fd, buf, PAGE_SIZE, my_page_addr) == PAGE_SIZE);
+    for (i = 0; i < PAGE_SIZE / 4; i++) {
+        g_assert_cmphex(ldl_be_p(buf + i * 4), ==, my_page_addr + i * 4);
+    }
+
+    qtest_quit(global_qtest);
+    global_qtest = saved_qtest;
+    close(fd);
+    unlink(wb_path);
+}
+
 static char tmp_path[] = "/tmp/qtest.m25p80.XXXXXX";
 
 int main(int argc, char **argv)
@@ -373,6 +456,7 @@ int main(int argc, char **argv)
     qtest_add_func("/m25p80/write_page", test_write_page);
     qtest_add_func("/m25p80/read_page_mem", test_read_page_mem);
     qtest_add_func("/m25p80/write_page_mem", test_write_page_mem);
+    qtest_add_func("/m25p80/write_back", test_write_back);
 
     ret = g_test_run();
 